@@ -0,0 +1,264 @@
+package main
+
+import (
+	"bufio"
+	"encoding/json"
+	"errors"
+	"fmt"
+	"net"
+	"os"
+	"os/signal"
+	"path/filepath"
+	"sync"
+	"syscall"
+
+	"github.com/hanwen/go-fuse/v2/fuse"
+	odfs "github.com/jstaf/onedriver/fs"
+	log "github.com/sirupsen/logrus"
+)
+
+// controlRequest is what "onedriver --attach" and "--detach" send to the daemon,
+// as a single line of JSON. The daemon answers with a controlResponse once the
+// mountpoint is mounted or unmounted.
+type controlRequest struct {
+	Command    string `json:"command"` // "attach" or "detach"
+	Mountpoint string `json:"mountpoint"`
+	CacheDir   string `json:"cacheDir,omitempty"` // attach only
+}
+
+type controlResponse struct {
+	Error string `json:"error,omitempty"`
+}
+
+// daemon serves several mounts from one process, so that they share the HTTP
+// transport, upload slots and hashing slots, and their delta fetches are spread
+// out instead of all happening at once.
+type daemon struct {
+	opts   mountOptions
+	mutex  sync.Mutex
+	mounts map[string]*daemonMount // by mountpoint
+}
+
+type daemonMount struct {
+	dir    string       // cache directory
+	server *fuse.Server // nil while still being mounted
+	cache  *odfs.Cache
+	done   chan struct{} // closed once unmounted and the cache is stopped
+}
+
+// controlSocketPath is where the daemon listens for attach and detach requests.
+func controlSocketPath() string {
+	if runtimeDir := os.Getenv("XDG_RUNTIME_DIR"); runtimeDir != "" {
+		return filepath.Join(runtimeDir, "onedriver.sock")
+	}
+	cacheDir, _ := os.UserCacheDir()
+	return filepath.Join(cacheDir, "onedriver", "daemon.sock")
+}
+
+// runDaemon serves mounts until the process is told to stop, at which point
+// everything is unmounted.
+func runDaemon(opts mountOptions) {
+	path := controlSocketPath()
+	if conn, err := net.Dial("unix", path); err == nil {
+		conn.Close()
+		log.WithField("socket", path).Fatal("Another onedriver daemon is already running.")
+	}
+	// left over if we were killed last time
+	os.Remove(path)
+	os.MkdirAll(filepath.Dir(path), 0700)
+	listener, err := net.Listen("unix", path)
+	if err == nil {
+		err = os.Chmod(path, 0600)
+	}
+	if err != nil {
+		log.WithFields(log.Fields{
+			"socket": path,
+			"err":    err,
+		}).Fatal("Could not listen on control socket.")
+	}
+	d := &daemon{opts: opts, mounts: make(map[string]*daemonMount)}
+	sdNotify("READY=1")
+	log.WithField("socket", path).Info("Daemon waiting for mounts.")
+
+	sigChan := make(chan os.Signal, 1)
+	signal.Notify(sigChan, syscall.SIGINT, syscall.SIGTERM)
+	go func() {
+		sig := <-sigChan
+		log.WithField("signal", sig.String()).Info("Signal received, unmounting everything.")
+		listener.Close()
+		d.detachAll()
+		os.Remove(path)
+		os.Exit(0)
+	}()
+
+	for {
+		conn, err := listener.Accept()
+		if err != nil {
+			// closed by the signal handler, which exits once done
+			select {}
+		}
+		go d.serve(conn)
+	}
+}
+
+// serve handles a single request from a control socket client.
+func (d *daemon) serve(conn net.Conn) {
+	defer conn.Close()
+	var req controlRequest
+	line, err := bufio.NewReader(conn).ReadBytes('\n')
+	if err == nil {
+		err = json.Unmarshal(line, &req)
+	}
+	if err == nil {
+		switch req.Command {
+		case "attach":
+			err = d.attach(req.Mountpoint, req.CacheDir)
+		case "detach":
+			err = d.detach(req.Mountpoint)
+		default:
+			err = fmt.Errorf("unknown command %q", req.Command)
+		}
+	}
+	var resp controlResponse
+	if err != nil {
+		resp.Error = err.Error()
+	}
+	out, _ := json.Marshal(resp)
+	conn.Write(append(out, '\n'))
+}
+
+// attach mounts the account whose cache is in dir at mountpoint. Attaching a
+// mountpoint that is already mounted does nothing. The account must have been
+// logged in to already, the daemon has nobody to log in for it.
+func (d *daemon) attach(mountpoint string, dir string) error {
+	if mountpoint == "" || dir == "" {
+		return errors.New("attach needs a mountpoint and a cache directory")
+	}
+	d.mutex.Lock()
+	if mount, exists := d.mounts[mountpoint]; exists {
+		mounting := mount.server == nil
+		d.mutex.Unlock()
+		if mounting {
+			return errors.New("mountpoint is already being mounted")
+		}
+		return nil
+	}
+	for _, mount := range d.mounts {
+		if mount.dir == dir {
+			d.mutex.Unlock()
+			return errors.New("cache directory is already in use by another mount")
+		}
+	}
+	// reserve the mountpoint, opening the cache can take a long time
+	mount := &daemonMount{dir: dir, done: make(chan struct{})}
+	d.mounts[mountpoint] = mount
+	d.mutex.Unlock()
+
+	log.WithFields(log.Fields{
+		"mountpoint": mountpoint,
+		"cacheDir":   dir,
+	}).Info("Attaching mount.")
+	server, cache, err := mountFS(mountpoint, dir, d.opts)
+	d.mutex.Lock()
+	defer d.mutex.Unlock()
+	if err != nil {
+		delete(d.mounts, mountpoint)
+		return err
+	}
+	mount.server, mount.cache = server, cache
+	go d.wait(mountpoint, mount)
+	return nil
+}
+
+// wait serves a mount until it is unmounted, by detach or from outside, and then
+// cleans up after it.
+func (d *daemon) wait(mountpoint string, mount *daemonMount) {
+	mount.server.Wait()
+	mount.cache.Stop()
+	d.mutex.Lock()
+	delete(d.mounts, mountpoint)
+	d.mutex.Unlock()
+	close(mount.done)
+	log.WithField("mountpoint", mountpoint).Info("Mount detached.")
+}
+
+// detach unmounts a mountpoint and returns once its cache has been stopped, so
+// that it can be attached again right away.
+func (d *daemon) detach(mountpoint string) error {
+	d.mutex.Lock()
+	mount, exists := d.mounts[mountpoint]
+	var server *fuse.Server
+	var cache *odfs.Cache
+	if exists {
+		server, cache = mount.server, mount.cache
+	}
+	d.mutex.Unlock()
+	if !exists {
+		// already gone, which is what was asked for
+		return nil
+	}
+	if server == nil {
+		return errors.New("mountpoint is still being mounted")
+	}
+	// make sure changes waiting for write-back are picked up on the next start
+	cache.FlushWriteBack()
+	if err := server.Unmount(); err != nil {
+		log.WithFields(log.Fields{
+			"mountpoint": mountpoint,
+			"err":        err,
+		}).Error("Failed to unmount filesystem cleanly!")
+		return err
+	}
+	<-mount.done
+	return nil
+}
+
+// detachAll unmounts everything the daemon serves.
+func (d *daemon) detachAll() {
+	d.mutex.Lock()
+	mountpoints := make([]string, 0, len(d.mounts))
+	for mountpoint := range d.mounts {
+		mountpoints = append(mountpoints, mountpoint)
+	}
+	d.mutex.Unlock()
+	for _, mountpoint := range mountpoints {
+		d.detach(mountpoint)
+	}
+}
+
+// controlDaemon asks the running daemon to attach or detach a mountpoint, and
+// waits for it to be done.
+func controlDaemon(attach bool, mountpoint string, dir string) error {
+	req := controlRequest{Command: "detach"}
+	var err error
+	if req.Mountpoint, err = filepath.Abs(mountpoint); err != nil {
+		return err
+	}
+	if attach {
+		req.Command = "attach"
+		if req.CacheDir, err = filepath.Abs(dir); err != nil {
+			return err
+		}
+	}
+	conn, err := net.Dial("unix", controlSocketPath())
+	if err != nil {
+		return fmt.Errorf("could not reach the onedriver daemon, is it running? %w", err)
+	}
+	defer conn.Close()
+	line, _ := json.Marshal(req)
+	if _, err = conn.Write(append(line, '\n')); err != nil {
+		return err
+	}
+	reply, err := bufio.NewReader(conn).ReadBytes('\n')
+	if err != nil {
+		return fmt.Errorf("daemon went away before answering: %w", err)
+	}
+	var resp controlResponse
+	if err = json.Unmarshal(reply, &resp); err != nil {
+		return err
+	}
+	if resp.Error != "" {
+		return fmt.Errorf("could not %s %s: %s", req.Command, req.Mountpoint, resp.Error)
+	}
+	return nil
+}
@@ -0,0 +1,459 @@
+// Benchmarks run against an in-memory fake of the Graph API instead of a real
+// account, so that results can be compared between patches and machines. Run
+// them with "make bench", or with something like:
+//
+//	go test -run '^$' -bench . ./fs -args -fake-graph -graph.latency=20ms
+package fs
+
+import (
+	"context"
+	"flag"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"runtime"
+	"sync/atomic"
+	"testing"
+	"time"
+
+	"github.com/hanwen/go-fuse/v2/fuse"
+	"github.com/jstaf/onedriver/fs/graph"
+	"github.com/jstaf/onedriver/fs/graph/graphtest"
+)
+
+var (
+	fakeGraph = flag.Bool("fake-graph", false,
+		"skip the setup against a real account, for running benchmarks only")
+	benchLatency   = flag.Duration("graph.latency", 0, "latency of the fake Graph API")
+	benchBandwidth = flag.Int64("graph.bandwidth", 0,
+		"bandwidth of the fake Graph API in bytes/s, 0 is unlimited")
+	benchThrottle = flag.Int("graph.throttle", 0,
+		"throttle every nth request to the fake Graph API while uploads are queued, 0 never")
+)
+
+// newBenchCache starts a fake server and a cache backed by it. The returned
+// function shuts both down again.
+func newBenchCache(b *testing.B) (*Cache, *graphtest.Server, func()) {
+	b.Helper()
+	server := graphtest.NewServer(graphtest.Options{
+		Latency:   *benchLatency,
+		Bandwidth: *benchBandwidth,
+	})
+	restore := server.Use()
+	dir, err := ioutil.TempDir("", "onedriver-bench")
+	if err != nil {
+		b.Fatal(err)
+	}
+	cache, err := NewCache(server.Auth(), filepath.Join(dir, "bench.db"))
+	if err != nil {
+		b.Fatal(err)
+	}
+	return cache, server, func() {
+		cache.Stop()
+		os.RemoveAll(dir)
+		restore()
+		server.Close()
+	}
+}
+
+// benchInsert adds an item that was put on the fake server after the cache was
+// created to the cache.
+func benchInsert(b *testing.B, cache *Cache, id string) *Inode {
+	b.Helper()
+	item, err := graph.GetItem(id, cache.GetAuth())
+	if err != nil {
+		b.Fatal(err)
+	}
+	inode := NewInodeDriveItem(item)
+	cache.InsertID(item.ID, inode)
+	return inode
+}
+
+// benchContent is size bytes of something that is not all zeroes.
+func benchContent(size int) []byte {
+	content := make([]byte, size)
+	for i := range content {
+		content[i] = byte(i * 7)
+	}
+	return content
+}
+
+// Opening and reading a file that is not on disk yet. Small files are fetched in
+// one request, large ones are streamed.
+func BenchmarkOpenRead(b *testing.B) {
+	for _, size := range []int{256 * 1024, 4 * 1024 * 1024, 64 * 1024 * 1024} {
+		b.Run(fmt.Sprintf("%dKiB", size/1024), func(b *testing.B) {
+			cache, server, done := newBenchCache(b)
+			defer done()
+			id := server.AddFile(graphtest.RootID, "read.bin", benchContent(size))
+			inode := benchInsert(b, cache, id)
+
+			ctx := context.Background()
+			buf := make([]byte, 128*1024)
+			b.SetBytes(int64(size))
+			b.ResetTimer()
+			for n := 0; n < b.N; n++ {
+				fh, _, errno := inode.Open(ctx, 0)
+				if errno != 0 {
+					b.Fatal("Open failed:", errno)
+				}
+				for off := int64(0); off < int64(size); off += int64(len(buf)) {
+					result, errno := inode.Read(ctx, fh, buf, off)
+					if errno != 0 {
+						b.Fatal("Read failed:", errno)
+					}
+					result.Bytes(buf)
+				}
+				inode.Flush(ctx, fh)
+				inode.Release(ctx, fh)
+
+				b.StopTimer()
+				cache.content.Delete(id)
+				b.StartTimer()
+			}
+		})
+	}
+}
+
+// Listing a large directory, both when its children have to be fetched and when
+// they are already known.
+func BenchmarkReaddir(b *testing.B) {
+	const entries = 10000
+	cache, server, done := newBenchCache(b)
+	defer done()
+	dirID := server.AddFolder(graphtest.RootID, "large")
+	for i := 0; i < entries; i++ {
+		server.AddFile(dirID, fmt.Sprintf("file%05d.txt", i), []byte("test\n"))
+	}
+	dir := benchInsert(b, cache, dirID)
+
+	readdir := func(b *testing.B) {
+		stream, errno := dir.Readdir(context.Background())
+		if errno != 0 {
+			b.Fatal("Readdir failed:", errno)
+		}
+		count := 0
+		for stream.HasNext() {
+			if _, errno := stream.Next(); errno != 0 {
+				b.Fatal("Listing failed:", errno)
+			}
+			count++
+		}
+		stream.Close()
+		if count != entries {
+			b.Fatalf("Expected %d entries, got %d.", entries, count)
+		}
+	}
+
+	b.Run("cold", func(b *testing.B) {
+		for n := 0; n < b.N; n++ {
+			b.StopTimer()
+			dir.mutex.Lock()
+			dir.children = nil
+			dir.childNames = nil
+			dir.subdir = 0
+			dir.mutex.Unlock()
+			b.StartTimer()
+			readdir(b)
+		}
+	})
+	readdir(b)
+	b.Run("warm", func(b *testing.B) {
+		for n := 0; n < b.N; n++ {
+			readdir(b)
+		}
+	})
+}
+
+// Fetching and applying a delta with lots of new files in directories that are
+// already cached.
+func BenchmarkDelta(b *testing.B) {
+	const dirs = 100
+	for _, items := range []int{10000, 100000} {
+		b.Run(fmt.Sprintf("%d", items), func(b *testing.B) {
+			cache, server, done := newBenchCache(b)
+			defer done()
+			auth := cache.GetAuth()
+			for n := 0; n < b.N; n++ {
+				b.StopTimer()
+				// the directories have to be cached and listed for their new
+				// children to be added by the delta
+				parents := make([]string, dirs)
+				for d := range parents {
+					name := fmt.Sprintf("delta%d-%d", n, d)
+					parents[d] = server.AddFolder(graphtest.RootID, name)
+					benchInsert(b, cache, parents[d])
+					cache.ListChildren(parents[d], auth)
+				}
+				token := server.DeltaToken()
+				for i := 0; i < items; i++ {
+					server.AddFile(parents[i%dirs], fmt.Sprintf("%d.txt", i), []byte("test\n"))
+				}
+				cache.deltaLink = "/me/drive/root/delta?token=" + token
+				b.StartTimer()
+
+				pages := make(chan deltaPage, deltaPagesAhead)
+				go cache.fetchDeltas(auth, pages)
+				if success, total := cache.applyDeltaPages(pages); !success || total != items {
+					b.Fatalf("Expected %d deltas, got %d (success: %t).", items, total, success)
+				}
+				if children, _ := cache.ListChildren(parents[0], auth); len(children) != items/dirs {
+					b.Fatalf("Deltas were not applied, directory has %d children.", len(children))
+				}
+			}
+		})
+	}
+}
+
+// Starting up and listing every directory, on the first start and when starting
+// from the metadata saved by a previous session.
+func BenchmarkStartup(b *testing.B) {
+	const dirs = 20
+	const files = 50
+	server := graphtest.NewServer(graphtest.Options{
+		Latency:   *benchLatency,
+		Bandwidth: *benchBandwidth,
+	})
+	defer server.Close()
+	defer server.Use()()
+	for d := 0; d < dirs; d++ {
+		dirID := server.AddFolder(graphtest.RootID, fmt.Sprintf("dir%d", d))
+		for f := 0; f < files; f++ {
+			server.AddFile(dirID, fmt.Sprintf("%d.txt", f), []byte("test\n"))
+		}
+	}
+	tmp, err := ioutil.TempDir("", "onedriver-bench")
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer os.RemoveAll(tmp)
+	auth := server.Auth()
+
+	walk := func(b *testing.B, cache *Cache) {
+		count := 0
+		pending := []string{cache.root}
+		for len(pending) > 0 {
+			id := pending[len(pending)-1]
+			pending = pending[:len(pending)-1]
+			children, err := cache.ListChildren(id, auth)
+			if err != nil {
+				b.Fatal(err)
+			}
+			for _, child := range children {
+				count++
+				if child.IsDir() {
+					pending = append(pending, child.ID())
+				}
+			}
+		}
+		if count < dirs*(files+1) {
+			b.Fatalf("Expected at least %d items, found %d.", dirs*(files+1), count)
+		}
+	}
+
+	b.Run("first", func(b *testing.B) {
+		for n := 0; n < b.N; n++ {
+			cache, err := NewCache(auth, filepath.Join(tmp, fmt.Sprintf("first%d.db", n)))
+			if err != nil {
+				b.Fatal(err)
+			}
+			walk(b, cache)
+			b.StopTimer()
+			cache.Stop()
+			b.StartTimer()
+		}
+	})
+
+	// a previous session that fetched deltas once, which saves the delta link
+	dbPath := filepath.Join(tmp, "resumed.db")
+	cache, err := NewCache(auth, dbPath)
+	if err != nil {
+		b.Fatal(err)
+	}
+	walk(b, cache)
+	cache.DeltaLoop(time.Hour)
+	for atomic.LoadInt64(&cache.lastDelta) == 0 {
+		time.Sleep(time.Millisecond)
+	}
+	cache.Stop()
+	b.Run("resumed", func(b *testing.B) {
+		for n := 0; n < b.N; n++ {
+			cache, err := NewCache(auth, dbPath)
+			if err != nil {
+				b.Fatal(err)
+			}
+			walk(b, cache)
+			b.StopTimer()
+			cache.Stop()
+			b.StartTimer()
+		}
+	})
+}
+
+// heapInUse is how much of the heap is still reachable after a collection.
+func heapInUse() uint64 {
+	var stats runtime.MemStats
+	runtime.GC()
+	runtime.ReadMemStats(&stats)
+	return stats.HeapAlloc
+}
+
+// How much memory the metadata of one cached item takes, both when it was fetched
+// from the server and when it was loaded from disk.
+func BenchmarkInodeMemory(b *testing.B) {
+	const entries = 20000
+	cache, server, done := newBenchCache(b)
+	defer done()
+	auth := cache.GetAuth()
+	dirID := server.AddFolder(graphtest.RootID, "memory")
+	for i := 0; i < entries; i++ {
+		server.AddFile(dirID, fmt.Sprintf("Some document %05d.docx", i), []byte("test\n"))
+	}
+	benchInsert(b, cache, dirID)
+
+	var ids []string
+	b.Run("fetched", func(b *testing.B) {
+		for n := 0; n < b.N; n++ {
+			b.StopTimer()
+			cache.DeleteID(dirID)
+			ids = nil
+			before := heapInUse()
+			b.StartTimer()
+			benchInsert(b, cache, dirID)
+			children, err := cache.ListChildren(dirID, auth)
+			if err != nil || len(children) != entries {
+				b.Fatalf("Expected %d children, got %d: %v", entries, len(children), err)
+			}
+			b.StopTimer()
+			for _, child := range children {
+				ids = append(ids, child.ID())
+			}
+			children = nil
+			b.ReportMetric(float64(heapInUse()-before)/entries, "heap-B/inode")
+			b.StartTimer()
+		}
+	})
+
+	cache.SerializeAll()
+	b.Run("loaded", func(b *testing.B) {
+		for n := 0; n < b.N; n++ {
+			b.StopTimer()
+			for _, id := range ids {
+				cache.metadata.delete(id)
+			}
+			before := heapInUse()
+			b.StartTimer()
+			for _, id := range ids {
+				if cache.GetID(id) == nil {
+					b.Fatal("Item was not saved:", id)
+				}
+			}
+			b.StopTimer()
+			b.ReportMetric(float64(heapInUse()-before)/entries, "heap-B/inode")
+			b.StartTimer()
+		}
+	})
+}
+
+// Writing the metadata of every item in a large cache to disk.
+func BenchmarkSerializeAll(b *testing.B) {
+	const items = 10000
+	cache, _, done := newBenchCache(b)
+	defer done()
+	ids := make([]string, 0, items)
+	root := cache.GetID(cache.root)
+	for i := 0; i < items; i++ {
+		inode := NewInode(fmt.Sprintf("%d.txt", i), 0644|fuse.S_IFREG, root)
+		cache.InsertID(inode.ID(), inode)
+		ids = append(ids, inode.ID())
+	}
+	cache.SerializeAll()
+
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		b.StopTimer()
+		for _, id := range ids {
+			cache.markDirty(id)
+		}
+		b.StartTimer()
+		cache.SerializeAll()
+	}
+}
+
+// benchUploadInode puts a file on the fake server and gives it new local content
+// to be uploaded.
+func benchUploadInode(b *testing.B, cache *Cache, server *graphtest.Server, name string,
+	size int) *Inode {
+	b.Helper()
+	inode := benchInsert(b, cache, server.AddFile(graphtest.RootID, name, []byte("old")))
+	content := benchContent(size)
+	inode.mutex.Lock()
+	inode.DriveItem.Size = uint64(size)
+	// hashes are computed from the content when the session is created
+	inode.DriveItem.File = nil
+	inode.hasChanges = true
+	inode.mutex.Unlock()
+	if err := cache.content.Insert(inode.ID(), content); err != nil {
+		b.Fatal(err)
+	}
+	return inode
+}
+
+// Uploading a single file, with a simple PUT for small files and an upload
+// session for large ones.
+func BenchmarkUploadSession(b *testing.B) {
+	for _, size := range []int{1024 * 1024, 32 * 1024 * 1024} {
+		b.Run(fmt.Sprintf("%dKiB", size/1024), func(b *testing.B) {
+			cache, server, done := newBenchCache(b)
+			defer done()
+			inode := benchUploadInode(b, cache, server, "upload.bin", size)
+			auth := cache.GetAuth()
+
+			b.SetBytes(int64(size))
+			b.ResetTimer()
+			for n := 0; n < b.N; n++ {
+				session, err := NewUploadSession(inode)
+				if err != nil {
+					b.Fatal(err)
+				}
+				if err = session.Upload(auth); err != nil {
+					b.Fatal(err)
+				}
+			}
+		})
+	}
+}
+
+// Uploading many small files at once through the upload manager. This is the
+// only benchmark that is throttled, since the upload manager is the only thing
+// that backs off and retries when it is.
+func BenchmarkUploadQueue(b *testing.B) {
+	const files = 32
+	const size = 256 * 1024
+	cache, server, done := newBenchCache(b)
+	defer done()
+	inodes := make([]*Inode, files)
+	for i := range inodes {
+		inodes[i] = benchUploadInode(b, cache, server, fmt.Sprintf("queued%d.bin", i), size)
+	}
+
+	server.Throttle(*benchThrottle)
+	defer server.Throttle(0)
+	b.SetBytes(files * size)
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		for _, inode := range inodes {
+			if err := cache.uploads.QueueUpload(inode); err != nil {
+				b.Fatal(err)
+			}
+		}
+		cache.uploads.sync()
+		for {
+			if queued, _ := cache.uploads.Stats(); queued == 0 {
+				break
+			}
+			time.Sleep(time.Millisecond)
+		}
+	}
+}
@@ -3,6 +3,7 @@ package fs
 import (
 	"errors"
 	"fmt"
+	"net"
 	"os"
 	"path/filepath"
 	"strings"
@@ -15,14 +16,34 @@ import (
 	bolt "go.etcd.io/bbolt"
 )
 
-// Cache caches Inodes for a filesystem. This cache never expires so that local
-// changes can persist. Should be created using the NewCache() constructor.
+// Cache caches Inodes for a filesystem. Metadata never expires so that local
+// changes can persist. File content is evicted in least recently used order once
+// it exceeds the limit set with SetContentLimit(), unless it has changes that
+// have not been uploaded yet. Should be created using the NewCache() constructor.
 type Cache struct {
-	metadata  sync.Map
+	activity  int64 // unix time of the last local change, first for atomic alignment
+	lastDelta int64 // unix time of the last successful delta fetch, atomic
+
+	metadata  *inodeIndex
 	db        *bolt.DB
+	content   *ContentStore
 	root      string // the id of the filesystem's root item
 	deltaLink string
 	uploads   *UploadManager
+	batch     *graph.Batcher // batches metadata operations made by concurrent fs calls
+	prefetch  *prefetcher    // nil unless enabled with EnablePrefetch
+	pins      *pinSet        // items kept available offline, see PinLoop
+
+	dirtyMutex sync.Mutex
+	dirty      map[string]bool // ids to be serialized, true if removed from the cache
+
+	deltaTrigger chan struct{} // wakes up the delta loop early
+
+	stop   chan struct{}  // closed by Stop
+	loops  sync.WaitGroup // background loops Stop waits for
+	status net.Listener   // see ServeStatus
+
+	writeBack writeBack
 
 	sync.RWMutex
 	auth    *graph.Auth
@@ -31,86 +52,263 @@ type Cache struct {
 
 // boltdb buckets
 var (
-	bucketContent  = []byte("content")
+	bucketContent  = []byte("content") // only used to migrate old content to the ContentStore
 	bucketMetadata = []byte("metadata")
 	bucketDelta    = []byte("delta")
 )
 
-// NewCache creates a new Cache
-func NewCache(auth *graph.Auth, dbpath string) *Cache {
+// NewCache creates a new Cache. If the database has the metadata of a previous
+// session, the filesystem is served from it right away without waiting on the
+// server, and the delta loop brings it up to date in the background starting
+// from the delta link it was saved with.
+func NewCache(auth *graph.Auth, dbpath string) (*Cache, error) {
 	db, err := bolt.Open(dbpath, 0600, &bolt.Options{Timeout: time.Second * 5})
 	if err != nil {
-		log.WithFields(log.Fields{"err": err}).Fatal("Could not open DB")
+		return nil, fmt.Errorf("could not open DB: %w", err)
 	}
 	db.Update(func(tx *bolt.Tx) error {
-		tx.CreateBucketIfNotExists(bucketContent)
 		tx.CreateBucketIfNotExists(bucketMetadata)
 		tx.CreateBucketIfNotExists(bucketDelta)
+		tx.CreateBucketIfNotExists(bucketWriteBack)
 		return nil
 	})
+	content, err := NewContentStore(contentDir(dbpath), db)
+	if err != nil {
+		db.Close()
+		return nil, err
+	}
 	cache := &Cache{
-		auth: auth,
-		db:   db,
+		auth:     auth,
+		db:       db,
+		metadata: newInodeIndex(),
+		content:  content,
+		dirty:    make(map[string]bool),
+		batch:    graph.NewBatcher(),
+		pins:     newPinSet(db),
+
+		deltaTrigger: make(chan struct{}, 1),
+		stop:         make(chan struct{}),
 	}
 
-	rootItem, err := graph.GetItem("root", auth)
-	root := NewInodeDriveItem(rootItem)
-	if err != nil {
-		if graph.IsOffline(err) {
-			// no network, load from db if possible and go to read-only state
-			cache.Lock()
-			cache.offline = true
-			cache.Unlock()
-			if root = cache.GetID("root"); root == nil {
-				log.Fatal("We are offline and could not fetch the filesystem root item from disk.")
+	root, deltaLink := cache.loadMetadata()
+	resumed := root != nil
+	if resumed {
+		log.Info("Starting from the metadata of the previous session, " +
+			"changes since then are fetched in the background.")
+	} else {
+		// first start, everything has to come from the server
+		rootItem, err := graph.GetItem("root", auth)
+		if err != nil {
+			content.Close()
+			db.Close()
+			if graph.IsOffline(err) {
+				return nil, errors.New("we are offline and there is no metadata " +
+					"from a previous session to start from")
 			}
-			// when offline, we load the cache deltaLink from disk
-			cache.db.View(func(tx *bolt.Tx) error {
-				if link := tx.Bucket(bucketDelta).Get([]byte("deltaLink")); link != nil {
-					cache.deltaLink = string(link)
-				} else {
-					// Only reached if a previous online session never survived
-					// long enough to save its delta link. We explicitly disallow these
-					// types of startups as it's possible for things to get out of sync
-					// this way.
-					log.Fatal("Cannot perform an offline startup without a valid delta " +
-						"link from a previous session.")
-				}
-				return nil
-			})
-		} else {
-			log.WithFields(log.Fields{
-				"err": err,
-			}).Fatal("Could not fetch root item of filesystem!")
+			return nil, fmt.Errorf("could not fetch root item of filesystem: %w", err)
 		}
+		root = NewInodeDriveItem(rootItem)
+		// using token=latest because we don't care about existing items - they'll
+		// be downloaded on-demand by the cache
+		deltaLink = "/me/drive/root/delta?token=latest"
 	}
+	cache.deltaLink = deltaLink
 	root.cache = cache
 	cache.root = root.ID()
 	cache.InsertID(cache.root, root)
 
 	cache.uploads = NewUploadManager(2*time.Second, db, cache, auth)
+	// clean up snapshots left behind by uploads that were never finished
+	cache.content.RemoveSnapshots(cache.uploads.snapshots())
+	cache.content.SetPinned(cache.contentPinned)
+	cache.recoverWriteBack()
+
+	if resumed {
+		// most likely exists already, and should not hold up the mount if not
+		cache.background(func() { cache.createTrash(auth) })
+	} else {
+		cache.createTrash(auth)
+	}
 
-	if !cache.IsOffline() {
-		// .Trash-UID is used by "gio trash" for user trash, create it if it
-		// does not exist
-		trash := fmt.Sprintf(".Trash-%d", os.Getuid())
-		if child, _ := cache.GetChild(cache.root, trash, auth); child == nil {
-			item, err := graph.Mkdir(trash, cache.root, auth)
-			if err != nil {
-				log.WithField("err", err).Error("Could not create trash folder. " +
-					"Trashing items through the file browser may result in errors.")
-			} else {
-				cache.InsertID(item.ID, NewInodeDriveItem(item))
+	// deltaloop is started manually
+	return cache, nil
+}
+
+// loadMetadata returns the root item saved by a previous session and the delta
+// link the saved metadata is current as of, or nil if there is none. Only the
+// root is read, everything else is loaded from the database when first needed.
+func (c *Cache) loadMetadata() (*Inode, string) {
+	var deltaLink string
+	c.db.View(func(tx *bolt.Tx) error {
+		if link := tx.Bucket(bucketDelta).Get([]byte("deltaLink")); link != nil {
+			deltaLink = string(link)
+		}
+		return nil
+	})
+	if deltaLink == "" {
+		// a previous session never survived long enough to fetch deltas, so its
+		// metadata can't be brought up to date
+		return nil, ""
+	}
+	root := c.GetID("root")
+	if root == nil {
+		return nil, ""
+	}
+	return root, deltaLink
+}
+
+// createTrash creates .Trash-UID, which is used by "gio trash" for user trash, if
+// it does not exist.
+func (c *Cache) createTrash(auth *graph.Auth) {
+	if c.IsOffline() {
+		return
+	}
+	trash := fmt.Sprintf(".Trash-%d", os.Getuid())
+	if child, _ := c.GetChild(c.root, trash, auth); child != nil {
+		return
+	}
+	item, err := graph.Mkdir(trash, c.root, auth)
+	if err != nil {
+		log.WithField("err", err).Error("Could not create trash folder. " +
+			"Trashing items through the file browser may result in errors.")
+		return
+	}
+	c.InsertID(item.ID, NewInodeDriveItem(item))
+}
+
+// how many records resync rewrites per database transaction
+const resyncBatchSize = 1000
+
+// resync is used when the server no longer accepts our delta link, because the
+// metadata we started from is too old. The changes since then can't be fetched,
+// so directory listings are dropped to be fetched again when next needed, and
+// polling restarts from the current state of the drive. Directories with items
+// that were never uploaded keep their listing, so that those items don't
+// disappear.
+func (c *Cache) resync() {
+	log.Warn("Delta link has expired, directory listings will be fetched again.")
+	c.deltaLink = "/me/drive/root/delta?token=latest"
+
+	dropListing := func(inode *Inode) bool {
+		if inode.children == nil || inode.listing != nil {
+			return false
+		}
+		for _, child := range inode.children {
+			if isLocalID(child) {
+				return false
 			}
 		}
+		inode.children = nil
+		inode.childNames = nil
+		inode.subdir = 0
+		return true
+	}
+	// everything that has not been loaded from the database, a batch at a time
+	// so that other writers are not held up for long
+	var next []byte
+	for {
+		updated := make(map[string][]byte)
+		c.db.View(func(tx *bolt.Tx) error {
+			cursor := tx.Bucket(bucketMetadata).Cursor()
+			key, data := cursor.First()
+			if next != nil {
+				key, data = cursor.Seek(next)
+			}
+			for ; key != nil && len(updated) < resyncBatchSize; key, data = cursor.Next() {
+				if c.metadata.load(string(key)) != nil {
+					continue
+				}
+				if inode, err := NewInodeBinary(data); err == nil && dropListing(inode) {
+					updated[string(key)] = inode.AsBinary()
+				}
+			}
+			next = append(next[:0], key...)
+			return nil
+		})
+		c.db.Update(func(tx *bolt.Tx) error {
+			b := tx.Bucket(bucketMetadata)
+			for key, data := range updated {
+				if c.metadata.load(key) != nil {
+					// loaded in the meantime, see below
+					continue
+				}
+				if err := b.Put([]byte(key), data); err != nil {
+					return err
+				}
+			}
+			return nil
+		})
+		if len(next) == 0 {
+			break
+		}
+	}
+	// inodes in memory go last, which also covers those loaded from the database
+	// while it was being updated
+	c.metadata.forEach(func(id string, inode *Inode) {
+		inode.mutex.Lock()
+		dropped := dropListing(inode)
+		inode.mutex.Unlock()
+		if dropped {
+			c.markDirty(id)
+		}
+	})
+}
 
-		// using token=latest because we don't care about existing items - they'll
-		// be downloaded on-demand by the cache
-		cache.deltaLink = "/me/drive/root/delta?token=latest"
+// Stop shuts down the cache's background work and closes its database, once its
+// filesystem has been unmounted. Changes waiting for their write-back are queued
+// for upload first - uploads still queued are resumed the next time the cache is
+// opened. Only needed when the process keeps running afterwards, everything the
+// cache started has returned once Stop does.
+func (c *Cache) Stop() {
+	close(c.stop)
+	if c.status != nil {
+		c.status.Close()
+	}
+	c.loops.Wait()
+	c.FlushWriteBack()
+	c.uploads.Stop()
+	c.batch.Close()
+	c.SerializeAll()
+	c.content.Close()
+	c.db.Close()
+}
+
+// background runs a loop, or other work that must be done before the database
+// is closed, as a goroutine that Stop waits for.
+func (c *Cache) background(loop func()) {
+	c.loops.Add(1)
+	go func() {
+		defer c.loops.Done()
+		loop()
+	}()
+}
+
+// stopped returns true once Stop has been called.
+func (c *Cache) stopped() bool {
+	select {
+	case <-c.stop:
+		return true
+	default:
+		return false
 	}
+}
 
-	// deltaloop is started manually
-	return cache
+// SetContentLimit sets the maximum size of the on-disk content cache in bytes. 0
+// means unlimited.
+func (c *Cache) SetContentLimit(limit uint64) {
+	c.content.SetLimit(limit)
+}
+
+// contentPinned returns true if an item's content must not be evicted, because
+// it has changes that only exist locally or was pinned to be kept offline.
+func (c *Cache) contentPinned(id string) bool {
+	if isLocalID(id) || c.uploads.IsQueued(id) {
+		return true
+	}
+	if inode := c.GetID(id); inode != nil && inode.HasChanges() {
+		return true
+	}
+	return c.isPinned(id)
 }
 
 // GetAuth returns the current auth
@@ -143,8 +341,8 @@ func (c *Cache) InodePath(fuseInode *fs.Inode) string {
 // GetID gets an inode from the cache by ID. No API fetching is performed.
 // Result is nil if no inode is found.
 func (c *Cache) GetID(id string) *Inode {
-	entry, exists := c.metadata.Load(id)
-	if !exists {
+	inode := c.metadata.load(id)
+	if inode == nil {
 		// we allow fetching from disk as a fallback while offline (and it's also
 		// necessary while transitioning from offline->online)
 		var found *Inode
@@ -152,17 +350,17 @@ func (c *Cache) GetID(id string) *Inode {
 			data := tx.Bucket(bucketMetadata).Get([]byte(id))
 			var err error
 			if data != nil {
-				found, err = NewInodeJSON(data)
+				found, err = NewInodeBinary(data)
 			}
 			return err
 		})
 		if found != nil {
 			found.cache = c
-			c.metadata.Store(id, found) // move to memory for next time
+			c.metadata.store(id, found) // move to memory for next time
 		}
 		return found
 	}
-	return entry.(*Inode)
+	return inode
 }
 
 // InsertID inserts a single item into the cache by ID and sets its parent using
@@ -172,8 +370,14 @@ func (c *Cache) InsertID(id string, inode *Inode) {
 	// make sure the item knows about the cache itself, then insert
 	inode.mutex.Lock()
 	inode.cache = c
+	inode.compact()
+	if inode.DriveItem.ID == id {
+		// so that the index and the parent's children share the compacted copy
+		id = inode.DriveItem.ID
+	}
 	inode.mutex.Unlock()
-	c.metadata.Store(id, inode)
+	c.metadata.store(id, inode)
+	c.markDirty(id)
 
 	parentID := inode.ParentID()
 	if parentID == "" {
@@ -189,10 +393,19 @@ func (c *Cache) InsertID(id string, inode *Inode) {
 		}).Error("Parent item could not be found when setting parent.")
 		return
 	}
+	// share the parent's own copy of its ID
+	if shared := parent.ID(); shared == parentID {
+		inode.mutex.Lock()
+		if inode.DriveItem.Parent.ID == shared {
+			inode.DriveItem.Parent.ID = shared
+		}
+		inode.mutex.Unlock()
+	}
 
 	// check if the item has already been added to the parent
 	// Lock order is super key here, must go parent->child or the deadlock
 	// detector screams at us.
+	name, isDir := inode.Name(), inode.IsDir()
 	parent.mutex.Lock()
 	defer parent.mutex.Unlock()
 	for _, child := range parent.children {
@@ -203,10 +416,8 @@ func (c *Cache) InsertID(id string, inode *Inode) {
 	}
 
 	// add to parent
-	if inode.IsDir() {
-		parent.subdir++
-	}
-	parent.children = append(parent.children, inode.ID())
+	parent.addChild(id, name, isDir)
+	c.markDirty(parentID)
 }
 
 // InsertChild adds an item as a child of a specified parent ID.
@@ -224,42 +435,57 @@ func (c *Cache) InsertChild(parentID string, child *Inode) {
 func (c *Cache) DeleteID(id string) {
 	if inode := c.GetID(id); inode != nil {
 		parent := c.GetID(inode.ParentID())
+		name, isDir := inode.Name(), inode.IsDir()
 		parent.mutex.Lock()
-		for i, childID := range parent.children {
-			if childID == id {
-				parent.children = append(parent.children[:i], parent.children[i+1:]...)
-				if inode.IsDir() {
-					parent.subdir--
-				}
-				break
-			}
-		}
+		parent.removeChild(id, name, isDir)
 		parent.mutex.Unlock()
+		c.markDirty(parent.ID())
 	}
-	c.metadata.Delete(id)
+	c.metadata.delete(id)
+	c.markRemoved(id)
 	c.uploads.CancelUpload(id)
 }
 
-// GetChild fetches a named child of an item. Wraps GetChildrenID.
+// GetChild fetches a named child of an item, compared case-insensitively. The
+// children of the item are fetched if they are not known yet.
 func (c *Cache) GetChild(id string, name string, auth *graph.Auth) (*Inode, error) {
-	children, err := c.GetChildrenID(id, auth)
-	if err != nil {
-		return nil, err
+	parent := c.GetID(id)
+	if parent == nil {
+		return nil, errors.New(id + " not found in cache")
 	}
-	for _, child := range children {
-		if strings.EqualFold(child.Name(), name) {
-			return child, nil
+	child, known := c.findChild(parent, name)
+	if !known {
+		if _, err := c.ListChildren(id, auth); err != nil {
+			return nil, err
 		}
+		child, _ = c.findChild(parent, name)
 	}
-	return nil, errors.New("child does not exist")
+	if child == nil {
+		return nil, errors.New("child does not exist")
+	}
+	return child, nil
 }
 
-// GetChildrenID grabs all DriveItems that are the children of the given ID. If
-// items are not found, they are fetched.
+// GetChildrenID grabs all DriveItems that are the children of the given ID,
+// keyed by their lowercased name. If items are not found, they are fetched.
 func (c *Cache) GetChildrenID(id string, auth *graph.Auth) (map[string]*Inode, error) {
+	list, err := c.ListChildren(id, auth)
+	if err != nil {
+		return nil, err
+	}
+	children := make(map[string]*Inode, len(list))
+	for _, child := range list {
+		children[strings.ToLower(child.Name())] = child
+	}
+	return children, nil
+}
+
+// ListChildren returns the children of the given ID, in the order they were
+// added. If items are not found, they are fetched.
+func (c *Cache) ListChildren(id string, auth *graph.Auth) ([]*Inode, error) {
 	// fetch item and catch common errors
 	inode := c.GetID(id)
-	children := make(map[string]*Inode)
+	children := make([]*Inode, 0)
 	if inode == nil {
 		log.WithFields(log.Fields{
 			"id": id,
@@ -275,61 +501,38 @@ func (c *Cache) GetChildrenID(id string, auth *graph.Auth) (map[string]*Inode, e
 		return children, nil
 	}
 
-	// If item.children is not nil, it means we have the item's children
-	// already and can fetch them directly from the cache
-	inode.mutex.RLock()
-	if inode.children != nil {
-		// can potentially have out-of-date child metadata if started offline, but since
-		// changes are disallowed while offline, the children will be back in sync after
-		// the first successful delta fetch (which also brings the fs back online)
-		for _, childID := range inode.children {
-			child := c.GetID(childID)
-			if child == nil {
-				// will be nil if deleted or never existed
-				continue
+	// We haven't fetched the children for this item yet, get them from the
+	// server. Only one fetch runs at a time per directory.
+	if listing := c.listing(inode); listing != nil {
+		fetched, err := listing.wait()
+		if err != nil {
+			if graph.IsOffline(err) {
+				log.WithFields(log.Fields{
+					"id": id,
+				}).Warn("We are offline, and no children found in cache. Pretending there are no children.")
+				return children, nil
 			}
-			children[strings.ToLower(child.Name())] = child
-		}
-		inode.mutex.RUnlock()
-		return children, nil
-	}
-	inode.mutex.RUnlock()
-
-	// We haven't fetched the children for this item yet, get them from the server.
-	fetched, err := graph.GetItemChildren(id, auth)
-	if err != nil {
-		if graph.IsOffline(err) {
-			log.WithFields(log.Fields{
-				"id": id,
-			}).Warn("We are offline, and no children found in cache. Pretending there are no children.")
-			return children, nil
+			return nil, err
 		}
-		// something else happened besides being offline
-		log.WithFields(log.Fields{
-			"err": err,
-		}).Error("Error while fetching children.")
-		return nil, err
+		return fetched, nil
 	}
 
-	inode.mutex.Lock()
-	inode.children = make([]string, 0)
-	for _, item := range fetched {
-		// we will always have an id after fetching from the server
-		child := NewInodeDriveItem(item)
-		child.cache = c
-		c.metadata.Store(child.DriveItem.ID, child)
-
-		// store in result map
-		children[strings.ToLower(child.Name())] = child
-
-		// store id in parent item and increment parents subdirectory count
-		inode.children = append(inode.children, child.DriveItem.ID)
-		if child.IsDir() {
-			inode.subdir++
+	// If item.children is not nil, it means we have the item's children
+	// already and can fetch them directly from the cache
+	// can potentially have out-of-date child metadata if started offline, but since
+	// changes are disallowed while offline, the children will be back in sync after
+	// the first successful delta fetch (which also brings the fs back online)
+	inode.mutex.RLock()
+	children = make([]*Inode, 0, len(inode.children))
+	for _, childID := range inode.children {
+		child := c.GetID(childID)
+		if child == nil {
+			// will be nil if deleted or never existed
+			continue
 		}
+		children = append(children, child)
 	}
-	inode.mutex.Unlock()
-
+	inode.mutex.RUnlock()
 	return children, nil
 }
 
@@ -357,20 +560,25 @@ func (c *Cache) GetPath(path string, auth *graph.Auth) (*Inode, error) {
 	split := strings.Split(path, "/")[1:] //omit leading "/"
 	var inode *Inode
 	for i := 0; i < len(split); i++ {
-		// fetches children
-		children, err := c.GetChildrenID(lastID, auth)
-		if err != nil {
-			return nil, err
+		// fetches children if necessary
+		parent := c.GetID(lastID)
+		if parent == nil {
+			return nil, errors.New(lastID + " not found in cache")
 		}
-
-		var exists bool // if we use ":=", item is shadowed
-		inode, exists = children[split[i]]
-		if !exists {
+		child, known := c.findChild(parent, split[i])
+		if !known {
+			if _, err := c.ListChildren(lastID, auth); err != nil {
+				return nil, err
+			}
+			child, _ = c.findChild(parent, split[i])
+		}
+		if child == nil {
 			// the item still doesn't exist after fetching from server. it
 			// doesn't exist
 			return nil, errors.New(strings.Join(split[:i+1], "/") +
 				" does not exist on server or in local cache")
 		}
+		inode = child
 		lastID = inode.ID()
 	}
 	return inode, nil
@@ -431,6 +639,7 @@ func (c *Cache) MoveID(oldID string, newID string) error {
 
 	// need to rename the child under the parent
 	parent := c.GetID(inode.ParentID())
+	folded := strings.ToLower(inode.Name())
 	parent.mutex.Lock()
 	for i, child := range parent.children {
 		if child == oldID {
@@ -438,19 +647,28 @@ func (c *Cache) MoveID(oldID string, newID string) error {
 			break
 		}
 	}
+	if parent.childNames != nil && parent.childNames[folded] == oldID {
+		parent.childNames[folded] = newID
+	}
 	parent.mutex.Unlock()
 
+	// content is moved while locked so that reads and writes never see an ID
+	// without content
+	var err error
+	isDir := inode.IsDir()
 	inode.mutex.Lock()
 	inode.DriveItem.ID = newID
+	if !isDir {
+		err = c.MoveContent(oldID, newID)
+	}
 	inode.mutex.Unlock()
 
-	// now actually perform the metadata+content move
+	// now actually perform the metadata move
 	c.DeleteID(oldID)
 	c.InsertID(newID, inode)
-	if inode.IsDir() {
-		return nil
-	}
-	return c.MoveContent(oldID, newID)
+	c.movePin(oldID, newID)
+	c.moveWriteBack(oldID, newID)
+	return err
 }
 
 // MovePath an item to a new position
@@ -475,67 +693,101 @@ func (c *Cache) MovePath(oldPath string, newPath string, auth *graph.Auth) error
 
 // GetContent reads a file's content from disk.
 func (c *Cache) GetContent(id string) []byte {
-	var content []byte // nil
-	c.db.View(func(tx *bolt.Tx) error {
-		b := tx.Bucket(bucketContent)
-		if tmp := b.Get([]byte(id)); tmp != nil {
-			content = make([]byte, len(tmp))
-			copy(content, tmp)
-		}
-		return nil
-	})
-	return content
+	return c.content.Get(id)
 }
 
 // InsertContent writes file content to disk.
 func (c *Cache) InsertContent(id string, content []byte) error {
-	return c.db.Update(func(tx *bolt.Tx) error {
-		b := tx.Bucket(bucketContent)
-		return b.Put([]byte(id), content)
-	})
+	return c.content.Insert(id, content)
 }
 
 // DeleteContent deletes content from disk.
 func (c *Cache) DeleteContent(id string) error {
-	return c.db.Update(func(tx *bolt.Tx) error {
-		b := tx.Bucket(bucketContent)
-		return b.Delete([]byte(id))
-	})
+	return c.content.Delete(id)
 }
 
 // MoveContent moves content from one ID to another
 func (c *Cache) MoveContent(oldID string, newID string) error {
-	return c.db.Update(func(tx *bolt.Tx) error {
-		b := tx.Bucket(bucketContent)
-		content := b.Get([]byte(oldID))
-		if content == nil {
-			return errors.New("Content not found for ID: " + oldID)
-		}
-		b.Put([]byte(newID), content)
-		b.Delete([]byte(oldID))
-		return nil
-	})
+	return c.content.Move(oldID, newID)
 }
 
-// SerializeAll dumps all inode metadata currently in the cache to disk. This
-// metadata is only used later if an item could not be found in memory AND the
-// cache is offline. Old metadata is not removed, only overwritten (to avoid an
-// offline session from wiping all metadata on a subsequent serialization).
-func (c *Cache) SerializeAll() {
-	log.Debug("Serializing cache metadata to disk.")
-	c.metadata.Range(func(key interface{}, value interface{}) bool {
-		c.db.Batch(func(tx *bolt.Tx) error {
-			id := fmt.Sprint(key)
-			contents := value.(*Inode).AsJSON()
-			b := tx.Bucket(bucketMetadata)
-			b.Put([]byte(id), contents)
-			if id == c.root {
-				// root item must be updated manually (since there's actually
-				// two copies)
-				b.Put([]byte("root"), contents)
+// markDirty flags an item's metadata as changed, so that it gets written to disk
+// by the next SerializeAll. Does not take any inode locks, so it is safe to call
+// while holding them.
+func (c *Cache) markDirty(id string) {
+	if c == nil {
+		return
+	}
+	c.dirtyMutex.Lock()
+	c.dirty[id] = false
+	c.dirtyMutex.Unlock()
+}
+
+// markRemoved flags an item's metadata to be removed from disk by the next
+// SerializeAll.
+func (c *Cache) markRemoved(id string) {
+	c.dirtyMutex.Lock()
+	c.dirty[id] = true
+	c.dirtyMutex.Unlock()
+}
+
+// SerializeAll writes the metadata of every inode that has changed since the
+// last call to disk, in a single transaction. This metadata is only used later
+// if an item could not be found in memory AND the cache is offline. Items are
+// only removed from disk after being deleted from the cache, never simply for
+// not being in memory (to avoid an offline session from wiping all metadata on a
+// subsequent serialization). Items that could not be written are kept for the
+// next call.
+func (c *Cache) SerializeAll() error {
+	c.dirtyMutex.Lock()
+	dirty := c.dirty
+	c.dirty = make(map[string]bool)
+	c.dirtyMutex.Unlock()
+	if len(dirty) == 0 {
+		return nil
+	}
+	log.WithField("items", len(dirty)).Debug("Serializing cache metadata to disk.")
+
+	// encode everything before starting the transaction, so that we never hold
+	// the db lock while waiting on inode locks
+	contents := make(map[string][]byte, len(dirty))
+	for id, removed := range dirty {
+		if removed {
+			contents[id] = nil
+		} else if inode := c.metadata.load(id); inode != nil {
+			contents[id] = inode.AsBinary()
+		}
+	}
+
+	err := c.db.Update(func(tx *bolt.Tx) error {
+		b := tx.Bucket(bucketMetadata)
+		for id, data := range contents {
+			var err error
+			if data == nil {
+				err = b.Delete([]byte(id))
+			} else {
+				err = b.Put([]byte(id), data)
+				if err == nil && id == c.root {
+					// root item must be updated manually (since there's actually
+					// two copies)
+					err = b.Put([]byte("root"), data)
+				}
 			}
-			return nil
-		})
-		return true
+			if err != nil {
+				return err
+			}
+		}
+		return nil
 	})
+	if err != nil {
+		log.WithField("err", err).Error("Could not serialize cache metadata, will retry.")
+		c.dirtyMutex.Lock()
+		for id, removed := range dirty {
+			if _, changed := c.dirty[id]; !changed {
+				c.dirty[id] = removed
+			}
+		}
+		c.dirtyMutex.Unlock()
+	}
+	return err
 }
@@ -0,0 +1,176 @@
+package fs
+
+import (
+	"strings"
+	"sync"
+	"sync/atomic"
+	"syscall"
+
+	"github.com/hanwen/go-fuse/v2/fs"
+)
+
+// number of shards in an inodeIndex, must be a power of two
+const inodeIndexShards = 64
+
+type inodeShard struct {
+	sync.RWMutex
+	inodes map[string]*Inode
+}
+
+// inodeIndex maps item IDs to inodes. It is split into shards with their own
+// locks, so that concurrent filesystem ops rarely wait on each other and
+// lookups never allocate. Every item is also given a small integer inode number
+// the first time it is seen, which stays the same when the item's ID changes
+// after an upload.
+type inodeIndex struct {
+	shards  [inodeIndexShards]inodeShard
+	lastIno uint64 // last inode number handed out, atomic
+}
+
+func newInodeIndex() *inodeIndex {
+	index := &inodeIndex{
+		// the root of the mount is always inode 1
+		lastIno: 1,
+	}
+	for i := range index.shards {
+		index.shards[i].inodes = make(map[string]*Inode)
+	}
+	return index
+}
+
+func (x *inodeIndex) shard(id string) *inodeShard {
+	// FNV-1a, inlined so that hashing an ID does not allocate
+	hash := uint32(2166136261)
+	for i := 0; i < len(id); i++ {
+		hash ^= uint32(id[i])
+		hash *= 16777619
+	}
+	return &x.shards[hash&(inodeIndexShards-1)]
+}
+
+// load returns the inode with a given ID, or nil if it is not in memory.
+func (x *inodeIndex) load(id string) *Inode {
+	shard := x.shard(id)
+	shard.RLock()
+	inode := shard.inodes[id]
+	shard.RUnlock()
+	return inode
+}
+
+// store adds an inode to the index. An inode replacing another one for the same
+// ID takes over its inode number.
+func (x *inodeIndex) store(id string, inode *Inode) {
+	shard := x.shard(id)
+	shard.Lock()
+	if atomic.LoadUint64(&inode.ino) == 0 {
+		ino := uint64(0)
+		if old, exists := shard.inodes[id]; exists {
+			ino = atomic.LoadUint64(&old.ino)
+		}
+		if ino == 0 {
+			ino = atomic.AddUint64(&x.lastIno, 1)
+		}
+		atomic.StoreUint64(&inode.ino, ino)
+	}
+	shard.inodes[id] = inode
+	shard.Unlock()
+}
+
+func (x *inodeIndex) delete(id string) {
+	shard := x.shard(id)
+	shard.Lock()
+	delete(shard.inodes, id)
+	shard.Unlock()
+}
+
+// forEach calls fn for every inode in the index. The index may be changed while
+// it runs, including by fn.
+func (x *inodeIndex) forEach(fn func(id string, inode *Inode)) {
+	for i := range x.shards {
+		shard := &x.shards[i]
+		shard.RLock()
+		ids := make([]string, 0, len(shard.inodes))
+		inodes := make([]*Inode, 0, len(shard.inodes))
+		for id, inode := range shard.inodes {
+			ids = append(ids, id)
+			inodes = append(inodes, inode)
+		}
+		shard.RUnlock()
+		for j, inode := range inodes {
+			fn(ids[j], inode)
+		}
+	}
+}
+
+// stableAttr is what identifies an inode to go-fuse.
+func (i *Inode) stableAttr() fs.StableAttr {
+	return fs.StableAttr{
+		Mode: i.Mode() & syscall.S_IFMT,
+		Ino:  atomic.LoadUint64(&i.ino),
+	}
+}
+
+// addChild adds a child to an inode's children. Must be called with the mutex
+// held.
+func (i *Inode) addChild(id string, name string, isDir bool) {
+	i.children = append(i.children, id)
+	if i.childNames != nil {
+		i.childNames[strings.ToLower(name)] = id
+	}
+	if isDir {
+		i.subdir++
+	}
+}
+
+// removeChild removes a child from an inode's children. Must be called with the
+// mutex held.
+func (i *Inode) removeChild(id string, name string, isDir bool) {
+	for idx, childID := range i.children {
+		if childID == id {
+			i.children = append(i.children[:idx], i.children[idx+1:]...)
+			if folded := strings.ToLower(name); i.childNames != nil && i.childNames[folded] == id {
+				delete(i.childNames, folded)
+			}
+			if isDir {
+				i.subdir--
+			}
+			return
+		}
+	}
+}
+
+// findChild returns the child of a directory with a given name, compared
+// case-insensitively. Never fetches anything from the server - known is false if
+// the children of the directory have not been fetched yet.
+func (c *Cache) findChild(parent *Inode, name string) (child *Inode, known bool) {
+	// ToLower does not allocate if name is already lowercase
+	folded := strings.ToLower(name)
+	parent.mutex.RLock()
+	if parent.children == nil {
+		parent.mutex.RUnlock()
+		return nil, false
+	}
+	id, exists := parent.childNames[folded]
+	built := parent.childNames != nil
+	parent.mutex.RUnlock()
+
+	if !built {
+		// children loaded from disk, build the table on first use
+		parent.mutex.Lock()
+		if parent.childNames == nil {
+			parent.childNames = make(map[string]string, len(parent.children))
+			for _, childID := range parent.children {
+				// lock order is parent->child
+				if child := c.GetID(childID); child != nil {
+					parent.childNames[strings.ToLower(child.Name())] = childID
+				}
+			}
+		}
+		id, exists = parent.childNames[folded]
+		parent.mutex.Unlock()
+	}
+	if !exists {
+		return nil, true
+	}
+	return c.GetID(id), true
+}
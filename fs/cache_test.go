@@ -2,14 +2,25 @@
 package fs
 
 import (
+	"encoding/json"
+	"errors"
 	"fmt"
 	"log"
+	"net"
+	"os"
+	"path/filepath"
 	"testing"
+	"time"
+
+	"github.com/hanwen/go-fuse/v2/fuse"
+	"github.com/jstaf/onedriver/fs/graph"
+	bolt "go.etcd.io/bbolt"
 )
 
 func TestRootGet(t *testing.T) {
 	t.Parallel()
-	cache := NewCache(auth, "test_root_get.db")
+	cache, err := NewCache(auth, "test_root_get.db")
+	failOnErr(t, err)
 	root, err := cache.GetPath("/", auth)
 	if err != nil {
 		t.Fatal(err)
@@ -22,7 +33,8 @@ func TestRootGet(t *testing.T) {
 
 func TestRootChildrenUpdate(t *testing.T) {
 	t.Parallel()
-	cache := NewCache(auth, "test_root_children_update.db")
+	cache, err := NewCache(auth, "test_root_children_update.db")
+	failOnErr(t, err)
 	children, err := cache.GetChildrenPath("/", auth)
 	if err != nil {
 		t.Fatal(err)
@@ -35,7 +47,8 @@ func TestRootChildrenUpdate(t *testing.T) {
 
 func TestSubdirGet(t *testing.T) {
 	t.Parallel()
-	cache := NewCache(auth, "test_subdir_get.db")
+	cache, err := NewCache(auth, "test_subdir_get.db")
+	failOnErr(t, err)
 	documents, err := cache.GetPath("/Documents", auth)
 	if err != nil {
 		t.Fatal(err)
@@ -47,7 +60,8 @@ func TestSubdirGet(t *testing.T) {
 
 func TestSubdirChildrenUpdate(t *testing.T) {
 	t.Parallel()
-	cache := NewCache(auth, "test_subdir_children_update.db")
+	cache, err := NewCache(auth, "test_subdir_children_update.db")
+	failOnErr(t, err)
 	children, err := cache.GetChildrenPath("/Documents", auth)
 	failOnErr(t, err)
 
@@ -63,7 +77,8 @@ func TestSubdirChildrenUpdate(t *testing.T) {
 
 func TestSamePointer(t *testing.T) {
 	t.Parallel()
-	cache := NewCache(auth, "test_same_pointer.db")
+	cache, err := NewCache(auth, "test_same_pointer.db")
+	failOnErr(t, err)
 	item, _ := cache.GetPath("/Documents", auth)
 	item2, _ := cache.GetPath("/Documents", auth)
 	if item != item2 {
@@ -73,3 +88,209 @@ func TestSamePointer(t *testing.T) {
 		t.Fatal("Item was nil!")
 	}
 }
+
+// Repeatedly closing a file within the write-back delay should only result in a
+// single pending upload, which goes away once the delay has passed. It should be
+// on disk in the meantime, in case we are killed before then.
+func TestWriteBackCoalesce(t *testing.T) {
+	t.Parallel()
+	cache, err := NewCache(auth, "test_write_back.db")
+	failOnErr(t, err)
+	cache.SetWriteBackDelay(100 * time.Millisecond)
+	for i := 0; i < 5; i++ {
+		if !cache.scheduleWriteBack("writeback-item") {
+			t.Fatal("Write-back was not scheduled.")
+		}
+		time.Sleep(20 * time.Millisecond)
+	}
+	cache.writeBack.mutex.Lock()
+	pending := len(cache.writeBack.pending)
+	cache.writeBack.mutex.Unlock()
+	if pending != 1 {
+		t.Fatalf("Expected 1 pending write-back, got %d.", pending)
+	}
+	persisted := func() bool {
+		var exists bool
+		cache.db.View(func(tx *bolt.Tx) error {
+			key, _ := tx.Bucket(bucketWriteBack).Cursor().Seek([]byte("writeback-item"))
+			exists = string(key) == "writeback-item"
+			return nil
+		})
+		return exists
+	}
+	if !persisted() {
+		t.Fatal("Pending write-back was not saved to disk.")
+	}
+
+	time.Sleep(200 * time.Millisecond)
+	if cache.cancelWriteBack("writeback-item") {
+		t.Fatal("Write-back was still pending after its delay had passed.")
+	}
+	if persisted() {
+		t.Fatal("Write-back was still on disk after its delay had passed.")
+	}
+}
+
+// Children should be found case-insensitively through the child table, which
+// must be kept up to date as children come and go. Inode numbers should survive
+// an inode being replaced.
+func TestInodeIndex(t *testing.T) {
+	t.Parallel()
+	cache := &Cache{metadata: newInodeIndex(), dirty: make(map[string]bool)}
+	parent := NewInode("parent", 0755|fuse.S_IFDIR, nil)
+	cache.InsertID(parent.ID(), parent)
+	first := NewInode("First.TXT", 0644|fuse.S_IFREG, parent)
+	cache.InsertID(first.ID(), first)
+
+	// the table is built on the first lookup
+	if child, known := cache.findChild(parent, "first.txt"); !known || child != first {
+		t.Fatal("Child was not found by its lowercased name.")
+	}
+	second := NewInode("second", 0755|fuse.S_IFDIR, parent)
+	cache.InsertID(second.ID(), second)
+	if child, _ := cache.findChild(parent, "SECOND"); child != second || parent.NLink() != 3 {
+		t.Fatal("Child inserted after the table was built was not found.")
+	}
+	parent.mutex.Lock()
+	parent.removeChild(first.ID(), first.Name(), false)
+	parent.mutex.Unlock()
+	if child, known := cache.findChild(parent, "first.txt"); !known || child != nil {
+		t.Fatal("Removed child was still found.")
+	}
+
+	ino := first.stableAttr().Ino
+	if ino <= 1 || ino == parent.stableAttr().Ino || ino == second.stableAttr().Ino {
+		t.Fatalf("Inode numbers were not unique: %d", ino)
+	}
+	replacement := NewInodeDriveItem(&first.DriveItem)
+	cache.metadata.store(first.ID(), replacement)
+	if replacement.stableAttr().Ino != ino {
+		t.Fatal("Replacement inode did not keep the inode number of the old one.")
+	}
+}
+
+// Paths are put together from the cache, and should say so when an ancestor is
+// missing from it instead of looking like a path below the root.
+func TestInodePath(t *testing.T) {
+	t.Parallel()
+	db, err := bolt.Open("test_inode_path.db", 0600, &bolt.Options{Timeout: time.Second * 5})
+	failOnErr(t, err)
+	defer db.Close()
+	failOnErr(t, db.Update(func(tx *bolt.Tx) error {
+		_, err := tx.CreateBucketIfNotExists(bucketMetadata)
+		return err
+	}))
+	cache := &Cache{metadata: newInodeIndex(), dirty: make(map[string]bool), db: db}
+	parent := NewInode("parent", 0755|fuse.S_IFDIR, nil)
+	cache.InsertID(parent.ID(), parent)
+	child := NewInode("child", 0644|fuse.S_IFREG, parent)
+	cache.InsertID(child.ID(), child)
+	if path := child.Path(); path != "/parent/child" {
+		t.Fatalf("Wrong path: %s", path)
+	}
+
+	missing := NewInode("missing", 0755|fuse.S_IFDIR, parent)
+	orphan := NewInode("orphan", 0644|fuse.S_IFREG, missing)
+	cache.InsertID(orphan.ID(), orphan)
+	if path := orphan.Path(); path != "["+missing.ID()+"]/orphan" {
+		t.Fatalf("Wrong path for an inode whose parent is not cached: %s", path)
+	}
+}
+
+// A listing in progress should be readable page by page as it arrives, and
+// report a failure once at the end.
+func TestListingStream(t *testing.T) {
+	t.Parallel()
+	listing := newChildListing()
+	stream := &listingStream{listing: listing}
+	listing.add([]*Inode{NewInode("first", 0644|fuse.S_IFREG, nil)})
+	if !stream.HasNext() {
+		t.Fatal("First page was not available before the listing finished.")
+	}
+	if entry, errno := stream.Next(); errno != 0 || entry.Name != "first" {
+		t.Fatalf("Unexpected entry: %+v, %d", entry, errno)
+	}
+
+	go func() {
+		time.Sleep(10 * time.Millisecond)
+		listing.add([]*Inode{NewInode("second", 0755|fuse.S_IFDIR, nil)})
+		listing.finish(errors.New("failed"))
+	}()
+	if !stream.HasNext() {
+		t.Fatal("Stream did not wait for the next page.")
+	}
+	if entry, _ := stream.Next(); entry.Name != "second" || entry.Mode&fuse.S_IFDIR == 0 {
+		t.Fatalf("Unexpected entry: %+v", entry)
+	}
+	if !stream.HasNext() {
+		t.Fatal("Failure was not reported.")
+	}
+	if _, errno := stream.Next(); errno == 0 {
+		t.Fatal("Failure was not reported as an error.")
+	}
+	if stream.HasNext() {
+		t.Fatal("Stream did not end after reporting a failure.")
+	}
+}
+
+// Prefetches of the same thing should only be queued once, and nothing should
+// be prefetched while offline.
+func TestPrefetchDedupe(t *testing.T) {
+	t.Parallel()
+	p := &prefetcher{
+		cache:    &Cache{},
+		jobs:     make(chan prefetchJob, prefetchQueueSize),
+		inFlight: make(map[prefetchJob]bool),
+	}
+	p.listed("dir")
+	p.listed("dir")
+	p.opened("dir") // no files are prefetched with a max size of 0
+	if len(p.jobs) != 1 {
+		t.Fatalf("Expected 1 queued prefetch, got %d.", len(p.jobs))
+	}
+	p.cache.offline = true
+	p.listed("other")
+	if len(p.jobs) != 1 {
+		t.Fatal("Prefetch was queued while offline.")
+	}
+	var nilPrefetcher *prefetcher
+	nilPrefetcher.listed("dir") // prefetching is disabled, must not panic
+}
+
+// Clients of the status socket should get the status as soon as they connect.
+func TestStatusSocket(t *testing.T) {
+	t.Parallel()
+	cache := &Cache{
+		content: &ContentStore{used: 42},
+		uploads: &UploadManager{},
+		offline: true,
+	}
+	path := filepath.Join(os.TempDir(), "onedriver_test_status.sock")
+	failOnErr(t, cache.ServeStatus(path))
+
+	conn, err := net.Dial("unix", path)
+	failOnErr(t, err)
+	defer conn.Close()
+	conn.SetReadDeadline(time.Now().Add(5 * time.Second))
+	var status Status
+	failOnErr(t, json.NewDecoder(conn).Decode(&status))
+	if !status.Offline || status.CacheUsed != 42 || status.UploadsQueued != 0 {
+		t.Fatalf("Unexpected status: %+v", status)
+	}
+}
+
+// Ops should only be traced once tracing has been enabled.
+func TestTraceOps(t *testing.T) {
+	before := opLatency[opRead].Snapshot().Count
+	if !graph.Tracing() {
+		traceEnd(opRead, traceStart())
+		if opLatency[opRead].Snapshot().Count != before || OpStats() != nil {
+			t.Fatal("Op was traced while tracing was disabled.")
+		}
+		graph.EnableTracing()
+	}
+	traceEnd(opRead, traceStart())
+	if stats := OpStats(); stats["Read"].Count != before+1 {
+		t.Fatalf("Op was not traced: %+v", stats["Read"])
+	}
+}
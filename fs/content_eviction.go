@@ -0,0 +1,224 @@
+package fs
+
+import (
+	"encoding/json"
+	"sort"
+	"time"
+
+	log "github.com/sirupsen/logrus"
+	bolt "go.etcd.io/bbolt"
+)
+
+// access times are only written back to disk when they are at least this stale,
+// so that reading a file does not cause a database write every time
+const accessedPersistInterval = int64(time.Hour / time.Second)
+
+// lruItem is an entry in the content store's LRU list.
+type lruItem struct {
+	id   string
+	size uint64
+}
+
+// loadIndex builds the in-memory access index from the block index on disk, so
+// that eviction never needs to scan the database.
+func (s *ContentStore) loadIndex() {
+	type indexed struct {
+		id       string
+		size     uint64
+		accessed int64
+	}
+	var items []indexed
+	s.db.View(func(tx *bolt.Tx) error {
+		return tx.Bucket(bucketBlocks).ForEach(func(key []byte, val []byte) error {
+			var record contentRecord
+			if json.Unmarshal(val, &record) == nil {
+				items = append(items, indexed{string(key), record.Size, record.Accessed})
+			}
+			return nil
+		})
+	})
+	sort.Slice(items, func(a, b int) bool {
+		return items[a].accessed < items[b].accessed
+	})
+
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	for _, item := range items {
+		if _, exists := s.index[item.id]; exists {
+			continue
+		}
+		s.index[item.id] = s.lru.PushFront(&lruItem{id: item.id, size: item.size})
+		s.used += item.size
+	}
+}
+
+// SetLimit sets the size budget of the content store in bytes. Once the total
+// size of all content exceeds it, the least recently used content is evicted.
+// A limit of 0 disables eviction.
+func (s *ContentStore) SetLimit(limit uint64) {
+	s.mutex.Lock()
+	s.limit = limit
+	s.mutex.Unlock()
+	s.triggerEviction()
+}
+
+// SetPinned sets a function used to determine if an item's content must be kept
+// regardless of the size budget, for instance because it has not been uploaded
+// yet.
+func (s *ContentStore) SetPinned(pinned func(id string) bool) {
+	s.mutex.Lock()
+	s.pinned = pinned
+	s.mutex.Unlock()
+}
+
+// Used returns the total size of all content in the store.
+func (s *ContentStore) Used() uint64 {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	return s.used
+}
+
+// touch marks an item's content as most recently used. Must be called with the
+// mutex held.
+func (s *ContentStore) touch(id string, entry *contentEntry) {
+	if elem, exists := s.index[id]; exists {
+		s.lru.MoveToFront(elem)
+	}
+	entry.Accessed = time.Now().Unix()
+}
+
+// accessStale returns true if an entry's access time on disk is out of date
+// enough to be worth writing back. Must be called with the mutex held.
+func (e *contentEntry) accessStale() bool {
+	return e.Accessed-e.saved > accessedPersistInterval
+}
+
+// track updates the access index after an item's content has changed size. Must
+// be called with the mutex held.
+func (s *ContentStore) track(id string, entry *contentEntry) {
+	if elem, exists := s.index[id]; exists {
+		item := elem.Value.(*lruItem)
+		s.used -= item.size
+		item.size = entry.Size
+		s.lru.MoveToFront(elem)
+	} else {
+		s.index[id] = s.lru.PushFront(&lruItem{id: id, size: entry.Size})
+	}
+	s.used += entry.Size
+	entry.Accessed = time.Now().Unix()
+	if s.limit > 0 && s.used > s.limit {
+		s.triggerEviction()
+	}
+}
+
+// untrack removes an item from the access index. Must be called with the mutex
+// held.
+func (s *ContentStore) untrack(id string) {
+	if elem, exists := s.index[id]; exists {
+		s.used -= elem.Value.(*lruItem).size
+		s.lru.Remove(elem)
+		delete(s.index, id)
+	}
+}
+
+// triggerEviction starts an eviction pass in the background, if one is not
+// already pending.
+func (s *ContentStore) triggerEviction() {
+	select {
+	case s.evict <- struct{}{}:
+	default:
+	}
+}
+
+func (s *ContentStore) evictLoop() {
+	defer close(s.done)
+	for {
+		select {
+		case <-s.evict:
+			s.evictLRU()
+		case <-s.stop:
+			return
+		}
+	}
+}
+
+// Close stops evicting content in the background, waits for an eviction pass in
+// progress to finish, and closes the files that are not in use. Must be called
+// before the database is closed.
+func (s *ContentStore) Close() {
+	close(s.stop)
+	<-s.done
+	s.mutex.Lock()
+	s.closeIdle()
+	s.mutex.Unlock()
+}
+
+// evictable returns true if an item's content is not in use and has no changes
+// that have not been persisted. Must be called with the mutex held.
+func (s *ContentStore) evictable(id string) bool {
+	entry, exists := s.entries[id]
+	return !exists || (entry.refs == 0 && !entry.dirty)
+}
+
+// evictLRU removes cold content until the store is back under its size budget.
+// Content that is open, has unsaved changes or is pinned is never evicted.
+func (s *ContentStore) evictLRU() {
+	s.mutex.Lock()
+	if s.limit == 0 || s.used <= s.limit {
+		s.mutex.Unlock()
+		return
+	}
+	var candidates []string
+	for elem := s.lru.Back(); elem != nil; elem = elem.Prev() {
+		if id := elem.Value.(*lruItem).id; s.evictable(id) {
+			candidates = append(candidates, id)
+		}
+	}
+	pinned := s.pinned
+	s.mutex.Unlock()
+
+	// the pinned check is done without holding the mutex, since it may need to
+	// take inode locks
+	evicted := 0
+	var freed uint64
+	for _, id := range candidates {
+		s.mutex.Lock()
+		done := s.used <= s.limit
+		s.mutex.Unlock()
+		if done {
+			break
+		}
+		if pinned != nil && pinned(id) {
+			continue
+		}
+		s.mutex.Lock()
+		if !s.evictable(id) {
+			// picked up again in the meantime
+			s.mutex.Unlock()
+			continue
+		}
+		size := uint64(0)
+		if elem, exists := s.index[id]; exists {
+			size = elem.Value.(*lruItem).size
+		}
+		err := s.remove(id)
+		s.mutex.Unlock()
+		// the content is no longer tracked either way, so its record goes too
+		s.dropRecord(id)
+		if err != nil {
+			log.WithFields(log.Fields{
+				"id":  id,
+				"err": err,
+			}).Warn("Could not evict content.")
+			continue
+		}
+		evicted++
+		freed += size
+	}
+	if evicted > 0 {
+		log.WithFields(log.Fields{
+			"items": evicted,
+			"bytes": freed,
+		}).Info("Evicted least recently used content from cache.")
+	}
+}
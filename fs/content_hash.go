@@ -0,0 +1,216 @@
+package fs
+
+import (
+	"crypto/sha1"
+	"encoding"
+	"errors"
+	"fmt"
+	"hash"
+	"io"
+	"runtime"
+
+	"github.com/jstaf/onedriver/fs/graph"
+)
+
+// hashSlots bounds how many files are hashed at once across every cache in the
+// process, so that mounts served by one daemon do not all read and hash their
+// files at the same time.
+var hashSlots = make(chan struct{}, runtime.NumCPU())
+
+// acquireHashSlot blocks until a file may be hashed. The returned function must
+// be called once done.
+func acquireHashSlot() func() {
+	hashSlots <- struct{}{}
+	return func() { <-hashSlots }
+}
+
+// contentHashes is the hash state of an item's content, kept per block so that
+// after a change only the blocks that changed are hashed again. SHA1 can only
+// resume from a prefix, so for it we keep the state of the hash at every block
+// boundary. QuickXorHash can be computed block by block and combined. The state
+// only lives in memory.
+type contentHashes struct {
+	gen   uint64                // incremented whenever content changes
+	sha1  [][]byte              // sha1[k] is the SHA1 state after the first k+1 blocks
+	folds []*graph.QuickXORFold // QuickXorHash fold of each block, nil if unknown
+}
+
+// invalidate drops the hash state of every block overlapping [off, end). Must
+// be called with the store's mutex held.
+func (h *contentHashes) invalidate(off int64, end int64) {
+	h.gen++
+	if end <= off {
+		return
+	}
+	first := off / contentBlockSize
+	if int64(len(h.sha1)) > first {
+		h.sha1 = h.sha1[:first]
+	}
+	for idx := first; idx <= (end-1)/contentBlockSize && idx < int64(len(h.folds)); idx++ {
+		h.folds[idx] = nil
+	}
+}
+
+// reset drops all hash state. Must be called with the store's mutex held.
+func (h *contentHashes) reset() {
+	*h = contentHashes{gen: h.gen + 1}
+}
+
+// setFold records the fold of a block. Must be called with the store's mutex
+// held.
+func (h *contentHashes) setFold(idx int64, fold *graph.QuickXORFold) {
+	for int64(len(h.folds)) <= idx {
+		h.folds = append(h.folds, nil)
+	}
+	h.folds[idx] = fold
+}
+
+// resumeSHA1 returns a SHA1 hash restored from a checkpoint, or a new one if
+// there is no checkpoint.
+func resumeSHA1(checkpoint []byte) hash.Hash {
+	digest := sha1.New()
+	if checkpoint != nil {
+		digest.(encoding.BinaryUnmarshaler).UnmarshalBinary(checkpoint)
+	}
+	return digest
+}
+
+// hashBlock records the hashes of a block of content that was just written, so
+// that content downloaded from the server does not need to be read back to be
+// hashed. data must be the entire block.
+func (s *ContentStore) hashBlock(id string, entry *contentEntry, idx int64, data []byte) {
+	fold := &graph.QuickXORFold{}
+	fold.Write(data, idx*contentBlockSize)
+
+	s.mutex.Lock()
+	gen := entry.hashes.gen
+	var checkpoint []byte
+	sequential := int64(len(entry.hashes.sha1)) == idx && int64(len(data)) == contentBlockSize
+	if sequential && idx > 0 {
+		checkpoint = entry.hashes.sha1[idx-1]
+	}
+	s.mutex.Unlock()
+
+	if sequential {
+		digest := resumeSHA1(checkpoint)
+		digest.Write(data)
+		checkpoint, _ = digest.(encoding.BinaryMarshaler).MarshalBinary()
+	}
+
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	if s.entries[id] != entry || entry.hashes.gen != gen {
+		return
+	}
+	entry.hashes.setFold(idx, fold)
+	if sequential && int64(len(entry.hashes.sha1)) == idx {
+		entry.hashes.sha1 = append(entry.hashes.sha1, checkpoint)
+	}
+}
+
+// acquireComplete is like acquire, but fails if the content is not complete.
+// Returns the size of the content.
+func (s *ContentStore) acquireComplete(id string) (*contentEntry, int64, error) {
+	entry, err := s.acquire(id)
+	if err != nil {
+		return nil, 0, err
+	}
+	s.mutex.Lock()
+	size, complete := int64(entry.Size), entry.Complete
+	s.mutex.Unlock()
+	if !complete {
+		s.release(entry)
+		return nil, 0, errors.New("content for item " + id + " is incomplete")
+	}
+	return entry, size, nil
+}
+
+// SHA1Hash returns the SHA1 hash of an item's complete content, in the same
+// format as graph.SHA1Hash. Hashing resumes after the last block that has not
+// changed since the content was last hashed.
+func (s *ContentStore) SHA1Hash(id string) (string, error) {
+	entry, size, err := s.acquireComplete(id)
+	if err != nil {
+		return "", err
+	}
+	defer s.release(entry)
+
+	s.mutex.Lock()
+	gen := entry.hashes.gen
+	start := int64(len(entry.hashes.sha1))
+	var checkpoint []byte
+	if start > 0 {
+		checkpoint = entry.hashes.sha1[start-1]
+	}
+	s.mutex.Unlock()
+
+	defer acquireHashSlot()()
+	digest := resumeSHA1(checkpoint)
+	buf := make([]byte, contentBlockSize)
+	for idx := start; idx*contentBlockSize < size; idx++ {
+		n, err := entry.file.ReadAt(buf, idx*contentBlockSize)
+		if end := size - idx*contentBlockSize; int64(n) > end {
+			n = int(end)
+		}
+		if err != nil && err != io.EOF {
+			return "", err
+		}
+		digest.Write(buf[:n])
+		if n < len(buf) {
+			break
+		}
+		state, _ := digest.(encoding.BinaryMarshaler).MarshalBinary()
+		s.mutex.Lock()
+		if entry.hashes.gen == gen && int64(len(entry.hashes.sha1)) == idx {
+			entry.hashes.sha1 = append(entry.hashes.sha1, state)
+		}
+		s.mutex.Unlock()
+	}
+	return fmt.Sprintf("%X", digest.Sum(nil)), nil
+}
+
+// QuickXORHash returns the QuickXorHash of an item's complete content. Only the
+// blocks that changed since the content was last hashed are read.
+func (s *ContentStore) QuickXORHash(id string) (string, error) {
+	entry, size, err := s.acquireComplete(id)
+	if err != nil {
+		return "", err
+	}
+	defer s.release(entry)
+
+	s.mutex.Lock()
+	gen := entry.hashes.gen
+	folds := append([]*graph.QuickXORFold{}, entry.hashes.folds...)
+	s.mutex.Unlock()
+
+	defer acquireHashSlot()()
+	var total graph.QuickXORFold
+	var buf []byte
+	for idx := int64(0); idx < numBlocks(uint64(size)); idx++ {
+		var fold *graph.QuickXORFold
+		if idx < int64(len(folds)) {
+			fold = folds[idx]
+		}
+		if fold == nil {
+			if buf == nil {
+				buf = make([]byte, contentBlockSize)
+			}
+			n, err := entry.file.ReadAt(buf, idx*contentBlockSize)
+			if end := size - idx*contentBlockSize; int64(n) > end {
+				n = int(end)
+			}
+			if err != nil && err != io.EOF {
+				return "", err
+			}
+			fold = &graph.QuickXORFold{}
+			fold.Write(buf[:n], idx*contentBlockSize)
+			s.mutex.Lock()
+			if entry.hashes.gen == gen {
+				entry.hashes.setFold(idx, fold)
+			}
+			s.mutex.Unlock()
+		}
+		total.Combine(fold)
+	}
+	return total.Sum(uint64(size)), nil
+}
@@ -0,0 +1,814 @@
+package fs
+
+import (
+	"container/list"
+	"encoding/json"
+	"errors"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"strings"
+	"sync"
+
+	"github.com/jstaf/onedriver/fs/graph"
+	log "github.com/sirupsen/logrus"
+	bolt "go.etcd.io/bbolt"
+)
+
+const (
+	// contentBlockSize is the granularity at which we keep track of which parts
+	// of a file's content are present on disk.
+	contentBlockSize int64 = 1024 * 1024
+
+	// idle file descriptors are closed when we have more than this many open
+	maxOpenContentFiles = 256
+
+	// how often (in blocks) the block index of partially fetched content is saved
+	contentSaveInterval = 8
+)
+
+// the block index for every item with content on disk
+var bucketBlocks = []byte("blocks")
+
+// contentRecord is the on-disk index entry for an item's content.
+type contentRecord struct {
+	Size     uint64 `json:"size"`
+	ETag     string `json:"etag,omitempty"` // etag of the remote item the content was fetched for
+	Complete bool   `json:"complete"`
+	Blocks   []byte `json:"blocks,omitempty"`   // bitmap of present blocks while incomplete
+	Accessed int64  `json:"accessed,omitempty"` // unix time of last access, used for eviction
+
+	// set once complete content has been validated against the remote item,
+	// cleared when the content changes, see Validate. Until then, the etag only
+	// tells Begin which blocks can be kept.
+	CTag   string        `json:"ctag,omitempty"`
+	Hashes *graph.Hashes `json:"hashes,omitempty"`
+}
+
+// contentEntry is the in-memory state of an item's content.
+type contentEntry struct {
+	contentRecord
+	file    *os.File
+	refs    int   // number of operations currently using file
+	dirty   bool  // record has changed since it was last persisted
+	removed bool  // entry has been deleted, close file once refs hits 0
+	saved   int64 // access time as of the last save
+	hashes  contentHashes
+}
+
+func (e *contentEntry) hasBlock(idx int64) bool {
+	if e.Complete {
+		return true
+	}
+	if idx < 0 || idx/8 >= int64(len(e.Blocks)) {
+		return false
+	}
+	return e.Blocks[idx/8]&(1<<uint(idx%8)) > 0
+}
+
+func (e *contentEntry) setBlock(idx int64) {
+	if e.Complete || idx < 0 || idx/8 >= int64(len(e.Blocks)) {
+		return
+	}
+	e.Blocks[idx/8] |= 1 << uint(idx%8)
+	for i := int64(0); i < numBlocks(e.Size); i++ {
+		if !e.hasBlock(i) {
+			return
+		}
+	}
+	e.Complete = true
+	e.Blocks = nil
+}
+
+// numBlocks is the number of content blocks required to hold size bytes
+func numBlocks(size uint64) int64 {
+	return (int64(size) + contentBlockSize - 1) / contentBlockSize
+}
+
+// ContentStore stores file content on disk as one sparse file per item, instead
+// of as values in the metadata database. Reads and writes only touch the parts of
+// a file involved, and content that is fetched from the server piecewise is
+// tracked in fixed size blocks so that partially downloaded files can be served
+// and resumed. Only the small block index lives in bbolt. ContentStore is safe
+// for concurrent use.
+type ContentStore struct {
+	dir     string
+	db      *bolt.DB
+	mutex   sync.Mutex
+	entries map[string]*contentEntry // lazily loaded from the db
+	removed map[string]int           // removed content whose record is still on disk
+	nopen   int                      // number of open file descriptors
+
+	// eviction state, see content_eviction.go
+	limit  uint64                   // size budget in bytes, 0 is unlimited
+	used   uint64                   // total size of all content
+	lru    *list.List               // ids of all content, front is most recently used
+	index  map[string]*list.Element // id -> element of lru
+	pinned func(id string) bool     // content that must not be evicted
+	evict  chan struct{}            // triggers an eviction pass
+	stop   chan struct{}            // closed by Close
+	done   chan struct{}            // closed once evictLoop has returned
+}
+
+// NewContentStore creates a content store that keeps its files in dir. Content
+// from databases created by older versions of onedriver is migrated out of the
+// database on first use.
+func NewContentStore(dir string, db *bolt.DB) (*ContentStore, error) {
+	if err := os.MkdirAll(dir, 0700); err != nil {
+		return nil, fmt.Errorf("could not create content directory: %w", err)
+	}
+	db.Update(func(tx *bolt.Tx) error {
+		_, err := tx.CreateBucketIfNotExists(bucketBlocks)
+		return err
+	})
+	store := &ContentStore{
+		dir:     dir,
+		db:      db,
+		entries: make(map[string]*contentEntry),
+		removed: make(map[string]int),
+		lru:     list.New(),
+		index:   make(map[string]*list.Element),
+		evict:   make(chan struct{}, 1),
+		stop:    make(chan struct{}),
+		done:    make(chan struct{}),
+	}
+	store.migrate()
+	store.loadIndex()
+	go store.evictLoop()
+	return store, nil
+}
+
+// contentDir determines where content should be stored for a given database.
+func contentDir(dbpath string) string {
+	return strings.TrimSuffix(dbpath, filepath.Ext(dbpath)) + "-content"
+}
+
+// migrate moves content out of the old whole-file "content" bucket.
+func (s *ContentStore) migrate() {
+	var ids []string
+	s.db.View(func(tx *bolt.Tx) error {
+		if b := tx.Bucket(bucketContent); b != nil {
+			return b.ForEach(func(key []byte, val []byte) error {
+				ids = append(ids, string(key))
+				return nil
+			})
+		}
+		return nil
+	})
+	if len(ids) == 0 {
+		return
+	}
+
+	log.Infof("Migrating content of %d items out of the metadata database.", len(ids))
+	for _, id := range ids {
+		var content []byte
+		s.db.View(func(tx *bolt.Tx) error {
+			content = append([]byte{}, tx.Bucket(bucketContent).Get([]byte(id))...)
+			return nil
+		})
+		if err := s.Insert(id, content); err != nil {
+			log.WithFields(log.Fields{
+				"id":  id,
+				"err": err,
+			}).Error("Could not migrate content, it will be refetched on next open.")
+		}
+	}
+	s.db.Update(func(tx *bolt.Tx) error {
+		return tx.DeleteBucket(bucketContent)
+	})
+}
+
+func (s *ContentStore) path(id string) string {
+	return filepath.Join(s.dir, id)
+}
+
+// entry fetches the in-memory state of an item's content, loading it from disk if
+// necessary. Returns nil if we have no content for the item. Must be called with
+// the mutex held.
+func (s *ContentStore) entry(id string) *contentEntry {
+	if entry, exists := s.entries[id]; exists {
+		return entry
+	}
+	if s.removed[id] > 0 {
+		// the record is about to be deleted, it must not be loaded again
+		return nil
+	}
+	var entry *contentEntry
+	s.db.View(func(tx *bolt.Tx) error {
+		if data := tx.Bucket(bucketBlocks).Get([]byte(id)); data != nil {
+			entry = &contentEntry{}
+			if err := json.Unmarshal(data, &entry.contentRecord); err != nil {
+				entry = nil
+				return err
+			}
+			entry.saved = entry.Accessed
+		}
+		return nil
+	})
+	if entry != nil {
+		s.entries[id] = entry
+	}
+	return entry
+}
+
+// open makes sure an entry's file is open. Must be called with the mutex held.
+func (s *ContentStore) open(id string, entry *contentEntry) error {
+	if entry.file != nil {
+		return nil
+	}
+	file, err := os.OpenFile(s.path(id), os.O_RDWR|os.O_CREATE, 0600)
+	if err != nil {
+		return err
+	}
+	entry.file = file
+	s.nopen++
+	if s.nopen > maxOpenContentFiles {
+		s.closeIdle()
+	}
+	return nil
+}
+
+// closeIdle closes the file descriptors of all entries not currently in use. Must
+// be called with the mutex held.
+func (s *ContentStore) closeIdle() {
+	for _, entry := range s.entries {
+		if entry.file != nil && entry.refs == 0 {
+			entry.file.Close()
+			entry.file = nil
+			s.nopen--
+		}
+	}
+}
+
+// acquire fetches an item's entry and makes sure its file is open and will stay
+// open until release is called.
+func (s *ContentStore) acquire(id string) (*contentEntry, error) {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	entry := s.entry(id)
+	if entry == nil {
+		return nil, errors.New("no content for item " + id)
+	}
+	if err := s.open(id, entry); err != nil {
+		return nil, err
+	}
+	entry.refs++
+	s.touch(id, entry)
+	return entry, nil
+}
+
+func (s *ContentStore) release(entry *contentEntry) {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	entry.refs--
+	if entry.removed && entry.refs == 0 && entry.file != nil {
+		entry.file.Close()
+		entry.file = nil
+		s.nopen--
+	}
+}
+
+// file returns the open file of an entry acquired earlier, as long as the entry
+// still holds the content of the item with the given ID. Returns nil if the
+// content has been replaced since.
+func (s *ContentStore) file(id string, entry *contentEntry) *os.File {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	if s.entries[id] != entry || entry.refs == 0 {
+		return nil
+	}
+	return entry.file
+}
+
+// save persists an entry's record to disk, unless the entry has been deleted or
+// moved in the meantime. Must not be called with the mutex held.
+func (s *ContentStore) save(id string, entry *contentEntry) error {
+	return s.db.Batch(func(tx *bolt.Tx) error {
+		s.mutex.Lock()
+		defer s.mutex.Unlock()
+		if s.entries[id] != entry {
+			return nil
+		}
+		data, _ := json.Marshal(entry.contentRecord)
+		entry.dirty = false
+		entry.saved = entry.Accessed
+		return tx.Bucket(bucketBlocks).Put([]byte(id), data)
+	})
+}
+
+// invalidate forgets which remote item an entry's content matches, after the
+// content was changed locally. Must be called with the mutex held.
+func (e *contentEntry) invalidate() {
+	e.ETag = ""
+	e.CTag = ""
+	e.Hashes = nil
+	e.dirty = true
+}
+
+// Validate records that an item's complete content is known to match a remote
+// item, so that the content can be checked against later versions of the item
+// with Matches instead of being hashed again.
+func (s *ContentStore) Validate(id string, item *graph.DriveItem) error {
+	s.mutex.Lock()
+	entry := s.entry(id)
+	if entry == nil || !entry.Complete {
+		s.mutex.Unlock()
+		return errors.New("no complete content for item " + id)
+	}
+	entry.ETag = item.ETag
+	entry.CTag = item.CTag
+	entry.Hashes = nil
+	if item.File != nil {
+		hashes := item.File.Hashes
+		entry.Hashes = &hashes
+	}
+	entry.dirty = true
+	s.mutex.Unlock()
+	return s.save(id, entry)
+}
+
+// Matches returns true if an item's content is complete and was validated
+// against a version of the remote item with the same content as item. This
+// never touches the content itself.
+func (s *ContentStore) Matches(id string, item *graph.DriveItem) bool {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	entry := s.entry(id)
+	if entry == nil || !entry.Complete || entry.Hashes == nil {
+		// streamed content may have changed on the server part way through
+		return false
+	}
+	if entry.ETag != "" && entry.ETag == item.ETag {
+		return true
+	}
+	// the etag also changes when only the metadata of an item does
+	if entry.CTag != "" && entry.CTag == item.CTag {
+		return true
+	}
+	return entry.Hashes != nil && (item.VerifyChecksum(entry.Hashes.SHA1Hash) ||
+		item.VerifyChecksum(entry.Hashes.QuickXorHash))
+}
+
+// Has returns true if we have any content for an item on disk.
+func (s *ContentStore) Has(id string) bool {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	return s.entry(id) != nil
+}
+
+// IsComplete returns true if an item's entire content is present on disk.
+func (s *ContentStore) IsComplete(id string) bool {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	entry := s.entry(id)
+	return entry != nil && entry.Complete
+}
+
+// Size returns the size of an item's content.
+func (s *ContentStore) Size(id string) uint64 {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	if entry := s.entry(id); entry != nil {
+		return entry.Size
+	}
+	return 0
+}
+
+// HasRange returns true if all blocks covering [off, end) are present on disk.
+// Ranges extending past the end of the content are truncated.
+func (s *ContentStore) HasRange(id string, off int64, end int64) bool {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	entry := s.entry(id)
+	if entry == nil {
+		return false
+	}
+	if end > int64(entry.Size) {
+		end = int64(entry.Size)
+	}
+	if entry.Complete || end <= off {
+		return true
+	}
+	for idx := off / contentBlockSize; idx <= (end-1)/contentBlockSize; idx++ {
+		if !entry.hasBlock(idx) {
+			return false
+		}
+	}
+	return true
+}
+
+// HasBlock returns true if a single block of an item's content is on disk.
+func (s *ContentStore) HasBlock(id string, idx int64) bool {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	entry := s.entry(id)
+	return entry != nil && entry.hasBlock(idx)
+}
+
+// Begin prepares the store to receive an item's content piecewise via
+// WriteBlock. Blocks that were fetched previously are kept if the size and
+// etag of the item are unchanged, otherwise the old content is discarded.
+func (s *ContentStore) Begin(id string, size uint64, etag string) error {
+	s.mutex.Lock()
+	entry := s.entry(id)
+	if entry != nil && !entry.Complete && entry.Size == size && entry.ETag == etag {
+		s.mutex.Unlock()
+		return nil
+	}
+	if entry == nil {
+		entry = &contentEntry{}
+		s.entries[id] = entry
+	}
+	if err := s.open(id, entry); err != nil {
+		s.mutex.Unlock()
+		return err
+	}
+	// truncating to 0 first discards any old content, the second truncate
+	// creates a sparse file of the correct size
+	entry.file.Truncate(0)
+	if err := entry.file.Truncate(int64(size)); err != nil {
+		s.mutex.Unlock()
+		return err
+	}
+	entry.contentRecord = contentRecord{
+		Size:     size,
+		ETag:     etag,
+		Complete: size == 0,
+	}
+	entry.hashes.reset()
+	if !entry.Complete {
+		entry.Blocks = make([]byte, (numBlocks(size)+7)/8)
+	}
+	s.track(id, entry)
+	s.mutex.Unlock()
+	return s.save(id, entry)
+}
+
+// WriteBlock stores a block of content fetched from the server and marks it as
+// present. The block index is persisted every few blocks and once the content
+// is complete - losing track of a block only means it gets fetched again.
+func (s *ContentStore) WriteBlock(id string, idx int64, data []byte) error {
+	entry, err := s.acquire(id)
+	if err != nil {
+		return err
+	}
+	defer s.release(entry)
+	if _, err = entry.file.WriteAt(data, idx*contentBlockSize); err != nil {
+		return err
+	}
+
+	s.mutex.Lock()
+	if s.entries[id] != entry {
+		// deleted while we were writing
+		s.mutex.Unlock()
+		return errors.New("content for item " + id + " was removed")
+	}
+	entry.setBlock(idx)
+	entry.dirty = true
+	save := entry.Complete || idx%contentSaveInterval == 0
+	s.mutex.Unlock()
+	s.hashBlock(id, entry, idx, data)
+	if save {
+		return s.save(id, entry)
+	}
+	return nil
+}
+
+// Insert replaces an item's content on disk with the complete content given.
+func (s *ContentStore) Insert(id string, content []byte) error {
+	s.mutex.Lock()
+	entry := s.entry(id)
+	if entry == nil {
+		entry = &contentEntry{}
+		s.entries[id] = entry
+	}
+	err := s.open(id, entry)
+	if err == nil {
+		err = entry.file.Truncate(0)
+	}
+	if err == nil {
+		_, err = entry.file.WriteAt(content, 0)
+	}
+	if err != nil {
+		s.mutex.Unlock()
+		return err
+	}
+	entry.contentRecord = contentRecord{
+		Size:     uint64(len(content)),
+		Complete: true,
+	}
+	entry.hashes.reset()
+	s.track(id, entry)
+	s.mutex.Unlock()
+	for off := int64(0); off < int64(len(content)); off += contentBlockSize {
+		end := off + contentBlockSize
+		if end > int64(len(content)) {
+			end = int64(len(content))
+		}
+		s.hashBlock(id, entry, off/contentBlockSize, content[off:end])
+	}
+	return s.save(id, entry)
+}
+
+// Get reads an item's entire content from disk. Returns nil if the content is not
+// completely present.
+func (s *ContentStore) Get(id string) []byte {
+	entry, err := s.acquire(id)
+	if err != nil {
+		return nil
+	}
+	defer s.release(entry)
+	s.mutex.Lock()
+	size, complete := entry.Size, entry.Complete
+	s.mutex.Unlock()
+	if !complete {
+		return nil
+	}
+
+	content := make([]byte, size)
+	n, err := entry.file.ReadAt(content, 0)
+	if err != nil && err != io.EOF {
+		return nil
+	}
+	return content[:n]
+}
+
+// ReadAt reads content from disk into buf, starting at off. Callers should make
+// sure the range is present with HasRange first. Returns io.EOF if the read
+// extends past the end of the content.
+func (s *ContentStore) ReadAt(id string, buf []byte, off int64) (int, error) {
+	entry, err := s.acquire(id)
+	if err != nil {
+		return 0, err
+	}
+	defer s.release(entry)
+	s.mutex.Lock()
+	size := int64(entry.Size)
+	s.mutex.Unlock()
+
+	if off >= size {
+		return 0, io.EOF
+	}
+	eof := false
+	if off+int64(len(buf)) > size {
+		buf = buf[:size-off]
+		eof = true
+	}
+	n, err := entry.file.ReadAt(buf, off)
+	if err == nil && eof {
+		err = io.EOF
+	}
+	return n, err
+}
+
+// WriteAt writes data to an item's content on disk, extending it if necessary.
+// Only complete content can be written to. The change to the block index is not
+// persisted until Flush is called.
+func (s *ContentStore) WriteAt(id string, data []byte, off int64) (int, error) {
+	entry, err := s.acquire(id)
+	if err != nil {
+		return 0, err
+	}
+	defer s.release(entry)
+	s.mutex.Lock()
+	complete := entry.Complete
+	s.mutex.Unlock()
+	if !complete {
+		return 0, errors.New("cannot write to incomplete content")
+	}
+
+	n, err := entry.file.WriteAt(data, off)
+	s.mutex.Lock()
+	if end := uint64(off) + uint64(n); end > entry.Size {
+		entry.Size = end
+	}
+	entry.invalidate()
+	entry.hashes.invalidate(off, off+int64(n))
+	s.track(id, entry)
+	s.mutex.Unlock()
+	return n, err
+}
+
+// Truncate changes the size of an item's content. Only complete content can be
+// truncated.
+func (s *ContentStore) Truncate(id string, size uint64) error {
+	entry, err := s.acquire(id)
+	if err != nil {
+		return err
+	}
+	defer s.release(entry)
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	if !entry.Complete {
+		return errors.New("cannot truncate incomplete content")
+	}
+	if err := entry.file.Truncate(int64(size)); err != nil {
+		return err
+	}
+	if size < entry.Size {
+		entry.hashes.invalidate(int64(size), int64(entry.Size))
+	} else {
+		entry.hashes.invalidate(int64(entry.Size), int64(size))
+	}
+	entry.Size = size
+	entry.invalidate()
+	s.track(id, entry)
+	return nil
+}
+
+// View calls fn with a reader for an item's complete content. The content will
+// not be closed out from under fn.
+func (s *ContentStore) View(id string, fn func(reader io.Reader) error) error {
+	entry, err := s.acquire(id)
+	if err != nil {
+		return err
+	}
+	defer s.release(entry)
+	s.mutex.Lock()
+	size, complete := entry.Size, entry.Complete
+	s.mutex.Unlock()
+	if !complete {
+		return errors.New("content for item " + id + " is incomplete")
+	}
+	return fn(io.NewSectionReader(entry.file, 0, int64(size)))
+}
+
+// snapshotDir is where copies of content taken for uploads are kept.
+func (s *ContentStore) snapshotDir() string {
+	return filepath.Join(s.dir, "snapshots")
+}
+
+// Snapshot copies an item's complete content to a new file that is not affected
+// by later changes to the item, and returns its path. Used for uploads, so that
+// a file can keep changing while it is being uploaded without the whole thing
+// being held in memory. The caller is responsible for deleting the snapshot.
+func (s *ContentStore) Snapshot(id string) (string, error) {
+	return s.snapshot(id, func(file io.Writer) error {
+		return s.View(id, func(reader io.Reader) error {
+			_, err := io.CopyBuffer(file, reader, make([]byte, contentBlockSize))
+			return err
+		})
+	})
+}
+
+// SnapshotData is like Snapshot, but for content that is not in the store.
+func (s *ContentStore) SnapshotData(id string, data []byte) (string, error) {
+	return s.snapshot(id, func(file io.Writer) error {
+		_, err := file.Write(data)
+		return err
+	})
+}
+
+func (s *ContentStore) snapshot(id string, fill func(file io.Writer) error) (string, error) {
+	if err := os.MkdirAll(s.snapshotDir(), 0700); err != nil {
+		return "", err
+	}
+	file, err := ioutil.TempFile(s.snapshotDir(), id+"-")
+	if err != nil {
+		return "", err
+	}
+	err = fill(file)
+	if closeErr := file.Close(); err == nil {
+		err = closeErr
+	}
+	if err != nil {
+		os.Remove(file.Name())
+		return "", err
+	}
+	return file.Name(), nil
+}
+
+// RemoveSnapshots deletes every snapshot that is not in keep. Used at startup to
+// clean up after uploads that were never finished.
+func (s *ContentStore) RemoveSnapshots(keep map[string]bool) {
+	names, _ := ioutil.ReadDir(s.snapshotDir())
+	for _, info := range names {
+		path := filepath.Join(s.snapshotDir(), info.Name())
+		if !keep[path] {
+			os.Remove(path)
+		}
+	}
+}
+
+// Sync makes sure an item's content and block index have been written to stable
+// storage.
+func (s *ContentStore) Sync(id string) error {
+	entry, err := s.acquire(id)
+	if err != nil {
+		return err
+	}
+	err = entry.file.Sync()
+	s.release(entry)
+	if err != nil {
+		return err
+	}
+	s.mutex.Lock()
+	dirty := entry.dirty
+	s.mutex.Unlock()
+	if dirty {
+		return s.save(id, entry)
+	}
+	return nil
+}
+
+// Flush persists any outstanding changes to an item's block index.
+func (s *ContentStore) Flush(id string) error {
+	s.mutex.Lock()
+	entry := s.entry(id)
+	dirty := entry != nil && (entry.dirty || entry.accessStale())
+	s.mutex.Unlock()
+	if dirty {
+		return s.save(id, entry)
+	}
+	return nil
+}
+
+// forget drops an entry from memory, closing its file once nobody is using it.
+// Must be called with the mutex held.
+func (s *ContentStore) forget(id string, entry *contentEntry) {
+	delete(s.entries, id)
+	entry.removed = true
+	if entry.file != nil && entry.refs == 0 {
+		entry.file.Close()
+		entry.file = nil
+		s.nopen--
+	}
+}
+
+// Delete removes an item's content from disk.
+func (s *ContentStore) Delete(id string) error {
+	s.mutex.Lock()
+	err := s.remove(id)
+	s.mutex.Unlock()
+	s.dropRecord(id)
+	return err
+}
+
+// remove deletes an item's content file and drops it from memory. The caller is
+// responsible for calling dropRecord afterwards, even if this fails. Must be
+// called with the mutex held.
+func (s *ContentStore) remove(id string) error {
+	if entry, exists := s.entries[id]; exists {
+		s.forget(id, entry)
+	}
+	s.removed[id]++
+	s.untrack(id)
+	err := os.Remove(s.path(id))
+	if os.IsNotExist(err) {
+		return nil
+	}
+	return err
+}
+
+// Move moves an item's content from one ID to another.
+func (s *ContentStore) Move(oldID string, newID string) error {
+	s.mutex.Lock()
+	entry := s.entry(oldID)
+	if entry == nil {
+		s.mutex.Unlock()
+		return errors.New("Content not found for ID: " + oldID)
+	}
+	// any open file descriptor remains valid after the rename
+	if err := os.Rename(s.path(oldID), s.path(newID)); err != nil {
+		s.mutex.Unlock()
+		return err
+	}
+	if old, exists := s.entries[newID]; exists {
+		s.forget(newID, old)
+	}
+	delete(s.entries, oldID)
+	s.removed[oldID]++
+	s.entries[newID] = entry
+	s.untrack(newID)
+	s.untrack(oldID)
+	s.track(newID, entry)
+	s.mutex.Unlock()
+
+	if err := s.dropRecord(oldID); err != nil {
+		return err
+	}
+	return s.save(newID, entry)
+}
+
+// dropRecord deletes the record of content that was removed, which entry ignores
+// from the moment the content is removed until the deletion has been committed.
+// Must not be called with the mutex held.
+func (s *ContentStore) dropRecord(id string) error {
+	err := s.db.Batch(func(tx *bolt.Tx) error {
+		s.mutex.Lock()
+		defer s.mutex.Unlock()
+		if entry, exists := s.entries[id]; exists {
+			// added again in the meantime, its record may have just been saved
+			entry.dirty = true
+		}
+		return tx.Bucket(bucketBlocks).Delete([]byte(id))
+	})
+	s.mutex.Lock()
+	if s.removed[id]--; s.removed[id] <= 0 {
+		delete(s.removed, id)
+	}
+	s.mutex.Unlock()
+	return err
+}
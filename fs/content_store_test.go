@@ -0,0 +1,190 @@
+package fs
+
+import (
+	"bytes"
+	"math/rand"
+	"testing"
+	"time"
+
+	"github.com/jstaf/onedriver/fs/graph"
+	bolt "go.etcd.io/bbolt"
+)
+
+// newTestContentStore opens a ContentStore with its own database. The returned
+// function closes both.
+func newTestContentStore(t *testing.T, dbpath string) (*ContentStore, func()) {
+	db, err := bolt.Open(dbpath, 0600, &bolt.Options{Timeout: time.Second * 5})
+	failOnErr(t, err)
+	store, err := NewContentStore(contentDir(dbpath), db)
+	failOnErr(t, err)
+	return store, func() {
+		store.Close()
+		db.Close()
+	}
+}
+
+// Fetched blocks should survive the store being reopened, and only be marked as
+// complete once every block is present.
+func TestContentStoreBlocks(t *testing.T) {
+	t.Parallel()
+	store, done := newTestContentStore(t, "test_content_store.db")
+	defer done()
+
+	size := uint64(2*contentBlockSize + 10)
+	failOnErr(t, store.Begin("blocks", size, "etag"))
+	failOnErr(t, store.WriteBlock("blocks", 0, make([]byte, contentBlockSize)))
+	failOnErr(t, store.Flush("blocks"))
+	if store.IsComplete("blocks") || !store.HasBlock("blocks", 0) || store.HasBlock("blocks", 1) {
+		t.Fatal("Block index did not match the blocks written.")
+	}
+
+	// same size and etag should keep the blocks we already have
+	reopened, err := NewContentStore(store.dir, store.db)
+	failOnErr(t, err)
+	defer reopened.Close()
+	failOnErr(t, reopened.Begin("blocks", size, "etag"))
+	if !reopened.HasBlock("blocks", 0) {
+		t.Fatal("Block was lost after reopening the store.")
+	}
+	failOnErr(t, reopened.WriteBlock("blocks", 1, make([]byte, contentBlockSize)))
+	failOnErr(t, reopened.WriteBlock("blocks", 2, []byte("0123456789")))
+	if !reopened.IsComplete("blocks") {
+		t.Fatal("Content was not complete after writing every block.")
+	}
+	if content := reopened.Get("blocks"); uint64(len(content)) != size ||
+		!bytes.HasSuffix(content, []byte("0123456789")) {
+		t.Fatal("Content did not match what was written.")
+	}
+
+	// a different etag means the old content is no longer valid
+	failOnErr(t, reopened.Begin("blocks", size, "new etag"))
+	if reopened.HasBlock("blocks", 0) {
+		t.Fatal("Stale blocks were kept after the etag changed.")
+	}
+}
+
+// Once over its size budget, the store should evict the least recently used
+// content that is not pinned or in use.
+func TestContentStoreEviction(t *testing.T) {
+	t.Parallel()
+	store, done := newTestContentStore(t, "test_content_eviction.db")
+	defer done()
+	store.SetPinned(func(id string) bool {
+		return id == "pinned"
+	})
+
+	data := make([]byte, 1024)
+	failOnErr(t, store.Insert("pinned", data))
+	failOnErr(t, store.Insert("cold", data))
+	failOnErr(t, store.Insert("open", data))
+	entry, err := store.acquire("open")
+	failOnErr(t, err)
+	defer store.release(entry)
+	failOnErr(t, store.Insert("hot", data))
+
+	store.SetLimit(3 * 1024)
+	for i := 0; i < 10 && store.Has("cold"); i++ {
+		time.Sleep(100 * time.Millisecond)
+	}
+	if store.Has("cold") {
+		t.Fatal("Least recently used content was not evicted.")
+	}
+	for _, id := range []string{"pinned", "open", "hot"} {
+		if !store.Has(id) {
+			t.Fatalf("\"%s\" should not have been evicted.", id)
+		}
+	}
+}
+
+// Removed content must not be loaded again from its record while the record is
+// still waiting to be deleted.
+func TestContentStoreRemovedRecord(t *testing.T) {
+	t.Parallel()
+	store, done := newTestContentStore(t, "test_content_removed.db")
+	defer done()
+
+	failOnErr(t, store.Insert("removed", []byte("content")))
+	store.mutex.Lock()
+	failOnErr(t, store.remove("removed"))
+	store.mutex.Unlock()
+	if store.IsComplete("removed") {
+		t.Fatal("Removed content was loaded again from its record.")
+	}
+	failOnErr(t, store.dropRecord("removed"))
+	reopened, err := NewContentStore(store.dir, store.db)
+	failOnErr(t, err)
+	defer reopened.Close()
+	if reopened.IsComplete("removed") {
+		t.Fatal("Record of removed content was not deleted.")
+	}
+}
+
+// Hashes computed incrementally from the block store should always match hashing
+// the whole content from scratch.
+func TestContentStoreHashes(t *testing.T) {
+	t.Parallel()
+	store, done := newTestContentStore(t, "test_content_hashes.db")
+	defer done()
+
+	content := make([]byte, 2*contentBlockSize+123)
+	rand.Read(content)
+	failOnErr(t, store.Insert("hashes", content))
+	check := func(step string) {
+		sha1, err := store.SHA1Hash("hashes")
+		failOnErr(t, err)
+		quickXOR, err := store.QuickXORHash("hashes")
+		failOnErr(t, err)
+		if sha1 != graph.SHA1Hash(&content) || quickXOR != graph.QuickXORHash(&content) {
+			t.Fatalf("Hashes did not match the content after %s.", step)
+		}
+	}
+	check("insert")
+
+	_, err := store.WriteAt("hashes", []byte("changed"), contentBlockSize+5)
+	failOnErr(t, err)
+	copy(content[contentBlockSize+5:], "changed")
+	check("write")
+
+	failOnErr(t, store.Truncate("hashes", uint64(contentBlockSize+2)))
+	content = content[:contentBlockSize+2]
+	check("truncate")
+
+	failOnErr(t, store.Truncate("hashes", uint64(2*contentBlockSize)))
+	content = append(content, make([]byte, contentBlockSize-2)...)
+	check("extend")
+}
+
+// Validated content should match later versions of the item with the same
+// content, until it is modified locally.
+func TestContentStoreValidate(t *testing.T) {
+	t.Parallel()
+	store, done := newTestContentStore(t, "test_content_validate.db")
+	defer done()
+
+	content := []byte("validated content")
+	item := &graph.DriveItem{ETag: "etag", CTag: "ctag", File: &graph.File{}}
+	item.File.Hashes.SHA1Hash = graph.SHA1Hash(&content)
+	failOnErr(t, store.Insert("validate", content))
+	if store.Matches("validate", item) {
+		t.Fatal("Content matched an item before being validated.")
+	}
+	failOnErr(t, store.Validate("validate", item))
+
+	renamed := *item
+	renamed.ETag = "renamed etag"
+	rehashed := renamed
+	rehashed.CTag = "new ctag"
+	changed := rehashed
+	changed.File = &graph.File{}
+	changed.File.Hashes.SHA1Hash = "0000"
+	if !store.Matches("validate", item) || !store.Matches("validate", &renamed) ||
+		!store.Matches("validate", &rehashed) || store.Matches("validate", &changed) {
+		t.Fatal("Validated content did not match the right items.")
+	}
+
+	_, err := store.WriteAt("validate", []byte("in"), 0)
+	failOnErr(t, err)
+	if store.Matches("validate", item) {
+		t.Fatal("Modified content still matched the remote item.")
+	}
+}
@@ -4,7 +4,12 @@ import (
 	"context"
 	"encoding/json"
 	"errors"
+	"hash/fnv"
+	"net/http"
+	"sort"
 	"strings"
+	"sync"
+	"sync/atomic"
 	"time"
 
 	"github.com/jstaf/onedriver/fs/graph"
@@ -12,59 +17,52 @@ import (
 	bolt "go.etcd.io/bbolt"
 )
 
-// DeltaLoop creates a new thread to poll the server for changes and should be
-// called as a goroutine
+const (
+	// number of workers used to apply deltas concurrently
+	deltaWorkers = 8
+
+	// how many pages of deltas can be fetched ahead of the ones being applied
+	deltaPagesAhead = 2
+)
+
+// DeltaLoop starts polling the server for changes in the background, until the
+// cache is stopped. interval is the longest time between polls while online -
+// polling is faster after recent changes, and backs off exponentially while
+// offline.
 func (c *Cache) DeltaLoop(interval time.Duration) {
+	c.background(func() { c.deltaLoop(interval) })
+}
+
+func (c *Cache) deltaLoop(interval time.Duration) {
 	log.Trace("Starting delta goroutine.")
+	defer joinDeltaPacer()()
+	c.background(c.watchNetwork)
+	schedule := newDeltaSchedule(interval)
 	for { // eva
-		// get deltas
-		log.Debug("Fetching deltas from server.")
-		pollSuccess := false
-		deltas := make(map[string]*Inode)
-		for {
-			incoming, cont, err := c.pollDeltas(c.GetAuth())
-			if err != nil {
-				// the only thing that should be able to bring the FS out
-				// of a read-only state is a successful delta call
-				log.WithField("err", err).Error(
-					"Error during delta fetch, marking fs as offline.",
-				)
-				c.Lock()
-				c.offline = true
-				c.Unlock()
-				break
-			}
-
-			for _, delta := range incoming {
-				// As per the API docs, the last delta received from the server
-				// for an item is the one we should use.
-				deltas[delta.ID()] = delta
-			}
-			if !cont {
-				log.Infof("Fetched %d deltas.", len(deltas))
-				pollSuccess = true
-				break
+		if turn := deltaTurn(); turn > 0 {
+			log.WithField("wait", turn).Trace("Waiting for the delta fetches of other mounts.")
+			select {
+			case <-time.After(turn):
+			case <-c.stop:
+				return
 			}
 		}
 
-		// now apply deltas
-		secondPass := make([]string, 0)
-		for _, delta := range deltas {
-			err := c.applyDelta(delta)
-			// retry deletion of non-empty directories after all other deltas applied
-			if err != nil && err.Error() == "directory is non-empty" {
-				secondPass = append(secondPass, delta.ID())
-			}
-		}
-		for _, id := range secondPass {
-			// failures should explicitly be ignored the second time around as per docs
-			c.applyDelta(deltas[id])
-		}
+		// get deltas, applying each page as soon as it arrives while the next
+		// one is fetched in the background
+		log.Debug("Fetching deltas from server.")
+		pages := make(chan deltaPage, deltaPagesAhead)
+		go c.fetchDeltas(c.GetAuth(), pages)
+		pollSuccess, total := c.applyDeltaPages(pages)
 
-		if !c.IsOffline() {
-			c.SerializeAll()
+		// the deltaLink may only move past these changes once they are on disk,
+		// otherwise a restart would never fetch them again
+		serialized := true
+		if pollSuccess || !c.IsOffline() {
+			serialized = c.SerializeAll() == nil
 		}
 
+		var wait time.Duration
 		if pollSuccess {
 			c.Lock()
 			if c.offline {
@@ -72,20 +70,130 @@ func (c *Cache) DeltaLoop(interval time.Duration) {
 			}
 			c.offline = false
 			c.Unlock()
+			atomic.StoreInt64(&c.lastDelta, time.Now().Unix())
 
-			c.db.Update(func(tx *bolt.Tx) error {
-				return tx.Bucket(bucketDelta).Put([]byte("deltaLink"), []byte(c.deltaLink))
-			})
-
-			// wait until next interval
-			time.Sleep(interval)
+			if serialized {
+				c.db.Update(func(tx *bolt.Tx) error {
+					return tx.Bucket(bucketDelta).Put([]byte("deltaLink"), []byte(c.deltaLink))
+				})
+			}
+			wait = schedule.online(total > 0 || c.recentActivity(schedule.current))
 		} else {
-			// shortened duration while offline
-			time.Sleep(2 * time.Second)
+			wait = schedule.offline()
 		}
+
+		// wait until next interval, or until we are told something changed
+		log.WithField("wait", wait).Trace("Waiting for next delta fetch.")
+		timer := time.NewTimer(wait)
+		select {
+		case <-timer.C:
+		case <-c.deltaTrigger:
+			timer.Stop()
+			log.Debug("Delta fetch triggered early.")
+		case <-c.stop:
+			timer.Stop()
+			return
+		}
+	}
+}
+
+// TriggerDelta makes the delta loop fetch deltas right away instead of waiting
+// for the rest of its polling interval. Multiple triggers before the next fetch
+// are coalesced into one.
+func (c *Cache) TriggerDelta() {
+	select {
+	case c.deltaTrigger <- struct{}{}:
+	default:
 	}
 }
 
+// deltaPage is a single page of deltas fetched from the server. last is set on
+// the final page of a successful polling cycle.
+type deltaPage struct {
+	deltas []*Inode
+	last   bool
+	err    error
+}
+
+// fetchDeltas fetches pages of deltas until the end of the current polling cycle
+// and sends them to pages, closing it when done. Since the channel is bounded,
+// fetching never gets too far ahead of the deltas being applied.
+func (c *Cache) fetchDeltas(auth *graph.Auth, pages chan<- deltaPage) {
+	defer close(pages)
+	for {
+		incoming, cont, err := c.pollDeltas(auth)
+		pages <- deltaPage{deltas: incoming, last: err == nil && !cont, err: err}
+		if err != nil || !cont {
+			return
+		}
+	}
+}
+
+// applyDeltaPages applies pages of deltas in the order they are received. Each
+// page is finished before the next one is started. Returns true if the polling
+// cycle completed successfully, and the number of deltas applied.
+func (c *Cache) applyDeltaPages(pages <-chan deltaPage) (bool, int) {
+	pollSuccess := false
+	total := 0
+	// deletions of non-empty directories, retried once everything else has been
+	// applied. Entries are set to nil if a later delta for the item arrives.
+	secondPass := make([]*Inode, 0)
+	retry := make(map[string]int)
+
+	for page := range pages {
+		if page.err != nil {
+			// the only thing that should be able to bring the FS out
+			// of a read-only state is a successful delta call
+			log.WithField("err", page.err).Error(
+				"Error during delta fetch, marking fs as offline.",
+			)
+			c.Lock()
+			c.offline = true
+			c.Unlock()
+			continue
+		}
+
+		// As per the API docs, the last delta received from the server for an
+		// item is the one we should use.
+		deltas := make(map[string]*Inode, len(page.deltas))
+		order := make([]string, 0, len(page.deltas)) // ids in the order they first arrived
+		for _, delta := range page.deltas {
+			id := delta.ID()
+			if _, exists := deltas[id]; !exists {
+				order = append(order, id)
+			}
+			deltas[id] = delta
+		}
+		batch := make([]*Inode, 0, len(order))
+		for _, id := range order {
+			if i, exists := retry[id]; exists {
+				// superseded by this newer delta
+				secondPass[i] = nil
+				delete(retry, id)
+			}
+			batch = append(batch, deltas[id])
+		}
+		for _, delta := range c.applyDeltas(batch) {
+			retry[delta.ID()] = len(secondPass)
+			secondPass = append(secondPass, delta)
+		}
+		total += len(batch)
+		pollSuccess = page.last
+	}
+	log.Infof("Fetched %d deltas.", total)
+
+	// children arrive after their parents, so retrying in reverse order deletes
+	// nested directories from the bottom up
+	for i := len(secondPass) - 1; i >= 0; i-- {
+		if secondPass[i] != nil {
+			// failures should explicitly be ignored the second time around as
+			// per docs
+			c.applyDelta(secondPass[i])
+		}
+	}
+	return pollSuccess, total
+}
+
 type deltaResponse struct {
 	NextLink  string   `json:"@odata.nextLink,omitempty"`
 	DeltaLink string   `json:"@odata.deltaLink,omitempty"`
@@ -99,6 +207,13 @@ type deltaResponse struct {
 // everything is a delta, regardless of where it came from).
 func (c *Cache) pollDeltas(auth *graph.Auth) ([]*Inode, bool, error) {
 	resp, err := graph.Get(c.deltaLink, auth)
+	var graphErr *graph.Error
+	if errors.As(err, &graphErr) && graphErr.StatusCode == http.StatusGone {
+		// our delta link is too old, likely because we started from the
+		// metadata of a session long ago
+		c.resync()
+		resp, err = graph.Get(c.deltaLink, auth)
+	}
 	if err != nil {
 		return make([]*Inode, 0), false, err
 	}
@@ -117,6 +232,82 @@ func (c *Cache) pollDeltas(auth *graph.Auth) ([]*Inode, bool, error) {
 	return page.Values, false, nil
 }
 
+// applyDeltas applies a batch of deduplicated deltas using a pool of workers.
+// Deltas are sharded by parent ID, so that changes to the same directory are
+// applied in the order they arrived while independent directories are updated
+// concurrently. A delta whose parent was created by an earlier delta in the same
+// batch waits for it to be applied first. Moves change two directories, so they
+// are applied one at a time, after everything that arrived before them. Returns
+// the deletions of non-empty directories (in arrival order), which must be
+// retried after all other deltas are applied.
+func (c *Cache) applyDeltas(deltas []*Inode) []*Inode {
+	secondPass := make([]*Inode, 0)
+	start := 0
+	for i, delta := range deltas {
+		local := c.GetID(delta.ID())
+		if local == nil || local.ParentID() == delta.ParentID() {
+			continue
+		}
+		secondPass = append(secondPass, c.applyDeltaShards(deltas[start:i])...)
+		if err := c.applyDelta(delta); err != nil && err.Error() == "directory is non-empty" {
+			secondPass = append(secondPass, delta)
+		}
+		start = i + 1
+	}
+	return append(secondPass, c.applyDeltaShards(deltas[start:])...)
+}
+
+// applyDeltaShards applies deltas that each only change a single directory,
+// sharded by parent ID.
+func (c *Cache) applyDeltaShards(deltas []*Inode) []*Inode {
+	if len(deltas) == 0 {
+		return nil
+	}
+	position := make(map[string]int, len(deltas))
+	done := make([]chan struct{}, len(deltas))
+	shards := make([][]int, deltaWorkers)
+	for i, delta := range deltas {
+		position[delta.ID()] = i
+		done[i] = make(chan struct{})
+		hash := fnv.New32a()
+		hash.Write([]byte(delta.ParentID()))
+		shard := hash.Sum32() % deltaWorkers
+		shards[shard] = append(shards[shard], i)
+	}
+
+	var wg sync.WaitGroup
+	var mutex sync.Mutex
+	secondPass := make([]*Inode, 0)
+	for _, shard := range shards {
+		wg.Add(1)
+		go func(shard []int) {
+			defer wg.Done()
+			for _, i := range shard {
+				delta := deltas[i]
+				// only wait on earlier deltas, which guarantees we can't deadlock
+				if parent, exists := position[delta.ParentID()]; exists && parent < i {
+					<-done[parent]
+				}
+				err := c.applyDelta(delta)
+				close(done[i])
+				// retry deletion of non-empty directories after all other deltas applied
+				if err != nil && err.Error() == "directory is non-empty" {
+					mutex.Lock()
+					secondPass = append(secondPass, delta)
+					mutex.Unlock()
+				}
+			}
+		}(shard)
+	}
+	wg.Wait()
+
+	// keep arrival order for the second pass
+	sort.Slice(secondPass, func(a, b int) bool {
+		return position[secondPass[a].ID()] < position[secondPass[b].ID()]
+	})
+	return secondPass
+}
+
 // applyDelta diagnoses and applies a server-side change to our local state.
 // Things we care about (present in the local cache):
 // * Deleted items
@@ -201,6 +392,7 @@ func (c *Cache) applyDelta(delta *Inode) error {
 				"delta":    "create",
 			}).Info("Creating inode from delta.")
 			c.InsertChild(parentID, delta)
+			c.pins.changed(id)
 			return nil
 		}
 	}
@@ -229,6 +421,8 @@ func (c *Cache) applyDelta(delta *Inode) error {
 			return errors.New("parent not in cache")
 		}
 		parent.Rename(context.Background(), local.Name(), newParent, name, 0)
+		// may have been moved into a pinned directory
+		c.pins.changed(id)
 		// do not return, there may be additional changes
 	}
 
@@ -263,11 +457,15 @@ func (c *Cache) applyDelta(delta *Inode) error {
 			local.DriveItem.ModTime = delta.DriveItem.ModTime
 			local.DriveItem.Size = delta.DriveItem.Size
 			local.DriveItem.ETag = delta.DriveItem.ETag
+			local.DriveItem.CTag = delta.DriveItem.CTag
 			// the rest of these are harmless when this is a directory
 			// as they will be null anyways
 			local.DriveItem.File = delta.DriveItem.File
 			local.hasChanges = false
-			local.data = nil
+			local.stream = nil
+			c.content.Delete(id)
+			c.markDirty(id)
+			c.pins.changed(id)
 			return nil
 		}
 	}
@@ -0,0 +1,128 @@
+package fs
+
+import (
+	"math/rand"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+const (
+	// fastest polling interval, used right after changes were seen
+	deltaMinInterval = 5 * time.Second
+
+	// first and longest wait between delta fetches while offline
+	deltaOfflineMin = 2 * time.Second
+	deltaOfflineMax = 5 * time.Minute
+
+	// how far apart the delta fetches of different caches in one process start
+	deltaStagger = 2 * time.Second
+)
+
+// deltaSchedule decides how long the delta loop waits between fetches. Polling
+// is fast after changes, and slows down each time nothing changes until it
+// reaches the maximum interval. While offline, the wait doubles after each
+// failure, with jitter so that many clients coming back don't hit the server
+// in lockstep.
+type deltaSchedule struct {
+	min, max time.Duration
+	current  time.Duration // wait between polls while online
+	backoff  time.Duration // next wait while offline, 0 when online
+	jitter   *rand.Rand
+}
+
+func newDeltaSchedule(max time.Duration) *deltaSchedule {
+	min := deltaMinInterval
+	if min > max {
+		min = max
+	}
+	return &deltaSchedule{
+		min:     min,
+		max:     max,
+		current: max,
+		jitter:  rand.New(rand.NewSource(time.Now().UnixNano())),
+	}
+}
+
+// online returns the wait after a successful fetch. changed is true if any
+// remote or local changes were seen since the last fetch.
+func (d *deltaSchedule) online(changed bool) time.Duration {
+	d.backoff = 0
+	if changed {
+		d.current = d.min
+	} else if d.current < d.max {
+		d.current *= 2
+		if d.current > d.max {
+			d.current = d.max
+		}
+	}
+	return d.current
+}
+
+// offline returns the wait after a failed fetch.
+func (d *deltaSchedule) offline() time.Duration {
+	if d.backoff == 0 {
+		d.backoff = deltaOfflineMin
+	} else if d.backoff < deltaOfflineMax {
+		d.backoff *= 2
+		if d.backoff > deltaOfflineMax {
+			d.backoff = deltaOfflineMax
+		}
+	}
+	// wait somewhere between half and all of the backoff
+	half := d.backoff / 2
+	return half + time.Duration(d.jitter.Int63n(int64(half)+1))
+}
+
+// noteActivity records that a local change was just made on the server, so
+// that the delta loop polls faster for a while. Safe to call on a nil Cache.
+func (c *Cache) noteActivity() {
+	if c == nil {
+		return
+	}
+	atomic.StoreInt64(&c.activity, time.Now().Unix())
+}
+
+// recentActivity returns true if a local change was made within the window.
+func (c *Cache) recentActivity(window time.Duration) bool {
+	last := atomic.LoadInt64(&c.activity)
+	return last > 0 && time.Since(time.Unix(last, 0)) <= window
+}
+
+// deltaPacer spreads out the delta fetches of every cache in the process, so that
+// a daemon serving several accounts does not poll for all of them at once. Does
+// nothing while there is only one delta loop.
+var deltaPacer struct {
+	sync.Mutex
+	loops int       // number of delta loops running
+	next  time.Time // earliest time the next fetch may start
+}
+
+// joinDeltaPacer counts a delta loop in until the returned function is called.
+func joinDeltaPacer() func() {
+	deltaPacer.Lock()
+	deltaPacer.loops++
+	deltaPacer.Unlock()
+	return func() {
+		deltaPacer.Lock()
+		deltaPacer.loops--
+		deltaPacer.Unlock()
+	}
+}
+
+// deltaTurn reserves a start time for a delta fetch and returns how long to wait
+// for it.
+func deltaTurn() time.Duration {
+	deltaPacer.Lock()
+	defer deltaPacer.Unlock()
+	if deltaPacer.loops < 2 {
+		return 0
+	}
+	now := time.Now()
+	start := deltaPacer.next
+	if start.Before(now) {
+		start = now
+	}
+	deltaPacer.next = start.Add(deltaStagger)
+	return start.Sub(now)
+}
@@ -14,9 +14,10 @@ import (
 )
 
 // a helper function for use with tests
-func (i *Inode) setContent(newContent []byte) {
+func (i *Inode) setContent(cache *Cache, newContent []byte) {
+	i.cache = cache
 	i.DriveItem.Size = uint64(len(newContent))
-	i.data = &newContent
+	cache.InsertContent(i.DriveItem.ID, newContent)
 	if i.DriveItem.Parent.DriveType == graph.DriveTypePersonal {
 		i.DriveItem.File.Hashes.SHA1Hash = graph.SHA1Hash(&newContent)
 	} else {
@@ -24,6 +25,15 @@ func (i *Inode) setContent(newContent []byte) {
 	}
 }
 
+// stopCache stops a cache that a test created next to the mounted one, and
+// removes its database and content.
+func stopCache(cache *Cache) {
+	path := cache.db.Path()
+	cache.Stop()
+	os.Remove(path)
+	os.RemoveAll(contentDir(path))
+}
+
 // In this test, we create a directory through the API, and wait to see if
 // the cache picks it up post-creation.
 func TestDeltaMkdir(t *testing.T) {
@@ -165,7 +175,10 @@ func TestDeltaContentChangeRemote(t *testing.T) {
 	inode := NewInodeDriveItem(item)
 	failOnErr(t, err)
 	newContent := []byte("because it has been changed remotely!")
-	inode.setContent(newContent)
+	cache, err := NewCache(auth, "test_delta_content_change_remote.db")
+	failOnErr(t, err)
+	defer stopCache(cache)
+	inode.setContent(cache, newContent)
 	session, err := NewUploadSession(inode)
 	failOnErr(t, err)
 	failOnErr(t, session.Upload(auth))
@@ -213,7 +226,10 @@ func TestDeltaContentChangeBoth(t *testing.T) {
 
 	inode := NewInodeDriveItem(item)
 	newContent := []byte("remote")
-	inode.setContent(newContent)
+	cache, err := NewCache(auth, "test_delta_content_change_both.db")
+	failOnErr(t, err)
+	defer stopCache(cache)
+	inode.setContent(cache, newContent)
 	session, err := NewUploadSession(inode)
 	failOnErr(t, err)
 	failOnErr(t, session.Upload(auth))
@@ -300,7 +316,8 @@ func TestDeltaFolderDeletion(t *testing.T) {
 // We should only perform a delta deletion of a folder if it was nonempty
 func TestDeltaFolderDeletionNonEmpty(t *testing.T) {
 	t.Parallel()
-	cache := NewCache(auth, "test_delta_folder_deletion_nonempty.db")
+	cache, err := NewCache(auth, "test_delta_folder_deletion_nonempty.db")
+	failOnErr(t, err)
 	dir := NewInode("folder", 0755|fuse.S_IFDIR, nil)
 	file := NewInode("file", 0644|fuse.S_IFREG, nil)
 	cache.InsertPath("/folder", nil, dir)
@@ -314,7 +331,7 @@ func TestDeltaFolderDeletionNonEmpty(t *testing.T) {
 		},
 		mode: 0755 | fuse.S_IFDIR,
 	}
-	err := cache.applyDelta(delta)
+	err = cache.applyDelta(delta)
 	if cache.GetID(delta.ID()) == nil {
 		t.Fatal("Folder should still be present")
 	}
@@ -358,7 +375,8 @@ func TestDeltaNoModTimeUpdate(t *testing.T) {
 // https://github.com/jstaf/onedriver/issues/111
 func TestDeltaMissingHash(t *testing.T) {
 	t.Parallel()
-	cache := NewCache(auth, "test_delta_missing_hash.db")
+	cache, err := NewCache(auth, "test_delta_missing_hash.db")
+	failOnErr(t, err)
 	file := NewInode("file", 0644|fuse.S_IFREG, nil)
 	cache.InsertPath("/folder", nil, file)
 
@@ -376,3 +394,33 @@ func TestDeltaMissingHash(t *testing.T) {
 	cache.applyDelta(delta)
 	// if we survive to here without a segfault, test passed
 }
+
+// Polling should speed up after changes, slow down while quiet, and back off
+// exponentially while offline.
+func TestDeltaSchedule(t *testing.T) {
+	t.Parallel()
+	schedule := newDeltaSchedule(30 * time.Second)
+	if wait := schedule.online(true); wait != deltaMinInterval {
+		t.Fatalf("Expected %s after changes, got %s.", deltaMinInterval, wait)
+	}
+	if wait := schedule.online(false); wait != 2*deltaMinInterval {
+		t.Fatalf("Expected %s while quiet, got %s.", 2*deltaMinInterval, wait)
+	}
+	for i := 0; i < 10; i++ {
+		schedule.online(false)
+	}
+	if schedule.current != 30*time.Second {
+		t.Fatalf("Polling interval did not stop at the maximum: %s.", schedule.current)
+	}
+
+	var last time.Duration
+	for i := 0; i < 20; i++ {
+		last = schedule.offline()
+		if last > deltaOfflineMax {
+			t.Fatalf("Offline backoff exceeded the maximum: %s.", last)
+		}
+	}
+	if last < deltaOfflineMax/2 {
+		t.Fatalf("Offline backoff did not grow: %s.", last)
+	}
+}
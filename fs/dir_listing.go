@@ -0,0 +1,165 @@
+package fs
+
+import (
+	"sync"
+	"syscall"
+
+	"github.com/hanwen/go-fuse/v2/fuse"
+	"github.com/jstaf/onedriver/fs/graph"
+	log "github.com/sirupsen/logrus"
+)
+
+// childListing is a fetch of a directory's children from the server that is in
+// progress. Children become available page by page as they arrive, so that
+// Readdir can start returning entries long before a huge directory has been
+// fetched. The directory's children are only set once the last page has
+// arrived - until then, anything that needs them complete (Lookup, deltas) waits
+// for the listing to finish instead of starting another one.
+type childListing struct {
+	mutex    sync.Mutex
+	arrived  *sync.Cond // broadcast when a page arrives or the listing ends
+	children []*Inode   // fetched so far
+	done     bool
+	err      error
+}
+
+func newChildListing() *childListing {
+	listing := &childListing{}
+	listing.arrived = sync.NewCond(&listing.mutex)
+	return listing
+}
+
+func (l *childListing) add(children []*Inode) {
+	l.mutex.Lock()
+	l.children = append(l.children, children...)
+	l.mutex.Unlock()
+	l.arrived.Broadcast()
+}
+
+func (l *childListing) finish(err error) {
+	l.mutex.Lock()
+	l.done = true
+	l.err = err
+	l.mutex.Unlock()
+	l.arrived.Broadcast()
+}
+
+// wait blocks until the listing has ended, and returns everything it fetched.
+func (l *childListing) wait() ([]*Inode, error) {
+	l.mutex.Lock()
+	defer l.mutex.Unlock()
+	for !l.done {
+		l.arrived.Wait()
+	}
+	return l.children, l.err
+}
+
+// listing returns the listing of a directory's children, starting one if none
+// is in progress. Returns nil if the children are already known.
+func (c *Cache) listing(inode *Inode) *childListing {
+	inode.mutex.Lock()
+	defer inode.mutex.Unlock()
+	if inode.children != nil {
+		return nil
+	}
+	if inode.listing == nil {
+		listing := newChildListing()
+		inode.listing = listing
+		c.background(func() { c.fetchChildren(inode, listing) })
+	}
+	return inode.listing
+}
+
+// fetchChildren runs a listing. Children are added to the cache as each page
+// arrives, but only become the children of the directory once all of them have
+// been fetched. The listing is shared by everyone waiting for it, so it uses the
+// cache's own auth rather than that of whoever started it.
+func (c *Cache) fetchChildren(inode *Inode, listing *childListing) {
+	id := inode.ID()
+	err := graph.GetItemChildrenPages(id, c.GetAuth(), func(page []*graph.DriveItem) bool {
+		children := make([]*Inode, 0, len(page))
+		for _, item := range page {
+			// we will always have an id after fetching from the server
+			child := NewInodeDriveItem(item)
+			child.cache = c
+			child.compact()
+			// equal, but not shared: every child should point at the parent's copy
+			if child.DriveItem.Parent.ID == id {
+				child.DriveItem.Parent.ID = id
+			}
+			c.metadata.store(child.DriveItem.ID, child)
+			c.markDirty(child.DriveItem.ID)
+			children = append(children, child)
+		}
+		listing.add(children)
+		return true
+	})
+
+	listing.mutex.Lock()
+	fetched := listing.children
+	listing.mutex.Unlock()
+	inode.mutex.Lock()
+	if err == nil && inode.children == nil {
+		inode.children = make([]string, 0, len(fetched))
+		inode.childNames = make(map[string]string, len(fetched))
+		for _, child := range fetched {
+			if c.metadata.load(child.ID()) != child || child.ParentID() != id {
+				// replaced, moved or deleted by a delta in the meantime
+				continue
+			}
+			// store id in parent item and increment parents subdirectory count
+			inode.addChild(child.ID(), child.Name(), child.IsDir())
+		}
+	}
+	inode.listing = nil
+	inode.mutex.Unlock()
+	if err == nil {
+		c.markDirty(id)
+	} else if !graph.IsOffline(err) {
+		log.WithFields(log.Fields{
+			"id":  id,
+			"err": err,
+		}).Error("Error while fetching children.")
+	}
+	listing.finish(err)
+}
+
+// listingStream is a DirStream over a listing that may still be in progress.
+// It blocks when it catches up with the pages fetched so far.
+type listingStream struct {
+	listing  *childListing
+	next     int
+	reported bool // the listing failed and Next has said so
+}
+
+func (s *listingStream) HasNext() bool {
+	l := s.listing
+	l.mutex.Lock()
+	defer l.mutex.Unlock()
+	for s.next >= len(l.children) && !l.done {
+		l.arrived.Wait()
+	}
+	// a failure is reported by Next, unless it was only because we are offline
+	return s.next < len(l.children) ||
+		(l.err != nil && !graph.IsOffline(l.err) && !s.reported)
+}
+
+func (s *listingStream) Next() (fuse.DirEntry, syscall.Errno) {
+	l := s.listing
+	l.mutex.Lock()
+	if s.next >= len(l.children) {
+		s.reported = true
+		l.mutex.Unlock()
+		return fuse.DirEntry{}, syscall.EREMOTEIO
+	}
+	child := l.children[s.next]
+	s.next++
+	l.mutex.Unlock()
+	return fuse.DirEntry{
+		Name: child.Name(),
+		Mode: child.Mode(),
+		Ino:  child.stableAttr().Ino,
+	}, 0
+}
+
+func (s *listingStream) Close() {}
@@ -491,3 +491,77 @@ func TestLibreOfficeSavePatternLarge(t *testing.T) {
 		t.Fatal("Item size was 0!")
 	}
 }
+
+// Pinning a directory through its extended attribute should download everything
+// in it, and keep it from being evicted until it is unpinned.
+func TestPinnedXAttr(t *testing.T) {
+	t.Parallel()
+	dir := filepath.Join(TestDir, "pinned")
+	failOnErr(t, os.Mkdir(dir, 0755))
+	failOnErr(t, ioutil.WriteFile(filepath.Join(dir, "pinned.txt"), []byte("offline\n"), 0644))
+
+	// forget the content once it has been uploaded, it has to come back
+	var id string
+	for i := 0; i < 30; i++ {
+		time.Sleep(time.Second)
+		inode, _ := fsCache.GetPath("/onedriver_tests/pinned/pinned.txt", auth)
+		if inode != nil && !isLocalID(inode.ID()) && !fsCache.uploads.IsQueued(inode.ID()) {
+			id = inode.ID()
+			break
+		}
+	}
+	if id == "" {
+		t.Fatal("File was never uploaded.")
+	}
+	failOnErr(t, fsCache.content.Delete(id))
+
+	failOnErr(t, syscall.Setxattr(dir, PinnedXAttr, []byte("1"), 0))
+	buf := make([]byte, 8)
+	if n, err := syscall.Getxattr(dir, PinnedXAttr, buf); err != nil || string(buf[:n]) != "1" {
+		t.Fatalf("Pinned attribute was not set, got %q: %v", buf[:n], err)
+	}
+	for i := 0; i < 30 && !fsCache.content.IsComplete(id); i++ {
+		time.Sleep(time.Second)
+	}
+	if !fsCache.content.IsComplete(id) {
+		t.Fatal("Content of pinned directory was not downloaded.")
+	}
+	if !fsCache.contentPinned(id) {
+		t.Fatal("Content of pinned directory could be evicted.")
+	}
+
+	failOnErr(t, syscall.Removexattr(dir, PinnedXAttr))
+	if _, err := syscall.Getxattr(dir, PinnedXAttr, buf); err != syscall.ENODATA {
+		t.Fatal("Pinned attribute was not removed:", err)
+	}
+	if fsCache.contentPinned(id) {
+		t.Fatal("Content of unpinned directory could not be evicted.")
+	}
+}
+
+// Reopening a file before its write-back has happened must not replace the local
+// changes with the content that is still on the server. Not parallel, as it
+// changes the write-back delay of the whole filesystem.
+func TestWriteBackReopen(t *testing.T) {
+	fname := filepath.Join(TestDir, "write_back_reopen.txt")
+	failOnErr(t, ioutil.WriteFile(fname, []byte("uploaded\n"), 0644))
+	var uploaded bool
+	for i := 0; i < 30 && !uploaded; i++ {
+		time.Sleep(time.Second)
+		inode, _ := fsCache.GetPath("/onedriver_tests/write_back_reopen.txt", auth)
+		uploaded = inode != nil && !isLocalID(inode.ID()) &&
+			!fsCache.uploads.IsQueued(inode.ID())
+	}
+	if !uploaded {
+		t.Fatal("File was never uploaded.")
+	}
+
+	fsCache.SetWriteBackDelay(10 * time.Second)
+	defer fsCache.SetWriteBackDelay(0)
+	failOnErr(t, ioutil.WriteFile(fname, []byte("changed locally\n"), 0644))
+	read, err := ioutil.ReadFile(fname)
+	failOnErr(t, err)
+	if string(read) != "changed locally\n" {
+		t.Fatalf("Local changes were lost on reopen, got %q.", read)
+	}
+}
@@ -0,0 +1,269 @@
+package graph
+
+import (
+	"bytes"
+	"encoding/json"
+	"errors"
+	"net/http"
+	"strconv"
+	"sync"
+	"time"
+)
+
+const (
+	// the most requests the API accepts in a single $batch
+	maxBatchSize = 20
+
+	// how long a Batcher waits for more requests before sending a batch
+	batchWindow = 5 * time.Millisecond
+)
+
+// BatchRequest is a single request inside of a $batch request. URL is relative
+// to GraphURL, just like the resource passed to Request.
+// https://docs.microsoft.com/en-us/graph/json-batching
+type BatchRequest struct {
+	ID        string            `json:"id"`
+	Method    string            `json:"method"`
+	URL       string            `json:"url"`
+	Body      json.RawMessage   `json:"body,omitempty"`
+	Headers   map[string]string `json:"headers,omitempty"`
+	DependsOn []string          `json:"dependsOn,omitempty"`
+}
+
+// BatchResponse is the response to a single request inside of a $batch request.
+type BatchResponse struct {
+	ID      string            `json:"id"`
+	Status  int               `json:"status"`
+	Headers map[string]string `json:"headers,omitempty"`
+	Body    json.RawMessage   `json:"body,omitempty"`
+}
+
+// Err returns the error for a response, like Request would have for the same
+// request made on its own.
+func (r *BatchResponse) Err() error {
+	if r.Status == 0 {
+		return errors.New("no response for request " + r.ID + " in batch")
+	}
+	if r.Status < 400 {
+		return nil
+	}
+	var err graphError
+	json.Unmarshal(r.Body, &err)
+	header := http.Header{}
+	for key, value := range r.Headers {
+		header.Set(key, value)
+	}
+	return &Error{
+		StatusCode: r.Status,
+		Code:       err.Error.Code,
+		Message:    err.Error.Message,
+		RetryAfter: RetryAfter(header),
+	}
+}
+
+// Batch sends up to 20 requests to the server in a single round trip. The
+// responses are returned in the same order as the requests.
+func Batch(requests []BatchRequest, auth *Auth) ([]BatchResponse, error) {
+	if len(requests) > maxBatchSize {
+		return nil, errors.New("too many requests for a single batch")
+	}
+	payload, _ := json.Marshal(struct {
+		Requests []BatchRequest `json:"requests"`
+	}{requests})
+	resp, err := Post("/$batch", auth, bytes.NewReader(payload))
+	if err != nil {
+		return nil, err
+	}
+	var result struct {
+		Responses []BatchResponse `json:"responses"`
+	}
+	if err = json.Unmarshal(resp, &result); err != nil {
+		return nil, err
+	}
+
+	// responses can come back in any order
+	byID := make(map[string]BatchResponse, len(result.Responses))
+	for _, response := range result.Responses {
+		byID[response.ID] = response
+	}
+	responses := make([]BatchResponse, len(requests))
+	for i, request := range requests {
+		if response, exists := byID[request.ID]; exists {
+			responses[i] = response
+		} else {
+			responses[i] = BatchResponse{ID: request.ID}
+		}
+	}
+	return responses, nil
+}
+
+// batchCall is a request waiting to be sent by a Batcher.
+type batchCall struct {
+	request BatchRequest
+	keys    []string // ids of the items the request touches
+	auth    *Auth
+	done    chan batchResult
+}
+
+type batchResult struct {
+	body []byte
+	err  error
+}
+
+// Batcher groups requests made around the same time by different callers into
+// $batch requests, so that bulk operations like removing a directory tree cost a
+// fraction of the round trips. Requests touching the same item are made to
+// depend on each other, so they are still applied in the order they were made.
+// Safe for concurrent use.
+type Batcher struct {
+	calls    chan *batchCall
+	stop     chan struct{} // closed by Close
+	stopOnce sync.Once
+	loopDone chan struct{}
+}
+
+// NewBatcher creates a new Batcher. It must be closed with Close once it is no
+// longer needed.
+func NewBatcher() *Batcher {
+	batcher := &Batcher{
+		calls:    make(chan *batchCall),
+		stop:     make(chan struct{}),
+		loopDone: make(chan struct{}),
+	}
+	go batcher.loop()
+	return batcher
+}
+
+// Close stops the Batcher. Requests that were already queued are still sent,
+// later ones fail right away.
+func (b *Batcher) Close() {
+	b.stopOnce.Do(func() {
+		close(b.stop)
+	})
+	<-b.loopDone
+}
+
+func (b *Batcher) loop() {
+	defer close(b.loopDone)
+	for {
+		var calls []*batchCall
+		select {
+		case call := <-b.calls:
+			calls = append(calls, call)
+		case <-b.stop:
+			return
+		}
+		timer := time.NewTimer(batchWindow)
+	collect:
+		for len(calls) < maxBatchSize {
+			select {
+			case call := <-b.calls:
+				calls = append(calls, call)
+			case <-timer.C:
+				break collect
+			case <-b.stop:
+				break collect
+			}
+		}
+		timer.Stop()
+		go b.send(calls)
+	}
+}
+
+// send makes the requests of a group of calls and hands back their results.
+func (b *Batcher) send(calls []*batchCall) {
+	if len(calls) == 1 {
+		// not worth the overhead of a batch
+		call := calls[0]
+		body, err := Request(call.request.URL, call.auth, call.request.Method,
+			bytes.NewReader(call.request.Body))
+		call.done <- batchResult{body, err}
+		return
+	}
+
+	requests := make([]BatchRequest, len(calls))
+	last := make(map[string]string) // item id -> id of the last request touching it
+	for i, call := range calls {
+		request := call.request
+		request.ID = strconv.Itoa(i + 1)
+		for _, key := range call.keys {
+			if dep, exists := last[key]; exists && !containsString(request.DependsOn, dep) {
+				request.DependsOn = append(request.DependsOn, dep)
+			}
+			last[key] = request.ID
+		}
+		requests[i] = request
+	}
+
+	responses, err := Batch(requests, calls[0].auth)
+	for i, call := range calls {
+		if err != nil {
+			call.done <- batchResult{nil, err}
+		} else {
+			call.done <- batchResult{responses[i].Body, responses[i].Err()}
+		}
+	}
+}
+
+func containsString(values []string, value string) bool {
+	for _, v := range values {
+		if v == value {
+			return true
+		}
+	}
+	return false
+}
+
+// do queues a request and waits for its result. keys are the ids of the items
+// the request touches.
+func (b *Batcher) do(method string, resource string, body []byte, auth *Auth, keys ...string) ([]byte, error) {
+	request := BatchRequest{Method: method, URL: resource}
+	if body != nil {
+		request.Body = body
+		request.Headers = map[string]string{"Content-Type": "application/json"}
+		if method == "PATCH" {
+			request.Headers["If-Match"] = "*"
+		}
+	}
+	call := &batchCall{
+		request: request,
+		keys:    keys,
+		auth:    auth,
+		done:    make(chan batchResult, 1),
+	}
+	select {
+	case b.calls <- call:
+	case <-b.stop:
+		return nil, errors.New("batcher was closed")
+	}
+	result := <-call.done
+	return result.body, result.err
+}
+
+// Remove is like the Remove function, but batched.
+func (b *Batcher) Remove(id string, auth *Auth) error {
+	_, err := b.do("DELETE", "/me/drive/items/"+id, nil, auth, id)
+	return err
+}
+
+// Mkdir is like the Mkdir function, but batched.
+func (b *Batcher) Mkdir(name string, parentID string, auth *Auth) (*DriveItem, error) {
+	resp, err := b.do("POST", childrenPathID(parentID), mkdirPayload(name), auth, parentID)
+	if err != nil {
+		return nil, err
+	}
+	item := &DriveItem{}
+	return item, json.Unmarshal(resp, item)
+}
+
+// Rename is like the Rename function, but batched.
+func (b *Batcher) Rename(itemID string, itemName string, parentID string, auth *Auth) error {
+	payload := renamePayload(itemName, parentID)
+	_, err := b.do("PATCH", "/me/drive/items/"+itemID, payload, auth, itemID, parentID)
+	if err != nil && isResourceModified(err) {
+		// same as Rename, the server may not be done creating the item yet
+		time.Sleep(time.Second)
+		_, err = b.do("PATCH", "/me/drive/items/"+itemID, payload, auth, itemID, parentID)
+	}
+	return err
+}
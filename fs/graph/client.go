@@ -0,0 +1,110 @@
+package graph
+
+import (
+	"crypto/tls"
+	"io"
+	"net"
+	"net/http"
+	"net/http/httptrace"
+	"sync/atomic"
+	"time"
+)
+
+// transport is shared by every request made by onedriver, so that connections
+// and TLS sessions to the Graph API and its download/upload hosts are reused
+// instead of being set up again for every request.
+var transport = &countingTransport{
+	base: &http.Transport{
+		Proxy: http.ProxyFromEnvironment,
+		DialContext: (&net.Dialer{
+			Timeout:   15 * time.Second,
+			KeepAlive: 30 * time.Second,
+		}).DialContext,
+		ForceAttemptHTTP2:     true,
+		MaxIdleConns:          64,
+		MaxIdleConnsPerHost:   16,
+		MaxConnsPerHost:       32,
+		IdleConnTimeout:       90 * time.Second,
+		TLSHandshakeTimeout:   10 * time.Second,
+		ExpectContinueTimeout: time.Second,
+		TLSClientConfig: &tls.Config{
+			ClientSessionCache: tls.NewLRUClientSessionCache(64),
+		},
+	},
+}
+
+// NewClient returns an HTTP client with the given timeout (0 for none) that
+// uses the shared transport. Clients are cheap, connections are what is shared.
+func NewClient(timeout time.Duration) *http.Client {
+	return &http.Client{Transport: transport, Timeout: timeout}
+}
+
+// ConnStats is a count of how many requests were made on reused connections and
+// how many had to open a new one, how much data went over them, and how long
+// the server took to respond.
+type ConnStats struct {
+	Reused        uint64
+	Opened        uint64
+	BytesSent     uint64
+	BytesReceived uint64
+	Latency       HistogramSnapshot // time until response headers arrived
+}
+
+// GetConnStats returns the counters of the shared transport.
+func GetConnStats() ConnStats {
+	return ConnStats{
+		Reused:        atomic.LoadUint64(&transport.reused),
+		Opened:        atomic.LoadUint64(&transport.opened),
+		BytesSent:     atomic.LoadUint64(&transport.sent),
+		BytesReceived: atomic.LoadUint64(&transport.received),
+		Latency:       transport.latency.Snapshot(),
+	}
+}
+
+// countingTransport counts connection reuse, bytes transferred and latency for
+// every request it carries.
+type countingTransport struct {
+	base     http.RoundTripper
+	reused   uint64
+	opened   uint64
+	sent     uint64
+	received uint64
+	latency  Histogram
+}
+
+// countingBody counts the bytes read from a request or response body.
+type countingBody struct {
+	io.ReadCloser
+	count *uint64
+}
+
+func (b countingBody) Read(p []byte) (int, error) {
+	n, err := b.ReadCloser.Read(p)
+	atomic.AddUint64(b.count, uint64(n))
+	return n, err
+}
+
+func (t *countingTransport) RoundTrip(request *http.Request) (*http.Response, error) {
+	start := time.Now()
+	trace := &httptrace.ClientTrace{
+		GotConn: func(info httptrace.GotConnInfo) {
+			if info.Reused {
+				atomic.AddUint64(&t.reused, 1)
+			} else {
+				atomic.AddUint64(&t.opened, 1)
+			}
+		},
+	}
+	request = request.WithContext(httptrace.WithClientTrace(request.Context(), trace))
+	if request.Body != nil && request.Body != http.NoBody {
+		// the length is not always known up front
+		request.Body = countingBody{ReadCloser: request.Body, count: &t.sent}
+	}
+	response, err := t.base.RoundTrip(request)
+	if err != nil {
+		return response, err
+	}
+	t.latency.Observe(time.Since(start))
+	response.Body = countingBody{ReadCloser: response.Body, count: &t.received}
+	return response, nil
+}
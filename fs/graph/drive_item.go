@@ -3,6 +3,11 @@ package graph
 import (
 	"bytes"
 	"encoding/json"
+	"errors"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"net/http"
 	"strings"
 	"time"
 )
@@ -63,6 +68,7 @@ type DriveItem struct {
 	Deleted          *Deleted         `json:"deleted,omitempty"`
 	ConflictBehavior string           `json:"@microsoft.graph.conflictBehavior,omitempty"`
 	ETag             string           `json:"eTag,omitempty"`
+	CTag             string           `json:"cTag,omitempty"` // only changes with content
 }
 
 // GetItem fetches a DriveItem by ID. ID can also be "root" for the root item.
@@ -108,45 +114,119 @@ func GetItemContent(id string, auth *Auth) ([]byte, error) {
 	return Get("/me/drive/items/"+id+"/content", auth)
 }
 
+// only used for parsing
+type downloadURLResponse struct {
+	DownloadURL string `json:"@microsoft.graph.downloadUrl"`
+}
+
+// GetItemDownloadURL fetches a short-lived, pre-authenticated URL that can be
+// used to fetch an item's content without an Authorization header. These
+// expire after roughly an hour and should be refetched if a request against
+// them fails.
+func GetItemDownloadURL(id string, auth *Auth) (string, error) {
+	body, err := Get("/me/drive/items/"+id+"?select=id,@microsoft.graph.downloadUrl", auth)
+	if err != nil {
+		return "", err
+	}
+	var resp downloadURLResponse
+	if err = json.Unmarshal(body, &resp); err != nil {
+		return "", err
+	}
+	if resp.DownloadURL == "" {
+		return "", errors.New("no download URL returned for item " + id)
+	}
+	return resp.DownloadURL, nil
+}
+
+// GetItemContentRange fetches size bytes of an item's content starting at
+// offset using an HTTP Range request against a URL from GetItemDownloadURL.
+// Fewer bytes than requested are returned if the range extends past the end of
+// the file, and an empty slice is returned if offset is beyond the end of the
+// file.
+func GetItemContentRange(downloadURL string, offset uint64, size uint64) ([]byte, error) {
+	if size == 0 {
+		return make([]byte, 0), nil
+	}
+	client := NewClient(60 * time.Second)
+	request, _ := http.NewRequest("GET", downloadURL, nil)
+	request.Header.Add("Range", fmt.Sprintf("bytes=%d-%d", offset, offset+size-1))
+	response, err := client.Do(request)
+	if err != nil {
+		return nil, err
+	}
+	defer response.Body.Close()
+
+	switch {
+	case response.StatusCode == http.StatusRequestedRangeNotSatisfiable:
+		return make([]byte, 0), nil
+	case response.StatusCode == http.StatusPartialContent:
+		return ioutil.ReadAll(io.LimitReader(response.Body, int64(size)))
+	case response.StatusCode == http.StatusOK:
+		// the server ignored our Range header and sent the whole file, discard
+		// everything we didn't ask for
+		if _, err = io.CopyN(ioutil.Discard, response.Body, int64(offset)); err != nil {
+			if err == io.EOF {
+				return make([]byte, 0), nil
+			}
+			return nil, err
+		}
+		return ioutil.ReadAll(io.LimitReader(response.Body, int64(size)))
+	}
+	return nil, fmt.Errorf("HTTP %d - could not fetch content range", response.StatusCode)
+}
+
 // Remove removes a directory or file by ID
 func Remove(id string, auth *Auth) error {
 	return Delete("/me/drive/items/"+id, auth)
 }
 
+// mkdirPayload is the request body used to create a new folder
+func mkdirPayload(name string) []byte {
+	bytePayload, _ := json.Marshal(DriveItem{
+		Name:   name,
+		Folder: &Folder{},
+	})
+	return bytePayload
+}
+
 // Mkdir creates a directory on the server at the specified parent ID.
 func Mkdir(name string, parentID string, auth *Auth) (*DriveItem, error) {
 	// create a new folder on the server
-	newFolderPost := DriveItem{
-		Name:   name,
-		Folder: &Folder{},
-	}
-	bytePayload, _ := json.Marshal(newFolderPost)
-	resp, err := Post(childrenPathID(parentID), auth, bytes.NewReader(bytePayload))
+	resp, err := Post(childrenPathID(parentID), auth, bytes.NewReader(mkdirPayload(name)))
 	if err != nil {
 		return nil, err
 	}
-	err = json.Unmarshal(resp, &newFolderPost)
-	return &newFolderPost, err
+	newFolder := DriveItem{}
+	err = json.Unmarshal(resp, &newFolder)
+	return &newFolder, err
 }
 
-// Rename moves and/or renames an item on the server. The itemName and parentID
-// arguments correspond to the *new* basename or id of the parent.
-func Rename(itemID string, itemName string, parentID string, auth *Auth) error {
-	// start creating patch content for server
-	// mutex does not need to be initialized since it is never used locally
-	patchContent := DriveItem{
+// renamePayload is the request body used to move and/or rename an item
+func renamePayload(itemName string, parentID string) []byte {
+	jsonPatch, _ := json.Marshal(DriveItem{
 		ConflictBehavior: "replace", // overwrite existing content at new location
 		Name:             itemName,
 		Parent: &DriveItemParent{
 			ID: parentID,
 		},
-	}
+	})
+	return jsonPatch
+}
 
+// isResourceModified returns true if a request failed because the item was
+// still being changed on the server.
+func isResourceModified(err error) bool {
+	return strings.Contains(err.Error(), "resourceModified")
+}
+
+// Rename moves and/or renames an item on the server. The itemName and parentID
+// arguments correspond to the *new* basename or id of the parent.
+func Rename(itemID string, itemName string, parentID string, auth *Auth) error {
 	// apply patch to server copy - note that we don't actually care about the
 	// response content, only if it returns an error
-	jsonPatch, _ := json.Marshal(patchContent)
+	jsonPatch := renamePayload(itemName, parentID)
 	_, err := Patch("/me/drive/items/"+itemID, auth, bytes.NewReader(jsonPatch))
-	if err != nil && strings.Contains(err.Error(), "resourceModified") {
+	if err != nil && isResourceModified(err) {
 		// Wait a second, then retry the request. The Onedrive servers sometimes
 		// aren't quick enough here if the object has been recently created
 		// (<1 second ago).
@@ -165,20 +245,38 @@ type driveChildren struct {
 // this is the internal method that actually fetches an item's children
 func getItemChildren(pollURL string, auth *Auth) ([]*DriveItem, error) {
 	fetched := make([]*DriveItem, 0)
+	err := getItemChildrenPages(pollURL, auth, func(page []*DriveItem) bool {
+		fetched = append(fetched, page...)
+		return true
+	})
+	return fetched, err
+}
+
+// getItemChildrenPages fetches an item's children one page at a time, calling
+// page with each one as soon as it arrives. Stops early if page returns false.
+func getItemChildrenPages(pollURL string, auth *Auth, page func([]*DriveItem) bool) error {
 	for pollURL != "" {
 		body, err := Get(pollURL, auth)
 		if err != nil {
-			return fetched, err
+			return err
 		}
 		var pollResult driveChildren
 		json.Unmarshal(body, &pollResult)
 
 		// there can be multiple pages of 200 items each (default).
 		// continue to next interation if we have an @odata.nextLink value
-		fetched = append(fetched, pollResult.Children...)
+		if !page(pollResult.Children) {
+			return nil
+		}
 		pollURL = strings.TrimPrefix(pollResult.NextLink, GraphURL)
 	}
-	return fetched, nil
+	return nil
+}
+
+// GetItemChildrenPages is like GetItemChildren, but hands over the children one
+// page at a time as they are fetched, instead of all at once at the end.
+func GetItemChildrenPages(id string, auth *Auth, page func([]*DriveItem) bool) error {
+	return getItemChildrenPages(childrenPathID(id), auth, page)
 }
 
 // GetItemChildren fetches all children of an item denoted by ID.
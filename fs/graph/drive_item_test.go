@@ -16,3 +16,61 @@ func TestGetItem(t *testing.T) {
 		t.Fatal("We didn't return an error for a non-existent item!")
 	}
 }
+
+// Operations made at the same time through a Batcher should all succeed, even
+// when several of them touch the same item.
+func TestBatcher(t *testing.T) {
+	t.Parallel()
+	var auth Auth
+	auth.FromFile(".auth_tokens.json")
+	root, err := GetItemPath("/", &auth)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	batcher := NewBatcher()
+	defer batcher.Close()
+	names := []string{"batch_a", "batch_b", "batch_c", "batch_d"}
+	type result struct {
+		item *DriveItem
+		err  error
+	}
+	results := make(chan result, len(names))
+	for _, name := range names {
+		go func(name string) {
+			item, err := batcher.Mkdir(name, root.ID, &auth)
+			results <- result{item, err}
+		}(name)
+	}
+	ids := make([]string, 0, len(names))
+	for range names {
+		result := <-results
+		if result.err != nil {
+			t.Fatal(result.err)
+		}
+		ids = append(ids, result.item.ID)
+	}
+
+	done := make(chan error, len(ids))
+	for _, id := range ids {
+		go func(id string) {
+			done <- batcher.Remove(id, &auth)
+		}(id)
+	}
+	for range ids {
+		if err := <-done; err != nil {
+			t.Fatal(err)
+		}
+	}
+}
+
+// Requests made after a Batcher was closed should fail instead of blocking.
+func TestBatcherClose(t *testing.T) {
+	t.Parallel()
+	batcher := NewBatcher()
+	batcher.Close()
+	batcher.Close()
+	if err := batcher.Remove("closed", &Auth{}); err == nil {
+		t.Fatal("Request on a closed batcher did not fail.")
+	}
+}
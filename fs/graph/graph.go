@@ -10,6 +10,7 @@ import (
 	"io"
 	"io/ioutil"
 	"net/http"
+	"strconv"
 	"strings"
 	"time"
 
@@ -17,8 +18,9 @@ import (
 	log "github.com/sirupsen/logrus"
 )
 
-// GraphURL is the API endpoint of Microsoft Graph
-const GraphURL = "https://graph.microsoft.com/v1.0"
+// GraphURL is the API endpoint of Microsoft Graph. Only ever changed to point
+// tests and benchmarks at a fake server, see the graphtest package.
+var GraphURL = "https://graph.microsoft.com/v1.0"
 
 // graphError is an internal struct used when decoding Graph's error messages
 type graphError struct {
@@ -28,6 +30,43 @@ type graphError struct {
 	} `json:"error"`
 }
 
+// Error is an error response from the Graph API.
+type Error struct {
+	StatusCode int
+	Code       string
+	Message    string
+	RetryAfter time.Duration // how long the server asked us to back off for, if at all
+}
+
+func (e *Error) Error() string {
+	return fmt.Sprintf("HTTP %d - %s: %s", e.StatusCode, e.Code, e.Message)
+}
+
+// Throttled returns true if the server rejected a request because we are making
+// too many of them.
+func (e *Error) Throttled() bool {
+	return e.StatusCode == http.StatusTooManyRequests ||
+		(e.StatusCode == http.StatusServiceUnavailable && e.RetryAfter > 0)
+}
+
+// RetryAfter parses the Retry-After header of a response, which is either a
+// number of seconds or an HTTP date. Returns 0 if the header is absent.
+func RetryAfter(header http.Header) time.Duration {
+	value := header.Get("Retry-After")
+	if value == "" {
+		return 0
+	}
+	if seconds, err := strconv.Atoi(value); err == nil && seconds > 0 {
+		return time.Duration(seconds) * time.Second
+	}
+	if date, err := http.ParseTime(value); err == nil {
+		if wait := time.Until(date); wait > 0 {
+			return wait
+		}
+	}
+	return 0
+}
+
 // Request performs an authenticated request to Microsoft Graph
 func Request(resource string, auth *Auth, method string, content io.Reader) ([]byte, error) {
 	if auth == nil || auth.AccessToken == "" {
@@ -40,9 +79,17 @@ func Request(resource string, auth *Auth, method string, content io.Reader) ([]b
 	}
 
 	auth.Refresh()
+	if Tracing() {
+		defer observeEndpoint(method, resource, time.Now())
+	}
 
-	client := &http.Client{Timeout: 15 * time.Second}
+	client := NewClient(15 * time.Second)
 	request, _ := http.NewRequest(method, GraphURL+resource, content)
+	if section, ok := content.(*io.SectionReader); ok {
+		// http.NewRequest only knows the length of in-memory readers, without one
+		// the body would be sent chunked
+		request.ContentLength = section.Size()
+	}
 	request.Header.Add("Authorization", "bearer "+auth.AccessToken)
 	switch method { // request type-specific code here
 	case "PATCH":
@@ -71,11 +118,9 @@ func Request(resource string, auth *Auth, method string, content io.Reader) ([]b
 		}).Warn("Authentication token invalid or new app permissions required, " +
 			"forcing reauth before retrying.")
 
-		reauth := newAuth(auth.path)
-		auth.AccessToken = reauth.AccessToken
-		auth.RefreshToken = reauth.RefreshToken
-		auth.ExpiresAt = reauth.ExpiresAt
-		auth.Account = reauth.Account
+		if err := auth.reauthenticate(); err != nil {
+			log.WithField("err", err).Error("Could not reauthenticate.")
+		}
 		request.Header.Set("Authorization", "bearer "+auth.AccessToken)
 	}
 	if response.StatusCode >= 500 || response.StatusCode == 401 {
@@ -92,8 +137,12 @@ func Request(resource string, auth *Auth, method string, content io.Reader) ([]b
 		// something was wrong with the request
 		var err graphError
 		json.Unmarshal(body, &err)
-		return nil, fmt.Errorf("HTTP %d - %s: %s",
-			response.StatusCode, err.Error.Code, err.Error.Message)
+		return nil, &Error{
+			StatusCode: response.StatusCode,
+			Code:       err.Error.Code,
+			Message:    err.Error.Message,
+			RetryAfter: RetryAfter(response.Header),
+		}
 	}
 	return body, nil
 }
@@ -113,7 +162,8 @@ func Post(resource string, auth *Auth, content io.Reader) ([]byte, error) {
 	return Request(resource, auth, "POST", content)
 }
 
-// Put is a convenience wrapper around Request
+// Put is a convenience wrapper around Request. Content from an io.SectionReader
+// is sent with its length, like content from memory.
 func Put(resource string, auth *Auth, content io.Reader) ([]byte, error) {
 	return Request(resource, auth, "PUT", content)
 }
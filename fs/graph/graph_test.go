@@ -1,8 +1,15 @@
 package graph
 
 import (
+	"encoding/base64"
+	"io/ioutil"
+	"math/rand"
+	"net/http"
+	"net/http/httptest"
 	"testing"
 	"time"
+
+	"github.com/rclone/rclone/backend/onedrive/quickxorhash"
 )
 
 func TestRequestUnauthenticated(t *testing.T) {
@@ -17,3 +24,120 @@ func TestRequestUnauthenticated(t *testing.T) {
 		t.Fatal("An unauthenticated request was not handled as an error")
 	}
 }
+
+func TestDecodeEngineIOPayload(t *testing.T) {
+	t.Parallel()
+	packets, err := decodePayload(`69:0{"sid":"abc","upgrades":[],"pingInterval":25000,"pingTimeout":60000}2:4023:42["notification","{}"]1:6`)
+	if err != nil {
+		t.Fatal(err)
+	}
+	// the noop packet at the end should be dropped
+	if len(packets) != 3 {
+		t.Fatalf("Expected 3 packets, got %d: %v", len(packets), packets)
+	}
+	if packets[0][0] != eioOpen || packets[1] != "40" {
+		t.Fatalf("Packets were not decoded correctly: %v", packets)
+	}
+	if _, err := decodePayload("5:40"); err == nil {
+		t.Fatal("A truncated payload was not handled as an error")
+	}
+	// lengths count characters, not bytes
+	if packets, err := decodePayload("4:4é2\"1:6"); err != nil || len(packets) != 1 ||
+		packets[0] != "4é2\"" {
+		t.Fatalf("Multibyte characters were not decoded correctly: %q, %v", packets, err)
+	}
+}
+
+// Requests to the same host should reuse connections from the shared transport.
+func TestSharedTransportReuse(t *testing.T) {
+	server := httptest.NewServer(http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		w.Write([]byte("ok"))
+	}))
+	defer server.Close()
+
+	before := GetConnStats()
+	for i := 0; i < 3; i++ {
+		resp, err := NewClient(5 * time.Second).Get(server.URL)
+		if err != nil {
+			t.Fatal(err)
+		}
+		ioutil.ReadAll(resp.Body)
+		resp.Body.Close()
+	}
+	after := GetConnStats()
+	if after.Reused-before.Reused < 2 {
+		t.Fatalf("Connections were not reused: %+v -> %+v", before, after)
+	}
+	if after.BytesReceived-before.BytesReceived < 6 || after.Latency.Count-before.Latency.Count < 3 {
+		t.Fatalf("Transfers were not counted: %+v -> %+v", before, after)
+	}
+}
+
+// Quantiles should be estimated as the upper bound of the bucket they fall in.
+func TestHistogramQuantile(t *testing.T) {
+	t.Parallel()
+	var h Histogram
+	if h.Snapshot().Quantile(0.5) != 0 {
+		t.Fatal("Empty histogram had a non-zero median.")
+	}
+	for i := 0; i < 9; i++ {
+		h.Observe(3 * time.Millisecond)
+	}
+	h.Observe(time.Second)
+	snapshot := h.Snapshot()
+	if snapshot.Count != 10 || snapshot.SumMicros != 9*3000+1000000 {
+		t.Fatalf("Unexpected snapshot: %+v", snapshot)
+	}
+	if median := snapshot.Quantile(0.5); median < 3*time.Millisecond || median > 6*time.Millisecond {
+		t.Fatalf("Unexpected median: %s", median)
+	}
+	if max := snapshot.Quantile(1); max < time.Second || max > 2*time.Second {
+		t.Fatalf("Unexpected maximum: %s", max)
+	}
+}
+
+// Folding data must give the same QuickXorHash as hashing it byte by byte, no
+// matter how the data is split up.
+func TestQuickXORFold(t *testing.T) {
+	t.Parallel()
+	for _, size := range []int{0, 1, 7, 159, 160, 161, 4096, 100003} {
+		data := make([]byte, size)
+		rand.Read(data)
+		expected := quickxorhash.Sum(data)
+		if hash := QuickXORHash(&data); hash != base64.StdEncoding.EncodeToString(expected[:]) {
+			t.Fatalf("Hash of %d bytes did not match rclone's: %s", size, hash)
+		}
+
+		var total QuickXORFold
+		for off := 0; off < size; {
+			end := off + rand.Intn(1000) + 1
+			if end > size {
+				end = size
+			}
+			var part QuickXORFold
+			part.Write(data[off:end], int64(off))
+			total.Combine(&part)
+			off = end
+		}
+		if total.Sum(uint64(size)) != QuickXORHash(&data) {
+			t.Fatalf("Combined folds of %d bytes did not match the whole.", size)
+		}
+	}
+}
+
+// Endpoints should be named without the IDs and paths of the items involved.
+func TestEndpointName(t *testing.T) {
+	t.Parallel()
+	names := map[string]string{
+		"/me/drive/items/ABC123/children?$top=999": "GET /me/drive/items/{id}/children",
+		"/me/drive/root:/Documents/a.txt:/content": "GET /me/drive/root:{path}:/content",
+		"/me/drive/items/ABC123:/a.txt:/content":   "GET /me/drive/items/{id}:{path}:/content",
+		"/me/drive/root/delta":                     "GET /me/drive/root/delta",
+		"/subscriptions/some-id":                   "GET /subscriptions/{id}",
+	}
+	for resource, expected := range names {
+		if name := endpointName("GET", resource); name != expected {
+			t.Errorf("Expected %s for %s, got %s", expected, resource, name)
+		}
+	}
+}
@@ -0,0 +1,889 @@
+// Package graphtest is an in-memory fake of the parts of the Microsoft Graph API
+// that onedriver uses. It lets the filesystem be tested and benchmarked without a
+// OneDrive account, with the latency, bandwidth and throttling of the server set
+// explicitly so that results are reproducible from one machine to the next.
+package graphtest
+
+import (
+	"bytes"
+	"encoding/json"
+	"fmt"
+	"io/ioutil"
+	"net/http"
+	"net/http/httptest"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/jstaf/onedriver/fs/graph"
+)
+
+// RootID is the ID of the root item of the fake drive.
+const RootID = "root-id"
+
+// driveID is the ID of the one drive the server has.
+const driveID = "graphtest"
+
+// default number of items in a page of children or deltas, same as the real API
+const defaultPageSize = 200
+
+// Options control how the fake server behaves. The zero value is a server that
+// answers instantly and never throttles.
+type Options struct {
+	Latency       time.Duration // added to every request before it is answered
+	Bandwidth     int64         // bytes/s for request and response bodies, 0 is unlimited
+	ThrottleEvery int           // every nth request is rejected with a 429, 0 never
+	RetryAfter    time.Duration // sent with throttled requests, 1s if 0
+	PageSize      int           // items per page of children and deltas
+}
+
+// item is a DriveItem on the fake drive, along with everything the real server
+// would know about it.
+type item struct {
+	graph.DriveItem
+	content  []byte
+	children []string          // ids, in the order they were created
+	names    map[string]string // lowercased name -> id of children
+	version  int
+}
+
+// uploadSession is a large upload in progress.
+type uploadSession struct {
+	id       string // of the item being replaced, or empty for a new one
+	parentID string
+	name     string
+	content  []byte
+}
+
+// Server is a fake Graph API backed by an in-memory drive. Its methods are safe
+// for concurrent use, including while requests are being served.
+type Server struct {
+	URL string // base URL of the API, what graph.GraphURL is set to by Use
+
+	opts     Options
+	server   *httptest.Server
+	requests uint64 // atomic
+	throttle int64  // atomic, Options.ThrottleEvery until changed by Throttle
+
+	mutex    sync.Mutex
+	items    map[string]*item
+	changes  []string // ids in the order they were changed, delta tokens index this
+	sessions map[string]*uploadSession
+	lastID   uint64
+
+	// the changes sent for the last delta token, so that paging through a huge
+	// delta does not deduplicate all of it again for every page
+	deltaSince int
+	deltaUpto  int
+	deltaIDs   []string
+	epoch      int // part of every delta token, tokens from older epochs have expired
+}
+
+// NewServer starts a fake server with an empty drive. It must be closed with
+// Close once done with it.
+func NewServer(opts Options) *Server {
+	if opts.PageSize <= 0 {
+		opts.PageSize = defaultPageSize
+	}
+	if opts.RetryAfter <= 0 {
+		opts.RetryAfter = time.Second
+	}
+	s := &Server{
+		opts:     opts,
+		throttle: int64(opts.ThrottleEvery),
+		items:    make(map[string]*item),
+		sessions: make(map[string]*uploadSession),
+	}
+	now := time.Now()
+	s.items[RootID] = &item{
+		DriveItem: graph.DriveItem{
+			ID:      RootID,
+			Name:    "root",
+			ModTime: &now,
+			Folder:  &graph.Folder{},
+			Parent: &graph.DriveItemParent{
+				DriveID:   driveID,
+				DriveType: graph.DriveTypePersonal,
+			},
+		},
+		children: make([]string, 0),
+		names:    make(map[string]string),
+	}
+	s.server = httptest.NewServer(http.HandlerFunc(s.serveHTTP))
+	s.URL = s.server.URL
+	return s
+}
+
+// Close shuts the server down.
+func (s *Server) Close() {
+	s.server.Close()
+}
+
+// Use points the graph package at the server until the returned function is
+// called, which points it back at wherever it was pointed at before.
+func (s *Server) Use() func() {
+	previous := graph.GraphURL
+	graph.GraphURL = s.URL
+	return func() {
+		graph.GraphURL = previous
+	}
+}
+
+// Auth returns credentials accepted by the server, which never expire.
+func (s *Server) Auth() *graph.Auth {
+	return &graph.Auth{
+		AccessToken:  "graphtest",
+		RefreshToken: "graphtest",
+		ExpiresAt:    time.Now().Add(24 * 365 * time.Hour).Unix(),
+	}
+}
+
+// Requests returns how many requests the server has received, including
+// throttled ones. Requests in a $batch are not counted separately.
+func (s *Server) Requests() uint64 {
+	return atomic.LoadUint64(&s.requests)
+}
+
+// Throttle changes how often requests are throttled, like Options.ThrottleEvery.
+func (s *Server) Throttle(every int) {
+	atomic.StoreInt64(&s.throttle, int64(every))
+}
+
+// AddFolder creates a folder on the drive and returns its ID.
+func (s *Server) AddFolder(parentID string, name string) string {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	return s.create(parentID, name, nil, true).ID
+}
+
+// AddFile creates a file on the drive and returns its ID.
+func (s *Server) AddFile(parentID string, name string, content []byte) string {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	return s.create(parentID, name, content, false).ID
+}
+
+// Content returns the content of a file on the drive, nil if there is no such
+// file.
+func (s *Server) Content(id string) []byte {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	if it := s.items[id]; it != nil && it.Folder == nil {
+		return append([]byte(nil), it.content...)
+	}
+	return nil
+}
+
+// DeltaToken returns a token for the delta endpoint that only returns changes
+// made after this call, like "latest".
+func (s *Server) DeltaToken() string {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	return s.token(len(s.changes))
+}
+
+// ExpireDeltaTokens makes the delta endpoint reject every token handed out so
+// far with 410 Gone, like the real API does for tokens that are too old.
+func (s *Server) ExpireDeltaTokens() {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	s.epoch++
+}
+
+// token formats the delta token for the first since changes. Must be called with
+// the mutex held.
+func (s *Server) token(since int) string {
+	return fmt.Sprintf("%d.%d", s.epoch, since)
+}
+
+// create adds an item to the drive, or replaces the content of the file with the
+// same name. Must be called with the mutex held.
+func (s *Server) create(parentID string, name string, content []byte, folder bool) *item {
+	parent := s.items[parentID]
+	if parent == nil || parent.Folder == nil {
+		return nil
+	}
+	if existing := s.child(parent, name); existing != nil {
+		if !folder && existing.Folder == nil {
+			s.setContent(existing, content)
+		}
+		return existing
+	}
+	s.lastID++
+	now := time.Now()
+	it := &item{DriveItem: graph.DriveItem{
+		ID:      fmt.Sprintf("ITEM%08d", s.lastID),
+		Name:    name,
+		ModTime: &now,
+		Parent: &graph.DriveItemParent{
+			ID:        parentID,
+			Path:      s.path(parent),
+			DriveID:   driveID,
+			DriveType: graph.DriveTypePersonal,
+		},
+	}}
+	if folder {
+		it.Folder = &graph.Folder{}
+		it.children = make([]string, 0)
+		it.names = make(map[string]string)
+		it.version = 1
+		it.tag()
+		s.changed(it)
+	} else {
+		s.setContent(it, content)
+	}
+	s.items[it.ID] = it
+	s.link(parent, it)
+	return it
+}
+
+// path is the parentReference path of a folder's children. Items keep the path
+// they were created or last moved with. Must be called with the mutex held.
+func (s *Server) path(parent *item) string {
+	if parent.ID == RootID {
+		return "/drive/root:"
+	}
+	return parent.Parent.Path + "/" + parent.Name
+}
+
+// link adds an item to a folder's children. Must be called with the mutex held.
+func (s *Server) link(parent *item, it *item) {
+	parent.children = append(parent.children, it.ID)
+	parent.names[strings.ToLower(it.Name)] = it.ID
+	parent.Folder.ChildCount++
+}
+
+// unlink removes an item from a folder's children. Must be called with the mutex
+// held.
+func (s *Server) unlink(parent *item, it *item) {
+	for i, id := range parent.children {
+		if id == it.ID {
+			parent.children = append(parent.children[:i], parent.children[i+1:]...)
+			parent.Folder.ChildCount--
+			break
+		}
+	}
+	if folded := strings.ToLower(it.Name); parent.names[folded] == it.ID {
+		delete(parent.names, folded)
+	}
+}
+
+// setContent replaces the content of a file. Must be called with the mutex held.
+func (s *Server) setContent(it *item, content []byte) {
+	now := time.Now()
+	it.content = append([]byte(nil), content...)
+	it.Size = uint64(len(content))
+	it.ModTime = &now
+	it.File = &graph.File{Hashes: graph.Hashes{
+		SHA1Hash:     graph.SHA1Hash(&it.content),
+		QuickXorHash: graph.QuickXORHash(&it.content),
+	}}
+	it.version++
+	it.tag()
+	s.changed(it)
+}
+
+// tag sets an item's eTag and cTag from its version.
+func (it *item) tag() {
+	it.ETag = fmt.Sprintf("\"{%s},%d\"", it.ID, it.version)
+	it.CTag = fmt.Sprintf("\"c:{%s},%d\"", it.ID, it.version)
+}
+
+// changed records that an item changed, for the delta endpoint.
+func (s *Server) changed(it *item) {
+	s.changes = append(s.changes, it.ID)
+}
+
+// child finds the child of a folder by name, case-insensitively like the real
+// API. Must be called with the mutex held.
+func (s *Server) child(parent *item, name string) *item {
+	if id, exists := parent.names[strings.ToLower(name)]; exists {
+		return s.items[id]
+	}
+	return nil
+}
+
+// remove deletes an item and everything below it. Must be called with the mutex
+// held.
+func (s *Server) remove(it *item) {
+	for _, id := range it.children {
+		if child := s.items[id]; child != nil {
+			s.remove(child)
+		}
+	}
+	if parent := s.items[it.Parent.ID]; parent != nil {
+		s.unlink(parent, it)
+	}
+	it.Deleted = &graph.Deleted{State: "deleted"}
+	it.children = nil
+	s.changed(it)
+}
+
+// wireItem is how an item is sent to clients.
+type wireItem struct {
+	*graph.DriveItem
+	DownloadURL string `json:"@microsoft.graph.downloadUrl,omitempty"`
+}
+
+// wire returns a copy of an item that is safe to marshal after the mutex has
+// been released. Must be called with the mutex held.
+func (s *Server) wire(it *item) wireItem {
+	copied := it.DriveItem
+	if copied.Parent != nil {
+		parent := *copied.Parent
+		copied.Parent = &parent
+	}
+	if copied.Folder != nil {
+		folder := *copied.Folder
+		copied.Folder = &folder
+	}
+	w := wireItem{DriveItem: &copied}
+	if it.Folder == nil && it.Deleted == nil {
+		w.DownloadURL = s.URL + "/download/" + it.ID
+	}
+	return w
+}
+
+// response is what a handler wants sent back to the client.
+type response struct {
+	status int
+	header http.Header
+	body   []byte
+}
+
+func jsonResponse(status int, v interface{}) response {
+	body, _ := json.Marshal(v)
+	return response{status: status, body: body}
+}
+
+func errorResponse(status int, code string, message string) response {
+	var body struct {
+		Error struct {
+			Code    string `json:"code"`
+			Message string `json:"message"`
+		} `json:"error"`
+	}
+	body.Error.Code = code
+	body.Error.Message = message
+	return jsonResponse(status, body)
+}
+
+func notFound() response {
+	return errorResponse(http.StatusNotFound, "itemNotFound", "The resource could not be found.")
+}
+
+func (s *Server) serveHTTP(w http.ResponseWriter, r *http.Request) {
+	n := atomic.AddUint64(&s.requests, 1)
+	if s.opts.Latency > 0 {
+		time.Sleep(s.opts.Latency)
+	}
+	body, _ := ioutil.ReadAll(r.Body)
+	r.Body.Close()
+
+	var resp response
+	if every := uint64(atomic.LoadInt64(&s.throttle)); every > 0 && n%every == 0 {
+		resp = errorResponse(http.StatusTooManyRequests, "activityLimitReached",
+			"The request has been throttled.")
+		resp.header = http.Header{}
+		seconds := int((s.opts.RetryAfter + time.Second - 1) / time.Second)
+		resp.header.Set("Retry-After", strconv.Itoa(seconds))
+	} else {
+		resp = s.handle(r.Method, r.URL.Path, r.URL.Query(), r.Header, body)
+	}
+
+	if s.opts.Bandwidth > 0 {
+		transferred := int64(len(body) + len(resp.body))
+		time.Sleep(time.Duration(transferred) * time.Second / time.Duration(s.opts.Bandwidth))
+	}
+	for key, values := range resp.header {
+		for _, value := range values {
+			w.Header().Add(key, value)
+		}
+	}
+	if len(resp.body) > 0 && w.Header().Get("Content-Type") == "" {
+		w.Header().Set("Content-Type", "application/json")
+	}
+	w.WriteHeader(resp.status)
+	w.Write(resp.body)
+}
+
+// handle answers a single request, which may also be part of a $batch.
+func (s *Server) handle(method string, path string, query map[string][]string,
+	header http.Header, body []byte) response {
+	switch {
+	case path == "/$batch" && method == "POST":
+		return s.batch(body)
+	case path == "/me":
+		return jsonResponse(http.StatusOK, graph.User{UserPrincipalName: "graphtest@example.com"})
+	case path == "/me/drive":
+		return s.drive()
+	case path == "/me/drive/root/delta":
+		return s.delta(query)
+	case strings.HasPrefix(path, "/download/"):
+		return s.download(strings.TrimPrefix(path, "/download/"), header)
+	case strings.HasPrefix(path, "/upload/"):
+		return s.upload(method, strings.TrimPrefix(path, "/upload/"), header, body)
+	case strings.HasPrefix(path, "/me/drive/"):
+		return s.driveItem(method, strings.TrimPrefix(path, "/me/drive/"), query, body)
+	}
+	return errorResponse(http.StatusBadRequest, "invalidRequest", "Unsupported resource "+path)
+}
+
+func (s *Server) drive() response {
+	s.mutex.Lock()
+	var used uint64
+	for _, it := range s.items {
+		if it.Deleted == nil {
+			used += it.Size
+		}
+	}
+	s.mutex.Unlock()
+	const total = 1 << 40
+	return jsonResponse(http.StatusOK, graph.Drive{
+		ID:        driveID,
+		DriveType: graph.DriveTypePersonal,
+		Quota: graph.DriveQuota{
+			Total:     total,
+			Used:      used,
+			Remaining: total - used,
+			State:     "normal",
+		},
+	})
+}
+
+// resolve finds what a resource below /me/drive/ refers to. Items are addressed
+// as "root", "items/{id}", "root:/{path}:" or "items/{id}:/{path}:", followed by
+// an optional action like "/children". If the last path segment does not exist,
+// its parent and name are returned instead so that it can be created.
+func (s *Server) resolve(resource string) (it *item, parent *item, name string, action string) {
+	var base, path string
+	if colon := strings.IndexByte(resource, ':'); colon >= 0 {
+		base = resource[:colon]
+		rest := resource[colon+1:]
+		if end := strings.IndexByte(rest, ':'); end >= 0 {
+			path, action = rest[:end], strings.TrimPrefix(rest[end+1:], "/")
+		} else {
+			path = rest
+		}
+	} else {
+		base = resource
+		if slash := strings.IndexByte(resource, '/'); slash >= 0 {
+			if strings.HasPrefix(resource, "items/") {
+				if next := strings.IndexByte(resource[6:], '/'); next >= 0 {
+					base, action = resource[:6+next], resource[6+next+1:]
+				}
+			} else {
+				base, action = resource[:slash], resource[slash+1:]
+			}
+		}
+	}
+
+	switch {
+	case base == "root":
+		it = s.items[RootID]
+	case strings.HasPrefix(base, "items/"):
+		id := strings.TrimPrefix(base, "items/")
+		if id == "root" {
+			id = RootID
+		}
+		it = s.items[id]
+	}
+	segments := strings.Split(strings.Trim(path, "/"), "/")
+	for i, segment := range segments {
+		if segment == "" {
+			continue
+		}
+		if it == nil || it.Folder == nil {
+			return nil, nil, "", action
+		}
+		child := s.child(it, segment)
+		if child == nil && i == len(segments)-1 {
+			parent, name = it, segment
+		}
+		it = child
+	}
+	if it != nil && it.Deleted != nil {
+		it = nil
+	}
+	return it, parent, name, action
+}
+
+// driveItem handles requests for items and their children and content.
+func (s *Server) driveItem(method string, resource string, query map[string][]string,
+	body []byte) response {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	it, parent, name, action := s.resolve(resource)
+
+	switch {
+	case action == "" && method == "GET":
+		if it == nil {
+			return notFound()
+		}
+		return jsonResponse(http.StatusOK, s.wire(it))
+
+	case action == "" && method == "PATCH":
+		if it == nil {
+			return notFound()
+		}
+		var patch graph.DriveItem
+		if err := json.Unmarshal(body, &patch); err != nil {
+			return errorResponse(http.StatusBadRequest, "invalidRequest", err.Error())
+		}
+		return s.move(it, patch)
+
+	case action == "" && method == "DELETE":
+		if it == nil || it.ID == RootID {
+			return notFound()
+		}
+		s.remove(it)
+		return response{status: http.StatusNoContent}
+
+	case action == "children" && method == "GET":
+		if it == nil || it.Folder == nil {
+			return notFound()
+		}
+		return s.children(it, resource, query)
+
+	case action == "children" && method == "POST":
+		if it == nil || it.Folder == nil {
+			return notFound()
+		}
+		var request graph.DriveItem
+		if err := json.Unmarshal(body, &request); err != nil || request.Name == "" {
+			return errorResponse(http.StatusBadRequest, "invalidRequest", "Missing name.")
+		}
+		if s.child(it, request.Name) != nil {
+			return errorResponse(http.StatusConflict, "nameAlreadyExists",
+				"An item with the same name already exists.")
+		}
+		folder := request.Folder != nil
+		return jsonResponse(http.StatusCreated, s.wire(s.create(it.ID, request.Name, nil, folder)))
+
+	case action == "content" && method == "GET":
+		if it == nil || it.Folder != nil {
+			return notFound()
+		}
+		return response{status: http.StatusOK, body: append([]byte(nil), it.content...)}
+
+	case action == "content" && method == "PUT":
+		if it != nil {
+			if it.Folder != nil {
+				return errorResponse(http.StatusBadRequest, "invalidRequest", "Not a file.")
+			}
+			s.setContent(it, body)
+			return jsonResponse(http.StatusOK, s.wire(it))
+		}
+		if parent == nil {
+			return notFound()
+		}
+		return jsonResponse(http.StatusCreated, s.wire(s.create(parent.ID, name, body, false)))
+
+	case action == "createUploadSession" && method == "POST":
+		session := &uploadSession{}
+		if it != nil {
+			session.id = it.ID
+		} else if parent != nil {
+			session.parentID, session.name = parent.ID, name
+		} else {
+			return notFound()
+		}
+		s.lastID++
+		key := fmt.Sprintf("SESSION%08d", s.lastID)
+		s.sessions[key] = session
+		return jsonResponse(http.StatusOK, map[string]interface{}{
+			"uploadUrl":          s.URL + "/upload/" + key,
+			"expirationDateTime": time.Now().Add(time.Hour),
+		})
+	}
+	return errorResponse(http.StatusBadRequest, "invalidRequest",
+		fmt.Sprintf("Unsupported %s of %s", method, resource))
+}
+
+// move renames and/or moves an item. Must be called with the mutex held.
+func (s *Server) move(it *item, patch graph.DriveItem) response {
+	newParent := s.items[it.Parent.ID]
+	if patch.Parent != nil && patch.Parent.ID != "" {
+		newParent = s.items[patch.Parent.ID]
+	}
+	if newParent == nil || newParent.Folder == nil || newParent.Deleted != nil {
+		return notFound()
+	}
+	name := it.Name
+	if patch.Name != "" {
+		name = patch.Name
+	}
+	if existing := s.child(newParent, name); existing != nil && existing != it {
+		s.remove(existing)
+	}
+	s.unlink(s.items[it.Parent.ID], it)
+	parentRef := *it.Parent
+	parentRef.ID = newParent.ID
+	parentRef.Path = s.path(newParent)
+	it.Parent = &parentRef
+	it.Name = name
+	s.link(newParent, it)
+	it.version++
+	it.tag()
+	s.changed(it)
+	return jsonResponse(http.StatusOK, s.wire(it))
+}
+
+// page holds a page of items, with links to the next one or to future changes.
+type page struct {
+	Value     []wireItem `json:"value"`
+	NextLink  string     `json:"@odata.nextLink,omitempty"`
+	DeltaLink string     `json:"@odata.deltaLink,omitempty"`
+}
+
+// skip returns the offset requested by a nextLink.
+func skip(query map[string][]string) int {
+	if values := query["$skiptoken"]; len(values) > 0 {
+		if n, err := strconv.Atoi(values[0]); err == nil && n > 0 {
+			return n
+		}
+	}
+	return 0
+}
+
+// children returns a page of a folder's children. Must be called with the mutex
+// held.
+func (s *Server) children(it *item, resource string, query map[string][]string) response {
+	start := skip(query)
+	if start > len(it.children) {
+		start = len(it.children)
+	}
+	end := start + s.opts.PageSize
+	if end > len(it.children) {
+		end = len(it.children)
+	}
+	result := page{Value: make([]wireItem, 0, end-start)}
+	for _, id := range it.children[start:end] {
+		result.Value = append(result.Value, s.wire(s.items[id]))
+	}
+	if end < len(it.children) {
+		result.NextLink = fmt.Sprintf("%s/me/drive/%s?$skiptoken=%d", s.URL, resource, end)
+	}
+	return jsonResponse(http.StatusOK, result)
+}
+
+// delta returns a page of the items that changed since a token, newest version
+// of each only, in the order of their last change.
+func (s *Server) delta(query map[string][]string) response {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	token := ""
+	if values := query["token"]; len(values) > 0 {
+		token = values[0]
+	}
+	if token == "latest" {
+		link := fmt.Sprintf("%s/me/drive/root/delta?token=%s", s.URL, s.token(len(s.changes)))
+		return jsonResponse(http.StatusOK, page{Value: make([]wireItem, 0), DeltaLink: link})
+	}
+	since := -1
+	if token != "" {
+		var epoch int
+		_, err := fmt.Sscanf(token, "%d.%d", &epoch, &since)
+		if err == nil && epoch != s.epoch {
+			return errorResponse(http.StatusGone, "resyncRequired",
+				"Resync required. Replace any local items with the server's version.")
+		}
+	}
+	if since < 0 || since > len(s.changes) {
+		// a full resync, like an initial delta without a token
+		since = 0
+	}
+
+	// only the last change to each item is sent
+	if s.deltaIDs == nil || s.deltaSince != since || s.deltaUpto != len(s.changes) {
+		changes := s.changes[since:]
+		last := make(map[string]int, len(changes))
+		for i, id := range changes {
+			last[id] = i
+		}
+		s.deltaIDs = make([]string, 0, len(last))
+		for i, id := range changes {
+			if last[id] == i {
+				s.deltaIDs = append(s.deltaIDs, id)
+			}
+		}
+		s.deltaSince, s.deltaUpto = since, len(s.changes)
+	}
+	ordered := s.deltaIDs
+
+	start := skip(query)
+	if start > len(ordered) {
+		start = len(ordered)
+	}
+	end := start + s.opts.PageSize
+	if end > len(ordered) {
+		end = len(ordered)
+	}
+	result := page{Value: make([]wireItem, 0, end-start)}
+	for _, id := range ordered[start:end] {
+		result.Value = append(result.Value, s.wire(s.items[id]))
+	}
+	if end < len(ordered) {
+		result.NextLink = fmt.Sprintf("%s/me/drive/root/delta?token=%s&$skiptoken=%d",
+			s.URL, s.token(since), end)
+	} else {
+		result.DeltaLink = fmt.Sprintf("%s/me/drive/root/delta?token=%s",
+			s.URL, s.token(s.deltaUpto))
+	}
+	return jsonResponse(http.StatusOK, result)
+}
+
+// parseRange parses a header value like "bytes=0-99" or "bytes 0-99/1000",
+// returning -1 for missing values.
+func parseRange(value string, prefix string) (start int64, end int64, total int64) {
+	start, end, total = -1, -1, -1
+	value = strings.TrimPrefix(value, prefix)
+	if slash := strings.IndexByte(value, '/'); slash >= 0 {
+		if n, err := strconv.ParseInt(value[slash+1:], 10, 64); err == nil {
+			total = n
+		}
+		value = value[:slash]
+	}
+	bounds := strings.SplitN(value, "-", 2)
+	if n, err := strconv.ParseInt(bounds[0], 10, 64); err == nil {
+		start = n
+	}
+	if len(bounds) == 2 {
+		if n, err := strconv.ParseInt(bounds[1], 10, 64); err == nil {
+			end = n
+		}
+	}
+	return start, end, total
+}
+
+// download serves a pre-authenticated download URL, with support for ranges.
+func (s *Server) download(id string, header http.Header) response {
+	s.mutex.Lock()
+	it := s.items[id]
+	if it == nil || it.Folder != nil || it.Deleted != nil {
+		s.mutex.Unlock()
+		return response{status: http.StatusNotFound}
+	}
+	content := it.content
+	s.mutex.Unlock()
+
+	value := header.Get("Range")
+	if value == "" {
+		return response{status: http.StatusOK, body: append([]byte(nil), content...)}
+	}
+	start, end, _ := parseRange(value, "bytes=")
+	size := int64(len(content))
+	if start < 0 || start >= size {
+		return response{status: http.StatusRequestedRangeNotSatisfiable}
+	}
+	if end < 0 || end >= size {
+		end = size - 1
+	}
+	resp := response{
+		status: http.StatusPartialContent,
+		header: http.Header{},
+		body:   append([]byte(nil), content[start:end+1]...),
+	}
+	resp.header.Set("Content-Range", fmt.Sprintf("bytes %d-%d/%d", start, end, size))
+	return resp
+}
+
+// upload handles the chunks sent to an upload session.
+func (s *Server) upload(method string, key string, header http.Header, body []byte) response {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	session := s.sessions[key]
+	if session == nil {
+		return errorResponse(http.StatusNotFound, "itemNotFound", "No such upload session.")
+	}
+
+	switch method {
+	case "DELETE":
+		delete(s.sessions, key)
+		return response{status: http.StatusNoContent}
+	case "GET":
+		return jsonResponse(http.StatusOK, map[string]interface{}{
+			"expirationDateTime": time.Now().Add(time.Hour),
+			"nextExpectedRanges": []string{fmt.Sprintf("%d-", len(session.content))},
+		})
+	case "PUT":
+		start, end, total := parseRange(header.Get("Content-Range"), "bytes ")
+		if start != int64(len(session.content)) || end-start+1 != int64(len(body)) || total < 0 {
+			return errorResponse(http.StatusRequestedRangeNotSatisfiable, "invalidRange",
+				"The uploaded fragment does not fit the expected range.")
+		}
+		session.content = append(session.content, body...)
+		if int64(len(session.content)) < total {
+			return jsonResponse(http.StatusAccepted, map[string]interface{}{
+				"expirationDateTime": time.Now().Add(time.Hour),
+				"nextExpectedRanges": []string{fmt.Sprintf("%d-", len(session.content))},
+			})
+		}
+
+		delete(s.sessions, key)
+		it := s.items[session.id]
+		if it != nil && it.Deleted == nil {
+			s.setContent(it, session.content)
+			return jsonResponse(http.StatusOK, s.wire(it))
+		}
+		if it = s.create(session.parentID, session.name, session.content, false); it == nil {
+			return notFound()
+		}
+		return jsonResponse(http.StatusCreated, s.wire(it))
+	}
+	return errorResponse(http.StatusBadRequest, "invalidRequest", "Unsupported method.")
+}
+
+// batch answers every request in a $batch, in order.
+func (s *Server) batch(body []byte) response {
+	var request struct {
+		Requests []graph.BatchRequest `json:"requests"`
+	}
+	if err := json.Unmarshal(body, &request); err != nil {
+		return errorResponse(http.StatusBadRequest, "invalidRequest", err.Error())
+	}
+	var result struct {
+		Responses []graph.BatchResponse `json:"responses"`
+	}
+	for _, sub := range request.Requests {
+		path, rawQuery := sub.URL, ""
+		if q := strings.IndexByte(path, '?'); q >= 0 {
+			path, rawQuery = path[:q], path[q+1:]
+		}
+		header := http.Header{}
+		for key, value := range sub.Headers {
+			header.Set(key, value)
+		}
+		query := parseQuery(rawQuery)
+		resp := s.handle(sub.Method, path, query, header, bytes.TrimSpace(sub.Body))
+		headers := make(map[string]string)
+		for key := range resp.header {
+			headers[key] = resp.header.Get(key)
+		}
+		result.Responses = append(result.Responses, graph.BatchResponse{
+			ID:      sub.ID,
+			Status:  resp.status,
+			Headers: headers,
+			Body:    json.RawMessage(resp.body),
+		})
+	}
+	return jsonResponse(http.StatusOK, result)
+}
+
+func parseQuery(raw string) map[string][]string {
+	query := make(map[string][]string)
+	for _, pair := range strings.Split(raw, "&") {
+		if pair == "" {
+			continue
+		}
+		kv := strings.SplitN(pair, "=", 2)
+		value := ""
+		if len(kv) == 2 {
+			value = kv[1]
+		}
+		query[kv[0]] = append(query[kv[0]], value)
+	}
+	return query
+}
@@ -0,0 +1,118 @@
+package graphtest
+
+import (
+	"bytes"
+	"encoding/json"
+	"fmt"
+	"net/http"
+	"strings"
+	"testing"
+
+	"github.com/jstaf/onedriver/fs/graph"
+)
+
+// The fake server must behave enough like the real one for the graph package's
+// own functions to work against it.
+func TestServerDriveItems(t *testing.T) {
+	server := NewServer(Options{PageSize: 3})
+	defer server.Close()
+	defer server.Use()()
+	auth := server.Auth()
+
+	root, err := graph.GetItem("root", auth)
+	if err != nil || root.ID != RootID {
+		t.Fatal("Could not fetch root:", err)
+	}
+	dir, err := graph.Mkdir("dir", RootID, auth)
+	if err != nil {
+		t.Fatal(err)
+	}
+	for i := 0; i < 10; i++ {
+		server.AddFile(dir.ID, fmt.Sprintf("%d.txt", i), []byte("test\n"))
+	}
+	children, err := graph.GetItemChildren(dir.ID, auth)
+	if err != nil || len(children) != 10 {
+		t.Fatalf("Expected 10 children across pages, got %d: %v", len(children), err)
+	}
+	if item, err := graph.GetItemPath("/dir/7.txt", auth); err != nil || item.Size != 5 {
+		t.Fatal("Could not fetch item by path:", err)
+	}
+
+	resp, err := graph.Put("/me/drive/items/"+dir.ID+":/new.txt:/content", auth,
+		strings.NewReader("some content"))
+	if err != nil {
+		t.Fatal(err)
+	}
+	var created graph.DriveItem
+	json.Unmarshal(resp, &created)
+	if !bytes.Equal(server.Content(created.ID), []byte("some content")) {
+		t.Fatal("Uploaded content was not stored.")
+	}
+	url, err := graph.GetItemDownloadURL(created.ID, auth)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if part, err := graph.GetItemContentRange(url, 5, 100); err != nil ||
+		string(part) != "content" {
+		t.Fatalf("Wrong content range %q: %v", part, err)
+	}
+}
+
+// Changes made after a delta token was handed out should come back from the delta
+// endpoint, once each and across pages.
+func TestServerDelta(t *testing.T) {
+	server := NewServer(Options{PageSize: 2})
+	defer server.Close()
+	defer server.Use()()
+	auth := server.Auth()
+
+	token := server.DeltaToken()
+	id := server.AddFile(RootID, "a.txt", []byte("a"))
+	server.AddFile(RootID, "b.txt", []byte("b"))
+	server.AddFile(RootID, "a.txt", []byte("changed"))
+	server.AddFolder(RootID, "c")
+
+	seen := make(map[string]int)
+	link := "/me/drive/root/delta?token=" + token
+	for link != "" {
+		body, err := graph.Get(link, auth)
+		if err != nil {
+			t.Fatal(err)
+		}
+		var page struct {
+			Value     []graph.DriveItem `json:"value"`
+			NextLink  string            `json:"@odata.nextLink"`
+			DeltaLink string            `json:"@odata.deltaLink"`
+		}
+		json.Unmarshal(body, &page)
+		for _, item := range page.Value {
+			seen[item.ID]++
+		}
+		link = strings.TrimPrefix(page.NextLink, graph.GraphURL)
+	}
+	if len(seen) != 3 || seen[id] != 1 {
+		t.Fatalf("Expected each of 3 changed items once, got %v", seen)
+	}
+	server.ExpireDeltaTokens()
+	_, err := graph.Get("/me/drive/root/delta?token="+token, auth)
+	if graphErr, ok := err.(*graph.Error); !ok || graphErr.StatusCode != http.StatusGone {
+		t.Fatal("Expired delta token was not rejected:", err)
+	}
+}
+
+// Throttled requests should look like throttling from the real API.
+func TestServerThrottle(t *testing.T) {
+	server := NewServer(Options{ThrottleEvery: 2})
+	defer server.Close()
+	defer server.Use()()
+	auth := server.Auth()
+
+	if _, err := graph.GetItem("root", auth); err != nil {
+		t.Fatal(err)
+	}
+	_, err := graph.GetItem("root", auth)
+	if graphErr, ok := err.(*graph.Error); !ok || !graphErr.Throttled() ||
+		graphErr.RetryAfter <= 0 {
+		t.Fatal("Second request was not throttled:", err)
+	}
+}
@@ -3,7 +3,9 @@ package graph
 import (
 	"crypto/sha1"
 	"encoding/base64"
+	"encoding/binary"
 	"fmt"
+	"io"
 	"strings"
 
 	"github.com/rclone/rclone/backend/onedrive/quickxorhash"
@@ -15,12 +17,98 @@ func SHA1Hash(data *[]byte) string {
 	return strings.ToUpper(fmt.Sprintf("%x", sha1.Sum(*data)))
 }
 
-// QuickXORHash computes the Microsoft-specific QuickXORHash. Reusing rclone's
-// implementation until I get the chance to rewrite/add test cases to remove the
-// dependency.
+// QuickXORHash computes the Microsoft-specific QuickXORHash.
 func QuickXORHash(data *[]byte) string {
-	hash := quickxorhash.Sum(*data)
-	return base64.StdEncoding.EncodeToString(hash[:])
+	var fold QuickXORFold
+	fold.Write(*data, 0)
+	return fold.Sum(uint64(len(*data)))
+}
+
+// SHA1HashStream hashes the contents of a stream.
+func SHA1HashStream(reader io.Reader) string {
+	hash := sha1.New()
+	io.Copy(hash, reader)
+	return strings.ToUpper(fmt.Sprintf("%x", hash.Sum(nil)))
+}
+
+// QuickXORHashStream hashes a stream.
+func QuickXORHashStream(reader io.Reader) string {
+	var fold QuickXORFold
+	buf := make([]byte, 1024*1024)
+	var length uint64
+	for {
+		n, err := reader.Read(buf)
+		fold.Write(buf[:n], int64(length))
+		length += uint64(n)
+		if err != nil {
+			break
+		}
+	}
+	return fold.Sum(length)
+}
+
+// QuickXorHash shifts every byte of input 11 bits further into a 160 bit
+// accumulator than the byte before it, and XORs it in. Since 11 and 160 are
+// coprime, bytes that are quickXORPeriod bytes apart land on exactly the same
+// bits. The hash is linear in its input, so it can be computed by first XORing
+// the input together at that period, which is cheap to do a machine word at a
+// time, and only then spreading the 160 folded bytes over the accumulator.
+const quickXORPeriod = 160
+
+// QuickXORFold is the QuickXorHash state of some data, minus the length of the
+// data. The data can be written in any order, and folds of different parts of
+// the same file can be combined, which lets the hash of a file be updated
+// without rereading the parts that did not change. The zero value is the fold of
+// no data.
+type QuickXORFold struct {
+	words [quickXORPeriod / 8]uint64 // byte n little endian is position n
+}
+
+// Write XORs data located at offset in a file into the fold.
+func (f *QuickXORFold) Write(data []byte, offset int64) {
+	pos := int(offset % quickXORPeriod)
+	for ; pos%8 != 0 && len(data) > 0; data = data[1:] {
+		f.words[pos/8] ^= uint64(data[0]) << (8 * uint(pos%8))
+		pos = (pos + 1) % quickXORPeriod
+	}
+	// word aligned from here on
+	for len(data) >= 8 {
+		f.words[pos/8] ^= binary.LittleEndian.Uint64(data)
+		data = data[8:]
+		pos = (pos + 8) % quickXORPeriod
+	}
+	for ; len(data) > 0; data = data[1:] {
+		f.words[pos/8] ^= uint64(data[0]) << (8 * uint(pos%8))
+		pos++
+	}
+}
+
+// Combine adds the data of another fold to this one.
+func (f *QuickXORFold) Combine(other *QuickXORFold) {
+	for i := range f.words {
+		f.words[i] ^= other.words[i]
+	}
+}
+
+// Sum returns the QuickXorHash of a file of the given length made up of the data
+// in the fold.
+func (f *QuickXORFold) Sum(length uint64) string {
+	var folded [quickXORPeriod]byte
+	for i, word := range f.words {
+		binary.LittleEndian.PutUint64(folded[i*8:], word)
+	}
+	// rclone's hasher does the spreading, all it sees is a file that is
+	// exactly one period long
+	hash := quickxorhash.New()
+	hash.Write(folded[:])
+	sum := hash.Sum(nil)
+	// the length is XORed into the last 8 bytes of the hash
+	var lengths [8]byte
+	binary.LittleEndian.PutUint64(lengths[:], length^quickXORPeriod)
+	for i, b := range lengths {
+		sum[len(sum)-8+i] ^= b
+	}
+	return base64.StdEncoding.EncodeToString(sum)
 }
 
 // VerifyChecksum checks to see if a DriveItem's checksum matches what it's
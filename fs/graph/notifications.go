@@ -0,0 +1,241 @@
+package graph
+
+import (
+	"context"
+	"encoding/json"
+	"errors"
+	"fmt"
+	"io/ioutil"
+	"net/http"
+	"net/url"
+	"strconv"
+	"strings"
+	"time"
+)
+
+// socketIOResponse is the subscription returned by the socketIo endpoint
+type socketIOResponse struct {
+	NotificationURL string `json:"notificationUrl"`
+}
+
+// GetNotificationURL subscribes to change notifications for the drive, and
+// returns the socket.io URL notifications will be delivered on.
+// https://docs.microsoft.com/en-us/onedrive/developer/rest-api/api/subscriptions_socketio
+func GetNotificationURL(auth *Auth) (string, error) {
+	resp, err := Get("/me/drive/root/subscriptions/socketIo", auth)
+	if err != nil {
+		return "", err
+	}
+	var sub socketIOResponse
+	if err = json.Unmarshal(resp, &sub); err != nil {
+		return "", err
+	}
+	if sub.NotificationURL == "" {
+		return "", errors.New("no notification URL in subscription response")
+	}
+	return sub.NotificationURL, nil
+}
+
+// engine.io packet types (protocol version 3)
+const (
+	eioOpen    = '0'
+	eioClose   = '1'
+	eioPing    = '2'
+	eioPong    = '3'
+	eioMessage = '4'
+	eioNoop    = '6'
+)
+
+// socket.io packet types, carried inside engine.io messages
+const (
+	sioConnect    = '0'
+	sioDisconnect = '1'
+	sioEvent      = '2'
+)
+
+// eioHandshake is the payload of the engine.io open packet
+type eioHandshake struct {
+	SID          string `json:"sid"`
+	PingInterval int    `json:"pingInterval"` // milliseconds
+	PingTimeout  int    `json:"pingTimeout"`  // milliseconds
+}
+
+// NotificationSocket is a minimal socket.io client over engine.io long-polling,
+// just enough to receive OneDrive change notifications. The contents of the
+// notifications are not used - each one only means that the drive has changed
+// and deltas should be fetched.
+type NotificationSocket struct {
+	url      string
+	sid      string
+	client   *http.Client
+	interval time.Duration
+	ctx      context.Context // done once closed, aborts requests in flight
+	cancel   context.CancelFunc
+}
+
+// DialNotifications opens a socket.io session on a notification URL obtained
+// from GetNotificationURL.
+func DialNotifications(notificationURL string) (*NotificationSocket, error) {
+	socket := &NotificationSocket{
+		url:    notificationURL,
+		client: NewClient(90 * time.Second), // longer than a poll
+	}
+	socket.ctx, socket.cancel = context.WithCancel(context.Background())
+	packets, err := socket.poll()
+	if err != nil {
+		socket.Close()
+		return nil, err
+	}
+	if len(packets) == 0 || packets[0][0] != eioOpen {
+		socket.Close()
+		return nil, errors.New("socket.io server did not send an open packet")
+	}
+	var handshake eioHandshake
+	if err := json.Unmarshal([]byte(packets[0][1:]), &handshake); err != nil {
+		socket.Close()
+		return nil, err
+	}
+	socket.sid = handshake.SID
+	socket.interval = time.Duration(handshake.PingInterval) * time.Millisecond
+	if socket.interval <= 0 {
+		socket.interval = 25 * time.Second
+	}
+	go socket.pingLoop()
+	return socket, nil
+}
+
+// endpoint builds the polling URL for the current session
+func (s *NotificationSocket) endpoint() string {
+	query := url.Values{}
+	query.Set("EIO", "3")
+	query.Set("transport", "polling")
+	query.Set("t", strconv.FormatInt(time.Now().UnixNano(), 36))
+	if s.sid != "" {
+		query.Set("sid", s.sid)
+	}
+	separator := "?"
+	if strings.Contains(s.url, "?") {
+		separator = "&"
+	}
+	return s.url + separator + query.Encode()
+}
+
+// poll performs a single long-poll request and returns the packets received
+func (s *NotificationSocket) poll() ([]string, error) {
+	request, _ := http.NewRequest("GET", s.endpoint(), nil)
+	resp, err := s.client.Do(request.WithContext(s.ctx))
+	if err != nil {
+		return nil, err
+	}
+	body, err := ioutil.ReadAll(resp.Body)
+	resp.Body.Close()
+	if err != nil {
+		return nil, err
+	}
+	if resp.StatusCode != http.StatusOK {
+		return nil, fmt.Errorf("HTTP %d - socket.io poll failed", resp.StatusCode)
+	}
+	return decodePayload(string(body))
+}
+
+// send posts a single packet to the server
+func (s *NotificationSocket) send(packet string) error {
+	payload := strconv.Itoa(len(packet)) + ":" + packet
+	request, _ := http.NewRequest("POST", s.endpoint(), strings.NewReader(payload))
+	request.Header.Set("Content-Type", "text/plain;charset=UTF-8")
+	resp, err := s.client.Do(request.WithContext(s.ctx))
+	if err != nil {
+		return err
+	}
+	resp.Body.Close()
+	if resp.StatusCode != http.StatusOK {
+		return fmt.Errorf("HTTP %d - socket.io send failed", resp.StatusCode)
+	}
+	return nil
+}
+
+// pingLoop keeps the session alive. In engine.io v3 the client is responsible
+// for sending pings.
+func (s *NotificationSocket) pingLoop() {
+	ticker := time.NewTicker(s.interval)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-s.ctx.Done():
+			return
+		case <-ticker.C:
+			if err := s.send(string(eioPing)); err != nil {
+				s.Close()
+				return
+			}
+		}
+	}
+}
+
+// Wait blocks until the server sends a notification (returns nil), or the
+// session fails or is closed (returns an error). A new session must be dialed
+// after an error.
+func (s *NotificationSocket) Wait() error {
+	for {
+		packets, err := s.poll()
+		if s.ctx.Err() != nil {
+			return errors.New("notification socket closed")
+		}
+		if err != nil {
+			s.Close()
+			return err
+		}
+		for _, packet := range packets {
+			switch packet[0] {
+			case eioClose:
+				s.Close()
+				return errors.New("notification socket closed by server")
+			case eioMessage:
+				if len(packet) > 1 && packet[1] == sioEvent {
+					return nil
+				}
+				if len(packet) > 1 && packet[1] == sioDisconnect {
+					s.Close()
+					return errors.New("notification socket disconnected by server")
+				}
+			}
+		}
+	}
+}
+
+// Close ends the session, and makes a Wait in progress return. Safe to call more
+// than once, and from any goroutine.
+func (s *NotificationSocket) Close() {
+	s.cancel()
+}
+
+// decodePayload splits an engine.io v3 text payload into packets. Each packet
+// is encoded as "<length>:<packet>".
+func decodePayload(payload string) ([]string, error) {
+	packets := make([]string, 0)
+	// lengths are in characters, not bytes
+	runes := []rune(payload)
+	for len(runes) > 0 {
+		sep := 0
+		for sep < len(runes) && runes[sep] != ':' {
+			sep++
+		}
+		if sep == 0 || sep == len(runes) {
+			return nil, errors.New("malformed engine.io payload")
+		}
+		length, err := strconv.Atoi(string(runes[:sep]))
+		if err != nil || length < 1 {
+			return nil, errors.New("malformed engine.io packet length")
+		}
+		runes = runes[sep+1:]
+		if len(runes) < length {
+			return nil, errors.New("truncated engine.io payload")
+		}
+		packet := string(runes[:length])
+		if packet[0] != eioNoop && packet[0] != eioPong {
+			packets = append(packets, packet)
+		}
+		runes = runes[length:]
+	}
+	return packets, nil
+}
@@ -3,8 +3,8 @@ package graph
 import (
 	"encoding/json"
 	"errors"
+	"fmt"
 	"io/ioutil"
-	"net/http"
 	"net/url"
 	"os"
 	"regexp"
@@ -30,6 +30,7 @@ type Auth struct {
 	AccessToken  string `json:"access_token"`
 	RefreshToken string `json:"refresh_token"`
 	path         string // auth tokens remember their path for use by Refresh()
+	noLogin      bool   // never log in again interactively, see LoadAuth
 }
 
 // AuthError is an authentication error from the Microsoft API. Generally we don't see
@@ -70,7 +71,7 @@ func (a *Auth) Refresh() {
 			"&redirect_uri=" + authRedirectURL +
 			"&refresh_token=" + a.RefreshToken +
 			"&grant_type=refresh_token")
-		resp, err := http.Post(authTokenURL,
+		resp, err := NewClient(15*time.Second).Post(authTokenURL,
 			"application/x-www-form-urlencoded",
 			postData)
 
@@ -101,7 +102,9 @@ func (a *Auth) Refresh() {
 				"response":  string(body),
 				"http_code": resp.StatusCode,
 			}).Error("Failed to renew access tokens. Attempting to reauthenticate.")
-			a = newAuth(a.path)
+			if err := a.reauthenticate(); err != nil {
+				log.WithField("err", err).Error("Could not reauthenticate.")
+			}
 		} else {
 			a.ToFile(a.path)
 		}
@@ -129,16 +132,16 @@ func parseAuthCode(url string) (string, error) {
 }
 
 // Exchange an auth code for a set of access tokens
-func getAuthTokens(authCode string) *Auth {
+func getAuthTokens(authCode string) (*Auth, error) {
 	postData := strings.NewReader("client_id=" + authClientID +
 		"&redirect_uri=" + authRedirectURL +
 		"&code=" + authCode +
 		"&grant_type=authorization_code")
-	resp, err := http.Post(authTokenURL,
+	resp, err := NewClient(15*time.Second).Post(authTokenURL,
 		"application/x-www-form-urlencoded",
 		postData)
 	if err != nil {
-		log.WithField("error", err).Fatalf("Could not POST to obtain auth tokens.")
+		return nil, fmt.Errorf("could not POST to obtain auth tokens: %w", err)
 	}
 	defer resp.Body.Close()
 
@@ -167,32 +170,60 @@ func getAuthTokens(authCode string) *Auth {
 				"response_parse_err": err,
 			}
 		}
-		log.WithFields(fields).Fatalf(
-			"Failed to retrieve access tokens. Authentication cannot continue.")
+		log.WithFields(fields).Error("Failed to retrieve access tokens.")
+		return nil, errors.New("failed to retrieve access tokens")
 	}
-	return &auth
+	return &auth, nil
 }
 
 // newAuth performs initial authentication flow and saves tokens to disk
-func newAuth(path string) *Auth {
+func newAuth(path string) (*Auth, error) {
 	old := Auth{}
 	old.FromFile(path)
-	auth := getAuthTokens(getAuthCode(old.Account))
+	code, err := getAuthCode(old.Account)
+	if err != nil {
+		return nil, err
+	}
+	auth, err := getAuthTokens(code)
+	if err != nil {
+		return nil, err
+	}
 
 	if user, err := GetUser(auth); err == nil {
 		auth.Account = user.UserPrincipalName
 	}
 	auth.ToFile(path)
-	return auth
+	return auth, nil
 }
 
-// Authenticate performs first-time authentication to Graph
+// reauthenticate logs in again and replaces the tokens with the new ones, unless
+// they were loaded with LoadAuth.
+func (a *Auth) reauthenticate() error {
+	if a.noLogin {
+		return errors.New("auth tokens are no longer valid, " +
+			"run \"onedriver --auth-only\" to log in again")
+	}
+	reauth, err := newAuth(a.path)
+	if err != nil {
+		return err
+	}
+	a.AccessToken = reauth.AccessToken
+	a.RefreshToken = reauth.RefreshToken
+	a.ExpiresAt = reauth.ExpiresAt
+	a.Account = reauth.Account
+	return nil
+}
+
+// Authenticate performs first-time authentication to Graph. Exits if that fails.
 func Authenticate(path string) *Auth {
 	auth := &Auth{}
 	_, err := os.Stat(path)
 	if os.IsNotExist(err) {
 		// no tokens found, gotta start oauth flow from beginning
-		auth = newAuth(path)
+		if auth, err = newAuth(path); err != nil {
+			log.WithField("err", err).Fatal("Authentication cannot continue. " +
+				"Please restart the application and try again.")
+		}
 	} else {
 		// we already have tokens, no need to force a new auth flow
 		auth.FromFile(path)
@@ -200,3 +231,22 @@ func Authenticate(path string) *Auth {
 	}
 	return auth
 }
+
+// LoadAuth loads auth tokens saved by an earlier Authenticate. Unlike
+// Authenticate it never logs in interactively, not even once the tokens are no
+// longer accepted, which makes it suitable for processes without a user in front
+// of them.
+func LoadAuth(path string) (*Auth, error) {
+	auth := &Auth{}
+	if err := auth.FromFile(path); err != nil {
+		return nil, fmt.Errorf("could not load auth tokens, "+
+			"run \"onedriver --auth-only\" to log in first: %w", err)
+	}
+	if auth.AccessToken == "" || auth.RefreshToken == "" {
+		return nil, errors.New("auth tokens are incomplete, " +
+			"run \"onedriver --auth-only\" to log in again")
+	}
+	auth.noLogin = true
+	auth.Refresh()
+	return auth, nil
+}
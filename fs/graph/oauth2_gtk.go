@@ -10,14 +10,13 @@ package graph
 import "C"
 
 import (
+	"errors"
 	"unsafe"
-
-	log "github.com/sirupsen/logrus"
 )
 
 // Fetch the auth code required as the first part of oauth2 authentication. Uses
 // webkit2gtk to create a popup browser.
-func getAuthCode(accountName string) string {
+func getAuthCode(accountName string) (string, error) {
 	cAuthURL := C.CString(getAuthURL())
 	cAccountName := C.CString(accountName)
 	cResponse := C.webkit_auth_window(cAuthURL, cAccountName)
@@ -28,9 +27,8 @@ func getAuthCode(accountName string) string {
 
 	code, err := parseAuthCode(response)
 	if err != nil {
-		//TODO create a popup with the auth failure message here instead of a log message
-		log.Fatal("No validation code returned, or code was invalid. " +
-			"Please restart the application and try again.")
+		//TODO create a popup with the auth failure message here instead of an error
+		return "", errors.New("no validation code returned, or code was invalid")
 	}
-	return code
+	return code, nil
 }
@@ -45,3 +45,16 @@ func TestAuthRefresh(t *testing.T) {
 		t.Fatal("Auth could not be refreshed successfully!")
 	}
 }
+
+// Tokens loaded without being able to log in must fail instead of starting an
+// interactive login.
+func TestLoadAuthNoLogin(t *testing.T) {
+	t.Parallel()
+	if _, err := LoadAuth("does_not_exist.json"); err == nil {
+		t.Fatal("Missing auth tokens were not an error.")
+	}
+	auth := Auth{noLogin: true}
+	if err := auth.reauthenticate(); err == nil {
+		t.Fatal("Tokens loaded with LoadAuth were reauthenticated.")
+	}
+}
@@ -0,0 +1,151 @@
+package graph
+
+import (
+	"math/bits"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// number of buckets in a Histogram, the last one holds everything slower than
+// about 35 minutes
+const histogramBuckets = 32
+
+// Histogram counts durations in power of two buckets of microseconds. Observing
+// a duration is a couple of atomic adds, so histograms can be updated from hot
+// paths without any locking. The zero value is ready to use.
+type Histogram struct {
+	count   uint64
+	sum     uint64 // microseconds
+	buckets [histogramBuckets]uint64
+}
+
+// HistogramSnapshot is the state of a Histogram at one point in time. Buckets[i]
+// counts durations shorter than 2^i microseconds that did not fit in a smaller
+// bucket.
+type HistogramSnapshot struct {
+	Count     uint64   `json:"count"`
+	SumMicros uint64   `json:"sumMicros"`
+	Buckets   []uint64 `json:"buckets"`
+}
+
+// Observe adds a duration to the histogram.
+func (h *Histogram) Observe(d time.Duration) {
+	micros := uint64(d / time.Microsecond)
+	if d < 0 {
+		micros = 0
+	}
+	idx := bits.Len64(micros)
+	if idx >= histogramBuckets {
+		idx = histogramBuckets - 1
+	}
+	atomic.AddUint64(&h.buckets[idx], 1)
+	atomic.AddUint64(&h.sum, micros)
+	atomic.AddUint64(&h.count, 1)
+}
+
+// Snapshot returns the current state of the histogram.
+func (h *Histogram) Snapshot() HistogramSnapshot {
+	snapshot := HistogramSnapshot{
+		Count:     atomic.LoadUint64(&h.count),
+		SumMicros: atomic.LoadUint64(&h.sum),
+		Buckets:   make([]uint64, histogramBuckets),
+	}
+	for i := range h.buckets {
+		snapshot.Buckets[i] = atomic.LoadUint64(&h.buckets[i])
+	}
+	return snapshot
+}
+
+// Quantile estimates the duration that a fraction q of all observations were
+// shorter than, as the upper bound of the bucket it falls in.
+func (s HistogramSnapshot) Quantile(q float64) time.Duration {
+	var total uint64
+	for _, count := range s.Buckets {
+		total += count
+	}
+	if total == 0 {
+		return 0
+	}
+	rank := uint64(q*float64(total) + 0.5)
+	if rank < 1 {
+		rank = 1
+	}
+	var seen uint64
+	for i, count := range s.Buckets {
+		seen += count
+		if seen >= rank {
+			return time.Duration(uint64(1)<<uint(i)) * time.Microsecond
+		}
+	}
+	return time.Duration(uint64(1)<<uint(len(s.Buckets)-1)) * time.Microsecond
+}
+
+// set while latencies are being traced, atomic
+var tracing int32
+
+// request latency of each Graph API endpoint, only recorded while tracing
+var endpoints sync.Map // endpoint name -> *Histogram
+
+// EnableTracing starts recording the latency of every Graph API endpoint and
+// FUSE op. Tracing is off by default, and only costs an atomic load per
+// request or op while off.
+func EnableTracing() {
+	atomic.StoreInt32(&tracing, 1)
+}
+
+// Tracing returns true if latencies are being traced.
+func Tracing() bool {
+	return atomic.LoadInt32(&tracing) != 0
+}
+
+// endpointName turns a request into the endpoint it was made to, with item IDs
+// and paths left out, like "GET /me/drive/items/{id}/children".
+func endpointName(method string, resource string) string {
+	if i := strings.IndexByte(resource, '?'); i >= 0 {
+		resource = resource[:i]
+	}
+	// path based addressing, like /me/drive/root:/some/file.txt:/content
+	if i := strings.IndexByte(resource, ':'); i >= 0 {
+		rest := ""
+		if j := strings.IndexByte(resource[i+1:], ':'); j >= 0 {
+			rest = resource[i+1+j+1:]
+		}
+		resource = resource[:i] + ":{path}:" + rest
+	}
+	segments := strings.Split(resource, "/")
+	for k := 1; k < len(segments); k++ {
+		if prev := segments[k-1]; prev == "items" || prev == "subscriptions" {
+			suffix := ""
+			if c := strings.IndexByte(segments[k], ':'); c >= 0 {
+				suffix = segments[k][c:]
+			}
+			segments[k] = "{id}" + suffix
+		}
+	}
+	return method + " " + strings.Join(segments, "/")
+}
+
+// observeEndpoint records how long a request to an endpoint that started at
+// start took.
+func observeEndpoint(method string, resource string, start time.Time) {
+	d := time.Since(start)
+	name := endpointName(method, resource)
+	histogram, ok := endpoints.Load(name)
+	if !ok {
+		histogram, _ = endpoints.LoadOrStore(name, &Histogram{})
+	}
+	histogram.(*Histogram).Observe(d)
+}
+
+// EndpointStats returns the request latency of every Graph API endpoint used
+// since tracing was enabled.
+func EndpointStats() map[string]HistogramSnapshot {
+	stats := make(map[string]HistogramSnapshot)
+	endpoints.Range(func(key, value interface{}) bool {
+		stats[key.(string)] = value.(*Histogram).Snapshot()
+		return true
+	})
+	return stats
+}
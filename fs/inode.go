@@ -3,6 +3,7 @@ package fs
 import (
 	"context"
 	"encoding/json"
+	"io"
 	"math"
 	"math/rand"
 	"os"
@@ -28,16 +29,20 @@ import (
 // implementing something like the fs.FileHandle to minimize the complexity of
 // operations like Flush.
 type Inode struct {
+	ino uint64 // inode number, assigned by the cache's index, first for atomic alignment
+
 	fs.Inode `json:"-"`
 
 	mutex sync.RWMutex // used to be a pointer, but fs.Inode also embeds a mutex :(
 	graph.DriveItem
 	cache      *Cache
-	children   []string // a slice of ids, nil when uninitialized
-	data       *[]byte  // empty by default
-	hasChanges bool     // used to trigger an upload on flush
-	subdir     uint32   // used purely by NLink()
-	mode       uint32   // do not set manually
+	children   []string          // a slice of ids, nil when uninitialized
+	childNames map[string]string // lowercased name -> id of children, built lazily
+	listing    *childListing     // set while children are being fetched
+	stream     *contentStream    // set while content is being fetched piece by piece
+	hasChanges bool              // used to trigger an upload on flush
+	subdir     uint32            // used purely by NLink()
+	mode       uint32            // do not set manually
 }
 
 // SerializeableInode is like a Inode, but can be serialized for local storage
@@ -51,17 +56,17 @@ type SerializeableInode struct {
 
 // NewInode initializes a new Inode
 func NewInode(name string, mode uint32, parent *Inode) *Inode {
-	itemParent := &graph.DriveItemParent{ID: "", Path: ""}
+	itemParent := &graph.DriveItemParent{}
+	var cache *Cache
 	if parent != nil {
-		itemParent.Path = parent.Path()
 		parent.mutex.RLock()
 		itemParent.ID = parent.DriveItem.ID
 		itemParent.DriveID = parent.DriveItem.Parent.DriveID
 		itemParent.DriveType = parent.DriveItem.Parent.DriveType
+		cache = parent.cache
 		parent.mutex.RUnlock()
 	}
 
-	var empty []byte
 	currentTime := time.Now()
 	return &Inode{
 		DriveItem: graph.DriveItem{
@@ -70,8 +75,8 @@ func NewInode(name string, mode uint32, parent *Inode) *Inode {
 			Parent:  itemParent,
 			ModTime: &currentTime,
 		},
+		cache:    cache,
 		children: make([]string, 0),
-		data:     &empty,
 		mode:     mode,
 	}
 }
@@ -99,12 +104,14 @@ func NewInodeJSON(data []byte) (*Inode, error) {
 	if err := json.Unmarshal(data, &raw); err != nil {
 		return nil, err
 	}
-	return &Inode{
+	inode := &Inode{
 		DriveItem: raw.DriveItem,
 		children:  raw.Children,
 		mode:      raw.Mode,
 		subdir:    raw.Subdir,
-	}, nil
+	}
+	inode.compact()
+	return inode, nil
 }
 
 // NewInodeDriveItem creates a new DriveItem from an Inode
@@ -212,14 +219,24 @@ func (i *Inode) Statfs(ctx context.Context, out *fuse.StatfsOut) syscall.Errno {
 
 // Readdir returns a list of directory entries (formerly OpenDir).
 func (i *Inode) Readdir(ctx context.Context) (fs.DirStream, syscall.Errno) {
-	log.WithFields(log.Fields{
-		"path": i.Path(),
-		"id":   i.ID(),
-	}).Debug()
+	defer traceEnd(opReaddir, traceStart())
+	if log.IsLevelEnabled(log.DebugLevel) {
+		log.WithFields(log.Fields{
+			"path": i.Path(),
+			"id":   i.ID(),
+		}).Debug()
+	}
 
 	cache := i.GetCache()
+	// subdirectories are likely to be entered next
+	cache.prefetch.listed(i.ID())
+	if listing := cache.listing(i); listing != nil {
+		// children are still being fetched, return them as they arrive instead
+		// of waiting for the whole directory
+		return &listingStream{listing: listing}, 0
+	}
 	// directories are always created with a remote graph id
-	children, err := cache.GetChildrenID(i.ID(), cache.GetAuth())
+	children, err := cache.ListChildren(i.ID(), cache.GetAuth())
 	if err != nil {
 		// not an item not found error (Lookup/Getattr will always be called
 		// before Readdir()), something has happened to our connection
@@ -230,11 +247,12 @@ func (i *Inode) Readdir(ctx context.Context) (fs.DirStream, syscall.Errno) {
 		return nil, syscall.EREMOTEIO
 	}
 
-	entries := make([]fuse.DirEntry, 0)
+	entries := make([]fuse.DirEntry, 0, len(children))
 	for _, child := range children {
 		entry := fuse.DirEntry{
 			Name: child.Name(),
 			Mode: child.Mode(),
+			Ino:  child.stableAttr().Ino,
 		}
 		entries = append(entries, entry)
 	}
@@ -243,11 +261,14 @@ func (i *Inode) Readdir(ctx context.Context) (fs.DirStream, syscall.Errno) {
 
 // Lookup an individual child of an inode.
 func (i *Inode) Lookup(ctx context.Context, name string, out *fuse.EntryOut) (*fs.Inode, syscall.Errno) {
-	log.WithFields(log.Fields{
-		"path": i.Path(),
-		"id":   i.ID(),
-		"name": name,
-	}).Trace()
+	defer traceEnd(opLookup, traceStart())
+	if log.IsLevelEnabled(log.TraceLevel) {
+		log.WithFields(log.Fields{
+			"path": i.Path(),
+			"id":   i.ID(),
+			"name": name,
+		}).Trace()
+	}
 
 	cache := i.GetCache()
 	child, _ := cache.GetChild(i.ID(), strings.ToLower(name), cache.GetAuth())
@@ -255,7 +276,7 @@ func (i *Inode) Lookup(ctx context.Context, name string, out *fuse.EntryOut) (*f
 		return nil, syscall.ENOENT
 	}
 	out.Attr = child.makeattr()
-	return i.NewInode(ctx, child, fs.StableAttr{Mode: child.Mode() & fuse.S_IFDIR}), 0
+	return i.NewInode(ctx, child, child.stableAttr()), 0
 }
 
 // RemoteID uploads an empty file to obtain a Onedrive ID if it doesn't already
@@ -289,7 +310,9 @@ func (i *Inode) RemoteID(auth *graph.Auth) (string, error) {
 		// we just successfully uploaded a copy, no need to do it again
 		i.hasChanges = false
 		i.DriveItem.ETag = session.ETag
+		i.DriveItem.CTag = session.CTag
 		name := i.DriveItem.Name
+		i.cache.markDirty(i.DriveItem.ID)
 		i.mutex.Unlock()
 
 		// this is all we really wanted from this transaction
@@ -304,107 +327,210 @@ func (i *Inode) RemoteID(auth *graph.Auth) (string, error) {
 	return originalID, nil
 }
 
-// Path returns an inode's full Path
+// Path returns an inode's full Path. If one of its ancestors is not in the cache,
+// the path starts with the ID of that ancestor in brackets instead.
 func (i *Inode) Path() string {
-	// special case when it's the root item
-	name := i.Name()
-	if i.ParentID() == "" && name == "root" {
-		return "/"
+	// inodes do not keep their parent's path, see compact()
+	var names []string
+	start := ""
+	for inode := i; inode != nil; {
+		inode.mutex.RLock()
+		name, cache := inode.DriveItem.Name, inode.cache
+		parentID := ""
+		if inode.DriveItem.Parent != nil {
+			parentID = inode.DriveItem.Parent.ID
+		}
+		inode.mutex.RUnlock()
+		if parentID == "" && name == "root" {
+			break
+		}
+		names = append(names, name)
+		if parentID == "" || cache == nil {
+			break
+		}
+		if inode = cache.GetID(parentID); inode == nil {
+			start = "[" + parentID + "]"
+		}
 	}
-
-	// all paths come prefixed with "/drive/root:"
-	i.mutex.RLock()
-	defer i.mutex.RUnlock()
-	if i.DriveItem.Parent == nil {
-		return name
+	for left, right := 0, len(names)-1; left < right; left, right = left+1, right-1 {
+		names[left], names[right] = names[right], names[left]
 	}
-	prepath := strings.TrimPrefix(i.DriveItem.Parent.Path+"/"+name, "/drive/root:")
-	return strings.Replace(prepath, "//", "/", -1)
+	return start + "/" + strings.Join(names, "/")
+}
+
+// lazyPath is an inode's path for log fields, which is only put together if the
+// entry is actually logged.
+type lazyPath struct {
+	inode *Inode
+}
+
+func (p lazyPath) String() string {
+	return p.inode.Path()
 }
 
-// Read from an Inode like a file
+// Read from an Inode like a file. Content not yet on disk is fetched from the
+// server first.
 func (i *Inode) Read(ctx context.Context, f fs.FileHandle, buf []byte, off int64) (fuse.ReadResult, syscall.Errno) {
-	path := i.Path()
-	if !i.HasContent() {
-		log.WithFields(log.Fields{
-			"id":   i.ID(),
-			"path": path,
-		}).Warn("Read called on a closed file descriptor! Reopening file for op.")
-		i.Open(ctx, 0)
+	defer traceEnd(opRead, traceStart())
+	id := i.ID()
+	store := i.GetCache().content
+	end := off + int64(len(buf))
+	if !store.HasRange(id, off, end) {
+		i.mutex.RLock()
+		stream := i.stream
+		i.mutex.RUnlock()
+		if stream == nil {
+			log.WithFields(log.Fields{
+				"id":   id,
+				"path": i.Path(),
+			}).Warn("Read called on a closed file descriptor! Reopening file for op.")
+			if errno := i.open(ctx, 0); errno != 0 {
+				return fuse.ReadResultData(make([]byte, 0)), errno
+			}
+			i.mutex.RLock()
+			stream = i.stream
+			i.mutex.RUnlock()
+		}
+		// don't hold the lock while we wait on the network
+		if stream != nil {
+			if err := stream.Fetch(off, end); err != nil {
+				log.WithFields(log.Fields{
+					"id":     id,
+					"path":   i.Path(),
+					"offset": off,
+					"err":    err,
+				}).Error("Failed to fetch content.")
+				return fuse.ReadResultData(make([]byte, 0)), syscall.EREMOTEIO
+			}
+		}
 	}
 
 	// we are locked for the remainder of this op
 	i.mutex.RLock()
 	defer i.mutex.RUnlock()
-
-	end := int(off) + int(len(buf))
-	oend := end
-	size := len(*i.data) // worse than using i.size(), but some edge cases require it
-	if int(off) > size {
+	id = i.DriveItem.ID
+	size := store.Size(id) // worse than using i.size(), but some edge cases require it
+	if off > int64(size) {
 		log.WithFields(log.Fields{
-			"id":        i.DriveItem.ID,
-			"path":      path,
-			"bufsize":   int64(end) - off,
+			"id":        id,
+			"name":      i.DriveItem.Name,
+			"bufsize":   len(buf),
 			"file_size": size,
 			"offset":    off,
 		}).Error("Offset was beyond file end (Onedrive metadata was wrong!). Refusing op.")
 		return fuse.ReadResultData(make([]byte, 0)), syscall.EINVAL
 	}
-	if end > size {
-		end = size
+
+	// if the file was opened with a handle on its content, the kernel can read
+	// straight from our copy on disk without it ever passing through our memory
+	if handle, ok := f.(*contentHandle); ok && handle != nil {
+		if file := store.file(id, handle.entry); file != nil {
+			n := len(buf)
+			if remaining := int64(size) - off; int64(n) > remaining {
+				n = int(remaining)
+			}
+			if log.IsLevelEnabled(log.TraceLevel) {
+				log.WithFields(log.Fields{
+					"id":        id,
+					"name":      i.DriveItem.Name,
+					"bufsize":   n,
+					"file_size": size,
+					"offset":    off,
+				}).Trace("Read file from content fd")
+			}
+			return fuse.ReadResultFd(file.Fd(), off, n), 0
+		}
 	}
-	log.WithFields(log.Fields{
-		"id":               i.DriveItem.ID,
-		"path":             path,
-		"original_bufsize": int64(oend) - off,
-		"bufsize":          int64(end) - off,
-		"file_size":        size,
-		"offset":           off,
-	}).Trace("Read file")
-	return fuse.ReadResultData((*i.data)[off:end]), 0
+
+	n, err := store.ReadAt(id, buf, off)
+	if err != nil && err != io.EOF {
+		log.WithFields(log.Fields{
+			"id":     id,
+			"name":   i.DriveItem.Name,
+			"offset": off,
+			"err":    err,
+		}).Error("Failed to read content from disk.")
+		return fuse.ReadResultData(make([]byte, 0)), syscall.EIO
+	}
+	if log.IsLevelEnabled(log.TraceLevel) {
+		log.WithFields(log.Fields{
+			"id":               id,
+			"name":             i.DriveItem.Name,
+			"original_bufsize": len(buf),
+			"bufsize":          n,
+			"file_size":        size,
+			"offset":           off,
+		}).Trace("Read file")
+	}
+	return fuse.ReadResultData(buf[:n]), 0
 }
 
 // Write to an Inode like a file. Note that changes are 100% local until
 // Flush() is called.
 func (i *Inode) Write(ctx context.Context, f fs.FileHandle, data []byte, off int64) (uint32, syscall.Errno) {
-	nWrite := len(data)
-	offset := int(off)
-	log.WithFields(log.Fields{
-		"id":      i.ID(),
-		"path":    i.Path(),
-		"bufsize": nWrite,
-		"offset":  off,
-	}).Tracef("Write file")
-
-	if !i.HasContent() {
+	defer traceEnd(opWrite, traceStart())
+	if log.IsLevelEnabled(log.TraceLevel) {
 		log.WithFields(log.Fields{
-			"id":   i.ID(),
-			"path": i.Path(),
-		}).Warn("Write called on a closed file descriptor! Reopening file for write op.")
-		i.Open(ctx, 0)
+			"id":      i.ID(),
+			"path":    i.Path(),
+			"bufsize": len(data),
+			"offset":  off,
+		}).Trace("Write file")
+	}
+
+	if errno := i.ensureContent(ctx); errno != 0 {
+		return 0, errno
 	}
 
 	i.mutex.Lock()
 	defer i.mutex.Unlock()
-	if offset+nWrite > int(i.DriveItem.Size)-1 {
-		// we've exceeded the file size, overwrite via append
-		*i.data = append((*i.data)[:offset], data...)
-	} else {
-		// writing inside the current file, overwrite in place
-		copy((*i.data)[offset:], data)
+	store := i.cache.content
+	nWrite, err := store.WriteAt(i.DriveItem.ID, data, off)
+	if err != nil {
+		log.WithFields(log.Fields{
+			"id":     i.DriveItem.ID,
+			"offset": off,
+			"err":    err,
+		}).Error("Failed to write content to disk.")
+		return uint32(nWrite), syscall.EIO
 	}
-	// probably a better way to do this, but whatever
-	i.DriveItem.Size = uint64(len(*i.data))
+	i.DriveItem.Size = store.Size(i.DriveItem.ID)
 	i.hasChanges = true
+	i.cache.markDirty(i.DriveItem.ID)
 
 	return uint32(nWrite), 0
 }
 
-// HasContent returns whether the file has been populated with data
+// ensureContent makes sure the entire content of a file is on disk, so that it
+// can be modified.
+func (i *Inode) ensureContent(ctx context.Context) syscall.Errno {
+	id := i.ID()
+	store := i.GetCache().content
+	if store.IsComplete(id) {
+		return 0
+	}
+	if isLocalID(id) && !store.Has(id) {
+		// a new file that has never had anything written to it
+		if err := store.Insert(id, nil); err != nil {
+			return syscall.EIO
+		}
+		return 0
+	}
+	if !i.HasContent() {
+		log.WithFields(log.Fields{
+			"id":   id,
+			"path": i.Path(),
+		}).Warn("Write called on a closed file descriptor! Reopening file for write op.")
+	}
+	return i.open(ctx, uint32(os.O_RDWR))
+}
+
+// HasContent returns whether the file's content is on disk (or is being fetched
+// from the server)
 func (i *Inode) HasContent() bool {
 	i.mutex.RLock()
 	defer i.mutex.RUnlock()
-	return i.data != nil
+	return i.stream != nil || i.cache.content.IsComplete(i.DriveItem.ID)
 }
 
 // HasChanges returns true if the file has local changes that haven't been
@@ -429,17 +555,42 @@ func (i *Inode) Fsync(ctx context.Context, f fs.FileHandle, flags uint32) syscal
 		"id":   i.ID(),
 		"path": i.Path(),
 	}).Debug()
+	// the caller explicitly asked for durability, so skip any write-back delay
+	cache := i.GetCache()
+	id := i.ID()
+	pending := cache.cancelWriteBack(id)
+	if i.HasChanges() {
+		if err := cache.content.Sync(id); err != nil {
+			log.WithFields(log.Fields{
+				"id":  id,
+				"err": err,
+			}).Error("Failed to sync content to disk.")
+			return syscall.EIO
+		}
+	}
+	errno := i.commit()
+	if pending && errno == 0 {
+		cache.writeBackQueued(id)
+	}
+	return errno
+}
+
+// commit hashes an item's new content and queues it for upload, if it has any
+// changes.
+func (i *Inode) commit() syscall.Errno {
 	if i.HasChanges() {
 		i.mutex.Lock()
 		i.hasChanges = false
 
-		// recompute hashes when saving new content
+		// recompute hashes when saving new content, only the blocks that
+		// changed since the last time are read
 		i.DriveItem.File = &graph.File{}
 		if i.DriveItem.Parent.DriveType == graph.DriveTypePersonal {
-			i.DriveItem.File.Hashes.SHA1Hash = graph.SHA1Hash(i.data)
+			i.DriveItem.File.Hashes.SHA1Hash, _ = i.cache.content.SHA1Hash(i.DriveItem.ID)
 		} else {
-			i.DriveItem.File.Hashes.QuickXorHash = graph.QuickXORHash(i.data)
+			i.DriveItem.File.Hashes.QuickXorHash, _ = i.cache.content.QuickXORHash(i.DriveItem.ID)
 		}
+		i.cache.markDirty(i.DriveItem.ID)
 		i.mutex.Unlock()
 
 		if err := i.cache.uploads.QueueUpload(i); err != nil {
@@ -455,21 +606,24 @@ func (i *Inode) Fsync(ctx context.Context, f fs.FileHandle, flags uint32) syscal
 	return 0
 }
 
-// Flush is called when a file descriptor is closed. Uses Fsync to perform file
-// uploads.
+// Flush is called when a file descriptor is closed. Changes are uploaded once
+// the write-back delay has passed, or right away if write-back is disabled.
 func (i *Inode) Flush(ctx context.Context, f fs.FileHandle) syscall.Errno {
-	log.WithFields(log.Fields{
-		"path": i.Path(),
-		"id":   i.ID(),
-	}).Debug()
-	i.Fsync(ctx, f, 0)
+	defer traceEnd(opFlush, traceStart())
+	if log.IsLevelEnabled(log.DebugLevel) {
+		log.WithFields(log.Fields{
+			"path": i.Path(),
+			"id":   i.ID(),
+		}).Debug()
+	}
+	if !i.HasChanges() || !i.GetCache().scheduleWriteBack(i.ID()) {
+		i.commit()
+	}
 
-	// wipe data from memory to avoid mem bloat over time
+	// content is already on disk, just make sure the block index is too
 	i.mutex.Lock()
-	if i.data != nil {
-		i.cache.InsertContent(i.DriveItem.ID, *i.data)
-		i.data = nil
-	}
+	i.cache.content.Flush(i.DriveItem.ID)
+	i.stream = nil
 	i.mutex.Unlock()
 	return 0
 }
@@ -495,10 +649,12 @@ func (i *Inode) makeattr() fuse.Attr {
 // Getattr returns a the Inode as a UNIX stat. Holds the read mutex for all of
 // the "metadata fetch" operations.
 func (i *Inode) Getattr(ctx context.Context, f fs.FileHandle, out *fuse.AttrOut) syscall.Errno {
-	log.WithFields(log.Fields{
-		"path": i.Path(),
-		"id":   i.ID(),
-	}).Trace()
+	if log.IsLevelEnabled(log.TraceLevel) {
+		log.WithFields(log.Fields{
+			"path": i.Path(),
+			"id":   i.ID(),
+		}).Trace()
+	}
 	out.Attr = i.makeattr()
 	return 0
 }
@@ -512,6 +668,11 @@ func (i *Inode) Setattr(ctx context.Context, f fs.FileHandle, in *fuse.SetAttrIn
 	}).Trace()
 
 	isDir := i.IsDir() // holds an rlock
+	if _, valid := in.GetSize(); valid {
+		if errno := i.ensureContent(ctx); errno != 0 {
+			return errno
+		}
+	}
 	i.mutex.Lock()
 
 	// utimens
@@ -530,17 +691,20 @@ func (i *Inode) Setattr(ctx context.Context, f fs.FileHandle, in *fuse.SetAttrIn
 
 	// truncate
 	if size, valid := in.GetSize(); valid {
-		if size > i.DriveItem.Size {
-			// unlikely to be hit, but implementing just in case
-			extra := make([]byte, size-i.DriveItem.Size)
-			*i.data = append(*i.data, extra...)
-		} else {
-			*i.data = (*i.data)[:size]
+		if err := i.cache.content.Truncate(i.DriveItem.ID, size); err != nil {
+			i.mutex.Unlock()
+			log.WithFields(log.Fields{
+				"id":   i.DriveItem.ID,
+				"size": size,
+				"err":  err,
+			}).Error("Failed to truncate content on disk.")
+			return syscall.EIO
 		}
 		i.DriveItem.Size = size
 		i.hasChanges = true
 	}
 
+	i.cache.markDirty(i.DriveItem.ID)
 	i.mutex.Unlock()
 	out.Attr = i.makeattr()
 	return 0
@@ -605,7 +769,7 @@ func Octal(i uint32) string {
 // Create a new local file. The server doesn't have this yet. The uint32 part of
 // the return are fuse flags.
 func (i *Inode) Create(ctx context.Context, name string, flags uint32, mode uint32, out *fuse.EntryOut) (*fs.Inode, fs.FileHandle, uint32, syscall.Errno) {
-	path := i.Path()
+	path := lazyPath{i}
 	id := i.ID()
 	cache := i.GetCache()
 	if cache.IsOffline() {
@@ -628,9 +792,13 @@ func (i *Inode) Create(ctx context.Context, name string, flags uint32, mode uint
 			"name":    name,
 			"mode":    Octal(mode),
 		}).Debug("Child inode already exists, truncating.")
-		child.data = nil
+		child.mutex.Lock()
+		cache.content.Insert(child.DriveItem.ID, nil)
+		child.stream = nil
 		child.DriveItem.Size = 0
 		child.hasChanges = true
+		cache.markDirty(child.DriveItem.ID)
+		child.mutex.Unlock()
 		return child.EmbeddedInode(), nil, uint32(0), 0
 	}
 
@@ -642,8 +810,9 @@ func (i *Inode) Create(ctx context.Context, name string, flags uint32, mode uint
 		"name":    name,
 		"mode":    Octal(mode),
 	}).Debug("Creating inode.")
+	cache.content.Insert(inode.ID(), nil)
 	cache.InsertChild(id, inode)
-	return i.NewInode(ctx, inode, fs.StableAttr{Mode: fuse.S_IFREG}), nil, uint32(0), 0
+	return i.NewInode(ctx, inode, inode.stableAttr()), nil, uint32(0), 0
 }
 
 // Mkdir creates a directory.
@@ -657,7 +826,7 @@ func (i *Inode) Mkdir(ctx context.Context, name string, mode uint32, out *fuse.E
 	auth := cache.GetAuth()
 
 	// create a new folder on the server
-	item, err := graph.Mkdir(name, i.ID(), auth)
+	item, err := cache.batch.Mkdir(name, i.ID(), auth)
 	if err != nil {
 		log.WithFields(log.Fields{
 			"path": name,
@@ -665,9 +834,10 @@ func (i *Inode) Mkdir(ctx context.Context, name string, mode uint32, out *fuse.E
 		}).Error("Error during directory creation:")
 		return nil, syscall.EREMOTEIO
 	}
+	cache.noteActivity()
 	inode := NewInodeDriveItem(item)
 	cache.InsertChild(i.ID(), inode)
-	return i.NewInode(ctx, inode, fs.StableAttr{Mode: fuse.S_IFDIR}), 0
+	return i.NewInode(ctx, inode, inode.stableAttr()), 0
 }
 
 // Unlink a child file.
@@ -692,7 +862,7 @@ func (i *Inode) Unlink(ctx context.Context, name string) syscall.Errno {
 	// server
 	id := child.ID()
 	if !isLocalID(id) {
-		if err := graph.Remove(id, cache.GetAuth()); err != nil {
+		if err := cache.batch.Remove(id, cache.GetAuth()); err != nil {
 			log.WithFields(log.Fields{
 				"err":  err,
 				"id":   id,
@@ -700,6 +870,7 @@ func (i *Inode) Unlink(ctx context.Context, name string) syscall.Errno {
 			}).Error("Failed to delete item on server. Aborting op.")
 			return syscall.EREMOTEIO
 		}
+		cache.noteActivity()
 	}
 
 	cache.DeleteID(id)
@@ -758,7 +929,7 @@ func (i *Inode) Rename(ctx context.Context, name string, newParent fs.InodeEmbed
 		return syscall.EBADF
 	}
 
-	if err = graph.Rename(id, filepath.Base(dest), parentID, auth); err != nil {
+	if err = cache.batch.Rename(id, filepath.Base(dest), parentID, auth); err != nil {
 		log.WithFields(log.Fields{
 			"id":       id,
 			"parentID": parentID,
@@ -768,6 +939,7 @@ func (i *Inode) Rename(ctx context.Context, name string, newParent fs.InodeEmbed
 		}).Error("Failed to rename remote item.")
 		return syscall.EREMOTEIO
 	}
+	cache.noteActivity()
 
 	// now rename local copy
 	if err = cache.MovePath(path, dest, auth); err != nil {
@@ -783,20 +955,55 @@ func (i *Inode) Rename(ctx context.Context, name string, newParent fs.InodeEmbed
 	return 0
 }
 
-// Open fetches a Inodes's content and initializes the .Data field with actual
-// data from the server. Data is loaded into memory on Open, and persisted to
-// disk on Flush.
+// contentHandle is the file handle returned from Open. It keeps the file holding
+// an item's content open so that reads can be served from it directly.
+type contentHandle struct {
+	entry *contentEntry
+}
+
+// Open fetches a Inodes's content and makes sure it is present in the content
+// store on disk, then returns a handle on it. The handle is released again by
+// Release.
 func (i *Inode) Open(ctx context.Context, flags uint32) (fh fs.FileHandle, fuseFlags uint32, errno syscall.Errno) {
-	path := i.Path()
+	defer traceEnd(opOpen, traceStart())
+	if errno = i.open(ctx, flags); errno != 0 {
+		return nil, uint32(0), errno
+	}
+	cache := i.GetCache()
+	// other small files next to this one are likely to be opened next
+	cache.prefetch.opened(i.ParentID())
+	entry, err := cache.content.acquire(i.ID())
+	if err != nil {
+		// reads will be served without the handle
+		return nil, uint32(0), 0
+	}
+	return &contentHandle{entry: entry}, uint32(0), 0
+}
+
+// Release is called once a file handle returned by Open is no longer in use.
+func (i *Inode) Release(ctx context.Context, f fs.FileHandle) syscall.Errno {
+	if handle, ok := f.(*contentHandle); ok && handle != nil {
+		i.GetCache().content.release(handle.entry)
+	}
+	return 0
+}
+
+// open fetches a Inodes's content and makes sure it is present in the content
+// store on disk. Small files are fetched from the server in their entirety,
+// large files opened read-only are fetched piece by piece as they are read.
+func (i *Inode) open(ctx context.Context, flags uint32) syscall.Errno {
+	path := lazyPath{i}
 	id := i.ID()
 	f := int(flags)
-	if f&os.O_RDWR+f&os.O_WRONLY > 0 && i.GetCache().IsOffline() {
+	write := f&os.O_RDWR+f&os.O_WRONLY > 0
+	cache := i.GetCache()
+	if write && cache.IsOffline() {
 		log.WithFields(log.Fields{
 			"path":  path,
 			"id":    id,
 			"flags": flags,
 		}).Debug("Refusing Open() with write flag, FS is offline.")
-		return nil, uint32(0), syscall.EROFS
+		return syscall.EROFS
 	}
 
 	log.WithFields(log.Fields{
@@ -804,34 +1011,49 @@ func (i *Inode) Open(ctx context.Context, flags uint32) (fh fs.FileHandle, fuseF
 		"id":   id,
 	}).Debug("Opening file for I/O.")
 
-	if i.HasContent() {
-		// we already have data, likely the file is already opened somewhere
-		return nil, uint32(0), 0
+	i.mutex.RLock()
+	stream := i.stream
+	i.mutex.RUnlock()
+	if stream != nil {
+		// we are already fetching content, likely the file is already opened
+		// somewhere
+		if write {
+			// partial content can't be written to
+			return i.fetchAll(ctx, stream)
+		}
+		return 0
 	}
 
 	// try grabbing from disk
-	cache := i.GetCache()
-	if content := cache.GetContent(id); content != nil {
+	store := cache.content
+	if store.IsComplete(id) {
 		// verify content against what we're supposed to have
-		var hashMatch bool
+		var hashMatch, hashed bool
 		i.mutex.RLock()
 		driveType := i.DriveItem.Parent.DriveType
 		if isLocalID(id) && i.DriveItem.File == nil {
 			// only check hashes if the file has been uploaded before, otherwise
 			// we just accept the cached content.
 			hashMatch = true
-		} else if driveType == graph.DriveTypePersonal {
-			hashMatch = i.VerifyChecksum(graph.SHA1Hash(&content))
-		} else if driveType == graph.DriveTypeBusiness || driveType == graph.DriveTypeSharepoint {
-			hashMatch = i.VerifyChecksum(graph.QuickXORHash(&content))
-		} else {
+		} else if i.hasChanges || cache.uploads.IsQueued(id) {
+			// local edits that are waiting for their write-back or upload, the
+			// hashes are only recomputed once the changes are committed
+			hashMatch = true
+		} else if store.Matches(id, &i.DriveItem) {
+			// already checked against this version of the item, skip hashing
+			hashMatch = true
+		} else if hashMatch, hashed = i.verifyContent(); !hashed {
 			hashMatch = true
 			log.WithFields(log.Fields{
-				"path":      path,
+				"name":      i.DriveItem.Name,
 				"driveType": driveType,
 				"id":        id,
 			}).Warn("Could not determine drive type, not checking hashes.")
 		}
+		if hashMatch && hashed {
+			// content is the same as the remote item, remember that for next time
+			store.Validate(id, &i.DriveItem)
+		}
 		i.mutex.RUnlock()
 
 		if hashMatch {
@@ -844,9 +1066,9 @@ func (i *Inode) Open(ctx context.Context, flags uint32) (fh fs.FileHandle, fuseF
 			i.mutex.Lock()
 			defer i.mutex.Unlock()
 			// this check is here in case the API file sizes are WRONG (it happens)
-			i.DriveItem.Size = uint64(len(content))
-			i.data = &content
-			return nil, uint32(0), 0
+			i.DriveItem.Size = store.Size(id)
+			i.cache.markDirty(id)
+			return 0
 		}
 		log.WithFields(log.Fields{
 			"id":        id,
@@ -857,9 +1079,44 @@ func (i *Inode) Open(ctx context.Context, flags uint32) (fh fs.FileHandle, fuseF
 
 	if isLocalID(id) {
 		// it's a local ID, and we failed to find the cached local content
-		return nil, uint32(0), syscall.EBADF
+		return syscall.EBADF
+	}
+
+	i.mutex.RLock()
+	size := i.DriveItem.Size
+	etag := i.DriveItem.ETag
+	i.mutex.RUnlock()
+	if size >= streamThreshold {
+		// large files are fetched piece by piece, so we don't have to wait for
+		// the entire file to download before the first read and blocks that have
+		// already been fetched are never fetched again
+		log.WithFields(log.Fields{
+			"id":   id,
+			"path": path,
+			"size": size,
+		}).Info("Streaming remote content for item from API.")
+		if err := store.Begin(id, size, etag); err != nil {
+			log.WithFields(log.Fields{
+				"id":  id,
+				"err": err,
+			}).Error("Could not prepare content store for item.")
+			return syscall.EIO
+		}
+		i.mutex.Lock()
+		if i.stream == nil {
+			i.stream = newContentStream(id, size, store, cache.GetAuth())
+		}
+		stream = i.stream
+		i.mutex.Unlock()
+		if write {
+			return i.fetchAll(ctx, stream)
+		}
+		return 0
 	}
 
+	if ctx.Err() != nil {
+		return syscall.EINTR
+	}
 	// didn't have it on disk, now try api
 	log.WithFields(log.Fields{
 		"id":   id,
@@ -873,13 +1130,67 @@ func (i *Inode) Open(ctx context.Context, flags uint32) (fh fs.FileHandle, fuseF
 			"id":   id,
 			"path": path,
 		}).Error("Failed to fetch remote content.")
-		return nil, uint32(0), syscall.EREMOTEIO
+		return syscall.EREMOTEIO
 	}
 
 	i.mutex.Lock()
 	defer i.mutex.Unlock()
+	if err := store.Insert(id, body); err != nil {
+		log.WithFields(log.Fields{
+			"err": err,
+			"id":  id,
+		}).Error("Could not write content to disk.")
+		return syscall.EIO
+	}
+	if match, _ := i.verifyContent(); match {
+		store.Validate(id, &i.DriveItem)
+	} else {
+		// likely changed on the server since we got its metadata, it gets
+		// checked again on the next open
+		log.WithFields(log.Fields{
+			"id":   id,
+			"name": i.DriveItem.Name,
+		}).Info("Fetched content did not match the item's checksums.")
+	}
 	// this check is here in case the API file sizes are WRONG (it happens)
 	i.DriveItem.Size = uint64(len(body))
-	i.data = &body
-	return nil, uint32(0), 0
+	i.cache.markDirty(id)
+	return 0
+}
+
+// verifyContent hashes an item's content on disk and checks it against the
+// item's checksums. hashed is false if nothing could be checked because the drive
+// type is unknown. Must be called with the mutex held.
+func (i *Inode) verifyContent() (match bool, hashed bool) {
+	store := i.cache.content
+	switch i.DriveItem.Parent.DriveType {
+	case graph.DriveTypePersonal:
+		hash, _ := store.SHA1Hash(i.DriveItem.ID)
+		return i.VerifyChecksum(hash), true
+	case graph.DriveTypeBusiness, graph.DriveTypeSharepoint:
+		hash, _ := store.QuickXORHash(i.DriveItem.ID)
+		return i.VerifyChecksum(hash), true
+	}
+	return false, false
+}
+
+// fetchAll fetches the remainder of a file's content that is being streamed, so
+// that it can be modified.
+func (i *Inode) fetchAll(ctx context.Context, stream *contentStream) syscall.Errno {
+	if err := stream.FetchAll(ctx); err != nil {
+		if ctx.Err() != nil {
+			return syscall.EINTR
+		}
+		log.WithFields(log.Fields{
+			"id":  stream.id,
+			"err": err,
+		}).Error("Failed to fetch remote content.")
+		return syscall.EREMOTEIO
+	}
+	i.mutex.Lock()
+	if i.stream == stream {
+		i.stream = nil
+	}
+	i.mutex.Unlock()
+	return 0
 }
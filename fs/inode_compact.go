@@ -0,0 +1,77 @@
+package fs
+
+import (
+	"strings"
+	"sync"
+)
+
+// Drives can have millions of items, so the metadata of every Inode should take
+// as little memory as we can get away with. Items decoded from the API have every
+// string in its own allocation, a copy of their parent's path and ID, and the
+// same drive ID and type as everything else. Inodes are compacted when they are
+// added to the cache, and decoded that way from disk in the first place.
+
+// maxDriveStrings bounds how many drive IDs and types are interned. There is one
+// per drive items have been shared from, so this is only reached by a drive
+// with an unusual amount of shared items, which then just stop being interned.
+const maxDriveStrings = 1024
+
+var driveStrings = struct {
+	sync.Mutex
+	values map[string]string
+}{values: make(map[string]string)}
+
+// internDriveString returns the copy of a drive ID or drive type that every item
+// from the same drive shares.
+func internDriveString(s string) string {
+	driveStrings.Lock()
+	defer driveStrings.Unlock()
+	if interned, ok := driveStrings.values[s]; ok {
+		return interned
+	}
+	if len(driveStrings.values) < maxDriveStrings {
+		driveStrings.values[s] = s
+	}
+	return s
+}
+
+// packStrings moves several strings into a single allocation.
+func packStrings(fields ...*string) {
+	total := 0
+	for _, field := range fields {
+		total += len(*field)
+	}
+	var packed strings.Builder
+	packed.Grow(total)
+	for _, field := range fields {
+		packed.WriteString(*field)
+	}
+	all := packed.String()
+	for _, field := range fields {
+		length := len(*field)
+		*field, all = all[:length], all[length:]
+	}
+}
+
+// compact rewrites an Inode's metadata to take less memory. The parent's path is
+// dropped, Path puts it together from the cache instead. The parent's ID is left
+// alone, it is shared with the parent once the Inode is added to the cache. Must
+// be called with the mutex held, or before the Inode is shared.
+func (i *Inode) compact() {
+	item := &i.DriveItem
+	fields := []*string{&item.ID, &item.Name, &item.ConflictBehavior, &item.ETag, &item.CTag}
+	// these may still be shared with the DriveItem the Inode was created from
+	if item.Parent != nil {
+		parent := *item.Parent
+		parent.Path = ""
+		parent.DriveID = internDriveString(parent.DriveID)
+		parent.DriveType = internDriveString(parent.DriveType)
+		item.Parent = &parent
+	}
+	if item.File != nil {
+		file := *item.File
+		item.File = &file
+		fields = append(fields, &file.Hashes.SHA1Hash, &file.Hashes.QuickXorHash)
+	}
+	packStrings(fields...)
+}
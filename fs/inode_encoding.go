@@ -0,0 +1,233 @@
+package fs
+
+import (
+	"encoding/binary"
+	"errors"
+	"time"
+
+	"github.com/jstaf/onedriver/fs/graph"
+)
+
+// Inode metadata is stored on disk in a compact binary encoding instead of JSON.
+// The first byte of an encoded Inode is always inodeEncodingVersion, which lets
+// us tell it apart from (and keep reading) metadata written as JSON by older
+// versions, which always starts with '{'. Version 1 did not store the cTag.
+const inodeEncodingVersion byte = 2
+
+// presence flags for optional fields
+const (
+	inodeHasModTime byte = 1 << iota
+	inodeHasParent
+	inodeHasFolder
+	inodeHasFile
+	inodeHasDeleted
+	inodeHasChildren
+)
+
+var errInodeEncoding = errors.New("invalid inode encoding")
+
+type inodeEncoder struct {
+	buf []byte
+}
+
+func (e *inodeEncoder) uvarint(v uint64) {
+	var tmp [binary.MaxVarintLen64]byte
+	n := binary.PutUvarint(tmp[:], v)
+	e.buf = append(e.buf, tmp[:n]...)
+}
+
+func (e *inodeEncoder) varint(v int64) {
+	var tmp [binary.MaxVarintLen64]byte
+	n := binary.PutVarint(tmp[:], v)
+	e.buf = append(e.buf, tmp[:n]...)
+}
+
+func (e *inodeEncoder) string(s string) {
+	e.uvarint(uint64(len(s)))
+	e.buf = append(e.buf, s...)
+}
+
+// inodeDecoder hands out strings that are all part of a single copy of the data,
+// which takes much less memory than a copy for each.
+type inodeDecoder struct {
+	buf    []byte
+	record string // all of buf, as a string
+	err    error
+}
+
+func (d *inodeDecoder) uvarint() uint64 {
+	if d.err != nil {
+		return 0
+	}
+	v, n := binary.Uvarint(d.buf)
+	if n <= 0 {
+		d.err = errInodeEncoding
+		return 0
+	}
+	d.buf = d.buf[n:]
+	return v
+}
+
+func (d *inodeDecoder) varint() int64 {
+	if d.err != nil {
+		return 0
+	}
+	v, n := binary.Varint(d.buf)
+	if n <= 0 {
+		d.err = errInodeEncoding
+		return 0
+	}
+	d.buf = d.buf[n:]
+	return v
+}
+
+func (d *inodeDecoder) byte() byte {
+	if d.err != nil || len(d.buf) == 0 {
+		d.err = errInodeEncoding
+		return 0
+	}
+	b := d.buf[0]
+	d.buf = d.buf[1:]
+	return b
+}
+
+func (d *inodeDecoder) string() string {
+	length := d.uvarint()
+	if d.err != nil || uint64(len(d.buf)) < length {
+		d.err = errInodeEncoding
+		return ""
+	}
+	start := len(d.record) - len(d.buf)
+	d.buf = d.buf[length:]
+	return d.record[start : start+int(length)]
+}
+
+// AsBinary encodes an Inode for storage on disk. Like AsJSON, but smaller and
+// faster to produce.
+func (i *Inode) AsBinary() []byte {
+	i.mutex.RLock()
+	defer i.mutex.RUnlock()
+	item := &i.DriveItem
+
+	var flags byte
+	if item.ModTime != nil {
+		flags |= inodeHasModTime
+	}
+	if item.Parent != nil {
+		flags |= inodeHasParent
+	}
+	if item.Folder != nil {
+		flags |= inodeHasFolder
+	}
+	if item.File != nil {
+		flags |= inodeHasFile
+	}
+	if item.Deleted != nil {
+		flags |= inodeHasDeleted
+	}
+	if i.children != nil {
+		flags |= inodeHasChildren
+	}
+
+	e := inodeEncoder{buf: make([]byte, 0, 128+len(i.children)*32)}
+	e.buf = append(e.buf, inodeEncodingVersion, flags)
+	e.string(item.ID)
+	e.string(item.Name)
+	e.uvarint(item.Size)
+	if item.ModTime != nil {
+		e.varint(item.ModTime.UnixNano())
+	}
+	if item.Parent != nil {
+		e.string("") // was the parent's path, see compact()
+		e.string(item.Parent.ID)
+		e.string(item.Parent.DriveID)
+		e.string(item.Parent.DriveType)
+	}
+	if item.Folder != nil {
+		e.uvarint(uint64(item.Folder.ChildCount))
+	}
+	if item.File != nil {
+		e.string(item.File.Hashes.SHA1Hash)
+		e.string(item.File.Hashes.QuickXorHash)
+	}
+	if item.Deleted != nil {
+		e.string(item.Deleted.State)
+	}
+	e.string(item.ConflictBehavior)
+	e.string(item.ETag)
+	e.string(item.CTag)
+	if i.children != nil {
+		e.uvarint(uint64(len(i.children)))
+		for _, child := range i.children {
+			e.string(child)
+		}
+	}
+	e.uvarint(uint64(i.subdir))
+	e.uvarint(uint64(i.mode))
+	return e.buf
+}
+
+// NewInodeBinary decodes an Inode stored on disk by AsBinary. Metadata stored as
+// JSON by older versions of onedriver is decoded with NewInodeJSON instead.
+func NewInodeBinary(data []byte) (*Inode, error) {
+	if len(data) > 0 && data[0] == '{' {
+		return NewInodeJSON(data)
+	}
+	d := inodeDecoder{buf: data, record: string(data)}
+	version := d.byte()
+	if version < 1 || version > inodeEncodingVersion {
+		return nil, errInodeEncoding
+	}
+	flags := d.byte()
+
+	inode := &Inode{}
+	item := &inode.DriveItem
+	item.ID = d.string()
+	item.Name = d.string()
+	item.Size = d.uvarint()
+	if flags&inodeHasModTime > 0 {
+		modTime := time.Unix(0, d.varint())
+		item.ModTime = &modTime
+	}
+	if flags&inodeHasParent > 0 {
+		d.string() // the parent's path, no longer stored
+		item.Parent = &graph.DriveItemParent{
+			ID:        d.string(),
+			DriveID:   d.string(),
+			DriveType: d.string(),
+		}
+	}
+	if flags&inodeHasFolder > 0 {
+		item.Folder = &graph.Folder{ChildCount: uint32(d.uvarint())}
+	}
+	if flags&inodeHasFile > 0 {
+		item.File = &graph.File{}
+		item.File.Hashes.SHA1Hash = d.string()
+		item.File.Hashes.QuickXorHash = d.string()
+	}
+	if flags&inodeHasDeleted > 0 {
+		item.Deleted = &graph.Deleted{State: d.string()}
+	}
+	item.ConflictBehavior = d.string()
+	item.ETag = d.string()
+	if version >= 2 {
+		item.CTag = d.string()
+	}
+	if flags&inodeHasChildren > 0 {
+		count := d.uvarint()
+		if d.err == nil && count > uint64(len(d.buf)) {
+			// every child takes at least one byte
+			return nil, errInodeEncoding
+		}
+		inode.children = make([]string, 0, count)
+		for j := uint64(0); j < count && d.err == nil; j++ {
+			inode.children = append(inode.children, d.string())
+		}
+	}
+	inode.subdir = uint32(d.uvarint())
+	inode.mode = uint32(d.uvarint())
+	if d.err != nil {
+		return nil, d.err
+	}
+	return inode, nil
+}
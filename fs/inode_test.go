@@ -109,3 +109,67 @@ func TestDoubleCreate(t *testing.T) {
 		)
 	}
 }
+
+// Inodes should survive a round trip through the on-disk binary encoding, and
+// metadata written as JSON by older versions should still be readable.
+func TestInodeBinaryEncoding(t *testing.T) {
+	t.Parallel()
+	parent := NewInode("parent", 0755|fuse.S_IFDIR, nil)
+	inode := NewInode("encoded.txt", 0644|fuse.S_IFREG, parent)
+	inode.DriveItem.Size = 1234
+	inode.DriveItem.ETag = "etag"
+	inode.DriveItem.CTag = "ctag"
+	inode.DriveItem.File = &graph.File{}
+	inode.DriveItem.File.Hashes.SHA1Hash = "ABCDEF"
+	inode.children = []string{"a", "b"}
+
+	for _, data := range [][]byte{inode.AsBinary(), inode.AsJSON()} {
+		decoded, err := NewInodeBinary(data)
+		failOnErr(t, err)
+		if decoded.ID() != inode.ID() || decoded.Name() != inode.Name() ||
+			decoded.Size() != inode.Size() || decoded.ParentID() != parent.ID() ||
+			decoded.ModTime() != inode.ModTime() || decoded.Mode() != inode.Mode() ||
+			decoded.DriveItem.ETag != "etag" || decoded.DriveItem.CTag != "ctag" ||
+			len(decoded.children) != 2 ||
+			decoded.DriveItem.File.Hashes.SHA1Hash != "ABCDEF" {
+			t.Fatalf("Decoded inode did not match original: %+v", decoded.DriveItem)
+		}
+	}
+
+	if _, err := NewInodeBinary(inode.AsBinary()[:10]); err == nil {
+		t.Fatal("Truncated data should not decode.")
+	}
+}
+
+// Compacting an inode should not change its metadata, other than forgetting the
+// parent's path, and should leave the item it was created from alone.
+func TestInodeCompact(t *testing.T) {
+	t.Parallel()
+	item := &graph.DriveItem{
+		ID:   "compact-id",
+		Name: "compact.txt",
+		ETag: "etag",
+		Parent: &graph.DriveItemParent{
+			ID:        "parent-id",
+			Path:      "/drive/root:/somewhere",
+			DriveID:   "drive-id",
+			DriveType: graph.DriveTypePersonal,
+		},
+		File: &graph.File{},
+	}
+	item.File.Hashes.SHA1Hash = "ABCDEF"
+	inode := NewInodeDriveItem(item)
+	inode.compact()
+	if inode.ID() != "compact-id" || inode.Name() != "compact.txt" ||
+		inode.ParentID() != "parent-id" || inode.DriveItem.ETag != "etag" ||
+		inode.DriveItem.Parent.DriveID != "drive-id" ||
+		inode.DriveItem.File.Hashes.SHA1Hash != "ABCDEF" {
+		t.Fatalf("Compacted inode did not match original: %+v", inode.DriveItem)
+	}
+	if inode.DriveItem.Parent.Path != "" {
+		t.Fatal("Parent path should have been dropped.")
+	}
+	if item.Parent.Path == "" {
+		t.Fatal("Item the inode was created from was modified.")
+	}
+}
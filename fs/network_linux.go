@@ -0,0 +1,96 @@
+// +build linux
+
+package fs
+
+import (
+	"errors"
+	"os"
+	"syscall"
+	"unsafe"
+
+	log "github.com/sirupsen/logrus"
+)
+
+// rtnetlink multicast groups, from linux/rtnetlink.h (not exported by syscall)
+const (
+	rtmgrpLink       = 0x1
+	rtmgrpIPv4Ifaddr = 0x10
+	rtmgrpIPv4Route  = 0x40
+	rtmgrpIPv6Ifaddr = 0x100
+)
+
+// watchNetwork listens for network interfaces coming up or gaining addresses
+// over rtnetlink, and triggers a delta fetch right away if we are offline
+// instead of waiting out the offline backoff. Returns once the cache is stopped.
+func (c *Cache) watchNetwork() {
+	fd, err := syscall.Socket(syscall.AF_NETLINK,
+		syscall.SOCK_RAW|syscall.SOCK_CLOEXEC|syscall.SOCK_NONBLOCK, syscall.NETLINK_ROUTE)
+	if err != nil {
+		log.WithField("err", err).Warn("Could not watch for network changes.")
+		return
+	}
+	addr := &syscall.SockaddrNetlink{
+		Family: syscall.AF_NETLINK,
+		Groups: rtmgrpLink | rtmgrpIPv4Ifaddr | rtmgrpIPv6Ifaddr | rtmgrpIPv4Route,
+	}
+	if err = syscall.Bind(fd, addr); err != nil {
+		syscall.Close(fd)
+		log.WithField("err", err).Warn("Could not watch for network changes.")
+		return
+	}
+	// non-blocking, so reads go through the runtime poller and closing the socket
+	// once the cache is stopped interrupts them
+	socket := os.NewFile(uintptr(fd), "netlink")
+	defer socket.Close()
+	done := make(chan struct{})
+	defer close(done)
+	go func() {
+		select {
+		case <-c.stop:
+			socket.Close()
+		case <-done:
+		}
+	}()
+
+	buf := make([]byte, syscall.Getpagesize())
+	for {
+		n, err := socket.Read(buf)
+		if c.stopped() {
+			return
+		}
+		if err != nil {
+			if errors.Is(err, syscall.ENOBUFS) {
+				continue
+			}
+			log.WithField("err", err).Warn("Stopped watching for network changes.")
+			return
+		}
+		msgs, err := syscall.ParseNetlinkMessage(buf[:n])
+		if err != nil {
+			continue
+		}
+		for _, msg := range msgs {
+			if networkUp(msg) && c.IsOffline() {
+				log.Debug("Network change detected while offline, fetching deltas.")
+				c.TriggerDelta()
+				break
+			}
+		}
+	}
+}
+
+// networkUp returns true if a netlink message means we may have connectivity
+// now that we did not have before.
+func networkUp(msg syscall.NetlinkMessage) bool {
+	switch msg.Header.Type {
+	case syscall.RTM_NEWADDR, syscall.RTM_NEWROUTE:
+		return true
+	case syscall.RTM_NEWLINK:
+		if len(msg.Data) < syscall.SizeofIfInfomsg {
+			return false
+		}
+		info := (*syscall.IfInfomsg)(unsafe.Pointer(&msg.Data[0]))
+		return info.Flags&syscall.IFF_UP != 0 && info.Flags&syscall.IFF_RUNNING != 0
+	}
+	return false
+}
@@ -0,0 +1,7 @@
+// +build !linux
+
+package fs
+
+// watchNetwork is only implemented on Linux, elsewhere the delta loop just
+// relies on its offline backoff.
+func (c *Cache) watchNetwork() {}
@@ -0,0 +1,73 @@
+package fs
+
+import (
+	"time"
+
+	"github.com/jstaf/onedriver/fs/graph"
+	log "github.com/sirupsen/logrus"
+)
+
+// how long to wait before resubscribing after the notification socket fails
+const notifyRetryInterval = 30 * time.Second
+
+// NotifyLoop subscribes to change notifications from the server in the
+// background, and triggers a delta fetch whenever one arrives, until the cache is
+// stopped. Meant to be used alongside DeltaLoop with a long safety interval.
+func (c *Cache) NotifyLoop() {
+	c.background(c.notifyLoop)
+}
+
+func (c *Cache) notifyLoop() {
+	log.Trace("Starting notification goroutine.")
+	for { // eva
+		if err := c.notifySession(); err != nil {
+			log.WithField("err", err).Debug(
+				"Change notification subscription failed, retrying.",
+			)
+		}
+		if c.stopped() {
+			return
+		}
+		// catch up on anything we missed while not subscribed
+		c.TriggerDelta()
+		select {
+		case <-time.After(notifyRetryInterval):
+		case <-c.stop:
+			return
+		}
+	}
+}
+
+// notifySession runs a single notification subscription until it fails.
+func (c *Cache) notifySession() error {
+	url, err := graph.GetNotificationURL(c.GetAuth())
+	if err != nil {
+		return err
+	}
+	socket, err := graph.DialNotifications(url)
+	if err != nil {
+		return err
+	}
+	defer socket.Close()
+	done := make(chan struct{})
+	defer close(done)
+	go func() {
+		// interrupts a long poll once the cache is stopped
+		select {
+		case <-c.stop:
+			socket.Close()
+		case <-done:
+		}
+	}()
+	log.Info("Subscribed to change notifications.")
+	for {
+		if err := socket.Wait(); err != nil {
+			return err
+		}
+		if c.stopped() {
+			return nil
+		}
+		log.Trace("Received change notification.")
+		c.TriggerDelta()
+	}
+}
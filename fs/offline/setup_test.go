@@ -44,9 +44,12 @@ func TestMain(m *testing.M) {
 	log.Info("Setup offline tests ------------------------------")
 
 	// reuses the cached data from the previous tests
-	cache := odfs.NewCache(auth, "test.db")
+	cache, err := odfs.NewCache(auth, "test.db")
+	if err != nil {
+		log.WithField("err", err).Fatal("Could not open cache.")
+	}
 	root, _ := cache.GetPath("/", auth)
-	go cache.DeltaLoop(5 * time.Second)
+	cache.DeltaLoop(5 * time.Second)
 	second := time.Second
 	server, _ := fs.Mount(mountLoc, root, &fs.Options{
 		EntryTimeout: &second,
@@ -62,7 +65,7 @@ func TestMain(m *testing.M) {
 	// setup sigint handler for graceful unmount on interrupt/terminate
 	sigChan := make(chan os.Signal, 1)
 	signal.Notify(sigChan, syscall.SIGINT, syscall.SIGTERM, syscall.SIGABRT)
-	go odfs.UnmountHandler(sigChan, server)
+	go odfs.UnmountHandler(sigChan, server, cache)
 
 	// mount fs in background thread
 	go server.Serve()
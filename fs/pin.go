@@ -0,0 +1,416 @@
+package fs
+
+import (
+	"context"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+
+	log "github.com/sirupsen/logrus"
+	bolt "go.etcd.io/bbolt"
+)
+
+// PinnedXAttr is the extended attribute that keeps a file or directory available
+// offline. Setting it to "1" pins it, setting it to "0" or removing it unpins it:
+//
+//	setfattr -n user.onedriver.pinned -v 1 ~/OneDrive/Projects
+const PinnedXAttr = "user.onedriver.pinned"
+
+const (
+	// number of pinned files downloaded at once
+	pinWorkers = 4
+
+	// how long to wait before trying again when pinned content could not be
+	// downloaded
+	pinRetryInterval = time.Minute
+)
+
+var bucketPinned = []byte("pinned")
+
+// pinSet keeps track of the items that were pinned, and of what in them needs to
+// be checked for content that is not on disk yet. The content of everything
+// below a pinned directory is downloaded, kept up to date as deltas come in, and
+// never evicted.
+type pinSet struct {
+	mutex   sync.Mutex
+	ids     map[string]bool // pinned items
+	pending map[string]bool // items that may have content to download
+	wakeup  chan struct{}
+	queued  int64 // files waiting to be downloaded, atomic
+}
+
+func newPinSet(db *bolt.DB) *pinSet {
+	p := &pinSet{
+		ids:     make(map[string]bool),
+		pending: make(map[string]bool),
+		wakeup:  make(chan struct{}, 1),
+	}
+	db.Update(func(tx *bolt.Tx) error {
+		b, err := tx.CreateBucketIfNotExists(bucketPinned)
+		if err != nil {
+			return err
+		}
+		return b.ForEach(func(key []byte, _ []byte) error {
+			p.ids[string(key)] = true
+			// checked once every session, the content may have been removed
+			p.pending[string(key)] = true
+			return nil
+		})
+	})
+	return p
+}
+
+// has returns true if an item itself was pinned.
+func (p *pinSet) has(id string) bool {
+	p.mutex.Lock()
+	defer p.mutex.Unlock()
+	return p.ids[id]
+}
+
+// empty returns true if nothing is pinned.
+func (p *pinSet) empty() bool {
+	p.mutex.Lock()
+	defer p.mutex.Unlock()
+	return len(p.ids) == 0
+}
+
+// changed notes that an item's content or location changed, in case it is
+// pinned. Does not take any inode locks.
+func (p *pinSet) changed(id string) {
+	p.mutex.Lock()
+	if len(p.ids) == 0 {
+		p.mutex.Unlock()
+		return
+	}
+	p.pending[id] = true
+	p.mutex.Unlock()
+	p.wake()
+}
+
+func (p *pinSet) wake() {
+	select {
+	case p.wakeup <- struct{}{}:
+	default:
+	}
+}
+
+// take returns the items that need to be checked, and forgets about them.
+func (p *pinSet) take() []string {
+	p.mutex.Lock()
+	defer p.mutex.Unlock()
+	ids := make([]string, 0, len(p.pending))
+	for id := range p.pending {
+		ids = append(ids, id)
+	}
+	p.pending = make(map[string]bool)
+	return ids
+}
+
+// retry checks an item again later, without waking up the pin loop.
+func (p *pinSet) retry(id string) {
+	p.mutex.Lock()
+	p.pending[id] = true
+	p.mutex.Unlock()
+}
+
+// Pin keeps an item's content, and that of everything below it if it is a
+// directory, available offline.
+func (c *Cache) Pin(id string) error {
+	err := c.db.Update(func(tx *bolt.Tx) error {
+		return tx.Bucket(bucketPinned).Put([]byte(id), []byte{})
+	})
+	if err != nil {
+		return err
+	}
+	c.pins.mutex.Lock()
+	c.pins.ids[id] = true
+	c.pins.pending[id] = true
+	c.pins.mutex.Unlock()
+	c.pins.wake()
+	return nil
+}
+
+// Unpin stops keeping an item available offline. Its content stays on disk until
+// it is evicted, like any other content.
+func (c *Cache) Unpin(id string) error {
+	c.pins.mutex.Lock()
+	delete(c.pins.ids, id)
+	c.pins.mutex.Unlock()
+	return c.db.Update(func(tx *bolt.Tx) error {
+		return tx.Bucket(bucketPinned).Delete([]byte(id))
+	})
+}
+
+// movePin keeps a pin when an item's ID changes.
+func (c *Cache) movePin(oldID string, newID string) {
+	if c.pins.has(oldID) {
+		c.Unpin(oldID)
+		c.Pin(newID)
+	}
+}
+
+// isPinned returns true if an item or one of the directories above it is pinned.
+func (c *Cache) isPinned(id string) bool {
+	if c.pins.empty() {
+		return false
+	}
+	for id != "" {
+		if c.pins.has(id) {
+			return true
+		}
+		inode := c.GetID(id)
+		if inode == nil {
+			return false
+		}
+		id = inode.ParentID()
+	}
+	return false
+}
+
+// PinnedQueued returns how many files of pinned items are still waiting to be
+// downloaded.
+func (c *Cache) PinnedQueued() int {
+	return int(atomic.LoadInt64(&c.pins.queued))
+}
+
+// pinDownload is a file to download for a pinned item.
+type pinDownload struct {
+	inode  *Inode
+	done   *sync.WaitGroup
+	failed *int32
+}
+
+// PinLoop starts downloading the content of pinned items in the background, and
+// keeps it up to date until the cache is stopped.
+func (c *Cache) PinLoop() {
+	c.background(c.pinLoop)
+}
+
+func (c *Cache) pinLoop() {
+	// downloads in progress are abandoned once the cache is stopped
+	ctx, cancel := context.WithCancel(context.Background())
+	defer cancel()
+	go func() {
+		select {
+		case <-c.stop:
+		case <-ctx.Done():
+		}
+		cancel()
+	}()
+
+	downloads := make(chan pinDownload)
+	var workers sync.WaitGroup
+	for i := 0; i < pinWorkers; i++ {
+		workers.Add(1)
+		go func() {
+			defer workers.Done()
+			for download := range downloads {
+				if errno := download.inode.download(ctx); errno != 0 {
+					atomic.StoreInt32(download.failed, 1)
+				}
+				atomic.AddInt64(&c.pins.queued, -1)
+				download.done.Done()
+			}
+		}()
+	}
+	defer func() {
+		close(downloads)
+		workers.Wait()
+	}()
+
+	for {
+		failed := false
+		for _, id := range c.pins.take() {
+			if !c.syncPinned(id, downloads) {
+				failed = true
+				c.pins.retry(id)
+			}
+			if c.stopped() {
+				return
+			}
+		}
+
+		var retry <-chan time.Time
+		if failed {
+			retry = time.After(pinRetryInterval)
+		}
+		select {
+		case <-c.pins.wakeup:
+		case <-retry:
+		case <-c.stop:
+			return
+		}
+	}
+}
+
+// syncPinned downloads everything in an item that is pinned and does not have its
+// content on disk yet. Returns false if that should be tried again later.
+func (c *Cache) syncPinned(id string, downloads chan<- pinDownload) bool {
+	inode := c.GetID(id)
+	if inode == nil {
+		// deleted, on the server or here
+		if c.pins.has(id) {
+			c.Unpin(id)
+		}
+		return true
+	}
+	if !c.isPinned(id) {
+		return true
+	}
+	if c.IsOffline() {
+		return false
+	}
+
+	// find everything that needs downloading first, so that the status shows how
+	// much is left
+	auth := c.GetAuth()
+	var files []*Inode
+	pending := []*Inode{inode}
+	for len(pending) > 0 {
+		inode := pending[len(pending)-1]
+		pending = pending[:len(pending)-1]
+		if !inode.IsDir() {
+			if c.needsDownload(inode) {
+				files = append(files, inode)
+			}
+			continue
+		}
+		children, err := c.ListChildren(inode.ID(), auth)
+		if err != nil {
+			log.WithFields(log.Fields{
+				"id":  inode.ID(),
+				"err": err,
+			}).Warn("Could not list pinned directory.")
+			return false
+		}
+		pending = append(pending, children...)
+	}
+	if len(files) == 0 {
+		return true
+	}
+	log.WithFields(log.Fields{
+		"id":    id,
+		"files": len(files),
+	}).Info("Downloading content of pinned item.")
+
+	var done sync.WaitGroup
+	var failed int32
+	atomic.AddInt64(&c.pins.queued, int64(len(files)))
+	for i, file := range files {
+		done.Add(1)
+		select {
+		case downloads <- pinDownload{inode: file, done: &done, failed: &failed}:
+		case <-c.stop:
+			done.Done()
+			atomic.AddInt64(&c.pins.queued, -int64(len(files)-i))
+			done.Wait()
+			return false
+		}
+	}
+	done.Wait()
+	return failed == 0
+}
+
+// needsDownload returns true if a file's content is not on disk, or might not be
+// the latest version. Files with local changes are left alone.
+func (c *Cache) needsDownload(inode *Inode) bool {
+	inode.mutex.RLock()
+	id := inode.DriveItem.ID
+	current := !isLocalID(id) && !inode.hasChanges &&
+		c.content.IsComplete(id) && c.content.Matches(id, &inode.DriveItem)
+	changed := isLocalID(id) || inode.hasChanges
+	inode.mutex.RUnlock()
+	return !current && !changed && !c.uploads.IsQueued(id)
+}
+
+// download fetches a file's entire content to disk, if it is not there already.
+// Gives up once ctx is done.
+func (i *Inode) download(ctx context.Context) syscall.Errno {
+	if errno := i.open(ctx, 0); errno != 0 {
+		return errno
+	}
+	i.mutex.RLock()
+	stream := i.stream
+	i.mutex.RUnlock()
+	if stream != nil {
+		// large files are only streamed by open
+		return i.fetchAll(ctx, stream)
+	}
+	return 0
+}
+
+// Getxattr reports whether an item is pinned, see PinnedXAttr.
+func (i *Inode) Getxattr(ctx context.Context, attr string, dest []byte) (uint32, syscall.Errno) {
+	if attr != PinnedXAttr || !i.GetCache().pins.has(i.ID()) {
+		return 0, syscall.ENODATA
+	}
+	value := "1"
+	if len(dest) == 0 {
+		// asking for the size
+		return uint32(len(value)), 0
+	}
+	if len(dest) < len(value) {
+		return uint32(len(value)), syscall.ERANGE
+	}
+	return uint32(copy(dest, value)), 0
+}
+
+// Setxattr pins or unpins an item, see PinnedXAttr. No other attributes can be
+// set.
+func (i *Inode) Setxattr(ctx context.Context, attr string, data []byte, flags uint32) syscall.Errno {
+	if attr != PinnedXAttr {
+		return syscall.ENOTSUP
+	}
+	id := i.ID()
+	cache := i.GetCache()
+	var err error
+	switch string(data) {
+	case "1":
+		log.WithFields(log.Fields{"id": id, "path": i.Path()}).Info("Pinning item.")
+		err = cache.Pin(id)
+	case "0":
+		err = cache.Unpin(id)
+	default:
+		return syscall.EINVAL
+	}
+	if err != nil {
+		log.WithFields(log.Fields{
+			"id":  id,
+			"err": err,
+		}).Error("Could not save pinned items.")
+		return syscall.EIO
+	}
+	return 0
+}
+
+// Removexattr unpins an item.
+func (i *Inode) Removexattr(ctx context.Context, attr string) syscall.Errno {
+	if attr != PinnedXAttr {
+		return syscall.ENOTSUP
+	}
+	cache := i.GetCache()
+	id := i.ID()
+	if !cache.pins.has(id) {
+		return syscall.ENODATA
+	}
+	if err := cache.Unpin(id); err != nil {
+		return syscall.EIO
+	}
+	return 0
+}
+
+// Listxattr lists PinnedXAttr for items that are pinned.
+func (i *Inode) Listxattr(ctx context.Context, dest []byte) (uint32, syscall.Errno) {
+	if !i.GetCache().pins.has(i.ID()) {
+		return 0, 0
+	}
+	list := PinnedXAttr + "\x00"
+	if len(dest) == 0 {
+		return uint32(len(list)), 0
+	}
+	if len(dest) < len(list) {
+		return uint32(len(list)), syscall.ERANGE
+	}
+	return uint32(copy(dest, list)), 0
+}
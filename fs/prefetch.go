@@ -0,0 +1,165 @@
+package fs
+
+import (
+	"sync"
+
+	"github.com/jstaf/onedriver/fs/graph"
+	log "github.com/sirupsen/logrus"
+)
+
+const (
+	// how many directory levels below a listed directory have their children
+	// fetched ahead of time
+	prefetchDepth = 2
+
+	// number of prefetches running at once
+	prefetchWorkers = 4
+
+	// prefetches beyond this many are dropped instead of queued
+	prefetchQueueSize = 1024
+)
+
+// prefetchJob is something to fetch ahead of time. Either the children of
+// directories below id, or the small files in directory id.
+type prefetchJob struct {
+	id    string
+	depth int  // directory levels left to fetch children for
+	files bool // fetch small files instead of children
+}
+
+// prefetcher fetches things the user is likely to access next in the background,
+// so that browsing a drive that has not been cached yet does not block on the
+// server at every step. It is only driven by access patterns - listing a
+// directory fetches the children of its subdirectories, and opening a file
+// fetches the other small files in the same directory.
+type prefetcher struct {
+	cache    *Cache
+	maxSize  uint64 // files up to this size are fetched, 0 fetches no files
+	jobs     chan prefetchJob
+	mutex    sync.Mutex
+	inFlight map[prefetchJob]bool
+}
+
+// EnablePrefetch starts fetching items ahead of time based on access patterns.
+// Files of up to maxFileSize bytes in directories where files are opened are
+// downloaded as well, 0 only prefetches directory listings.
+func (c *Cache) EnablePrefetch(maxFileSize uint64) {
+	p := &prefetcher{
+		cache:    c,
+		maxSize:  maxFileSize,
+		jobs:     make(chan prefetchJob, prefetchQueueSize),
+		inFlight: make(map[prefetchJob]bool),
+	}
+	for i := 0; i < prefetchWorkers; i++ {
+		c.background(p.worker)
+	}
+	c.prefetch = p
+}
+
+// add queues a job, unless the same job is already pending or the queue is full.
+// Prefetching is only an optimization, so dropping jobs is fine.
+func (p *prefetcher) add(job prefetchJob) {
+	if p == nil || p.cache.IsOffline() {
+		return
+	}
+	p.mutex.Lock()
+	defer p.mutex.Unlock()
+	if p.inFlight[job] {
+		return
+	}
+	select {
+	case p.jobs <- job:
+		p.inFlight[job] = true
+	default:
+	}
+}
+
+// listed notes that a directory was listed.
+func (p *prefetcher) listed(id string) {
+	p.add(prefetchJob{id: id, depth: prefetchDepth})
+}
+
+// opened notes that a file in a directory was opened.
+func (p *prefetcher) opened(parentID string) {
+	if p != nil && p.maxSize > 0 {
+		p.add(prefetchJob{id: parentID, files: true})
+	}
+}
+
+func (p *prefetcher) worker() {
+	for {
+		var job prefetchJob
+		select {
+		case job = <-p.jobs:
+		case <-p.cache.stop:
+			return
+		}
+		if job.files {
+			p.fetchFiles(job.id)
+		} else {
+			p.fetchChildren(job.id, job.depth)
+		}
+		p.mutex.Lock()
+		delete(p.inFlight, job)
+		p.mutex.Unlock()
+	}
+}
+
+// fetchChildren fetches the children of every subdirectory of a directory, and
+// queues the same for the subdirectories until depth runs out.
+func (p *prefetcher) fetchChildren(id string, depth int) {
+	auth := p.cache.GetAuth()
+	children, err := p.cache.ListChildren(id, auth)
+	if err != nil || depth <= 0 {
+		return
+	}
+	for _, child := range children {
+		if child.IsDir() {
+			p.add(prefetchJob{id: child.ID(), depth: depth - 1})
+		}
+	}
+}
+
+// fetchFiles downloads the small files in a directory that are not in the
+// content store yet.
+func (p *prefetcher) fetchFiles(id string) {
+	auth := p.cache.GetAuth()
+	children, err := p.cache.ListChildren(id, auth)
+	if err != nil {
+		return
+	}
+	store := p.cache.content
+	for _, child := range children {
+		childID := child.ID()
+		if child.IsDir() || isLocalID(childID) || child.Size() > p.maxSize ||
+			store.Has(childID) {
+			continue
+		}
+		if p.cache.IsOffline() || p.cache.stopped() {
+			return
+		}
+		child.mutex.RLock()
+		etag := child.DriveItem.ETag
+		child.mutex.RUnlock()
+		body, err := graph.GetItemContent(childID, auth)
+		if err != nil {
+			log.WithFields(log.Fields{
+				"id":  childID,
+				"err": err,
+			}).Debug("Could not prefetch content.")
+			continue
+		}
+
+		child.mutex.Lock()
+		// opened, changed or moved to a new ID in the meantime
+		if child.DriveItem.ID == childID && child.DriveItem.ETag == etag &&
+			!store.Has(childID) && !child.hasChanges {
+			if err := store.Insert(childID, body); err == nil {
+				if match, _ := child.verifyContent(); match {
+					store.Validate(childID, &child.DriveItem)
+				}
+			}
+		}
+		child.mutex.Unlock()
+	}
+}
@@ -1,6 +1,7 @@
 package fs
 
 import (
+	"flag"
 	"fmt"
 	"os"
 	"os/exec"
@@ -35,6 +36,13 @@ var fsCache *Cache // used to inject bad content into the fs for some tests
 // avoid having to repeatedly recreate auth_tokens.json and juggle multiple auth
 // sessions.
 func TestMain(m *testing.M) {
+	flag.Parse()
+	if *fakeGraph {
+		// benchmarks bring their own fake server and need none of the setup below
+		log.SetLevel(log.WarnLevel)
+		os.Exit(m.Run())
+	}
+
 	// determine if we're running a single test in vscode or something
 	var singleTest bool
 	for _, arg := range os.Args {
@@ -52,13 +60,17 @@ func TestMain(m *testing.M) {
 	toDelete, _ := filepath.Glob("test*.db")
 	for _, db := range toDelete {
 		os.Remove(db)
+		os.RemoveAll(contentDir(db))
 	}
 
 	f := logger.LogTestSetup()
 	defer f.Close()
 
 	auth = graph.Authenticate(".auth_tokens.json")
-	fsCache = NewCache(auth, "test.db")
+	var err error
+	if fsCache, err = NewCache(auth, "test.db"); err != nil {
+		log.WithField("err", err).Fatal("Could not open cache.")
+	}
 
 	second := time.Second
 	root, _ := fsCache.GetPath("/", auth)
@@ -68,7 +80,6 @@ func TestMain(m *testing.M) {
 		MountOptions: fuse.MountOptions{
 			Name:          "onedriver",
 			FsName:        "onedriver",
-			DisableXAttrs: true,
 			MaxBackground: 1024,
 		},
 	})
@@ -76,7 +87,7 @@ func TestMain(m *testing.M) {
 	// setup sigint handler for graceful unmount on interrupt/terminate
 	sigChan := make(chan os.Signal, 1)
 	signal.Notify(sigChan, syscall.SIGINT, syscall.SIGTERM, syscall.SIGABRT)
-	go UnmountHandler(sigChan, server)
+	go UnmountHandler(sigChan, server, fsCache)
 
 	// mount fs in background thread
 	go server.Serve()
@@ -92,7 +103,8 @@ func TestMain(m *testing.M) {
 		os.Mkdir(filepath.Join(TestDir, "paging"), 0755)
 		createPagingTestFiles()
 	}
-	go fsCache.DeltaLoop(5 * time.Second)
+	fsCache.DeltaLoop(5 * time.Second)
+	fsCache.PinLoop()
 
 	// not created by default on onedrive for business
 	os.Mkdir(mountLoc+"/Documents", 0755)
@@ -9,12 +9,17 @@ import (
 )
 
 // UnmountHandler should be used as goroutine that will handle sigint then exit gracefully
-func UnmountHandler(signal <-chan os.Signal, server *fuse.Server) {
+func UnmountHandler(signal <-chan os.Signal, server *fuse.Server, cache *Cache) {
 	sig := <-signal // block until signal
 	log.WithFields(log.Fields{
 		"signal": strings.ToUpper(sig.String()),
 	}).Info("Signal received, unmounting filesystem.")
 
+	// make sure changes waiting for write-back are picked up on the next start,
+	// and that it starts from the latest metadata
+	cache.FlushWriteBack()
+	cache.SerializeAll()
+
 	err := server.Unmount()
 	if err != nil {
 		log.WithFields(log.Fields{
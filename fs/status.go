@@ -0,0 +1,126 @@
+package fs
+
+import (
+	"bytes"
+	"encoding/json"
+	"net"
+	"os"
+	"sync/atomic"
+	"time"
+
+	"github.com/jstaf/onedriver/fs/graph"
+	log "github.com/sirupsen/logrus"
+)
+
+// how often clients of the status socket are sent an update, if anything changed
+const statusInterval = time.Second
+
+// Status is a snapshot of what a mounted filesystem is doing. Traffic, its rates
+// and request latency are counted for the whole process, so in --daemon mode
+// every mount reports the combined totals of all mounts.
+type Status struct {
+	Offline         bool                    `json:"offline"`
+	UploadsQueued   int                     `json:"uploadsQueued"`   // including those in progress
+	UploadsInFlight int                     `json:"uploadsInFlight"` // in progress right now
+	PinnedQueued    int                     `json:"pinnedQueued"`    // files to download to keep pinned items offline
+	LastDelta       int64                   `json:"lastDelta"`       // unix time changes were last fetched, 0 if never
+	CacheUsed       uint64                  `json:"cacheUsed"`       // bytes of file content on disk
+	BytesSent       uint64                  `json:"bytesSent"`
+	BytesReceived   uint64                  `json:"bytesReceived"`
+	SendRate        float64                 `json:"sendRate"`    // bytes/s since the last update, status socket only
+	ReceiveRate     float64                 `json:"receiveRate"` // bytes/s since the last update, status socket only
+	RequestLatency  graph.HistogramSnapshot `json:"requestLatency"`
+
+	// only while tracing, see graph.EnableTracing
+	OpLatency       map[string]graph.HistogramSnapshot `json:"opLatency,omitempty"`
+	EndpointLatency map[string]graph.HistogramSnapshot `json:"endpointLatency,omitempty"`
+}
+
+// Status returns what the filesystem is doing right now.
+func (c *Cache) Status() Status {
+	queued, inFlight := c.uploads.Stats()
+	conns := graph.GetConnStats()
+	var endpoints map[string]graph.HistogramSnapshot
+	if graph.Tracing() {
+		endpoints = graph.EndpointStats()
+	}
+	return Status{
+		Offline:         c.IsOffline(),
+		UploadsQueued:   queued,
+		UploadsInFlight: inFlight,
+		PinnedQueued:    c.PinnedQueued(),
+		LastDelta:       atomic.LoadInt64(&c.lastDelta),
+		CacheUsed:       c.content.Used(),
+		BytesSent:       conns.BytesSent,
+		BytesReceived:   conns.BytesReceived,
+		RequestLatency:  conns.Latency,
+		OpLatency:       OpStats(),
+		EndpointLatency: endpoints,
+	}
+}
+
+// ServeStatus listens for connections on a Unix socket at path. Every client is
+// sent the Status as a line of JSON right away, and again whenever it changes,
+// until it disconnects or the cache is stopped. This is how the launcher shows
+// what a mount is doing.
+func (c *Cache) ServeStatus(path string) error {
+	// left over if we were killed last time
+	os.Remove(path)
+	listener, err := net.Listen("unix", path)
+	if err != nil {
+		return err
+	}
+	if err = os.Chmod(path, 0600); err != nil {
+		listener.Close()
+		return err
+	}
+	c.status = listener
+	go func() {
+		for {
+			conn, err := listener.Accept()
+			if err != nil {
+				if !c.stopped() {
+					log.WithField("err", err).Error("Status socket stopped accepting connections.")
+				}
+				return
+			}
+			go c.streamStatus(conn)
+		}
+	}()
+	return nil
+}
+
+// streamStatus sends status updates to a client until it goes away.
+func (c *Cache) streamStatus(conn net.Conn) {
+	defer conn.Close()
+	ticker := time.NewTicker(statusInterval)
+	defer ticker.Stop()
+
+	var last []byte
+	var prev Status
+	prevTime := time.Now()
+	for first := true; ; first = false {
+		status := c.Status()
+		now := time.Now()
+		if !first {
+			elapsed := now.Sub(prevTime).Seconds()
+			status.SendRate = float64(status.BytesSent-prev.BytesSent) / elapsed
+			status.ReceiveRate = float64(status.BytesReceived-prev.BytesReceived) / elapsed
+		}
+		prev, prevTime = status, now
+
+		line, _ := json.Marshal(status)
+		if !bytes.Equal(line, last) {
+			conn.SetWriteDeadline(now.Add(statusInterval))
+			if _, err := conn.Write(append(line, '\n')); err != nil {
+				return
+			}
+			last = line
+		}
+		select {
+		case <-ticker.C:
+		case <-c.stop:
+			return
+		}
+	}
+}
@@ -0,0 +1,214 @@
+package fs
+
+import (
+	"context"
+	"strings"
+	"sync"
+
+	"github.com/jstaf/onedriver/fs/graph"
+	log "github.com/sirupsen/logrus"
+)
+
+const (
+	// files at least this large are fetched piece by piece instead of with a
+	// single request
+	streamThreshold uint64 = 4 * uint64(contentBlockSize)
+
+	// how many blocks to fetch ahead of a sequential reader
+	streamReadAhead = 4
+
+	// maximum number of blocks fetched from the server at once for a single file
+	streamParallelism = 4
+)
+
+// streamBlock is a block of a file's content currently being fetched. ready is
+// closed once the block has been written to the content store or err has been
+// populated.
+type streamBlock struct {
+	index int64
+	err   error
+	ready chan struct{}
+}
+
+// contentStream fetches an item's content on-demand in fixed size blocks using
+// HTTP range requests, instead of downloading the entire file before the first
+// read can be served. Fetched blocks are written to the content store, so they
+// survive the file being closed and only missing blocks are ever fetched again.
+type contentStream struct {
+	id    string
+	size  uint64
+	store *ContentStore
+	auth  *graph.Auth
+	slots chan struct{} // limits the number of concurrent fetches
+
+	mutex       sync.Mutex
+	downloadURL string
+	inflight    map[int64]*streamBlock
+	next        int64 // block index we expect a sequential reader to ask for next
+}
+
+// newContentStream creates a stream for an item. The store must have been
+// prepared to receive the item's content with ContentStore.Begin. No content is
+// fetched until the first call to Fetch.
+func newContentStream(id string, size uint64, store *ContentStore, auth *graph.Auth) *contentStream {
+	return &contentStream{
+		id:       id,
+		size:     size,
+		store:    store,
+		auth:     auth,
+		slots:    make(chan struct{}, streamParallelism),
+		inflight: make(map[int64]*streamBlock),
+		next:     -1,
+	}
+}
+
+// Fetch makes sure that the content in the range [off, end) is present in the
+// content store, fetching any missing blocks.
+func (s *contentStream) Fetch(off int64, end int64) error {
+	if end > int64(s.size) {
+		end = int64(s.size)
+	}
+	if off >= end {
+		return nil
+	}
+	first := off / contentBlockSize
+	last := (end - 1) / contentBlockSize
+	s.readAhead(first, last)
+	return s.wait(first, last)
+}
+
+// FetchAll fetches every block that is not already present in the content store.
+// Only a few blocks are fetched at a time, so that no more are started once ctx
+// is done.
+func (s *contentStream) FetchAll(ctx context.Context) error {
+	nblocks := numBlocks(s.size)
+	pending := make([]*streamBlock, 0, streamParallelism)
+	for idx := int64(0); idx < nblocks || len(pending) > 0; {
+		if idx < nblocks && len(pending) < streamParallelism {
+			if block := s.block(idx); block != nil {
+				pending = append(pending, block)
+			}
+			idx++
+			continue
+		}
+		select {
+		case <-pending[0].ready:
+			if pending[0].err != nil {
+				return pending[0].err
+			}
+			pending = pending[1:]
+		case <-ctx.Done():
+			return ctx.Err()
+		}
+	}
+	return nil
+}
+
+// wait fetches the blocks from first to last and waits for them to finish.
+func (s *contentStream) wait(first int64, last int64) error {
+	blocks := make([]*streamBlock, 0, last-first+1)
+	for idx := first; idx <= last; idx++ {
+		if block := s.block(idx); block != nil {
+			blocks = append(blocks, block)
+		}
+	}
+	for _, block := range blocks {
+		<-block.ready
+		if block.err != nil {
+			return block.err
+		}
+	}
+	return nil
+}
+
+// readAhead detects sequential readers and starts fetching the blocks they are
+// likely to ask for next.
+func (s *contentStream) readAhead(first int64, last int64) {
+	s.mutex.Lock()
+	sequential := first == s.next || first == s.next-1
+	s.next = last + 1
+	s.mutex.Unlock()
+	if !sequential {
+		return
+	}
+
+	nblocks := numBlocks(s.size)
+	for idx := last + 1; idx <= last+streamReadAhead && idx < nblocks; idx++ {
+		s.block(idx)
+	}
+}
+
+// block starts fetching the block at idx in the background if it is not already
+// present or being fetched. Returns nil if the block is already present.
+func (s *contentStream) block(idx int64) *streamBlock {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	if block, exists := s.inflight[idx]; exists {
+		return block
+	}
+	if s.store.HasBlock(s.id, idx) {
+		return nil
+	}
+
+	block := &streamBlock{index: idx, ready: make(chan struct{})}
+	s.inflight[idx] = block
+	go s.fetch(block)
+	return block
+}
+
+// fetch downloads a single block's content from the server and writes it to the
+// content store. The download URL is refetched once if the old one has expired.
+func (s *contentStream) fetch(block *streamBlock) {
+	s.slots <- struct{}{}
+	defer func() {
+		<-s.slots
+		s.mutex.Lock()
+		delete(s.inflight, block.index)
+		s.mutex.Unlock()
+		close(block.ready)
+	}()
+
+	offset := uint64(block.index * contentBlockSize)
+	var data []byte
+	for attempt := 0; attempt < 2; attempt++ {
+		url, err := s.url(attempt > 0)
+		if err != nil {
+			block.err = err
+			return
+		}
+		data, block.err = graph.GetItemContentRange(url, offset, uint64(contentBlockSize))
+		if block.err == nil || !strings.HasPrefix(block.err.Error(), "HTTP 4") {
+			break
+		}
+	}
+	if block.err == nil {
+		block.err = s.store.WriteBlock(s.id, block.index, data)
+	}
+	if block.err != nil {
+		log.WithFields(log.Fields{
+			"id":     s.id,
+			"offset": offset,
+			"err":    block.err,
+		}).Error("Failed to fetch content block.")
+	}
+}
+
+// url returns the download URL of the item, fetching it if we do not have one
+// or if refresh is set.
+func (s *contentStream) url(refresh bool) (string, error) {
+	s.mutex.Lock()
+	url := s.downloadURL
+	s.mutex.Unlock()
+	if url != "" && !refresh {
+		return url, nil
+	}
+
+	url, err := graph.GetItemDownloadURL(s.id, s.auth)
+	if err != nil {
+		return "", err
+	}
+	s.mutex.Lock()
+	s.downloadURL = url
+	s.mutex.Unlock()
+	return url, nil
+}
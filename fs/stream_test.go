@@ -0,0 +1,70 @@
+package fs
+
+import (
+	"bytes"
+	"io"
+	"io/ioutil"
+	"os/exec"
+	"path/filepath"
+	"testing"
+	"time"
+
+	"github.com/jstaf/onedriver/fs/graph"
+	bolt "go.etcd.io/bbolt"
+)
+
+// Verify that content fetched by a contentStream matches the original file, both
+// for sequential reads and for reads that jump around the file.
+func TestContentStreamReadAt(t *testing.T) {
+	t.Parallel()
+	failOnErr(t, exec.Command("cp", "dmel.fa", filepath.Join(TestDir, "stream.fa")).Run())
+	original, err := ioutil.ReadFile("dmel.fa")
+	failOnErr(t, err)
+
+	var item *graph.DriveItem
+	for i := 0; i < retrySeconds; i++ {
+		time.Sleep(time.Second)
+		item, err = graph.GetItemPath("/onedriver_tests/stream.fa", auth)
+		if err == nil && item.Size == uint64(len(original)) {
+			break
+		}
+	}
+	failOnErr(t, err)
+
+	// use a separate store so we don't touch the content of the mounted file
+	db, err := bolt.Open("test_stream.db", 0600, &bolt.Options{Timeout: time.Second * 5})
+	failOnErr(t, err)
+	defer db.Close()
+	store, err := NewContentStore(contentDir("test_stream.db"), db)
+	failOnErr(t, err)
+	defer store.Close()
+	failOnErr(t, store.Begin(item.ID, item.Size, item.ETag))
+	stream := newContentStream(item.ID, item.Size, store, auth)
+
+	offsets := []int64{
+		0,
+		contentBlockSize,
+		contentBlockSize - 100, // crosses a block boundary
+		int64(len(original)) / 2,
+		10,
+	}
+	for _, off := range offsets {
+		buf := make([]byte, 128*1024)
+		failOnErr(t, stream.Fetch(off, off+int64(len(buf))))
+		n, err := store.ReadAt(item.ID, buf, off)
+		if err != nil && err != io.EOF {
+			t.Fatal(err)
+		}
+		if !bytes.Equal(buf[:n], original[off:off+int64(n)]) {
+			t.Fatalf("Streamed content did not match original at offset %d", off)
+		}
+	}
+
+	// read past the end of the file
+	buf := make([]byte, 4096)
+	failOnErr(t, stream.Fetch(int64(len(original))-100, int64(len(original))+4096))
+	n, err := store.ReadAt(item.ID, buf, int64(len(original))-100)
+	if err != io.EOF || n != 100 {
+		t.Fatalf("Expected a short read of 100 bytes and io.EOF, got %d bytes and %v", n, err)
+	}
+}
@@ -0,0 +1,52 @@
+package fs
+
+import (
+	"time"
+
+	"github.com/jstaf/onedriver/fs/graph"
+)
+
+// FUSE ops whose latency is tracked while tracing is enabled
+const (
+	opLookup = iota
+	opReaddir
+	opOpen
+	opRead
+	opWrite
+	opFlush
+	numOps
+)
+
+var opNames = [numOps]string{"Lookup", "Readdir", "Open", "Read", "Write", "Flush"}
+
+var opLatency [numOps]graph.Histogram
+
+// traceStart returns when an op started, or the zero time if tracing is
+// disabled. Meant to be used as `defer traceEnd(op, traceStart())`, so that a
+// disabled trace costs a single atomic load.
+func traceStart() time.Time {
+	if !graph.Tracing() {
+		return time.Time{}
+	}
+	return time.Now()
+}
+
+// traceEnd records how long an op took.
+func traceEnd(op int, start time.Time) {
+	if !start.IsZero() {
+		opLatency[op].Observe(time.Since(start))
+	}
+}
+
+// OpStats returns the latency of each traced FUSE op, or nil if tracing is
+// disabled (see graph.EnableTracing).
+func OpStats() map[string]graph.HistogramSnapshot {
+	if !graph.Tracing() {
+		return nil
+	}
+	stats := make(map[string]graph.HistogramSnapshot, numOps)
+	for op := range opLatency {
+		stats[opNames[op]] = opLatency[op].Snapshot()
+	}
+	return stats
+}
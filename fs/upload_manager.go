@@ -1,7 +1,12 @@
 package fs
 
 import (
+	"container/heap"
 	"encoding/json"
+	"errors"
+	"os"
+	"sync"
+	"sync/atomic"
 	"time"
 
 	"github.com/jstaf/onedriver/fs/graph"
@@ -9,16 +14,25 @@ import (
 	bolt "go.etcd.io/bbolt"
 )
 
-const maxUploadsInFlight = 5
-
 var bucketUploads = []byte("uploads")
 
-// UploadManager is used to manage and retry uploads.
+// UploadManager is used to manage and retry uploads. Uploads are started as soon
+// as there is capacity for them, in priority order (see uploadQueue).
 type UploadManager struct {
 	queue         chan *UploadSession
 	deletionQueue chan string
+	done          chan *UploadSession // sessions whose Upload has returned
+	barrier       chan chan struct{}  // see sync
+	wakeup        chan struct{}       // a shared upload slot freed up, see uploadSlots
+	stop          chan struct{}       // closed by Stop
+	stopped       chan struct{}       // closed once uploadLoop has returned
 	sessions      map[string]*UploadSession
-	inFlight      uint8 // number of sessions in flight
+	sessionsMutex sync.RWMutex              // sessions is only modified by uploadLoop
+	superseded    map[string]*UploadSession // running uploads that a newer session waits for
+	pending       uploadQueue               // sessions waiting to be started
+	limiter       *uploadLimiter
+	inFlight      int32 // number of sessions in flight, atomic so Stats can read it
+	largeInFlight int   // number of large sessions in flight
 	auth          *graph.Auth
 	cache         *Cache
 	db            *bolt.DB
@@ -29,11 +43,19 @@ func NewUploadManager(duration time.Duration, db *bolt.DB, cache *Cache, auth *g
 	manager := UploadManager{
 		queue:         make(chan *UploadSession),
 		deletionQueue: make(chan string, 1000), // FIXME - why does this chan need to be buffered now???
+		done:          make(chan *UploadSession),
+		barrier:       make(chan chan struct{}),
+		wakeup:        make(chan struct{}, 1),
+		stop:          make(chan struct{}),
+		stopped:       make(chan struct{}),
 		sessions:      make(map[string]*UploadSession),
+		superseded:    make(map[string]*UploadSession),
+		limiter:       newUploadLimiter(),
 		auth:          auth,
 		db:            db,
 		cache:         cache,
 	}
+	var restored []*UploadSession
 	db.View(func(tx *bolt.Tx) error {
 		// Add any incomplete sessions from disk - any sessions here were never
 		// finished. The most likely cause of this is that the user shut off
@@ -52,119 +74,361 @@ func NewUploadManager(duration time.Duration, db *bolt.DB, cache *Cache, auth *g
 				).Error("Error while restoring upload sessions from disk.")
 				return err
 			}
-			if session.getState() != uploadNotStarted {
-				manager.inFlight++
-			}
-			session.cancel(auth) // uploads are currently non-resumable
-			manager.sessions[session.ID] = session
+			restored = append(restored, session)
 			return nil
 		})
 	})
+	for _, session := range restored {
+		if err := manager.restoreSession(session); err != nil {
+			log.WithFields(log.Fields{
+				"id":   session.ID,
+				"name": session.Name,
+				"err":  err,
+			}).Error("Could not restore upload session, dropping it.")
+			manager.forgetSession(session.ID)
+			continue
+		}
+		manager.sessions[session.ID] = session
+	}
 	go manager.uploadLoop(duration)
 	return &manager
 }
 
-// uploadLoop manages the deduplication and tracking of uploads
+// restoreSession prepares a session read from disk to be uploaded again. Large
+// uploads resume from wherever they were interrupted, as long as their upload URL
+// is still valid. Sessions stored by older versions of onedriver with their
+// content inline are migrated to a snapshot on disk.
+func (u *UploadManager) restoreSession(session *UploadSession) error {
+	if session.Snapshot == "" {
+		if session.Data == nil || u.cache == nil {
+			return errors.New("upload session has no content")
+		}
+		snapshot, err := u.cache.content.SnapshotData(session.ID, session.Data)
+		if err != nil {
+			return err
+		}
+		session.Snapshot = snapshot
+		session.Data = nil
+	}
+	if _, err := os.Stat(session.Snapshot); err != nil {
+		// the snapshot is gone, upload whatever we have now instead
+		if u.cache == nil || !u.cache.content.IsComplete(session.ID) {
+			return err
+		}
+		if session.Snapshot, err = u.cache.content.Snapshot(session.ID); err != nil {
+			return err
+		}
+		session.Size = u.cache.content.Size(session.ID)
+		session.UploadURL = ""
+		if err = session.hashSnapshot(); err != nil {
+			return err
+		}
+	}
+	if !session.canResume() {
+		session.UploadURL = ""
+	}
+	u.persistSession(session)
+	return nil
+}
+
+// snapshots returns the snapshots in use by the manager's sessions.
+func (u *UploadManager) snapshots() map[string]bool {
+	u.sessionsMutex.RLock()
+	defer u.sessionsMutex.RUnlock()
+	snapshots := make(map[string]bool, len(u.sessions))
+	for _, session := range u.sessions {
+		snapshots[session.Snapshot] = true
+	}
+	return snapshots
+}
+
+// persistSession writes a session to disk in case the user shuts off their
+// computer or kills onedriver prematurely.
+func (u *UploadManager) persistSession(session *UploadSession) {
+	contents, _ := json.Marshal(session)
+	session.persistedURL = session.uploadURL()
+	u.db.Update(func(tx *bolt.Tx) error {
+		// keyed by the ID the session was queued with, the ID changes once a
+		// new file has been uploaded
+		b, _ := tx.CreateBucketIfNotExists(bucketUploads)
+		return b.Put([]byte(session.OldID), contents)
+	})
+}
+
+// forgetSession deletes a session from disk.
+func (u *UploadManager) forgetSession(id string) {
+	u.db.Update(func(tx *bolt.Tx) error {
+		if b := tx.Bucket(bucketUploads); b != nil {
+			b.Delete([]byte(id))
+		}
+		return nil
+	})
+}
+
+// uploadLoop manages the deduplication and tracking of uploads. duration is how
+// often delayed retries are checked for.
 func (u *UploadManager) uploadLoop(duration time.Duration) {
+	defer close(u.stopped)
 	ticker := time.NewTicker(duration)
+	defer ticker.Stop()
+	for _, session := range u.sessions {
+		u.enqueue(session)
+	}
 	for {
 		select {
 		case session := <-u.queue: // new sessions
-			// deduplicate sessions for the same item
+			// deduplicate sessions for the same item. A small upload in progress
+			// can't be stopped, so the new session waits for it to return instead
+			// of racing it to the server.
 			if old, exists := u.sessions[session.ID]; exists {
 				old.cancel(u.auth)
+				if old.running {
+					u.superseded[session.ID] = old
+				} else {
+					old.removeSnapshot()
+					u.pending.remove(old)
+				}
 			}
-			u.db.Update(func(tx *bolt.Tx) error {
-				// persist to disk in case the user shuts off their computer or
-				// kills onedriver prematurely
-				contents, _ := json.Marshal(session)
-				b, _ := tx.CreateBucketIfNotExists(bucketUploads)
-				return b.Put([]byte(session.ID), contents)
-			})
+			u.persistSession(session)
+			u.sessionsMutex.Lock()
 			u.sessions[session.ID] = session
+			u.sessionsMutex.Unlock()
+			if _, waiting := u.superseded[session.ID]; !waiting {
+				u.enqueue(session)
+			}
 
 		case cancelID := <-u.deletionQueue: // remove uploads for deleted items
 			u.finishUpload(cancelID)
 
-		case <-ticker.C: // periodically start uploads, or remove them if done/failed
+		case done := <-u.barrier:
+			close(done)
+
+		case <-u.wakeup:
+
+		case <-u.stop:
+			return
+
+		case session := <-u.done: // an upload finished or failed
+			session.running = false
+			atomic.AddInt32(&u.inFlight, -1)
+			large := session.Size >= uploadLargeSize
+			if large {
+				u.largeInFlight--
+			}
+			sharedUploadSlots.release(large)
+			// sessions that were cancelled in the meantime are done
+			if u.sessions[session.OldID] == session {
+				u.uploadDone(session)
+			} else if u.superseded[session.OldID] == session {
+				u.supersededDone(session)
+			}
+
+		case <-ticker.C:
 			for _, session := range u.sessions {
-				switch session.getState() {
-				case uploadNotStarted:
-					// max active upload sessions are capped at this limit for faster
-					// uploads of individual files and also to prevent possible server-
-					// side throttling that can cause errors.
-					if u.inFlight < maxUploadsInFlight {
-						u.inFlight++
-						go session.Upload(u.auth)
-					}
-
-				case uploadErrored:
-					session.retries++
-					if session.retries > 5 {
-						log.WithFields(log.Fields{
-							"id":      session.ID,
-							"name":    session.Name,
-							"err":     session.Error(),
-							"retries": session.retries,
-						}).Error(
-							"Upload session failed too many times, cancelling session. " +
-								"This is a bug - please file a bug report!",
-						)
-						u.finishUpload(session.ID)
-					}
-
-					log.WithFields(log.Fields{
-						"id":   session.ID,
-						"name": session.Name,
-						"err":  session.Error(),
-					}).Warning("Upload session failed, will retry from beginning.")
-					session.cancel(u.auth) // cancel large sessions
-					session.setState(uploadNotStarted, nil)
-
-				case uploadComplete:
-					log.WithFields(log.Fields{
-						"id":    session.ID,
-						"oldID": session.OldID,
-						"name":  session.Name,
-					}).Debug("Upload completed!")
-
-					// ID changed during upload, move to new ID
-					if session.OldID != session.ID {
-						err := u.cache.MoveID(session.OldID, session.ID)
-						if err != nil {
-							log.WithFields(log.Fields{
-								"id":    session.ID,
-								"oldID": session.OldID,
-								"name":  session.Name,
-								"err":   err,
-							}).Error("Could not move inode to new ID!")
-						}
-					}
-
-					// inode will exist at the new ID now, but we check if inode
-					// is nil to see if the item has been deleted since upload start
-					if inode := u.cache.GetID(session.ID); inode != nil {
-						inode.mutex.Lock()
-						inode.DriveItem.ETag = session.ETag
-						inode.mutex.Unlock()
-					}
-
-					// the old ID is the one that was used to add it to the queue.
-					// cleanup the session.
-					u.finishUpload(session.OldID)
+				if session.running && session.uploadURL() != session.persistedURL {
+					// a large upload got an upload session, save it so the
+					// upload can be resumed after a restart
+					u.persistSession(session)
 				}
 			}
 		}
+		u.dispatch()
 	}
 }
 
+// enqueue adds a session to the queue of uploads waiting to be started.
+func (u *UploadManager) enqueue(session *UploadSession) {
+	if session.queued.IsZero() {
+		session.queued = time.Now()
+	}
+	heap.Push(&u.pending, session)
+}
+
+// dispatch starts as many queued uploads as there is capacity for.
+func (u *UploadManager) dispatch() {
+	now := time.Now()
+	var later []*UploadSession
+	for u.pending.Len() > 0 && int(u.inFlight) < u.limiter.capacity() {
+		session := heap.Pop(&u.pending).(*UploadSession)
+		large := session.Size >= uploadLargeSize
+		if now.Before(session.notBefore) || (large && u.largeInFlight >= maxLargeUploadsInFlight) ||
+			!sharedUploadSlots.acquire(u, large) {
+			later = append(later, session)
+			continue
+		}
+		atomic.AddInt32(&u.inFlight, 1)
+		if large {
+			u.largeInFlight++
+		}
+		session.running = true
+		go func(session *UploadSession) {
+			session.Upload(u.auth)
+			select {
+			case u.done <- session:
+			case <-u.stop:
+				sharedUploadSlots.release(large)
+			}
+		}(session)
+	}
+	for _, session := range later {
+		heap.Push(&u.pending, session)
+	}
+}
+
+// uploadDone handles a session whose Upload has returned, either by finishing
+// it or by queueing it to be retried.
+func (u *UploadManager) uploadDone(session *UploadSession) {
+	switch session.getState() {
+	case uploadErrored:
+		var graphErr *graph.Error
+		if errors.As(session.getError(), &graphErr) && graphErr.Throttled() {
+			// being throttled is not the session's fault, don't count it
+			u.limiter.throttled(graphErr.RetryAfter)
+			log.WithFields(log.Fields{
+				"id":         session.ID,
+				"name":       session.Name,
+				"retryAfter": graphErr.RetryAfter,
+				"limit":      int(u.limiter.limit),
+			}).Warning("Uploads are being throttled by the server, backing off.")
+			session.notBefore = u.limiter.pausedUntil
+		} else {
+			session.retries++
+			if session.retries > 5 {
+				log.WithFields(log.Fields{
+					"id":      session.ID,
+					"name":    session.Name,
+					"err":     session.Error(),
+					"retries": session.retries,
+				}).Error(
+					"Upload session failed too many times, cancelling session. " +
+						"This is a bug - please file a bug report!",
+				)
+				u.finishUpload(session.OldID)
+				return
+			}
+			log.WithFields(log.Fields{
+				"id":   session.ID,
+				"name": session.Name,
+				"err":  session.Error(),
+			}).Warning("Upload session failed, will retry.")
+			session.notBefore = time.Now().Add(time.Duration(1<<uint(session.retries)) * time.Second)
+		}
+		// large uploads keep their upload URL and resume where they left off
+		session.setState(uploadNotStarted, nil)
+		u.enqueue(session)
+
+	case uploadComplete:
+		u.limiter.success()
+		log.WithFields(log.Fields{
+			"id":    session.ID,
+			"oldID": session.OldID,
+			"name":  session.Name,
+		}).Debug("Upload completed!")
+
+		// ID changed during upload, move to new ID
+		if session.OldID != session.ID {
+			err := u.cache.MoveID(session.OldID, session.ID)
+			if err != nil {
+				log.WithFields(log.Fields{
+					"id":    session.ID,
+					"oldID": session.OldID,
+					"name":  session.Name,
+					"err":   err,
+				}).Error("Could not move inode to new ID!")
+			}
+		}
+
+		// inode will exist at the new ID now, but we check if inode
+		// is nil to see if the item has been deleted since upload start
+		if inode := u.cache.GetID(session.ID); inode != nil {
+			inode.mutex.Lock()
+			inode.DriveItem.ETag = session.ETag
+			inode.DriveItem.CTag = session.CTag
+			inode.mutex.Unlock()
+			u.cache.markDirty(session.ID)
+		}
+
+		// the old ID is the one that was used to add it to the queue.
+		// cleanup the session.
+		u.finishUpload(session.OldID)
+	}
+}
+
+// supersededDone starts the session that replaced an upload once the replaced
+// upload has returned.
+func (u *UploadManager) supersededDone(old *UploadSession) {
+	delete(u.superseded, old.OldID)
+	old.removeSnapshot()
+	session, exists := u.sessions[old.OldID]
+	if !exists {
+		// cancelled in the meantime
+		return
+	}
+	if old.getState() == uploadComplete && old.OldID != old.ID {
+		// the file was created on the server, the new session has to update it
+		// rather than create another one
+		if err := u.cache.MoveID(old.OldID, old.ID); err != nil {
+			log.WithFields(log.Fields{
+				"id":    old.ID,
+				"oldID": old.OldID,
+				"name":  old.Name,
+				"err":   err,
+			}).Error("Could not move inode to new ID!")
+		}
+		u.forgetSession(old.OldID)
+		u.sessionsMutex.Lock()
+		delete(u.sessions, old.OldID)
+		session.ID = old.ID
+		session.OldID = old.ID
+		u.sessions[session.ID] = session
+		u.sessionsMutex.Unlock()
+		u.persistSession(session)
+	}
+	u.enqueue(session)
+}
+
+// wake makes the upload loop try to start queued uploads again. Safe to call from
+// any goroutine.
+func (u *UploadManager) wake() {
+	select {
+	case u.wakeup <- struct{}{}:
+	default:
+	}
+}
+
+// Stop shuts down the upload loop and returns once it is done. Uploads that are
+// still queued or in progress stay on disk and are resumed by the next
+// UploadManager created from the same database.
+func (u *UploadManager) Stop() {
+	close(u.stop)
+	<-u.stopped
+}
+
 // QueueUpload queues an item for upload.
 func (u *UploadManager) QueueUpload(inode *Inode) error {
 	session, err := NewUploadSession(inode)
-	if err == nil {
-		u.queue <- session
+	if err != nil {
+		return err
+	}
+	u.cache.noteActivity()
+	select {
+	case u.queue <- session:
+		return nil
+	case <-u.stop:
+		session.removeSnapshot()
+		return errors.New("upload manager was stopped")
+	}
+}
+
+// sync waits until the upload loop has processed (and persisted) every upload
+// queued before it was called.
+func (u *UploadManager) sync() {
+	done := make(chan struct{})
+	select {
+	case u.barrier <- done:
+		<-done
+	case <-u.stop:
 	}
-	return err
 }
 
 // CancelUpload is used to kill any pending uploads for a session
@@ -178,15 +442,29 @@ func (u *UploadManager) CancelUpload(id string) {
 func (u *UploadManager) finishUpload(id string) {
 	if session, exists := u.sessions[id]; exists {
 		session.cancel(u.auth)
+		session.removeSnapshot()
+		u.pending.remove(session)
 	}
-	u.db.Update(func(tx *bolt.Tx) error {
-		if b := tx.Bucket(bucketUploads); b != nil {
-			b.Delete([]byte(id))
-		}
-		return nil
-	})
-	if u.inFlight > 0 {
-		u.inFlight--
-	}
+	u.forgetSession(id)
+	u.sessionsMutex.Lock()
 	delete(u.sessions, id)
+	u.sessionsMutex.Unlock()
+}
+
+// Stats returns the number of uploads that are queued or in progress, and how
+// many of those are in progress. Safe to call from any goroutine.
+func (u *UploadManager) Stats() (queued int, inFlight int) {
+	u.sessionsMutex.RLock()
+	queued = len(u.sessions)
+	u.sessionsMutex.RUnlock()
+	return queued, int(atomic.LoadInt32(&u.inFlight))
+}
+
+// IsQueued returns true if an item has an upload that is queued or in progress.
+// Safe to call from any goroutine.
+func (u *UploadManager) IsQueued(id string) bool {
+	u.sessionsMutex.RLock()
+	defer u.sessionsMutex.RUnlock()
+	_, exists := u.sessions[id]
+	return exists
 }
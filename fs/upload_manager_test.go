@@ -2,6 +2,7 @@ package fs
 
 import (
 	"bytes"
+	"container/heap"
 	"encoding/json"
 	"errors"
 	"fmt"
@@ -107,3 +108,84 @@ func TestRepeatedUploads(t *testing.T) {
 		}
 	}
 }
+
+// Small uploads should be started before large ones, and in the order they were
+// queued otherwise.
+func TestUploadQueueOrder(t *testing.T) {
+	t.Parallel()
+	now := time.Now()
+	sessions := []*UploadSession{
+		{ID: "large", Size: uploadLargeSize, queued: now},
+		{ID: "small-late", Size: 10, queued: now.Add(2 * time.Second)},
+		{ID: "small-early", Size: 10, queued: now.Add(time.Second)},
+	}
+	var queue uploadQueue
+	for _, session := range sessions {
+		heap.Push(&queue, session)
+	}
+	for _, expected := range []string{"small-early", "small-late", "large"} {
+		if id := heap.Pop(&queue).(*UploadSession).ID; id != expected {
+			t.Fatalf("Expected %s to be started next, got %s.", expected, id)
+		}
+	}
+}
+
+// The number of uploads in flight should shrink when throttled and slowly grow
+// back afterwards.
+func TestUploadLimiter(t *testing.T) {
+	t.Parallel()
+	limiter := newUploadLimiter()
+	initial := limiter.capacity()
+	limiter.throttled(time.Millisecond)
+	time.Sleep(2 * time.Millisecond)
+	if limiter.capacity() >= initial {
+		t.Fatalf("Limit did not decrease after throttling: %d", limiter.capacity())
+	}
+	for i := 0; i < 100; i++ {
+		limiter.success()
+	}
+	if limiter.capacity() != maxUploadsInFlight {
+		t.Fatalf("Limit did not recover to the maximum: %d", limiter.capacity())
+	}
+	limiter.throttled(time.Hour)
+	if limiter.capacity() != 0 {
+		t.Fatal("Uploads should be paused while throttled.")
+	}
+}
+
+// Uploads of different managers should share the slots of the process, and
+// managers that were turned away should be woken up once a slot frees up.
+func TestUploadSlots(t *testing.T) {
+	t.Parallel()
+	slots := &uploadSlots{waiting: make(map[*UploadManager]bool)}
+	first := &UploadManager{wakeup: make(chan struct{}, 1)}
+	second := &UploadManager{wakeup: make(chan struct{}, 1)}
+	for i := 0; i < maxLargeUploadsInFlight; i++ {
+		if !slots.acquire(first, true) {
+			t.Fatal("Could not start a large upload with free slots.")
+		}
+	}
+	if slots.acquire(second, true) {
+		t.Fatal("Large uploads of all managers should share one limit.")
+	}
+	for i := maxLargeUploadsInFlight; i < maxUploadsInFlight; i++ {
+		if !slots.acquire(second, false) {
+			t.Fatal("Small uploads should not be held up by large ones.")
+		}
+	}
+	if slots.acquire(first, false) {
+		t.Fatal("Started more uploads than there are slots.")
+	}
+
+	slots.release(true)
+	for _, manager := range []*UploadManager{first, second} {
+		select {
+		case <-manager.wakeup:
+		default:
+			t.Fatal("Manager waiting for a slot was not woken up.")
+		}
+	}
+	if !slots.acquire(second, true) {
+		t.Fatal("Could not take a slot that was released.")
+	}
+}
@@ -0,0 +1,158 @@
+package fs
+
+import (
+	"container/heap"
+	"sync"
+	"time"
+)
+
+const (
+	// bounds for the number of uploads in flight at once, which adapts to
+	// throttling by the server
+	minUploadsInFlight = 1
+	maxUploadsInFlight = 10
+
+	// large uploads are capped separately so they can't crowd out small ones
+	maxLargeUploadsInFlight = 2
+
+	// how long to hold off on new uploads when throttled without a Retry-After
+	uploadThrottleBackoff = 10 * time.Second
+)
+
+// uploadQueue is a priority queue of upload sessions waiting to be started.
+// Small uploads (usually files that were just saved) go before large ones, and
+// sessions of the same kind are started in the order they were queued.
+type uploadQueue []*UploadSession
+
+func (q uploadQueue) Len() int {
+	return len(q)
+}
+
+func (q uploadQueue) Less(a, b int) bool {
+	largeA, largeB := q[a].Size >= uploadLargeSize, q[b].Size >= uploadLargeSize
+	if largeA != largeB {
+		return largeB
+	}
+	return q[a].queued.Before(q[b].queued)
+}
+
+func (q uploadQueue) Swap(a, b int) {
+	q[a], q[b] = q[b], q[a]
+	q[a].queueIndex = a
+	q[b].queueIndex = b
+}
+
+func (q *uploadQueue) Push(x interface{}) {
+	session := x.(*UploadSession)
+	session.queueIndex = len(*q)
+	*q = append(*q, session)
+}
+
+func (q *uploadQueue) Pop() interface{} {
+	old := *q
+	session := old[len(old)-1]
+	old[len(old)-1] = nil
+	session.queueIndex = -1
+	*q = old[:len(old)-1]
+	return session
+}
+
+// contains returns true if a session is waiting in the queue.
+func (q uploadQueue) contains(session *UploadSession) bool {
+	i := session.queueIndex
+	return i >= 0 && i < len(q) && q[i] == session
+}
+
+// remove takes a session out of the queue, if it is in it.
+func (q *uploadQueue) remove(session *UploadSession) {
+	if q.contains(session) {
+		heap.Remove(q, session.queueIndex)
+	}
+}
+
+// uploadLimiter adapts the number of uploads in flight to how the server is
+// coping: the limit grows by one for every limit's worth of successful uploads,
+// and is halved whenever we are throttled (AIMD).
+type uploadLimiter struct {
+	limit       float64
+	pausedUntil time.Time // no new uploads are started before this
+}
+
+func newUploadLimiter() *uploadLimiter {
+	return &uploadLimiter{limit: 5}
+}
+
+// capacity is the number of uploads that may currently be in flight.
+func (l *uploadLimiter) capacity() int {
+	if time.Now().Before(l.pausedUntil) {
+		return 0
+	}
+	return int(l.limit)
+}
+
+func (l *uploadLimiter) success() {
+	l.limit += 1 / l.limit
+	if l.limit > maxUploadsInFlight {
+		l.limit = maxUploadsInFlight
+	}
+}
+
+// throttled backs off after the server asked us to slow down, for retryAfter if
+// it said how long to wait.
+func (l *uploadLimiter) throttled(retryAfter time.Duration) {
+	l.limit /= 2
+	if l.limit < minUploadsInFlight {
+		l.limit = minUploadsInFlight
+	}
+	if retryAfter <= 0 {
+		retryAfter = uploadThrottleBackoff
+	}
+	if until := time.Now().Add(retryAfter); until.After(l.pausedUntil) {
+		l.pausedUntil = until
+	}
+}
+
+// uploadSlots caps the number of uploads in flight across every UploadManager in
+// the process, on top of each manager's own limit. With a single mount this never
+// gets in the way, but mounts served by one daemon share the uplink instead of
+// each starting their own maximum. Managers that were turned away are woken up
+// once a slot frees up.
+type uploadSlots struct {
+	mutex    sync.Mutex
+	inFlight int
+	large    int
+	waiting  map[*UploadManager]bool
+}
+
+var sharedUploadSlots = &uploadSlots{waiting: make(map[*UploadManager]bool)}
+
+// acquire takes a slot for an upload, or returns false and remembers to wake u
+// up later if there is none.
+func (s *uploadSlots) acquire(u *UploadManager, large bool) bool {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	if s.inFlight >= maxUploadsInFlight || (large && s.large >= maxLargeUploadsInFlight) {
+		s.waiting[u] = true
+		return false
+	}
+	s.inFlight++
+	if large {
+		s.large++
+	}
+	return true
+}
+
+// release gives back a slot taken by acquire.
+func (s *uploadSlots) release(large bool) {
+	s.mutex.Lock()
+	s.inFlight--
+	if large {
+		s.large--
+	}
+	waiting := s.waiting
+	s.waiting = make(map[*UploadManager]bool)
+	s.mutex.Unlock()
+	for u := range waiting {
+		u.wake()
+	}
+}
@@ -5,10 +5,11 @@ import (
 	"encoding/json"
 	"errors"
 	"fmt"
+	"io"
 	"io/ioutil"
-	"math"
 	"net/http"
 	"net/url"
+	"os"
 	"strconv"
 	"strings"
 	"sync"
@@ -19,8 +20,20 @@ import (
 )
 
 const (
-	// 10MB is the recommended upload size according to the graph API docs
-	uploadChunkSize uint64 = 10 * 1024 * 1024
+	// chunks of large uploads must be a multiple of 320KiB in size
+	uploadChunkUnit uint64 = 320 * 1024
+
+	// 10MB is the recommended upload size according to the graph API docs, and
+	// is the size we start at before adjusting to the measured bandwidth
+	uploadChunkSize = 32 * uploadChunkUnit
+
+	// bounds for the chunk size. The API allows up to 60MiB, but we keep up to
+	// two chunks in memory at a time.
+	uploadMinChunkSize = 4 * uploadChunkUnit
+	uploadMaxChunkSize = 128 * uploadChunkUnit
+
+	// chunks are sized to take roughly this long to send
+	uploadChunkDuration = 10 * time.Second
 
 	// uploads larget than 4MB must use a formal upload session
 	uploadLargeSize uint64 = 4 * 1024 * 1024
@@ -36,7 +49,8 @@ const (
 
 // UploadSession contains a snapshot of the file we're uploading. We have to
 // take the snapshot or the file may have changed on disk during upload (which
-// would break the upload). It is not recommended to directly deserialize into
+// would break the upload). The snapshot is a copy of the content on disk, so
+// that large files are never held in memory. It is not recommended to directly deserialize into
 // this structure from API responses in case Microsoft ever adds a size, data,
 // or modTime field to the response.
 type UploadSession struct {
@@ -46,7 +60,8 @@ type UploadSession struct {
 	Name               string    `json:"name"`
 	ExpirationDateTime time.Time `json:"expirationDateTime"`
 	Size               uint64    `json:"size,omitempty"`
-	Data               []byte    `json:"data,omitempty"`
+	Snapshot           string    `json:"snapshot,omitempty"` // path to a copy of the content
+	Data               []byte    `json:"data,omitempty"`     // only read to migrate old sessions
 	SHA1Hash           string    `json:"sha1hash,omitempty"`
 	QuickXORHash       string    `json:"quickxorhash,omitempty"`
 	ModTime            time.Time `json:"modTime,omitempty"`
@@ -55,8 +70,16 @@ type UploadSession struct {
 	mutex     sync.Mutex
 	UploadURL string `json:"uploadUrl"`
 	ETag      string `json:"eTag,omitempty"`
+	CTag      string `json:"cTag,omitempty"`
 	state     int
-	error     // embedded error tracks errors that killed an upload
+
+	// only used by UploadManager
+	persistedURL string    // UploadURL as last written to disk
+	queued       time.Time // when the session was queued
+	notBefore    time.Time // don't retry before this
+	queueIndex   int       // position in the upload queue
+	running      bool      // an Upload is in progress
+	error                  // embedded error tracks errors that killed an upload
 }
 
 // MarshalJSON implements a custom JSON marshaler to avoid race conditions
@@ -86,6 +109,13 @@ func (u *UploadSession) getState() int {
 	return u.state
 }
 
+// getError returns the error that killed the last upload attempt, if any.
+func (u *UploadSession) getError() error {
+	u.mutex.Lock()
+	defer u.mutex.Unlock()
+	return u.error
+}
+
 // setState is just a helper method to set the UploadSession state and make error checking
 // a little more straightforwards.
 func (u *UploadSession) setState(state int, err error) error {
@@ -109,47 +139,188 @@ func NewUploadSession(inode *Inode) (*UploadSession, error) {
 		ParentID: inode.DriveItem.Parent.ID,
 		Name:     inode.DriveItem.Name,
 		Size:     inode.DriveItem.Size,
-		Data:     nil,
 		ModTime:  *inode.DriveItem.ModTime,
 	}
-	if inode.data == nil {
-		session.Data = inode.cache.GetContent(inode.DriveItem.ID)
-		if session.Data == nil {
-			log.WithFields(log.Fields{
-				"id":   inode.DriveItem.ID,
-				"name": inode.DriveItem.Name,
-			}).Error("Tried to load file data from disk but could not find any!")
-			return nil, errors.New("inode data was nil")
-		}
-	} else {
-		session.Data = make([]byte, inode.DriveItem.Size)
-		copy(session.Data, *inode.data)
+	snapshot, err := inode.cache.content.Snapshot(inode.DriveItem.ID)
+	if err != nil {
+		log.WithFields(log.Fields{
+			"id":   inode.DriveItem.ID,
+			"name": inode.DriveItem.Name,
+			"err":  err,
+		}).Error("Tried to load file data from disk but could not find any!")
+		return nil, errors.New("inode data was nil")
 	}
+	session.Snapshot = snapshot
 
 	if inode.DriveItem.File != nil {
 		session.SHA1Hash = inode.DriveItem.File.Hashes.SHA1Hash
 		session.QuickXORHash = inode.DriveItem.File.Hashes.QuickXorHash
 	} else {
-		// compute both hashes for now, session does not know the drivetype
-		session.SHA1Hash = graph.SHA1Hash(&session.Data)
-		session.QuickXORHash = graph.QuickXORHash(&session.Data)
+		if err = session.hashSnapshot(); err != nil {
+			session.removeSnapshot()
+			return nil, err
+		}
 	}
 	return &session, nil
 }
 
+// source opens the content to be uploaded. The returned function must be called
+// once done with it.
+func (u *UploadSession) source() (io.ReaderAt, func(), error) {
+	file, err := os.Open(u.Snapshot)
+	if err != nil {
+		return nil, nil, err
+	}
+	return file, func() { file.Close() }, nil
+}
+
+// hashSnapshot computes the hashes of the session's snapshot. Both are computed
+// for now, since the session does not know the drivetype.
+func (u *UploadSession) hashSnapshot() error {
+	src, done, err := u.source()
+	if err != nil {
+		return err
+	}
+	defer done()
+	defer acquireHashSlot()()
+	u.SHA1Hash = graph.SHA1HashStream(io.NewSectionReader(src, 0, int64(u.Size)))
+	u.QuickXORHash = graph.QuickXORHashStream(io.NewSectionReader(src, 0, int64(u.Size)))
+	return nil
+}
+
+// removeSnapshot deletes the session's copy of the content once it is no longer
+// needed.
+func (u *UploadSession) removeSnapshot() {
+	u.mutex.Lock()
+	snapshot := u.Snapshot
+	u.mutex.Unlock()
+	if snapshot == "" {
+		return
+	}
+	if err := os.Remove(snapshot); err != nil && !os.IsNotExist(err) {
+		log.WithFields(log.Fields{
+			"id":       u.ID,
+			"snapshot": snapshot,
+			"err":      err,
+		}).Warn("Could not remove upload snapshot.")
+	}
+}
+
+// uploadStatus is the state of a large upload session on the server.
+// https://docs.microsoft.com/en-us/onedrive/developer/rest-api/api/driveitem_createuploadsession#resuming-an-in-progress-upload
+type uploadStatus struct {
+	ExpirationDateTime time.Time `json:"expirationDateTime"`
+	NextExpectedRanges []string  `json:"nextExpectedRanges"`
+}
+
+// uploadURL returns the URL of the session's large upload, if any.
+func (u *UploadSession) uploadURL() string {
+	u.mutex.Lock()
+	defer u.mutex.Unlock()
+	return u.UploadURL
+}
+
+// canResume returns true if the session has an upload URL that has not expired
+// yet, so that an interrupted upload can pick up where it left off.
+func (u *UploadSession) canResume() bool {
+	u.mutex.Lock()
+	defer u.mutex.Unlock()
+	return u.UploadURL != "" && time.Until(u.ExpirationDateTime) > time.Minute
+}
+
+// resumeOffset asks the server how much of the upload it has received already,
+// and returns the offset to continue from.
+func (u *UploadSession) resumeOffset() (uint64, error) {
+	resp, err := graph.NewClient(15 * time.Second).Get(u.uploadURL())
+	if err != nil {
+		return 0, err
+	}
+	defer resp.Body.Close()
+	body, _ := ioutil.ReadAll(resp.Body)
+	if resp.StatusCode != http.StatusOK {
+		return 0, fmt.Errorf("HTTP %d - could not get upload session status", resp.StatusCode)
+	}
+	var status uploadStatus
+	if err = json.Unmarshal(body, &status); err != nil {
+		return 0, err
+	}
+	if len(status.NextExpectedRanges) == 0 {
+		return 0, errors.New("upload session does not expect any more data")
+	}
+	// chunks are always sent in order, so only the first range is ever missing
+	start := strings.SplitN(status.NextExpectedRanges[0], "-", 2)[0]
+	offset, err := strconv.ParseUint(start, 10, 64)
+	if err != nil {
+		return 0, err
+	}
+	if offset >= u.Size {
+		return 0, errors.New("upload session expects data past the end of the file")
+	}
+	u.mutex.Lock()
+	u.ExpirationDateTime = status.ExpirationDateTime
+	u.mutex.Unlock()
+	return offset, nil
+}
+
+// uploadChunkData is a chunk of content read ahead of being sent.
+type uploadChunkData struct {
+	offset uint64
+	data   []byte
+	err    error
+}
+
+// readChunk reads a chunk of content in the background, so that the next chunk
+// can be prepared while the current one is sent.
+func (u *UploadSession) readChunk(src io.ReaderAt, offset uint64, size uint64) <-chan uploadChunkData {
+	out := make(chan uploadChunkData, 1)
+	if offset+size > u.Size {
+		size = u.Size - offset
+	}
+	go func() {
+		data := make([]byte, size)
+		n, err := src.ReadAt(data, int64(offset))
+		if err == io.EOF && n == len(data) {
+			err = nil
+		}
+		out <- uploadChunkData{offset: offset, data: data, err: err}
+	}()
+	return out
+}
+
+// nextChunkSize adjusts the chunk size so that a chunk takes roughly
+// uploadChunkDuration to send at the bandwidth measured for the last one.
+func nextChunkSize(current uint64, sent uint64, elapsed time.Duration) uint64 {
+	if elapsed <= 0 || sent < current {
+		// final chunk, or nothing worth measuring
+		return current
+	}
+	ideal := uint64(float64(sent) / elapsed.Seconds() * uploadChunkDuration.Seconds())
+	// move halfway towards the ideal size to smooth out noisy measurements
+	size := (current + ideal) / 2
+	size -= size % uploadChunkUnit
+	if size < uploadMinChunkSize {
+		return uploadMinChunkSize
+	}
+	if size > uploadMaxChunkSize {
+		return uploadMaxChunkSize
+	}
+	return size
+}
+
 // cancel the upload session by deleting the temp file at the endpoint.
 func (u *UploadSession) cancel(auth *graph.Auth) {
-	u.mutex.Lock()
 	// small upload sessions will also have an empty UploadURL in addition to
 	// uninitialized large file uploads.
-	nonemptyURL := u.UploadURL != ""
-	u.mutex.Unlock()
-	if nonemptyURL {
+	uploadURL := u.uploadURL()
+	if uploadURL != "" {
 		state := u.getState()
 		if state == uploadStarted || state == uploadErrored {
 			// dont care about result, this is purely us being polite to the server
-			go graph.Delete(u.UploadURL, auth)
+			go graph.Delete(uploadURL, auth)
 		}
+		u.mutex.Lock()
+		u.UploadURL = ""
+		u.mutex.Unlock()
 	}
 }
 
@@ -157,33 +328,28 @@ func (u *UploadSession) cancel(auth *graph.Auth) {
 // to make things this way because the internal Put func doesn't work all that
 // well when we need to add custom headers. Will return without an error if
 // irrespective of HTTP status (errors are reserved for stuff that prevented
-// the HTTP request at all).
-func (u *UploadSession) uploadChunk(auth *graph.Auth, offset uint64) ([]byte, int, error) {
-	if u.UploadURL == "" {
+// the HTTP request at all), except when the server is throttling us, which is
+// returned as a *graph.Error so the upload manager can back off.
+func (u *UploadSession) uploadChunk(auth *graph.Auth, offset uint64, data []byte) ([]byte, int, error) {
+	uploadURL := u.uploadURL()
+	if uploadURL == "" {
 		return nil, -1, errors.New("UploadSession UploadURL cannot be empty")
 	}
-
-	// how much of the file are we going to upload?
-	end := offset + uploadChunkSize
-	var reqChunkSize uint64
+	end := offset + uint64(len(data))
 	if end > u.Size {
-		end = u.Size
-		reqChunkSize = end - offset + 1
-	}
-	if offset > u.Size {
-		return nil, -1, errors.New("offset cannot be larger than DriveItem size")
+		return nil, -1, errors.New("chunk cannot extend past the end of the DriveItem")
 	}
 
 	auth.Refresh()
 
-	client := &http.Client{}
+	client := graph.NewClient(0)
 	request, _ := http.NewRequest(
 		"PUT",
-		u.UploadURL,
-		bytes.NewReader((u.Data)[offset:end]),
+		uploadURL,
+		bytes.NewReader(data),
 	)
 	// no Authorization header - it will throw a 401 if present
-	request.Header.Add("Content-Length", strconv.Itoa(int(reqChunkSize)))
+	request.Header.Add("Content-Length", strconv.Itoa(len(data)))
 	frags := fmt.Sprintf("bytes %d-%d/%d", offset, end-1, u.Size)
 	log.WithField("id", u.ID).Info("Uploading ", frags)
 	request.Header.Add("Content-Range", frags)
@@ -195,6 +361,15 @@ func (u *UploadSession) uploadChunk(auth *graph.Auth, offset uint64) ([]byte, in
 	}
 	defer resp.Body.Close()
 	response, _ := ioutil.ReadAll(resp.Body)
+	throttle := &graph.Error{
+		StatusCode: resp.StatusCode,
+		Code:       "throttled",
+		Message:    string(response),
+		RetryAfter: graph.RetryAfter(resp.Header),
+	}
+	if throttle.Throttled() {
+		return response, resp.StatusCode, throttle
+	}
 	return response, resp.StatusCode, nil
 }
 
@@ -208,6 +383,12 @@ func (u *UploadSession) Upload(auth *graph.Auth) error {
 	}).Debug("Uploading file.")
 	u.setState(uploadStarted, nil)
 
+	src, done, err := u.source()
+	if err != nil {
+		return u.setState(uploadErrored, err)
+	}
+	defer done()
+
 	var uploadPath string
 	var resp []byte
 	if u.Size < uploadLargeSize {
@@ -228,64 +409,102 @@ func (u *UploadSession) Upload(auth *graph.Auth) error {
 			)
 		}
 		// small files handled in this block
-		var err error
-		resp, err = graph.Put(uploadPath, auth, bytes.NewReader(u.Data))
+		resp, err = graph.Put(uploadPath, auth, io.NewSectionReader(src, 0, int64(u.Size)))
 		if err != nil && strings.Contains(err.Error(), "resourceModified") {
 			// retry the request after a second, likely the server is having issues
 			time.Sleep(time.Second)
-			resp, err = graph.Put(uploadPath, auth, bytes.NewReader(u.Data))
+			resp, err = graph.Put(uploadPath, auth, io.NewSectionReader(src, 0, int64(u.Size)))
 		}
 		if err != nil {
 			return u.setState(uploadErrored, err)
 		}
 	} else {
-		if isLocalID(u.ID) {
-			uploadPath = fmt.Sprintf(
-				"/me/drive/items/%s:/%s:/createUploadSession",
-				url.PathEscape(u.ParentID),
-				url.PathEscape(u.Name),
-			)
+		// resume the existing upload session if there is one
+		offset := uint64(0)
+		resumed := false
+		if u.canResume() {
+			if offset, err = u.resumeOffset(); err == nil {
+				resumed = true
+				log.WithFields(log.Fields{
+					"id":     u.ID,
+					"name":   u.Name,
+					"offset": offset,
+				}).Info("Resuming upload session.")
+			} else {
+				log.WithFields(log.Fields{
+					"id":   u.ID,
+					"name": u.Name,
+					"err":  err,
+				}).Info("Could not resume upload session, starting over.")
+				u.cancel(auth)
+				offset = 0
+			}
 		} else {
-			uploadPath = fmt.Sprintf(
-				"/me/drive/items/%s/createUploadSession",
-				url.PathEscape(u.ID),
-			)
-		}
-		sessionPostData, _ := json.Marshal(UploadSessionPost{
-			ConflictBehavior: "replace",
-			FileSystemInfo: FileSystemInfo{
-				LastModifiedDateTime: u.ModTime,
-			},
-		})
-		resp, err := graph.Post(uploadPath, auth, bytes.NewReader(sessionPostData))
-		if err != nil {
-			return u.setState(uploadErrored, err)
+			u.cancel(auth)
 		}
 
-		// populate UploadURL/expiration - we unmarshal into a fresh session here
-		// just in case the API does something silly at a later date and overwrites
-		// a field it shouldn't.
-		tmp := UploadSession{}
-		if err = json.Unmarshal(resp, &tmp); err != nil {
-			return u.setState(uploadErrored, err)
+		if !resumed {
+			if isLocalID(u.ID) {
+				uploadPath = fmt.Sprintf(
+					"/me/drive/items/%s:/%s:/createUploadSession",
+					url.PathEscape(u.ParentID),
+					url.PathEscape(u.Name),
+				)
+			} else {
+				uploadPath = fmt.Sprintf(
+					"/me/drive/items/%s/createUploadSession",
+					url.PathEscape(u.ID),
+				)
+			}
+			sessionPostData, _ := json.Marshal(UploadSessionPost{
+				ConflictBehavior: "replace",
+				FileSystemInfo: FileSystemInfo{
+					LastModifiedDateTime: u.ModTime,
+				},
+			})
+			resp, err = graph.Post(uploadPath, auth, bytes.NewReader(sessionPostData))
+			if err != nil {
+				return u.setState(uploadErrored, err)
+			}
+
+			// populate UploadURL/expiration - we unmarshal into a fresh session here
+			// just in case the API does something silly at a later date and overwrites
+			// a field it shouldn't.
+			tmp := UploadSession{}
+			if err = json.Unmarshal(resp, &tmp); err != nil {
+				return u.setState(uploadErrored, err)
+			}
+			u.mutex.Lock()
+			u.UploadURL = tmp.UploadURL
+			u.ExpirationDateTime = tmp.ExpirationDateTime
+			u.mutex.Unlock()
 		}
-		u.mutex.Lock()
-		u.UploadURL = tmp.UploadURL
-		u.ExpirationDateTime = tmp.ExpirationDateTime
-		u.mutex.Unlock()
 
-		// api upload session created successfully, now do actual content upload
+		// api upload session created successfully, now do actual content upload.
+		// Chunks have to be sent in order, but the next one is read from disk
+		// while the current one is being sent.
 		var status int
-		nchunks := int(math.Ceil(float64(u.Size) / float64(uploadChunkSize)))
-		for i := 0; i < nchunks; i++ {
-			resp, status, err = u.uploadChunk(auth, uint64(i)*uploadChunkSize)
+		chunkSize := uploadChunkSize
+		next := u.readChunk(src, offset, chunkSize)
+		for {
+			chunk := <-next
+			if chunk.err != nil {
+				return u.setState(uploadErrored, chunk.err)
+			}
+			end := chunk.offset + uint64(len(chunk.data))
+			if end < u.Size {
+				next = u.readChunk(src, end, chunkSize)
+			}
+
+			start := time.Now()
+			resp, status, err = u.uploadChunk(auth, chunk.offset, chunk.data)
 			if err != nil {
 				log.WithFields(log.Fields{
-					"id":      u.ID,
-					"name":    u.Name,
-					"chunk":   i,
-					"nchunks": nchunks,
-					"err":     err,
+					"id":     u.ID,
+					"name":   u.Name,
+					"offset": chunk.offset,
+					"size":   u.Size,
+					"err":    err,
 				}).Error("Error during chunk upload.")
 				return u.setState(uploadErrored, err)
 			}
@@ -294,14 +513,15 @@ func (u *UploadSession) Upload(auth *graph.Auth) error {
 			// exit this loop unless it receives a non 5xx error or serious failure
 			for backoff := 1; status >= 500; backoff *= 2 {
 				log.WithFields(log.Fields{
-					"id":      u.ID,
-					"name":    u.Name,
-					"chunk":   i,
-					"nchunks": nchunks,
-					"status":  status,
+					"id":     u.ID,
+					"name":   u.Name,
+					"offset": chunk.offset,
+					"size":   u.Size,
+					"status": status,
 				}).Errorf("The OneDrive server is having issues, retrying chunk upload in %ds.", backoff)
 				time.Sleep(time.Duration(backoff) * time.Second)
-				resp, status, err = u.uploadChunk(auth, uint64(i)*uploadChunkSize)
+				start = time.Now()
+				resp, status, err = u.uploadChunk(auth, chunk.offset, chunk.data)
 				if err != nil { // a serious, non 4xx/5xx error
 					log.WithFields(log.Fields{
 						"id":     u.ID,
@@ -313,10 +533,19 @@ func (u *UploadSession) Upload(auth *graph.Auth) error {
 				}
 			}
 
-			// handle client-side errors
+			// handle client-side errors, the session cannot be resumed after these
 			if status >= 400 {
+				u.cancel(auth)
 				return u.setState(uploadErrored, errors.New(string(resp)))
 			}
+			if end >= u.Size {
+				// the server is done with the session once it has everything
+				u.mutex.Lock()
+				u.UploadURL = ""
+				u.mutex.Unlock()
+				break
+			}
+			chunkSize = nextChunkSize(chunkSize, uint64(len(chunk.data)), time.Since(start))
 		}
 	}
 
@@ -337,6 +566,8 @@ func (u *UploadSession) Upload(auth *graph.Auth) error {
 	u.mutex.Lock()
 	u.ID = remote.ID
 	u.ETag = remote.ETag
+	u.CTag = remote.CTag
 	u.mutex.Unlock()
+	u.removeSnapshot()
 	return u.setState(uploadComplete, nil)
 }
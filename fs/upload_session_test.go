@@ -4,6 +4,8 @@ import (
 	"bytes"
 	"context"
 	"io/ioutil"
+	"net/http"
+	"net/http/httptest"
 	"os"
 	"os/exec"
 	"path/filepath"
@@ -152,3 +154,56 @@ func TestUploadSessionLargeFS(t *testing.T) {
 	}
 	t.Fatalf("\nUpload session did not complete successfully!")
 }
+
+// Chunk sizes should follow the measured bandwidth, while staying within bounds
+// and a multiple of 320KiB as required by the API.
+func TestUploadChunkSize(t *testing.T) {
+	t.Parallel()
+	// 10MB in 1s is fast, chunks should grow
+	size := nextChunkSize(uploadChunkSize, uploadChunkSize, time.Second)
+	if size <= uploadChunkSize {
+		t.Errorf("Chunk size did not grow on a fast connection: %d", size)
+	}
+	// 10MB in 100s is slow, chunks should shrink
+	slow := nextChunkSize(uploadChunkSize, uploadChunkSize, 100*time.Second)
+	if slow >= uploadChunkSize {
+		t.Errorf("Chunk size did not shrink on a slow connection: %d", slow)
+	}
+	for _, s := range []uint64{size, slow} {
+		if s%uploadChunkUnit != 0 || s < uploadMinChunkSize || s > uploadMaxChunkSize {
+			t.Errorf("Invalid chunk size: %d", s)
+		}
+	}
+	if s := nextChunkSize(uploadMaxChunkSize, uploadMaxChunkSize, time.Millisecond); s != uploadMaxChunkSize {
+		t.Errorf("Chunk size exceeded the maximum: %d", s)
+	}
+}
+
+// Interrupted uploads should resume from the first range the server is missing.
+func TestUploadResumeOffset(t *testing.T) {
+	t.Parallel()
+	server := httptest.NewServer(http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		w.Write([]byte(`{"expirationDateTime":"2099-01-01T00:00:00Z",` +
+			`"nextExpectedRanges":["10485760-"]}`))
+	}))
+	defer server.Close()
+
+	session := UploadSession{
+		Size:               20 * 1024 * 1024,
+		UploadURL:          server.URL,
+		ExpirationDateTime: time.Now().Add(time.Hour),
+	}
+	if !session.canResume() {
+		t.Fatal("Session with a valid upload URL could not be resumed.")
+	}
+	offset, err := session.resumeOffset()
+	failOnErr(t, err)
+	if offset != 10*1024*1024 {
+		t.Fatalf("Wrong resume offset: %d", offset)
+	}
+
+	session.ExpirationDateTime = time.Now()
+	if session.canResume() {
+		t.Fatal("Session with an expired upload URL should not be resumed.")
+	}
+}
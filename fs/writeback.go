@@ -0,0 +1,195 @@
+package fs
+
+import (
+	"sync"
+	"time"
+
+	log "github.com/sirupsen/logrus"
+	bolt "go.etcd.io/bbolt"
+)
+
+// writeBack delays uploads of files that were just closed until they have not
+// been touched for a while. Editors and build tools often close and reopen the
+// same file many times in a row, and without a delay every close would hash
+// the whole file and start a new upload. Pending write-backs are also kept on
+// disk, so that changes are still uploaded after onedriver was killed during the
+// delay.
+type writeBack struct {
+	mutex   sync.Mutex
+	delay   time.Duration // 0 uploads files as soon as they are closed
+	pending map[string]*time.Timer
+}
+
+// ids of the items with a pending write-back
+var bucketWriteBack = []byte("writeBack")
+
+// SetWriteBackDelay sets how long a closed file must go unchanged before it is
+// uploaded. fsync(2) always uploads right away. A delay of 0 disables write-back.
+func (c *Cache) SetWriteBackDelay(delay time.Duration) {
+	c.writeBack.mutex.Lock()
+	c.writeBack.delay = delay
+	c.writeBack.mutex.Unlock()
+}
+
+// scheduleWriteBack uploads an item's changes once the write-back delay has
+// passed. Scheduling an item again restarts its delay, so repeated closes are
+// coalesced into a single upload. Returns false if write-back is disabled.
+func (c *Cache) scheduleWriteBack(id string) bool {
+	c.writeBack.mutex.Lock()
+	delay := c.writeBack.delay
+	timer, exists := c.writeBack.pending[id]
+	if exists {
+		timer.Reset(delay)
+	}
+	c.writeBack.mutex.Unlock()
+	if delay <= 0 {
+		return false
+	}
+	if exists {
+		return true
+	}
+
+	// on disk before the delay starts, the database is not written while the
+	// mutex is held
+	c.db.Batch(func(tx *bolt.Tx) error {
+		return tx.Bucket(bucketWriteBack).Put([]byte(id), []byte{})
+	})
+	c.writeBack.mutex.Lock()
+	defer c.writeBack.mutex.Unlock()
+	if timer, exists := c.writeBack.pending[id]; exists {
+		// scheduled by someone else in the meantime
+		timer.Reset(delay)
+		return true
+	}
+	if c.writeBack.pending == nil {
+		c.writeBack.pending = make(map[string]*time.Timer)
+	}
+	c.writeBack.pending[id] = time.AfterFunc(delay, func() {
+		c.writeBack.mutex.Lock()
+		delete(c.writeBack.pending, id)
+		c.writeBack.mutex.Unlock()
+		if c.commit(id) {
+			c.writeBackQueued(id)
+		}
+	})
+	return true
+}
+
+// cancelWriteBack drops a pending write-back, returns true if there was one. Its
+// record on disk stays until writeBackQueued is called.
+func (c *Cache) cancelWriteBack(id string) bool {
+	c.writeBack.mutex.Lock()
+	defer c.writeBack.mutex.Unlock()
+	if timer, exists := c.writeBack.pending[id]; exists {
+		timer.Stop()
+		delete(c.writeBack.pending, id)
+		return true
+	}
+	return false
+}
+
+// writeBackQueued forgets the records of write-backs whose uploads have been
+// queued, once the upload sessions have been persisted in their place. Items that
+// have been scheduled again in the meantime keep their record.
+func (c *Cache) writeBackQueued(ids ...string) {
+	c.uploads.sync()
+	c.db.Batch(func(tx *bolt.Tx) error {
+		b := tx.Bucket(bucketWriteBack)
+		c.writeBack.mutex.Lock()
+		defer c.writeBack.mutex.Unlock()
+		for _, id := range ids {
+			if _, exists := c.writeBack.pending[id]; !exists {
+				b.Delete([]byte(id))
+			}
+		}
+		return nil
+	})
+}
+
+// moveWriteBack keeps a pending write-back when an item's ID changes. The delay
+// starts over.
+func (c *Cache) moveWriteBack(oldID string, newID string) {
+	if c.cancelWriteBack(oldID) {
+		c.scheduleWriteBack(newID)
+		c.db.Batch(func(tx *bolt.Tx) error {
+			return tx.Bucket(bucketWriteBack).Delete([]byte(oldID))
+		})
+	}
+}
+
+// FlushWriteBack uploads everything with a pending write-back right away, and
+// returns once the uploads have been queued and persisted. Used before exiting
+// so that no changes are lost.
+func (c *Cache) FlushWriteBack() {
+	c.writeBack.mutex.Lock()
+	ids := make([]string, 0, len(c.writeBack.pending))
+	for id, timer := range c.writeBack.pending {
+		if timer.Stop() {
+			ids = append(ids, id)
+		}
+		delete(c.writeBack.pending, id)
+	}
+	c.writeBack.mutex.Unlock()
+
+	queued := make([]string, 0, len(ids))
+	for _, id := range ids {
+		if c.commit(id) {
+			queued = append(queued, id)
+		}
+	}
+	if len(ids) > 0 {
+		log.WithField("items", len(ids)).Info("Queued pending write-backs for upload.")
+	}
+	c.writeBackQueued(queued...)
+}
+
+// recoverWriteBack queues the uploads of write-backs that were still pending
+// when the previous session ended without flushing them. Whether the item had
+// changes and its new size were only known in memory, so the content on disk is
+// uploaded as is.
+func (c *Cache) recoverWriteBack() {
+	var ids []string
+	c.db.View(func(tx *bolt.Tx) error {
+		return tx.Bucket(bucketWriteBack).ForEach(func(key []byte, _ []byte) error {
+			ids = append(ids, string(key))
+			return nil
+		})
+	})
+	if len(ids) == 0 {
+		return
+	}
+	log.WithField("items", len(ids)).Info(
+		"Uploading changes whose write-back was interrupted by the previous session.")
+	queued := make([]string, 0, len(ids))
+	for _, id := range ids {
+		inode := c.GetID(id)
+		if inode == nil || inode.IsDir() {
+			// deleted since, nothing left to upload
+			queued = append(queued, id)
+			continue
+		}
+		if !c.content.IsComplete(id) {
+			log.WithField("id", id).Warn("Content of an interrupted write-back " +
+				"is gone, its changes are lost.")
+			queued = append(queued, id)
+			continue
+		}
+		inode.mutex.Lock()
+		inode.hasChanges = true
+		inode.DriveItem.Size = c.content.Size(id)
+		inode.mutex.Unlock()
+		if c.commit(id) {
+			queued = append(queued, id)
+		}
+	}
+	c.writeBackQueued(queued...)
+}
+
+// commit queues an item's changes for upload, if it still exists. Returns false
+// if it exists but its upload could not be queued.
+func (c *Cache) commit(id string) bool {
+	if inode := c.GetID(id); inode != nil {
+		return inode.commit() == 0
+	}
+	return true
+}
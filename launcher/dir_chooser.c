@@ -11,13 +11,15 @@ static void response_cb(GtkNativeDialog *self, gint response_id, char *path) {
 }
 
 /**
- * Creates a popup folder chooser via GTK.
+ * Creates a popup folder chooser via GTK, starting in start or the home directory
+ * if NULL.
  */
-char *dir_chooser(char *title) {
+char *dir_chooser(char *title, const char *start) {
     gtk_init(NULL, NULL);
     GtkFileChooserNative *chooser = gtk_file_chooser_native_new(
         title, NULL, GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER, "Select", NULL);
-    gtk_file_chooser_set_current_folder(GTK_FILE_CHOOSER(chooser), g_get_home_dir());
+    gtk_file_chooser_set_current_folder(GTK_FILE_CHOOSER(chooser),
+                                        start ? start : g_get_home_dir());
     GtkNativeDialog *dialog = GTK_NATIVE_DIALOG(chooser);
 
     char path[512] = "";
@@ -1,3 +1,3 @@
 #pragma once
 
-char *dir_chooser(char *title);
+char *dir_chooser(char *title, const char *start);
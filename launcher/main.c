@@ -1,3 +1,5 @@
+#define _XOPEN_SOURCE 500
+#include <ftw.h>
 #include <gtk/gtk.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -11,29 +13,121 @@
 #define PLUS_ICON "list-add-symbolic"
 #define MINUS_ICON "user-trash-symbolic"
 #define ENABLED_ICON "object-select-symbolic"
+#define PIN_ICON "folder-download-symbolic"
 
 #define MOUNT_MESSAGE "Mount or unmount selected OneDrive account"
 
-static GHashTable *mounts, *switches;
+static GHashTable *mounts, *switches, *unit_switches, *unit_statuses;
+
+static void enable_mountpoint_cb(GtkWidget *widget, char *unit_name);
+static void activate_mount_cb(GtkWidget *widget, gboolean state, char *unit_name);
+
+/**
+ * Set the enabled toggle of a row without enabling or disabling anything.
+ */
+static void set_toggle_quietly(GtkWidget *toggle, gboolean active) {
+    g_signal_handlers_block_matched(toggle, G_SIGNAL_MATCH_FUNC, 0, 0, NULL,
+                                    enable_mountpoint_cb, NULL);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(toggle), active);
+    g_signal_handlers_unblock_matched(toggle, G_SIGNAL_MATCH_FUNC, 0, 0, NULL,
+                                      enable_mountpoint_cb, NULL);
+}
+
+/**
+ * Set the mount switch of a row without starting or stopping anything.
+ */
+static void set_switch_quietly(GtkWidget *sw, gboolean active) {
+    g_signal_handlers_block_matched(sw, G_SIGNAL_MATCH_FUNC, 0, 0, NULL,
+                                    activate_mount_cb, NULL);
+    gtk_switch_set_active(GTK_SWITCH(sw), active);
+    g_signal_handlers_unblock_matched(sw, G_SIGNAL_MATCH_FUNC, 0, 0, NULL,
+                                      activate_mount_cb, NULL);
+}
+
+/**
+ * Undo a change to the enabled toggle if systemd could not make it.
+ */
+static void enable_mountpoint_done_cb(const char *unit_name, bool success,
+                                      void *toggle) {
+    if (!success) {
+        gboolean active = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(toggle));
+        set_toggle_quietly(toggle, !active);
+    }
+    g_object_unref(toggle);
+}
 
 /**
  * Enable or disable a mountpoint when button is clicked.
  */
 static void enable_mountpoint_cb(GtkWidget *widget, char *unit_name) {
     gboolean active = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
-    if (systemd_unit_set_enabled(unit_name, (bool)active)) {
-        // set the toggle state if systemd call was successful
-        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(widget), (gboolean)active);
+    systemd_unit_set_enabled_async(unit_name, (bool)active, enable_mountpoint_done_cb,
+                                   g_object_ref(widget));
+}
+
+/**
+ * Undo a change to the mount switch if systemd could not make it.
+ */
+static void activate_mount_done_cb(const char *unit_name, bool success, void *sw) {
+    if (!success) {
+        set_switch_quietly(sw, !gtk_switch_get_active(GTK_SWITCH(sw)));
     }
+    g_object_unref(sw);
 }
 
 /**
  * Start or stop the mountpoint for an acccount.
  */
 static void activate_mount_cb(GtkWidget *widget, gboolean state, char *unit_name) {
-    if (!systemd_unit_set_active(unit_name, state)) {
-        gtk_switch_set_active(GTK_SWITCH(widget), !state);
+    systemd_unit_set_active_async(unit_name, state, activate_mount_done_cb,
+                                  g_object_ref(widget));
+}
+
+/**
+ * Set the enabled toggle of a row once its state has been fetched.
+ */
+static void unit_enabled_cb(const char *unit_name, bool enabled, void *toggle) {
+    set_toggle_quietly(toggle, enabled);
+    g_object_unref(toggle);
+}
+
+/**
+ * Show what a mount is doing in its row.
+ */
+static void mount_status_cb(const struct fs_status *status, void *label) {
+    if (!status) {
+        // the stream is over, a new one is started when the mount is back
+        gtk_label_set_text(GTK_LABEL(label), "");
+        g_object_set_data(G_OBJECT(label), "streaming", NULL);
+        g_object_unref(label);
+        return;
+    }
+    char *description = fs_status_describe(status);
+    gtk_label_set_text(GTK_LABEL(label), description);
+    g_free(description);
+}
+
+/**
+ * Set the mount switch of a row once its state has been fetched, and follow the
+ * status of the mount while it is running.
+ */
+static void unit_active_cb(const char *unit_name, bool active, void *user_data) {
+    GtkWidget *sw = g_hash_table_lookup(unit_switches, unit_name);
+    if (sw) {
+        set_switch_quietly(sw, active);
     }
+    GtkWidget *label = g_hash_table_lookup(unit_statuses, unit_name);
+    char *instance;
+    if (active && label && !g_object_get_data(G_OBJECT(label), "streaming") &&
+        systemd_untemplate_unit(unit_name, &instance) == 0) {
+        g_object_set_data(G_OBJECT(label), "streaming", GINT_TO_POINTER(TRUE));
+        fs_status_watch(instance, mount_status_cb, g_object_ref(label));
+        free(instance);
+    }
+}
+
+static int remove_cb(const char *path, const struct stat *sb, int flag, struct FTW *ftwbuf) {
+    return remove(path);
 }
 
 /**
@@ -58,39 +152,101 @@ static void delete_mount_cb(GtkWidget *widget, char *unit_name) {
         remove(path);
         sprintf(path, "%s/onedriver/%s/onedriver.db", cachedir, instance);
         remove(path);
+        sprintf(path, "%s/onedriver/%s/onedriver-content", cachedir, instance);
+        nftw(path, remove_cb, 16, FTW_DEPTH | FTW_PHYS);
         sprintf(path, "%s/onedriver/%s/", cachedir, instance);
         rmdir(path);
 
         free(instance);
         free(path);
+        g_hash_table_remove(unit_switches, unit_name);
+        g_hash_table_remove(unit_statuses, unit_name);
         gtk_widget_destroy(gtk_widget_get_ancestor(widget, GTK_TYPE_LIST_BOX_ROW));
     }
     gtk_widget_destroy(dialog);
 }
 
+/**
+ * Pick a folder in a mount to keep available offline, or to stop keeping offline if
+ * it already is.
+ */
+static void pin_folder_cb(GtkWidget *widget, gpointer user_data) {
+    GtkWidget *row = gtk_widget_get_ancestor(widget, GTK_TYPE_LIST_BOX_ROW);
+    const char *mount = g_hash_table_lookup(mounts, row);
+    if (!fs_is_mounted(mount)) {
+        g_print("\"%s\" must be mounted to keep folders in it offline.\n", mount);
+        return;
+    }
+
+    char *path = dir_chooser("Select a folder to keep available offline", mount);
+    size_t len = strlen(mount);
+    if (strncmp(path, mount, len) != 0 || (path[len] != '/' && path[len] != '\0')) {
+        if (strlen(path)) {
+            g_print("\"%s\" is not in \"%s\".\n", path, mount);
+        }
+        free(path);
+        return;
+    }
+
+    bool pinned = fs_is_pinned(path);
+    if (pinned) {
+        GtkWidget *window = gtk_widget_get_ancestor(widget, GTK_TYPE_WINDOW);
+        GtkWidget *dialog = gtk_dialog_new_with_buttons(
+            "Stop keeping folder offline?", GTK_WINDOW(window), GTK_DIALOG_MODAL,
+            "Cancel", GTK_RESPONSE_REJECT, "Stop", GTK_RESPONSE_ACCEPT, NULL);
+        gint response = gtk_dialog_run(GTK_DIALOG(dialog));
+        gtk_widget_destroy(dialog);
+        if (response != GTK_RESPONSE_ACCEPT) {
+            free(path);
+            return;
+        }
+    }
+    if (!fs_set_pinned(path, !pinned)) {
+        g_print("Could not %s \"%s\".\n", pinned ? "unpin" : "pin", path);
+    }
+    free(path);
+}
+
+/**
+ * Open a mountpoint in the default file manager once it is available. Releases the
+ * reference to the row's switch, if one was passed.
+ */
+static void open_mount_cb(const char *mount, bool available, gpointer sw) {
+    if (sw) {
+        if (available) {
+            // activate the switch to match the unit state if it's not already active
+            set_switch_quietly(sw, TRUE);
+        }
+        g_object_unref(sw);
+    }
+    if (!available) {
+        g_print("Timed out waiting for \"%s\" to be mounted.\n", mount);
+        return;
+    }
+    char uri[512] = "file://";
+    strncat(uri, mount, 504);
+    g_app_info_launch_default_for_uri(uri, NULL, NULL);
+}
+
 /**
  * Open the mountpoint when a user clicks on it.
  */
 static void activate_row_cb(GtkListBox *box, GtkListBoxRow *row, gpointer user_data) {
     const char *mount = g_hash_table_lookup(mounts, row);
 
-    // start the mount if it's not started already
+    // start the mount if it's not started already, the switch follows the unit
+    GtkWidget *sw = g_hash_table_lookup(switches, row);
+    if (gtk_switch_get_active(GTK_SWITCH(sw))) {
+        open_mount_cb(mount, true, NULL);
+        return;
+    }
     char *unit_name, *escaped;
     systemd_path_escape(mount, &escaped);
     systemd_template_unit(ONEDRIVER_SERVICE_TEMPLATE, escaped, &unit_name);
-    if (!systemd_unit_is_active(unit_name) && systemd_unit_set_active(unit_name, true)) {
-        fs_poll_until_avail(mount, 10);
-
-        // activate the switch to match the unit state if it's not already active
-        GtkWidget *sw = g_hash_table_lookup(switches, row);
-        gtk_switch_set_active(GTK_SWITCH(sw), TRUE);
-    }
+    systemd_unit_set_active_async(unit_name, true, NULL, NULL);
+    fs_watch_until_avail(mount, 10, open_mount_cb, g_object_ref(sw));
     free(unit_name);
     free(escaped);
-
-    char uri[512] = "file://";
-    strncat(uri, mount, 504);
-    g_app_info_launch_default_for_uri(uri, NULL, NULL);
 }
 
 /**
@@ -125,6 +281,11 @@ static GtkWidget *new_mount_row(char *mount) {
     // unit_name is not freed - it is used by callbacks when triggered at a later date
     gtk_box_pack_start(GTK_BOX(box), label, FALSE, FALSE, 5);
 
+    // filled in from the mount's status socket while it is running
+    GtkWidget *status_label = gtk_label_new("");
+    gtk_style_context_add_class(gtk_widget_get_style_context(status_label), "dim-label");
+    gtk_box_pack_start(GTK_BOX(box), status_label, FALSE, FALSE, 0);
+
     GtkWidget *delete_mountpoint_btn =
         gtk_button_new_from_icon_name(MINUS_ICON, GTK_ICON_SIZE_BUTTON);
     gtk_widget_set_tooltip_text(delete_mountpoint_btn,
@@ -133,21 +294,26 @@ static GtkWidget *new_mount_row(char *mount) {
                      unit_name);
     gtk_box_pack_end(GTK_BOX(box), delete_mountpoint_btn, FALSE, FALSE, 0);
 
+    GtkWidget *pin_btn = gtk_button_new_from_icon_name(PIN_ICON, GTK_ICON_SIZE_BUTTON);
+    gtk_widget_set_tooltip_text(pin_btn, "Keep a folder available offline");
+    g_signal_connect(pin_btn, "clicked", G_CALLBACK(pin_folder_cb), NULL);
+    gtk_box_pack_end(GTK_BOX(box), pin_btn, FALSE, FALSE, 0);
+
     // add a button to enable the mountpoint
     GtkWidget *unit_enabled_btn = gtk_toggle_button_new();
     GtkWidget *enabled_img =
         gtk_image_new_from_icon_name(ENABLED_ICON, GTK_ICON_SIZE_BUTTON);
     gtk_button_set_image(GTK_BUTTON(unit_enabled_btn), enabled_img);
     gtk_widget_set_tooltip_text(unit_enabled_btn, "Start mountpoint on login");
-    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(unit_enabled_btn),
-                                 (gboolean)systemd_unit_is_enabled(unit_name));
+    systemd_unit_is_enabled_async(unit_name, unit_enabled_cb,
+                                  g_object_ref(unit_enabled_btn));
     g_signal_connect(unit_enabled_btn, "toggled", G_CALLBACK(enable_mountpoint_cb),
                      unit_name);
     gtk_box_pack_end(GTK_BOX(box), unit_enabled_btn, FALSE, FALSE, 0);
 
-    // and a switch to actually start/stop the mountpoint
+    // and a switch to actually start/stop the mountpoint, the state of all of them is
+    // fetched at once (see activate)
     GtkWidget *mount_toggle = gtk_switch_new();
-    gtk_switch_set_active(GTK_SWITCH(mount_toggle), systemd_unit_is_active(unit_name));
     gtk_widget_set_tooltip_text(mount_toggle, MOUNT_MESSAGE);
     g_signal_connect(mount_toggle, "state-set", G_CALLBACK(activate_mount_cb), unit_name);
     gtk_widget_set_valign(mount_toggle, GTK_ALIGN_CENTER);
@@ -155,6 +321,8 @@ static GtkWidget *new_mount_row(char *mount) {
 
     g_hash_table_insert(mounts, row, strdup(mount));
     g_hash_table_insert(switches, row, mount_toggle);
+    g_hash_table_insert(unit_switches, unit_name, mount_toggle);
+    g_hash_table_insert(unit_statuses, unit_name, status_label);
     return row;
 }
 
@@ -164,7 +332,7 @@ static GtkWidget *new_mount_row(char *mount) {
 static void new_mountpoint_cb(GtkWidget *widget, GtkListBox *box) {
     char *unit_name, *mount, *escaped_mountpoint;
 
-    mount = dir_chooser("Select a mountpoint");
+    mount = dir_chooser("Select a mountpoint", NULL);
     if (!fs_mountpoint_is_valid(mount)) {
         g_print(
             "Mountpoint \"%s\" was not valid. Mountpoint must be an empty directory.\n",
@@ -176,17 +344,13 @@ static void new_mountpoint_cb(GtkWidget *widget, GtkListBox *box) {
     systemd_path_escape(mount, &escaped_mountpoint);
     systemd_template_unit(ONEDRIVER_SERVICE_TEMPLATE, escaped_mountpoint, &unit_name);
 
-    // start the mountpoint and open it
-    systemd_unit_set_active(unit_name, true);
-    fs_poll_until_avail(mount, -1);
-    char uri[512] = "file://";
-    strncat(uri, mount, 506);
-    g_app_info_launch_default_for_uri(uri, NULL, NULL);
-
-    // now create the row
+    // create the row, then start the mountpoint and open it once it's up
     GtkWidget *row = new_mount_row(mount);
     gtk_list_box_insert(box, row, -1);
     gtk_widget_show_all(row);
+    systemd_unit_set_active_async(unit_name, true, NULL, NULL);
+    fs_watch_until_avail(mount, -1, open_mount_cb,
+                         g_object_ref(g_hash_table_lookup(switches, row)));
 
     free(mount);
     free(unit_name);
@@ -199,6 +363,8 @@ static void new_mountpoint_cb(GtkWidget *widget, GtkListBox *box) {
 static void activate(GtkApplication *app, gpointer data) {
     mounts = g_hash_table_new(g_direct_hash, g_direct_equal);
     switches = g_hash_table_new(g_direct_hash, g_direct_equal);
+    unit_switches = g_hash_table_new(g_str_hash, g_str_equal);
+    unit_statuses = g_hash_table_new(g_str_hash, g_str_equal);
 
     GtkWidget *window = gtk_application_window_new(app);
     gtk_window_set_default_size(GTK_WINDOW(window), 550, 400);
@@ -228,6 +394,9 @@ static void activate(GtkApplication *app, gpointer data) {
         free(*found);
     }
     free(existing_mounts);
+    // watch before listing, so that no change can fall between the two
+    systemd_watch_units(ONEDRIVER_UNIT_PATTERN, unit_active_cb, NULL);
+    systemd_units_active_async(ONEDRIVER_UNIT_PATTERN, unit_active_cb, NULL);
 
     gtk_list_box_unselect_all(GTK_LIST_BOX(listbox));
     gtk_widget_show_all(window);
@@ -0,0 +1,151 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "onedriver.h"
+#include "systemd.h"
+
+// how many mountpoints fs_known_mounts finds in the fake cache directory
+#define BENCH_MOUNTS 100
+
+// a path with a bit of everything systemd has to escape
+#define BENCH_PATH "/home/user/OneDrive - Contoso Ltd/Shared Documents/Q3 report.d"
+
+static double elapsed_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Call fn in batches of doubling size until at least a second has passed, then
+ * print how long each call took on average.
+ */
+static void bench(const char *name, void (*fn)(void *data), void *data) {
+    struct timespec start;
+    long iterations = 0;
+    double elapsed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long batch = 1; elapsed < 1.0; batch *= 2) {
+        for (long i = 0; i < batch; i++) {
+            fn(data);
+        }
+        iterations += batch;
+        elapsed = elapsed_since(&start);
+    }
+    printf("%-28s %10ld %14.1f ns/op\n", name, iterations, elapsed * 1e9 / iterations);
+}
+
+static void bench_systemd_escape(void *data) {
+    free(systemd_escape((const char *)data));
+}
+
+static void bench_systemd_unescape(void *data) {
+    free(systemd_unescape((const char *)data));
+}
+
+static void bench_systemd_path_escape(void *data) {
+    char *escaped;
+    systemd_path_escape((const char *)data, &escaped);
+    free(escaped);
+}
+
+static void bench_systemd_template_unit(void *data) {
+    char *unit_name;
+    systemd_template_unit(ONEDRIVER_SERVICE_TEMPLATE, (const char *)data, &unit_name);
+    free(unit_name);
+}
+
+static void bench_fs_known_mounts(void *data) {
+    char **mounts = fs_known_mounts();
+    int found = 0;
+    for (char **mount = mounts; *mount; mount++) {
+        free(*mount);
+        found++;
+    }
+    free(mounts);
+    if (found != BENCH_MOUNTS) {
+        fprintf(stderr, "fs_known_mounts found %d mounts, expected %d\n", found,
+                BENCH_MOUNTS);
+        exit(1);
+    }
+}
+
+/**
+ * Create mountpoints below root, and a cache directory for each one like a
+ * mount would leave behind. Mountpoint paths are written to mountpoints.
+ */
+static void setup_known_mounts(const char *root, char **mountpoints) {
+    char *cachedir = g_build_filename(root, "cache", ONEDRIVER_NAME, NULL);
+    g_mkdir_with_parents(cachedir, 0700);
+    for (int i = 0; i < BENCH_MOUNTS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "OneDrive %03d", i);
+        mountpoints[i] = g_build_filename(root, name, NULL);
+        g_mkdir(mountpoints[i], 0700);
+
+        char *escaped;
+        systemd_path_escape(mountpoints[i], &escaped);
+        char *instance_cache = g_build_filename(cachedir, escaped, NULL);
+        g_mkdir(instance_cache, 0700);
+        g_free(instance_cache);
+        free(escaped);
+    }
+    g_free(cachedir);
+}
+
+static void teardown_known_mounts(const char *root, char **mountpoints) {
+    char *cachedir = g_build_filename(root, "cache", ONEDRIVER_NAME, NULL);
+    for (int i = 0; i < BENCH_MOUNTS; i++) {
+        char *escaped;
+        systemd_path_escape(mountpoints[i], &escaped);
+        char *instance_cache = g_build_filename(cachedir, escaped, NULL);
+        g_rmdir(instance_cache);
+        g_free(instance_cache);
+        free(escaped);
+        g_rmdir(mountpoints[i]);
+        g_free(mountpoints[i]);
+    }
+    g_rmdir(cachedir);
+    char *parent = g_path_get_dirname(cachedir);
+    g_rmdir(parent);
+    g_free(parent);
+    g_free(cachedir);
+    g_rmdir(root);
+}
+
+int main(int argc, char **argv) {
+    // must be set before glib looks up the cache dir for the first time
+    char *root = g_dir_make_tmp("onedriver-bench-XXXXXX", NULL);
+    if (!root) {
+        fprintf(stderr, "Could not create a temporary directory.\n");
+        return 1;
+    }
+    char *cache_home = g_build_filename(root, "cache", NULL);
+    g_setenv("XDG_CACHE_HOME", cache_home, TRUE);
+    g_free(cache_home);
+
+    char *escaped = systemd_escape(BENCH_PATH);
+    char *instance;
+    systemd_path_escape(BENCH_PATH, &instance);
+
+    bench("systemd_escape", bench_systemd_escape, BENCH_PATH);
+    bench("systemd_unescape", bench_systemd_unescape, escaped);
+    bench("systemd_path_escape", bench_systemd_path_escape, BENCH_PATH);
+    bench("systemd_template_unit", bench_systemd_template_unit, instance);
+
+    char *mountpoints[BENCH_MOUNTS];
+    setup_known_mounts(root, mountpoints);
+    bench("fs_known_mounts", bench_fs_known_mounts, NULL);
+    teardown_known_mounts(root, mountpoints);
+
+    free(escaped);
+    free(instance);
+    g_free(root);
+    return 0;
+}
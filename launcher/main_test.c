@@ -26,6 +26,53 @@ MU_TEST(test_fs_mountpoint_is_valid) {
     rmdir("_test");
 }
 
+// can we find fuse mounts in the mount table, and only fuse mounts?
+MU_TEST(test_fs_mountinfo_has_mount) {
+    const char *mountinfo =
+        "22 1 0:21 / /proc rw,nosuid,nodev,noexec,relatime shared:12 - proc proc rw\n"
+        "98 29 0:45 / /home/test/OneDrive rw,nosuid,nodev,relatime shared:51 - "
+        "fuse.onedriver onedriver rw,user_id=1000,group_id=1000\n"
+        "99 29 0:46 / /home/test/with\\040space rw,relatime - fuse.onedriver onedriver "
+        "rw\n";
+    mu_check(fs_mountinfo_has_mount(mountinfo, "/home/test/OneDrive"));
+    mu_check(fs_mountinfo_has_mount(mountinfo, "/home/test/OneDrive/"));
+    mu_check(fs_mountinfo_has_mount(mountinfo, "/home/test/with space"));
+    mu_check(!fs_mountinfo_has_mount(mountinfo, "/home/test"));
+    mu_check(!fs_mountinfo_has_mount(mountinfo, "/proc"));
+    mu_check(!fs_mountinfo_has_mount("", "/home/test/OneDrive"));
+}
+
+// can we read and describe the status sent by a running mount?
+MU_TEST(test_fs_status) {
+    struct fs_status status;
+    mu_check(!fs_status_parse("not json", &status));
+    mu_check(fs_status_parse("{\"offline\":false,\"uploadsQueued\":2,"
+                             "\"uploadsInFlight\":1,\"sendRate\":2048.5,"
+                             "\"requestLatency\":{\"count\":0}}",
+                             &status));
+    mu_check(!status.offline && status.uploads_queued == 2);
+    mu_check(status.uploads_in_flight == 1);
+    char *description = fs_status_describe(&status);
+    mu_assert(strcmp(description, "Uploading 2 files (2.0 kB/s)") == 0, description);
+    g_free(description);
+
+    mu_check(fs_status_parse("{\"offline\":false,\"pinnedQueued\":3}", &status));
+    description = fs_status_describe(&status);
+    mu_assert(strcmp(description, "Downloading 3 files to keep offline") == 0,
+              description);
+    g_free(description);
+
+    mu_check(fs_status_parse("{\"offline\":true,\"uploadsQueued\":1}", &status));
+    description = fs_status_describe(&status);
+    mu_assert(strcmp(description, "Offline, 1 change waiting") == 0, description);
+    g_free(description);
+
+    mu_check(fs_status_parse("{}", &status));
+    description = fs_status_describe(&status);
+    mu_assert(strcmp(description, "Up to date") == 0, description);
+    g_free(description);
+}
+
 // Can we convert paths from ~/some_path to /home/username/some_path and back?
 MU_TEST(test_home_escape) {
     const char *homedir = g_get_home_dir();
@@ -91,6 +138,25 @@ MU_TEST(test_systemd_untemplate_unit) {
     free(unescaped2);
 }
 
+// can we get unit names back from their dbus object paths?
+MU_TEST(test_systemd_unit_from_object_path) {
+    char *unit_name;
+    mu_check(systemd_unit_from_object_path(
+                 "/org/freedesktop/systemd1/unit/onedriver_40home_2dtest_2eservice",
+                 &unit_name) == 0);
+    mu_check(strcmp(unit_name, "onedriver@home-test.service") == 0);
+    free(unit_name);
+
+    mu_check(systemd_unit_from_object_path("/org/freedesktop/systemd1/unit/_",
+                                           &unit_name) == 0);
+    mu_check(strcmp(unit_name, "") == 0);
+    free(unit_name);
+
+    mu_check(systemd_unit_from_object_path("/org/freedesktop/systemd1/unit/bad_4",
+                                           &unit_name) < 0);
+    mu_check(systemd_unit_from_object_path("/org/freedesktop/systemd1", &unit_name) < 0);
+}
+
 // can we enable and disable systemd units? (and correctly check if the units are
 // enabled/disabled?)
 MU_TEST(test_systemd_unit_enabled) {
@@ -135,6 +201,7 @@ MU_TEST(test_systemd_unit_active) {
 
     mu_assert(systemd_unit_set_active(unit_name, true), "Could not start unit.");
     fs_poll_until_avail((const char *)&cwd, -1);
+    mu_assert(fs_is_mounted(cwd), "Mount did not show up in the mount table.");
     mu_assert(systemd_unit_is_active(unit_name), "Did not detect unit as active");
 
     // test this function while we're at it
@@ -165,11 +232,14 @@ MU_TEST_SUITE(systemd_tests) {
     free(unit_name);
 
     MU_RUN_TEST(test_fs_mountpoint_is_valid);
+    MU_RUN_TEST(test_fs_mountinfo_has_mount);
+    MU_RUN_TEST(test_fs_status);
     MU_RUN_TEST(test_home_escape);
     MU_RUN_TEST(test_systemd_path_escape);
     MU_RUN_TEST(test_systemd_path_unescape);
     MU_RUN_TEST(test_systemd_template_unit);
     MU_RUN_TEST(test_systemd_untemplate_unit);
+    MU_RUN_TEST(test_systemd_unit_from_object_path);
     MU_RUN_TEST(test_systemd_unit_enabled);
     MU_RUN_TEST(test_systemd_unit_active);
 }
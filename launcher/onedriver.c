@@ -1,46 +1,175 @@
 #define _DEFAULT_SOURCE
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+#include <glib-unix.h>
 #include <glib.h>
 #include <json-glib/json-glib.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
 #include <unistd.h>
 
 #include "onedriver.h"
 #include "systemd.h"
 
 /**
- * Block until the fs is available, or a timeout is reached. If the timeout is
- * -1, will wait until a default of 120 seconds.
+ * Check if the contents of a mountinfo file (see proc(5)) contain a FUSE filesystem
+ * mounted at the mountpoint.
  */
-void fs_poll_until_avail(const char *mountpoint, int timeout) {
-    bool found = false;
-    if (timeout == -1) {
-        timeout = 120;
+bool fs_mountinfo_has_mount(const char *mountinfo, const char *mountpoint) {
+    // mountinfo never has trailing slashes, and neither should we
+    char *wanted = g_strdup(mountpoint);
+    for (size_t len = strlen(wanted); len > 1 && wanted[len - 1] == '/'; len--) {
+        wanted[len - 1] = '\0';
     }
-    for (int i = 0; i < timeout * 10; i++) {
-        DIR *dir = opendir(mountpoint);
-        if (!dir) {
-            return;
+
+    bool found = false;
+    char **lines = g_strsplit(mountinfo, "\n", -1);
+    for (char **line = lines; *line && !found; line++) {
+        // 36 35 98:0 /root /mount/point rw,noatime master:1 - fuse.onedriver ...
+        char **fields = g_strsplit(*line, " ", -1);
+        if (g_strv_length(fields) < 5) {
+            g_strfreev(fields);
+            continue;
         }
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL) {
-            if (strcmp(entry->d_name, XDG_VOLUME_INFO) == 0) {
-                found = true;
+        // the optional fields end with a lone "-", the fstype comes next
+        char *fstype = NULL;
+        for (char **field = fields + 5; *field; field++) {
+            if (strcmp(*field, "-") == 0) {
+                fstype = *(field + 1);
                 break;
             }
         }
-        closedir(dir);
+        if (fstype && strncmp(fstype, "fuse", 4) == 0) {
+            // whitespace and backslashes in the mountpoint are octal escaped
+            char *path = g_strcompress(fields[4]);
+            found = strcmp(path, wanted) == 0;
+            g_free(path);
+        }
+        g_strfreev(fields);
+    }
+    g_strfreev(lines);
+    g_free(wanted);
+    return found;
+}
 
-        if (found) {
+/**
+ * Check if a FUSE filesystem is mounted at the mountpoint.
+ */
+bool fs_is_mounted(const char *mountpoint) {
+    char *mountinfo;
+    if (!g_file_get_contents(MOUNTINFO, &mountinfo, NULL, NULL)) {
+        return false;
+    }
+    bool mounted = fs_mountinfo_has_mount(mountinfo, mountpoint);
+    g_free(mountinfo);
+    return mounted;
+}
+
+/**
+ * Block until the fs is available, or a timeout is reached. If the timeout is
+ * -1, will wait until a default of 120 seconds. Rather than polling the mountpoint,
+ * this sleeps until the kernel says the mount table has changed.
+ */
+void fs_poll_until_avail(const char *mountpoint, int timeout) {
+    if (timeout == -1) {
+        timeout = 120;
+    }
+    // opened before the first check so that no change can be missed
+    int fd = open(MOUNTINFO, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    gint64 deadline = g_get_monotonic_time() + timeout * G_USEC_PER_SEC;
+    while (!fs_is_mounted(mountpoint)) {
+        gint64 remaining = (deadline - g_get_monotonic_time()) / 1000;
+        if (remaining <= 0) {
             break;
         }
-        usleep(100 * 1000); // 0.1 seconds
+        struct pollfd pfd = {.fd = fd, .events = POLLPRI};
+        poll(&pfd, 1, (int)remaining);
     }
+    close(fd);
+}
+
+struct fs_watch {
+    char *mountpoint;
+    int fd;
+    guint fd_source;
+    guint timeout_source;
+    fs_avail_cb callback;
+    void *user_data;
+};
+
+/**
+ * Report the result of a watch and free it. The source that ended the watch must
+ * have cleared its id already.
+ */
+static void fs_watch_finish(struct fs_watch *watch, bool available) {
+    if (watch->fd_source) {
+        g_source_remove(watch->fd_source);
+    }
+    if (watch->timeout_source) {
+        g_source_remove(watch->timeout_source);
+    }
+    close(watch->fd);
+    watch->callback(watch->mountpoint, available, watch->user_data);
+    free(watch->mountpoint);
+    free(watch);
+}
+
+static gboolean fs_watch_changed_cb(gint fd, GIOCondition condition, gpointer user_data) {
+    struct fs_watch *watch = user_data;
+    if (!fs_is_mounted(watch->mountpoint)) {
+        return G_SOURCE_CONTINUE;
+    }
+    watch->fd_source = 0;
+    fs_watch_finish(watch, true);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean fs_watch_timeout_cb(gpointer user_data) {
+    struct fs_watch *watch = user_data;
+    watch->timeout_source = 0;
+    fs_watch_finish(watch, false);
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * Call callback from the main loop once the fs is available, or with available set
+ * to false once the timeout (-1 for 120 seconds) is reached. Does not block - the
+ * mount table is watched for changes instead. If the fs is available already, the
+ * callback is called before this returns.
+ */
+void fs_watch_until_avail(const char *mountpoint, int timeout, fs_avail_cb callback,
+                          void *user_data) {
+    if (timeout == -1) {
+        timeout = 120;
+    }
+    int fd = open(MOUNTINFO, O_RDONLY);
+    if (fd < 0 || fs_is_mounted(mountpoint)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        callback(mountpoint, fd >= 0, user_data);
+        return;
+    }
+
+    struct fs_watch *watch = calloc(1, sizeof(struct fs_watch));
+    watch->mountpoint = strdup(mountpoint);
+    watch->fd = fd;
+    watch->callback = callback;
+    watch->user_data = user_data;
+    // the kernel flags the mountinfo file with POLLPRI when the mount table changes
+    watch->fd_source = g_unix_fd_add(fd, G_IO_PRI | G_IO_ERR, fs_watch_changed_cb, watch);
+    watch->timeout_source = g_timeout_add_seconds(timeout, fs_watch_timeout_cb, watch);
 }
 
 /**
@@ -76,6 +205,181 @@ char *fs_account_name(const char *instance) {
     return account_name;
 }
 
+// json-glib only has getters with defaults for missing members since 1.6
+static bool json_bool_member(JsonObject *object, const char *name) {
+    return json_object_has_member(object, name) &&
+           json_object_get_boolean_member(object, name);
+}
+
+static gint64 json_int_member(JsonObject *object, const char *name) {
+    return json_object_has_member(object, name) ? json_object_get_int_member(object, name)
+                                                : 0;
+}
+
+static double json_double_member(JsonObject *object, const char *name) {
+    return json_object_has_member(object, name)
+               ? json_object_get_double_member(object, name)
+               : 0;
+}
+
+/**
+ * Read a line of JSON from a mount's status socket. Returns false if it could not
+ * be parsed. Missing fields are left at zero.
+ */
+bool fs_status_parse(const char *json, struct fs_status *status) {
+    memset(status, 0, sizeof(struct fs_status));
+    JsonParser *parser = json_parser_new();
+    if (!json_parser_load_from_data(parser, json, -1, NULL) ||
+        !JSON_NODE_HOLDS_OBJECT(json_parser_get_root(parser))) {
+        g_object_unref(parser);
+        return false;
+    }
+    JsonObject *root = json_node_get_object(json_parser_get_root(parser));
+    status->offline = json_bool_member(root, "offline");
+    status->uploads_queued = json_int_member(root, "uploadsQueued");
+    status->uploads_in_flight = json_int_member(root, "uploadsInFlight");
+    status->pinned_queued = json_int_member(root, "pinnedQueued");
+    status->last_delta = json_int_member(root, "lastDelta");
+    status->cache_used = json_int_member(root, "cacheUsed");
+    status->send_rate = json_double_member(root, "sendRate");
+    status->receive_rate = json_double_member(root, "receiveRate");
+    g_object_unref(parser);
+    return true;
+}
+
+/**
+ * Describe a mount's status in a few words. Result should be freed with g_free.
+ */
+char *fs_status_describe(const struct fs_status *status) {
+    if (status->offline) {
+        if (status->uploads_queued > 0) {
+            return g_strdup_printf("Offline, %d %s waiting", status->uploads_queued,
+                                   status->uploads_queued == 1 ? "change" : "changes");
+        }
+        return g_strdup("Offline");
+    }
+    if (status->uploads_queued > 0) {
+        if (status->send_rate < 1) {
+            return g_strdup_printf("Uploading %d %s", status->uploads_queued,
+                                   status->uploads_queued == 1 ? "file" : "files");
+        }
+        char *rate = g_format_size((guint64)status->send_rate);
+        char *description =
+            g_strdup_printf("Uploading %d %s (%s/s)", status->uploads_queued,
+                            status->uploads_queued == 1 ? "file" : "files", rate);
+        g_free(rate);
+        return description;
+    }
+    if (status->pinned_queued > 0) {
+        const char *files = status->pinned_queued == 1 ? "file" : "files";
+        if (status->receive_rate < 1) {
+            return g_strdup_printf("Downloading %d %s to keep offline",
+                                   status->pinned_queued, files);
+        }
+        char *rate = g_format_size((guint64)status->receive_rate);
+        char *description = g_strdup_printf("Downloading %d %s to keep offline (%s/s)",
+                                            status->pinned_queued, files, rate);
+        g_free(rate);
+        return description;
+    }
+    if (status->receive_rate >= 1) {
+        char *rate = g_format_size((guint64)status->receive_rate);
+        char *description = g_strdup_printf("Downloading (%s/s)", rate);
+        g_free(rate);
+        return description;
+    }
+    return g_strdup("Up to date");
+}
+
+struct fs_status_stream {
+    GDataInputStream *input;
+    GSocketConnection *conn;
+    fs_status_cb callback;
+    void *user_data;
+};
+
+static void fs_status_stream_end(struct fs_status_stream *stream) {
+    stream->callback(NULL, stream->user_data);
+    if (stream->input) {
+        g_object_unref(stream->input);
+    }
+    if (stream->conn) {
+        g_object_unref(stream->conn);
+    }
+    free(stream);
+}
+
+static void fs_status_line_cb(GObject *source, GAsyncResult *res, gpointer user_data) {
+    struct fs_status_stream *stream = user_data;
+    char *line = g_data_input_stream_read_line_finish(stream->input, res, NULL, NULL);
+    if (!line) {
+        // the mount went away
+        fs_status_stream_end(stream);
+        return;
+    }
+    struct fs_status status;
+    if (fs_status_parse(line, &status)) {
+        stream->callback(&status, stream->user_data);
+    }
+    g_free(line);
+    g_data_input_stream_read_line_async(stream->input, G_PRIORITY_DEFAULT, NULL,
+                                        fs_status_line_cb, stream);
+}
+
+static void fs_status_connected_cb(GObject *source, GAsyncResult *res,
+                                   gpointer user_data) {
+    struct fs_status_stream *stream = user_data;
+    stream->conn = g_socket_client_connect_finish(G_SOCKET_CLIENT(source), res, NULL);
+    if (!stream->conn) {
+        fs_status_stream_end(stream);
+        return;
+    }
+    stream->input =
+        g_data_input_stream_new(g_io_stream_get_input_stream(G_IO_STREAM(stream->conn)));
+    g_data_input_stream_read_line_async(stream->input, G_PRIORITY_DEFAULT, NULL,
+                                        fs_status_line_cb, stream);
+}
+
+/**
+ * Follow the status of a running mount from its status socket, without blocking.
+ * callback is invoked from the main loop every time the status changes, and with a
+ * NULL status once the mount goes away or could not be reached.
+ */
+void fs_status_watch(const char *instance, fs_status_cb callback, void *user_data) {
+    struct fs_status_stream *stream = calloc(1, sizeof(struct fs_status_stream));
+    stream->callback = callback;
+    stream->user_data = user_data;
+
+    char *path = g_strdup_printf("%s/%s/%s/%s", g_get_user_cache_dir(), ONEDRIVER_NAME,
+                                 instance, ONEDRIVER_STATUS_SOCKET);
+    GSocketAddress *address = g_unix_socket_address_new(path);
+    g_free(path);
+    GSocketClient *client = g_socket_client_new();
+    g_socket_client_connect_async(client, G_SOCKET_CONNECTABLE(address), NULL,
+                                  fs_status_connected_cb, stream);
+    g_object_unref(client);
+    g_object_unref(address);
+}
+
+/**
+ * Check if a file or directory in a mount was pinned to be kept available offline.
+ * Things below a pinned directory are kept offline too, but are not pinned
+ * themselves.
+ */
+bool fs_is_pinned(const char *path) {
+    char value[8];
+    ssize_t len = getxattr(path, ONEDRIVER_PINNED_XATTR, value, sizeof(value));
+    return len == 1 && value[0] == '1';
+}
+
+/**
+ * Pin a file or directory in a mount to keep it available offline, or unpin it. The
+ * mount downloads pinned content in the background.
+ */
+bool fs_set_pinned(const char *path, bool pinned) {
+    return setxattr(path, ONEDRIVER_PINNED_XATTR, pinned ? "1" : "0", 1, 0) == 0;
+}
+
 /**
  * Check that the mountpoint is actually valid: mounpoint exists and nothing is in it.
  */
@@ -110,12 +414,12 @@ char **fs_known_mounts() {
     char *cachedir = malloc(strlen(g_get_user_cache_dir()) + strlen(ONEDRIVER_NAME) + 2);
     strcat(strcat(strcpy(cachedir, g_get_user_cache_dir()), "/"), ONEDRIVER_NAME);
     DIR *cache = opendir(cachedir);
+    free(cachedir);
     if (!cache) {
         char **r = malloc(sizeof(char *));
         *r = NULL;
         return r;
     }
-    free(cachedir);
 
     int idx = 0;
     int size = 10;
@@ -135,13 +439,17 @@ char **fs_known_mounts() {
             if (stat(fullpath, &st) == 0 && st.st_mode & S_IFDIR) {
                 // yep, add em
                 r[idx++] = fullpath;
-                if (idx > size) {
+                // always leave room for the terminating NULL
+                if (idx >= size) {
                     size *= 2;
                     r = realloc(r, size * sizeof(char *));
                 }
+            } else {
+                free(fullpath);
             }
         }
     }
+    closedir(cache);
     r[idx] = NULL;
     return r;
 }
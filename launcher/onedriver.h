@@ -4,11 +4,41 @@
 
 #define ONEDRIVER_NAME "onedriver"
 #define ONEDRIVER_SERVICE_TEMPLATE "onedriver@.service"
+#define ONEDRIVER_UNIT_PATTERN "onedriver@*.service"
 #define XDG_VOLUME_INFO ".xdg-volume-info"
+#define MOUNTINFO "/proc/self/mountinfo"
+#define ONEDRIVER_STATUS_SOCKET "status.sock"
+#define ONEDRIVER_PINNED_XATTR "user.onedriver.pinned"
 
+/**
+ * What a running mount is doing, see fs.Status in the daemon.
+ */
+struct fs_status {
+    bool offline;
+    int uploads_queued;
+    int uploads_in_flight;
+    int pinned_queued;
+    long long last_delta;
+    long long cache_used;
+    double send_rate;
+    double receive_rate;
+};
+
+typedef void (*fs_status_cb)(const struct fs_status *status, void *user_data);
+typedef void (*fs_avail_cb)(const char *mountpoint, bool available, void *user_data);
+
+bool fs_mountinfo_has_mount(const char *mountinfo, const char *mountpoint);
+bool fs_is_mounted(const char *mountpoint);
 void fs_poll_until_avail(const char *mountpoint, int timeout);
+void fs_watch_until_avail(const char *mountpoint, int timeout, fs_avail_cb callback,
+                          void *user_data);
 char *fs_account_name(const char *mountpoint);
 bool fs_mountpoint_is_valid(const char *mountpoint);
 char **fs_known_mounts();
 char *escape_home(const char *path);
 char *unescape_home(const char *path);
+bool fs_status_parse(const char *json, struct fs_status *status);
+char *fs_status_describe(const struct fs_status *status);
+void fs_status_watch(const char *instance, fs_status_cb callback, void *user_data);
+bool fs_is_pinned(const char *path);
+bool fs_set_pinned(const char *path, bool pinned);
@@ -224,177 +224,413 @@ int systemd_untemplate_unit(const char *unit_name, char **ret) {
 }
 
 /**
- * Connect to DBus and create a new proxy object.
- * The resulting GDBusProxy object should be freed via g_object_unref.
+ * Get the name of a unit from its systemd D-Bus object path, which is the unit name
+ * escaped by systemd's bus_label_escape. ret should be freed by the caller.
  */
-static GDBusProxy *dbus_proxy_new(GBusType type, const char *bus_name,
-                                  const char *object_path, const char *interface,
-                                  GError **err) {
-    GDBusProxy *proxy = NULL;
-    GDBusConnection *bus = g_bus_get_sync(type, NULL, err);
-    if (!*err) {
-        proxy = g_dbus_proxy_new_sync(bus, G_DBUS_PROXY_FLAGS_NONE, NULL, bus_name,
-                                      object_path, interface, NULL, err);
+int systemd_unit_from_object_path(const char *path, char **ret) {
+    size_t prefix_len = strlen(SYSTEMD_UNIT_PATH_PREFIX);
+    if (strncmp(path, SYSTEMD_UNIT_PATH_PREFIX, prefix_len) != 0) {
+        return -1;
+    }
+    const char *label = path + prefix_len;
+    char *name = malloc(strlen(label) + 1);
+    if (!name) {
+        return -ENOMEM;
     }
-    g_object_unref(bus);
-    return proxy;
+
+    // anything that is not alphanumeric is escaped as _xx, an empty label as "_"
+    char *t = name;
+    if (strcmp(label, "_") != 0) {
+        for (const char *f = label; *f; f++) {
+            if (*f == '_') {
+                int a = systemd_unhexchar(f[1]);
+                int b = a < 0 ? a : systemd_unhexchar(f[2]);
+                if (b < 0) {
+                    free(name);
+                    return -EINVAL;
+                }
+                *(t++) = (char)((a << 4) | b);
+                f += 2;
+            } else {
+                *(t++) = *f;
+            }
+        }
+    }
+    *t = '\0';
+    *ret = name;
+    return 0;
 }
 
+// how long to wait for systemd before giving up on a call, in milliseconds
+#define SYSTEMD_CALL_TIMEOUT 5000
+
 /**
- * systemd_unit_is_active will return true if a systemd unit is currently running
+ * Get the proxy for systemd's Manager object. The bus connection and proxy are
+ * created on first use and shared by every call after that - the proxy must not be
+ * freed. Returns NULL if the session bus is unavailable.
  */
-bool systemd_unit_is_active(const char *unit_name) {
-    bool r = false;
+static GDBusProxy *systemd_manager() {
+    static GDBusProxy *manager = NULL;
+    if (manager) {
+        return manager;
+    }
     GError *err = NULL;
-
-    // get the service unit path from systemd
-    GDBusProxy *proxy =
-        dbus_proxy_new(G_BUS_TYPE_SESSION, SYSTEMD_BUS_NAME, SYSTEMD_OBJECT_PATH,
-                       "org.freedesktop.systemd1.Manager", &err);
-    if (err) {
-        g_error("Could not create dbus proxy: %s\n", err->message);
-        g_error_free(err);
-        return r;
+    GDBusConnection *bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &err);
+    if (!err) {
+        // the Manager has no properties we care about
+        manager = g_dbus_proxy_new_sync(bus, G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+                                        NULL, SYSTEMD_BUS_NAME, SYSTEMD_OBJECT_PATH,
+                                        SYSTEMD_MANAGER_INTERFACE, NULL, &err);
+        g_object_unref(bus);
     }
-    GVariant *response = g_dbus_proxy_call_sync(
-        proxy, "org.freedesktop.systemd1.Manager.GetUnit",
-        g_variant_new("(s)", unit_name), G_DBUS_CALL_FLAGS_NONE, -1, NULL, &err);
-    g_object_unref(proxy);
     if (err) {
-        if (strstr(err->message, "org.freedesktop.systemd1.NoSuchUnit")) {
-            return r;
-        }
-        g_error("dbus error: %s\n", err->message);
+        g_warning("Could not create systemd dbus proxy: %s\n", err->message);
         g_error_free(err);
-        return r;
     }
+    return manager;
+}
 
-    // get systemd unit's ActiveState property
-    const gchar *unit_path;
-    g_variant_get(response, "(o)", &unit_path);
-    GDBusProxy *unit_proxy =
-        dbus_proxy_new(G_BUS_TYPE_SESSION, SYSTEMD_BUS_NAME, unit_path,
-                       "org.freedesktop.systemd1.Unit", &err);
-    g_variant_unref(response);
-    if (err) {
-        g_error("Could not create systemd dbus proxy: %s\n", err->message);
-        g_error_free(err);
-        return r;
-    }
-    GVariant *state_var = g_dbus_proxy_get_cached_property(unit_proxy, "ActiveState");
-    r = strcmp(g_variant_get_string(state_var, NULL), "active") == 0;
+/**
+ * Turns the response to a systemd call into a result for a unit.
+ */
+typedef bool (*systemd_parse_fn)(GVariant *response);
 
-    g_object_unref(unit_proxy);
-    g_variant_unref(state_var);
-    return r;
-}
+struct systemd_call {
+    char *unit_name;
+    systemd_parse_fn parse;
+    systemd_unit_cb callback;
+    void *user_data;
+};
 
 /**
- * Turn a systemd unit off or on. Returns true on success.
+ * Make a blocking call to the Manager. Returns the parsed response, or just whether
+ * the call succeeded if parse is NULL. params is consumed.
  */
-bool systemd_unit_set_active(const char *unit_name, bool active) {
+static bool systemd_call_sync(const char *method, GVariant *params,
+                              systemd_parse_fn parse) {
+    GDBusProxy *manager = systemd_manager();
+    if (!manager) {
+        g_variant_unref(g_variant_ref_sink(params));
+        return false;
+    }
     GError *err = NULL;
-    GDBusProxy *proxy =
-        dbus_proxy_new(G_BUS_TYPE_SESSION, SYSTEMD_BUS_NAME, SYSTEMD_OBJECT_PATH,
-                       "org.freedesktop.systemd1.Manager", &err);
+    GVariant *response =
+        g_dbus_proxy_call_sync(manager, method, params, G_DBUS_CALL_FLAGS_NONE,
+                               SYSTEMD_CALL_TIMEOUT, NULL, &err);
     if (err) {
-        g_error("Could not create systemd dbus proxy: %s\n", err->message);
+        g_warning("systemd call %s failed: %s\n", method, err->message);
         g_error_free(err);
         return false;
     }
+    bool r = parse ? parse(response) : true;
+    g_variant_unref(response);
+    return r;
+}
 
-    char *method_name;
-    if (active) {
-        method_name = "org.freedesktop.systemd1.Manager.StartUnit";
-    } else {
-        method_name = "org.freedesktop.systemd1.Manager.StopUnit";
-    }
-    // call params ref: https://www.freedesktop.org/wiki/Software/systemd/dbus/
-    GVariant *response = g_dbus_proxy_call_sync(
-        proxy, method_name, g_variant_new("(ss)", unit_name, "replace"),
-        G_DBUS_CALL_FLAGS_NONE, -1, NULL, &err);
-    g_object_unref(proxy);
+static void systemd_call_done_cb(GObject *source, GAsyncResult *res, gpointer user_data) {
+    struct systemd_call *call = user_data;
+    GError *err = NULL;
+    GVariant *response = g_dbus_proxy_call_finish(G_DBUS_PROXY(source), res, &err);
+    bool r = false;
     if (err) {
-        g_error("Failed while changing unit state to %d: %s\n", (int)active,
-                err->message);
+        g_warning("systemd call for %s failed: %s\n", call->unit_name, err->message);
         g_error_free(err);
-        return false;
+    } else {
+        r = call->parse ? call->parse(response) : true;
+        g_variant_unref(response);
     }
-    g_variant_unref(response);
-    return true;
+    if (call->callback) {
+        call->callback(call->unit_name, r, call->user_data);
+    }
+    free(call->unit_name);
+    free(call);
 }
 
 /**
- * systemd_unit_is_enabled returns if a systemd unit is enabled
+ * Make a call to the Manager without blocking. callback is invoked from the main
+ * loop with the parsed response, or whether the call succeeded if parse is NULL.
+ * params is consumed.
  */
-bool systemd_unit_is_enabled(const char *unit_name) {
-    GError *err = NULL;
-    GDBusProxy *proxy =
-        dbus_proxy_new(G_BUS_TYPE_SESSION, SYSTEMD_BUS_NAME, SYSTEMD_OBJECT_PATH,
-                       "org.freedesktop.systemd1.Manager", &err);
-    if (err) {
-        g_error("Could not create systemd dbus proxy: %s\n", err->message);
-        g_error_free(err);
-        return false;
+static void systemd_call_async(const char *method, GVariant *params,
+                               const char *unit_name, systemd_parse_fn parse,
+                               systemd_unit_cb callback, void *user_data) {
+    GDBusProxy *manager = systemd_manager();
+    if (!manager) {
+        g_variant_unref(g_variant_ref_sink(params));
+        if (callback) {
+            callback(unit_name, false, user_data);
+        }
+        return;
     }
+    struct systemd_call *call = malloc(sizeof(struct systemd_call));
+    call->unit_name = strdup(unit_name);
+    call->parse = parse;
+    call->callback = callback;
+    call->user_data = user_data;
+    g_dbus_proxy_call(manager, method, params, G_DBUS_CALL_FLAGS_NONE,
+                      SYSTEMD_CALL_TIMEOUT, NULL, systemd_call_done_cb, call);
+}
 
-    GVariant *response = g_dbus_proxy_call_sync(
-        proxy, "org.freedesktop.systemd1.Manager.GetUnitFileState",
-        g_variant_new("(s)", unit_name), G_DBUS_CALL_FLAGS_NONE, -1, NULL, &err);
-    g_object_unref(proxy);
-    if (err) {
-        g_error("Could not determine unit file state: %s\n", err->message);
-        g_error_free(err);
-        return false;
+/**
+ * Read the active state of the first unit in a response to ListUnitsByNames.
+ */
+static bool parse_unit_active(GVariant *response) {
+    bool r = false;
+    GVariantIter *iter;
+    const char *active_state;
+    g_variant_get(response, "(a(ssssssouso))", &iter);
+    if (g_variant_iter_next(iter, "(&s&s&s&s&s&s&ou&s&o)", NULL, NULL, NULL,
+                            &active_state, NULL, NULL, NULL, NULL, NULL, NULL)) {
+        r = strcmp(active_state, "active") == 0;
     }
+    g_variant_iter_free(iter);
+    return r;
+}
 
+static bool parse_unit_file_enabled(GVariant *response) {
     const gchar *enabled_state;
-    g_variant_get(response, "(s)", &enabled_state);
-    bool r = strcmp(enabled_state, "enabled") == 0;
+    g_variant_get(response, "(&s)", &enabled_state);
+    return strcmp(enabled_state, "enabled") == 0;
+}
 
-    g_variant_unref(response);
-    return r;
+static GVariant *unit_active_params(const char *unit_name) {
+    // units that are not loaded are reported as inactive instead of an error
+    const char *names[] = {unit_name, NULL};
+    return g_variant_new("(^as)", names);
+}
+
+static const char *set_active_method(bool active) {
+    return active ? "StartUnit" : "StopUnit";
+}
+
+static GVariant *set_active_params(const char *unit_name) {
+    // call params ref: https://www.freedesktop.org/wiki/Software/systemd/dbus/
+    return g_variant_new("(ss)", unit_name, "replace");
+}
+
+static const char *set_enabled_method(bool enabled) {
+    return enabled ? "EnableUnitFiles" : "DisableUnitFiles";
+}
+
+static GVariant *set_enabled_params(const char *unit_name, bool enabled) {
+    const char *names[] = {unit_name, NULL};
+    if (enabled) {
+        // call_params: unit files, persistent (/etc vs /run), replace links
+        return g_variant_new("(^asbb)", names, false, true);
+    }
+    // call_params: unit files, persistent
+    return g_variant_new("(^asb)", names, false);
+}
+
+/**
+ * systemd_unit_is_active will return true if a systemd unit is currently running
+ */
+bool systemd_unit_is_active(const char *unit_name) {
+    return systemd_call_sync("ListUnitsByNames", unit_active_params(unit_name),
+                             parse_unit_active);
+}
+
+/**
+ * Like systemd_unit_is_active, but does not block. callback receives whether the
+ * unit is running.
+ */
+void systemd_unit_is_active_async(const char *unit_name, systemd_unit_cb callback,
+                                  void *user_data) {
+    systemd_call_async("ListUnitsByNames", unit_active_params(unit_name), unit_name,
+                       parse_unit_active, callback, user_data);
+}
+
+/**
+ * Turn a systemd unit off or on. Returns true on success.
+ */
+bool systemd_unit_set_active(const char *unit_name, bool active) {
+    return systemd_call_sync(set_active_method(active), set_active_params(unit_name),
+                             NULL);
+}
+
+/**
+ * Like systemd_unit_set_active, but does not block. callback (may be NULL) receives
+ * whether the unit's state was changed.
+ */
+void systemd_unit_set_active_async(const char *unit_name, bool active,
+                                   systemd_unit_cb callback, void *user_data) {
+    systemd_call_async(set_active_method(active), set_active_params(unit_name),
+                       unit_name, NULL, callback, user_data);
+}
+
+/**
+ * systemd_unit_is_enabled returns if a systemd unit is enabled
+ */
+bool systemd_unit_is_enabled(const char *unit_name) {
+    return systemd_call_sync("GetUnitFileState", g_variant_new("(s)", unit_name),
+                             parse_unit_file_enabled);
+}
+
+/**
+ * Like systemd_unit_is_enabled, but does not block. callback receives whether the
+ * unit is enabled.
+ */
+void systemd_unit_is_enabled_async(const char *unit_name, systemd_unit_cb callback,
+                                   void *user_data) {
+    systemd_call_async("GetUnitFileState", g_variant_new("(s)", unit_name), unit_name,
+                       parse_unit_file_enabled, callback, user_data);
 }
 
 /**
  * Enable or disable a user systemd unit. Returns true on success.
  */
 bool systemd_unit_set_enabled(const char *unit_name, bool enabled) {
+    return systemd_call_sync(set_enabled_method(enabled),
+                             set_enabled_params(unit_name, enabled), NULL);
+}
+
+/**
+ * Like systemd_unit_set_enabled, but does not block. callback (may be NULL) receives
+ * whether the unit was enabled or disabled.
+ */
+void systemd_unit_set_enabled_async(const char *unit_name, bool enabled,
+                                    systemd_unit_cb callback, void *user_data) {
+    systemd_call_async(set_enabled_method(enabled),
+                       set_enabled_params(unit_name, enabled), unit_name, NULL,
+                       callback, user_data);
+}
+
+struct systemd_list_call {
+    systemd_unit_cb callback;
+    void *user_data;
+};
+
+static void systemd_list_done_cb(GObject *source, GAsyncResult *res, gpointer user_data) {
+    struct systemd_list_call *call = user_data;
     GError *err = NULL;
-    GDBusProxy *proxy =
-        dbus_proxy_new(G_BUS_TYPE_SESSION, SYSTEMD_BUS_NAME, SYSTEMD_OBJECT_PATH,
-                       "org.freedesktop.systemd1.Manager", &err);
+    GVariant *response = g_dbus_proxy_call_finish(G_DBUS_PROXY(source), res, &err);
     if (err) {
-        g_error("Could not create systemd dbus proxy: %s\n", err->message);
+        g_warning("Could not list systemd units: %s\n", err->message);
         g_error_free(err);
-        return false;
+        free(call);
+        return;
     }
-
-    GVariantBuilder *unit_name_builder = g_variant_builder_new(G_VARIANT_TYPE("as"));
-    g_variant_builder_add(unit_name_builder, "s", unit_name);
-    GVariant *response;
-    if (enabled) { // different method calls depending on enable/disable
-        // ref: https://www.freedesktop.org/wiki/Software/systemd/dbus/
-        // call_params: unit files, persistent (/etc vs /run), replace links
-        response = g_dbus_proxy_call_sync(
-            proxy, "org.freedesktop.systemd1.Manager.EnableUnitFiles",
-            g_variant_new("(asbb)", unit_name_builder, false, true),
-            G_DBUS_CALL_FLAGS_NONE, -1, NULL, &err);
-    } else {
-        // call_params: unit files, persistent
-        response = g_dbus_proxy_call_sync(
-            proxy, "org.freedesktop.systemd1.Manager.DisableUnitFiles",
-            g_variant_new("(asb)", unit_name_builder, false), G_DBUS_CALL_FLAGS_NONE, -1,
-            NULL, &err);
-    }
-    g_variant_builder_unref(unit_name_builder);
-    g_object_unref(proxy);
-    if (err) {
-        g_error("Could not change systemd unit enabled state to %d: %s\n", (int)enabled,
-                err->message);
-        g_error_free(err);
-        return false;
+    GVariantIter *iter;
+    const char *name, *active_state;
+    g_variant_get(response, "(a(ssssssouso))", &iter);
+    while (g_variant_iter_next(iter, "(&s&s&s&s&s&s&ou&s&o)", &name, NULL, NULL,
+                               &active_state, NULL, NULL, NULL, NULL, NULL, NULL)) {
+        call->callback(name, strcmp(active_state, "active") == 0, call->user_data);
     }
+    g_variant_iter_free(iter);
     g_variant_unref(response);
-    return true;
+    free(call);
+}
+
+/**
+ * Fetch the active state of every loaded unit matching a glob pattern (like
+ * "onedriver@*.service") with a single call, without blocking. callback is invoked
+ * once per unit. Units that are not loaded are not running, and are skipped.
+ */
+void systemd_units_active_async(const char *pattern, systemd_unit_cb callback,
+                                void *user_data) {
+    GDBusProxy *manager = systemd_manager();
+    if (!manager) {
+        return;
+    }
+    struct systemd_list_call *call = malloc(sizeof(struct systemd_list_call));
+    call->callback = callback;
+    call->user_data = user_data;
+    // call_params: unit states to match (all of them), unit name patterns
+    const char *states[] = {NULL};
+    const char *patterns[] = {pattern, NULL};
+    g_dbus_proxy_call(manager, "ListUnitsByPatterns",
+                      g_variant_new("(^as^as)", states, patterns), G_DBUS_CALL_FLAGS_NONE,
+                      SYSTEMD_CALL_TIMEOUT, NULL, systemd_list_done_cb, call);
+}
+
+struct systemd_watch {
+    char *pattern;
+    systemd_unit_cb callback;
+    void *user_data;
+};
+
+static void unit_new_cb(GDBusConnection *bus, const gchar *sender, const gchar *path,
+                        const gchar *interface, const gchar *signal, GVariant *params,
+                        gpointer user_data) {
+    struct systemd_watch *watch = user_data;
+    const char *unit_name;
+    g_variant_get(params, "(&s&o)", &unit_name, NULL);
+    if (g_pattern_match_simple(watch->pattern, unit_name)) {
+        // a unit that was just loaded may already be starting
+        systemd_unit_is_active_async(unit_name, watch->callback, watch->user_data);
+    }
+}
+
+static void unit_removed_cb(GDBusConnection *bus, const gchar *sender, const gchar *path,
+                            const gchar *interface, const gchar *signal, GVariant *params,
+                            gpointer user_data) {
+    struct systemd_watch *watch = user_data;
+    const char *unit_name;
+    g_variant_get(params, "(&s&o)", &unit_name, NULL);
+    if (g_pattern_match_simple(watch->pattern, unit_name)) {
+        // only units that are not running can be unloaded
+        watch->callback(unit_name, false, watch->user_data);
+    }
+}
+
+static void unit_properties_changed_cb(GDBusConnection *bus, const gchar *sender,
+                                       const gchar *path, const gchar *interface,
+                                       const gchar *signal, GVariant *params,
+                                       gpointer user_data) {
+    struct systemd_watch *watch = user_data;
+    GVariant *changed;
+    const char *active_state;
+    g_variant_get(params, "(&s@a{sv}@as)", NULL, &changed, NULL);
+    if (g_variant_lookup(changed, "ActiveState", "&s", &active_state) &&
+        // a unit passes through activating/deactivating, which would flip switches
+        // back and forth while they are being toggled
+        (strcmp(active_state, "active") == 0 || strcmp(active_state, "inactive") == 0 ||
+         strcmp(active_state, "failed") == 0)) {
+        char *unit_name;
+        if (systemd_unit_from_object_path(path, &unit_name) == 0) {
+            if (g_pattern_match_simple(watch->pattern, unit_name)) {
+                watch->callback(unit_name, strcmp(active_state, "active") == 0,
+                                watch->user_data);
+            }
+            free(unit_name);
+        }
+    }
+    g_variant_unref(changed);
+}
+
+/**
+ * Watch units matching a glob pattern for changes in whether they are running.
+ * callback is invoked from the main loop every time a unit starts or stops, no matter
+ * who started or stopped it. The watch lasts for the rest of the program.
+ */
+void systemd_watch_units(const char *pattern, systemd_unit_cb callback,
+                         void *user_data) {
+    GDBusProxy *manager = systemd_manager();
+    if (!manager) {
+        return;
+    }
+    struct systemd_watch *watch = malloc(sizeof(struct systemd_watch));
+    watch->pattern = strdup(pattern);
+    watch->callback = callback;
+    watch->user_data = user_data;
+
+    GDBusConnection *bus = g_dbus_proxy_get_connection(manager);
+    g_dbus_connection_signal_subscribe(bus, SYSTEMD_BUS_NAME, SYSTEMD_MANAGER_INTERFACE,
+                                       "UnitNew", SYSTEMD_OBJECT_PATH, NULL,
+                                       G_DBUS_SIGNAL_FLAGS_NONE, unit_new_cb, watch,
+                                       NULL);
+    g_dbus_connection_signal_subscribe(bus, SYSTEMD_BUS_NAME, SYSTEMD_MANAGER_INTERFACE,
+                                       "UnitRemoved", SYSTEMD_OBJECT_PATH, NULL,
+                                       G_DBUS_SIGNAL_FLAGS_NONE, unit_removed_cb, watch,
+                                       NULL);
+    // arg0 of PropertiesChanged is the interface whose properties changed
+    g_dbus_connection_signal_subscribe(
+        bus, SYSTEMD_BUS_NAME, "org.freedesktop.DBus.Properties", "PropertiesChanged",
+        NULL, SYSTEMD_UNIT_INTERFACE, G_DBUS_SIGNAL_FLAGS_NONE,
+        unit_properties_changed_cb, watch, NULL);
+
+    // systemd only emits unit signals while at least one client is subscribed
+    g_dbus_proxy_call(manager, "Subscribe", NULL, G_DBUS_CALL_FLAGS_NONE,
+                      SYSTEMD_CALL_TIMEOUT, NULL, NULL, NULL);
 }
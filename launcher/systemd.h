@@ -10,6 +10,14 @@
 
 #define SYSTEMD_BUS_NAME "org.freedesktop.systemd1"
 #define SYSTEMD_OBJECT_PATH "/org/freedesktop/systemd1"
+#define SYSTEMD_MANAGER_INTERFACE "org.freedesktop.systemd1.Manager"
+#define SYSTEMD_UNIT_INTERFACE "org.freedesktop.systemd1.Unit"
+#define SYSTEMD_UNIT_PATH_PREFIX SYSTEMD_OBJECT_PATH "/unit/"
+
+/**
+ * Receives the result of an async call about a unit, its meaning depends on the call.
+ */
+typedef void (*systemd_unit_cb)(const char *unit_name, bool result, void *user_data);
 
 char systemd_hexchar(int x);
 int systemd_unhexchar(char c);
@@ -19,7 +27,20 @@ int systemd_path_escape(const char *path, char **ret);
 int systemd_path_unescape(const char *instance, char **ret);
 int systemd_template_unit(const char *template, const char *instance, char **ret);
 int systemd_untemplate_unit(const char *unit_name, char **ret);
+int systemd_unit_from_object_path(const char *path, char **ret);
 bool systemd_unit_is_active(const char *unit_name);
+void systemd_unit_is_active_async(const char *unit_name, systemd_unit_cb callback,
+                                  void *user_data);
 bool systemd_unit_set_active(const char *unit_name, bool active);
+void systemd_unit_set_active_async(const char *unit_name, bool active,
+                                   systemd_unit_cb callback, void *user_data);
 bool systemd_unit_is_enabled(const char *unit_name);
+void systemd_unit_is_enabled_async(const char *unit_name, systemd_unit_cb callback,
+                                   void *user_data);
 bool systemd_unit_set_enabled(const char *unit_name, bool enabled);
+void systemd_unit_set_enabled_async(const char *unit_name, bool enabled,
+                                    systemd_unit_cb callback, void *user_data);
+void systemd_units_active_async(const char *pattern, systemd_unit_cb callback,
+                                void *user_data);
+void systemd_watch_units(const char *pattern, systemd_unit_cb callback,
+                         void *user_data);
@@ -2,11 +2,17 @@ package main
 
 import (
 	"encoding/json"
+	"errors"
 	"fmt"
 	"io/ioutil"
+	"math"
+	"net"
+	"net/http"
+	_ "net/http/pprof"
 	"os"
 	"os/signal"
 	"path/filepath"
+	"strconv"
 	"strings"
 	"syscall"
 	"time"
@@ -34,6 +40,8 @@ While offline, the filesystem will be read-only until connectivity is re-
 established.
 
 Usage: onedriver [options] <mountpoint>
+       onedriver [options] --daemon
+       onedriver [options] --attach|--detach <mountpoint>
 
 Valid options:
 `)
@@ -44,7 +52,7 @@ func main() {
 	// setup cli parsing
 	authOnly := flag.BoolP("auth-only", "a", false,
 		"Authenticate to OneDrive and then exit.")
-	logLevel := flag.StringP("log", "l", "debug", "Set logging level/verbosity. "+
+	logLevel := flag.StringP("log", "l", "info", "Set logging level/verbosity. "+
 		"Can be one of: fatal, error, warn, info, debug, trace")
 	cacheDir := flag.StringP("cache-dir", "c", "",
 		"Change the default cache directory used by onedriver. "+
@@ -52,6 +60,34 @@ func main() {
 	wipeCache := flag.BoolP("wipe-cache", "w", false,
 		"Delete the existing onedriver cache directory and then exit. "+
 			"Equivalent to resetting the program.")
+	cacheSize := flag.StringP("cache-size", "s", "0",
+		"Maximum size of downloaded file content kept in the cache directory, "+
+			"like \"500M\" or \"10G\". Least recently used files are removed "+
+			"once the cache grows past this size. 0 means unlimited.")
+	notify := flag.BoolP("notify", "n", false,
+		"Subscribe to change notifications from the server and fetch changes "+
+			"as soon as they happen, instead of polling for them every 30 seconds.")
+	writeBackDelay := flag.DurationP("write-back", "b", 0,
+		"Wait until a closed file has been left alone for this long, like \"5s\", "+
+			"before uploading it. Repeated saves are combined into a single upload. "+
+			"fsync() always uploads right away. 0 uploads files as soon as they are closed.")
+	prefetch := flag.StringP("prefetch", "p", "",
+		"Fetch the contents of subdirectories of listed directories in the background, "+
+			"and download files up to this size, like \"1M\", when a file next to them "+
+			"is opened. 0 only prefetches directory listings. Disabled by default.")
+	pprofAddr := flag.String("pprof", "",
+		"Serve runtime profiles at this address, like \"localhost:6060\", and "+
+			"record latency histograms of filesystem ops and Graph API requests.")
+	daemonMode := flag.Bool("daemon", false,
+		"Serve several mountpoints from one process, which are attached and "+
+			"detached with --attach and --detach. Options for mounts are taken from the "+
+			"daemon's command line.")
+	attach := flag.Bool("attach", false,
+		"Ask the running daemon to mount the mountpoint, using the cache directory "+
+			"given with --cache-dir. Returns once it is mounted. The account must have "+
+			"been logged in to with --auth-only first.")
+	detach := flag.Bool("detach", false,
+		"Ask the running daemon to unmount the mountpoint.")
 	versionFlag := flag.BoolP("version", "v", false, "Display program version.")
 	debugOn := flag.BoolP("debug", "d", false, "Enable FUSE debug logging.")
 	flag.BoolP("help", "h", false, "Displays this help message.")
@@ -91,34 +127,127 @@ func main() {
 	log.SetReportCaller(true)
 	log.SetFormatter(logger.LogrusFormatter())
 
+	contentLimit, err := parseSize(*cacheSize)
+	if err != nil {
+		log.WithField("cacheSize", *cacheSize).Fatal("Could not parse cache size.")
+	}
+	var prefetchSize uint64
+	if *prefetch != "" {
+		if prefetchSize, err = parseSize(*prefetch); err != nil {
+			log.WithField("prefetch", *prefetch).Fatal("Could not parse prefetch size.")
+		}
+	}
+
+	if *pprofAddr != "" {
+		go servePprof(*pprofAddr)
+	}
+	opts := mountOptions{
+		contentLimit:   contentLimit,
+		writeBackDelay: *writeBackDelay,
+		prefetch:       *prefetch != "",
+		prefetchSize:   prefetchSize,
+		notify:         *notify,
+		debug:          *debugOn,
+	}
+	if *daemonMode {
+		log.Infof("onedriver v%s %s", version, commit[:clen])
+		runDaemon(opts)
+		return
+	}
+
 	// determine and validate mountpoint
 	if len(flag.Args()) == 0 {
 		flag.Usage()
 		fmt.Printf("\nNo mountpoint provided, exiting.\n")
 		os.Exit(1)
 	}
+	mountpoint := flag.Arg(0)
+	if *attach || *detach {
+		if err := controlDaemon(*attach, mountpoint, dir); err != nil {
+			fmt.Fprintln(os.Stderr, err)
+			os.Exit(1)
+		}
+		os.Exit(0)
+	}
 
 	log.Infof("onedriver v%s %s", version, commit[:clen])
-	mountpoint := flag.Arg(0)
+	opts.login = true
+	server, cache, err := mountFS(mountpoint, dir, opts)
+	if err != nil {
+		log.WithFields(log.Fields{
+			"mountpoint": mountpoint,
+			"err":        err,
+		}).Fatal("Could not mount filesystem.")
+	}
+
+	// fs.Mount only returns once the kernel has the mount
+	sdNotify("READY=1")
+
+	// setup signal handler for graceful unmount on signals like sigint
+	sigChan := make(chan os.Signal, 1)
+	signal.Notify(sigChan, syscall.SIGINT, syscall.SIGTERM)
+	go odfs.UnmountHandler(sigChan, server, cache)
+
+	// serve filesystem
+	server.Wait()
+}
+
+// mountOptions are what a filesystem is mounted with. A daemon mounts everything
+// with the same options.
+type mountOptions struct {
+	contentLimit   uint64
+	writeBackDelay time.Duration
+	prefetch       bool
+	prefetchSize   uint64
+	notify         bool
+	debug          bool
+	login          bool // log in interactively if there are no valid auth tokens
+}
+
+// mountFS mounts the account whose cache is in dir at mountpoint, and returns once
+// the kernel has the mount. Authenticates first if needed and opts.login is set,
+// otherwise the account must have been logged in to already.
+func mountFS(mountpoint string, dir string, opts mountOptions) (*fuse.Server, *odfs.Cache, error) {
 	st, err := os.Stat(mountpoint)
 	if err != nil || !st.IsDir() {
-		log.WithField(
-			"mountpoint", mountpoint,
-		).Fatal("Mountpoint did not exist or was not a directory.")
+		return nil, nil, errors.New("mountpoint did not exist or was not a directory")
 	}
 	if res, _ := ioutil.ReadDir(mountpoint); len(res) > 0 {
-		log.WithField(
-			"mountpoint", mountpoint,
-		).Fatal("Mountpoint must be empty.")
+		return nil, nil, errors.New("mountpoint must be empty")
 	}
 
 	// create a new filesystem and mount it
-	auth := graph.Authenticate(authPath)
-	cache := odfs.NewCache(auth, filepath.Join(dir, "onedriver.db"))
+	os.MkdirAll(dir, 0700)
+	authPath := filepath.Join(dir, "auth_tokens.json")
+	var auth *graph.Auth
+	if opts.login {
+		auth = graph.Authenticate(authPath)
+	} else if auth, err = graph.LoadAuth(authPath); err != nil {
+		return nil, nil, err
+	}
+	cache, err := odfs.NewCache(auth, filepath.Join(dir, "onedriver.db"))
+	if err != nil {
+		return nil, nil, err
+	}
+	cache.SetContentLimit(opts.contentLimit)
+	cache.SetWriteBackDelay(opts.writeBackDelay)
+	if opts.prefetch {
+		cache.EnablePrefetch(opts.prefetchSize)
+	}
 	root, _ := cache.GetPath("/", auth)
-	go cache.DeltaLoop(30 * time.Second)
+	if opts.notify {
+		// notifications trigger delta fetches, polling is only a safety net
+		cache.NotifyLoop()
+		cache.DeltaLoop(10 * time.Minute)
+	} else {
+		cache.DeltaLoop(30 * time.Second)
+	}
+	cache.PinLoop()
 
 	xdgVolumeInfo(cache, auth)
+	if err := cache.ServeStatus(filepath.Join(dir, "status.sock")); err != nil {
+		log.WithField("err", err).Error("Could not serve status socket.")
+	}
 
 	second := time.Second
 	server, err := fs.Mount(mountpoint, root, &fs.Options{
@@ -127,23 +256,53 @@ func main() {
 		MountOptions: fuse.MountOptions{
 			Name:          "onedriver",
 			FsName:        "onedriver",
-			DisableXAttrs: true,
 			MaxBackground: 1024,
 		},
 	})
 	if err != nil {
-		log.WithField("err", err).Fatalf("Mount failed. Is the mountpoint already in use? "+
-			"(Try running \"fusermount -uz %s\")\n", mountpoint)
+		cache.Stop()
+		return nil, nil, fmt.Errorf("mount failed, is the mountpoint already in use? "+
+			"(try running \"fusermount -uz %s\"): %w", mountpoint, err)
 	}
+	server.SetDebug(opts.debug)
+	return server, cache, nil
+}
 
-	// setup signal handler for graceful unmount on signals like sigint
-	sigChan := make(chan os.Signal, 1)
-	signal.Notify(sigChan, syscall.SIGINT, syscall.SIGTERM)
-	go odfs.UnmountHandler(sigChan, server)
+// sdNotify sends a state change to systemd when running as a Type=notify service
+// (see sd_notify(3)). Does nothing when not started by systemd.
+func sdNotify(state string) {
+	socket := os.Getenv("NOTIFY_SOCKET")
+	if socket == "" {
+		return
+	}
+	// abstract socket names starting with "@" are handled by net
+	conn, err := net.DialUnix("unixgram", nil, &net.UnixAddr{Name: socket, Net: "unixgram"})
+	if err != nil {
+		log.WithField("err", err).Warn("Could not connect to systemd notify socket.")
+		return
+	}
+	defer conn.Close()
+	if _, err = conn.Write([]byte(state)); err != nil {
+		log.WithField("err", err).Warn("Could not notify systemd.")
+	}
+}
 
-	// serve filesystem
-	server.SetDebug(*debugOn)
-	server.Wait()
+// servePprof serves runtime profiles and latency histograms over HTTP. Tracing
+// is only enabled while profiling is, since it is not free.
+func servePprof(addr string) {
+	graph.EnableTracing()
+	http.HandleFunc("/debug/latency", func(w http.ResponseWriter, r *http.Request) {
+		w.Header().Set("Content-Type", "application/json")
+		json.NewEncoder(w).Encode(map[string]interface{}{
+			"ops":       odfs.OpStats(),
+			"endpoints": graph.EndpointStats(),
+		})
+	})
+	log.WithField("addr", addr).Info("Serving runtime profiles.")
+	// net/http/pprof registers itself with http.DefaultServeMux
+	if err := http.ListenAndServe(addr, nil); err != nil {
+		log.WithField("err", err).Error("Could not serve runtime profiles.")
+	}
 }
 
 // xdgVolumeInfo createx .xdg-volume-info for a nice little onedrive logo in the
@@ -180,3 +339,24 @@ func xdgVolumeInfo(cache *odfs.Cache, auth *graph.Auth) {
 		cache.InsertID(inode.ID(), inode)
 	}
 }
+
+// parseSize converts a human readable size like "500M" or "10G" to bytes. Sizes
+// without a suffix are in bytes.
+func parseSize(size string) (uint64, error) {
+	size = strings.TrimSuffix(strings.ToUpper(strings.TrimSpace(size)), "B")
+	multiplier := uint64(1)
+	units := "KMGT"
+	if len(size) > 0 {
+		if idx := strings.IndexByte(units, size[len(size)-1]); idx >= 0 {
+			multiplier = 1 << (10 * uint(idx+1))
+			size = size[:len(size)-1]
+		}
+	}
+	value, err := strconv.ParseFloat(strings.TrimSpace(size), 64)
+	// ParseFloat also accepts "NaN" and "Inf", which have no size in bytes
+	bytes := value * float64(multiplier)
+	if err != nil || math.IsNaN(value) || value < 0 || bytes >= math.MaxUint64 {
+		return 0, fmt.Errorf("invalid size: %s", size)
+	}
+	return uint64(bytes), nil
+}
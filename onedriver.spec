@@ -44,6 +44,7 @@ cp resources/%{name}.png %{buildroot}/usr/share/icons/%{name}
 cp resources/%{name}.svg %{buildroot}/usr/share/icons/%{name}
 cp resources/%{name}.desktop %{buildroot}/usr/share/applications
 cp resources/%{name}@.service %{buildroot}/usr/lib/systemd/user
+cp resources/%{name}.service %{buildroot}/usr/lib/systemd/user
 cp resources/%{name}.1.gz %{buildroot}/usr/share/man/man1
 
 # fix for el8 build in mock
@@ -56,6 +57,7 @@ cp resources/%{name}.1.gz %{buildroot}/usr/share/man/man1
 %attr(644, root, root) /usr/share/icons/%{name}/%{name}.svg
 %attr(644, root, root) /usr/share/applications/%{name}.desktop
 %attr(644, root, root) /usr/lib/systemd/user/%{name}@.service
+%attr(644, root, root) /usr/lib/systemd/user/%{name}.service
 %doc
 %attr(644, root, root) /usr/share/man/man1/%{name}.1.gz
 